@@ -0,0 +1,565 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Calibration stage, see calib.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fitsio.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "parallel.h"
+#include "image.h"
+#include "camera.h"
+#include "calib.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Pixels per row tile of the correction */
+#define CAL_TILE_PIXELS 16384
+
+/* Flat pixels below this fraction of the mean are dead, gain 0 */
+#define CAL_MIN_FLAT 0.01
+
+#define LOADING_MT "picam.calib_loading"
+
+static const char *output_names[NUM_CAL_OUTPUTS] = {"both", "corrected"};
+
+struct calibration {
+	pi_mutex lock;
+	int refs;
+
+	piint width, height;
+	int output;
+	float pedestal;
+
+	/* Per pixel, always allocated: zero bias and dark, unit gain
+	where no master was given. dark is in ADU/s */
+	float *bias, *dark, *gain;
+	char bias_name[CAL_NAME_LEN], dark_name[CAL_NAME_LEN], flat_name[CAL_NAME_LEN];
+};
+
+/* The calibration in use, guarded by current_lock */
+static pi_mutex current_lock;
+static struct calibration *current;
+
+/* One frame being corrected by parallel_for */
+struct calib_job {
+	const struct calibration *cal;
+	const pi16u *in;
+	pi16u *out;
+	float exptime;
+	long rows_per_tile;
+};
+
+typedef void (*correct_fn)(const pi16u *in, pi16u *out, const float *bias,
+	const float *dark, const float *gain, float exptime, float pedestal, size_t n);
+
+
+/* Correction kernels. Both round the same way, so the output does not
+depend on the kernel */
+
+static void correct_scalar(const pi16u *in, pi16u *out, const float *bias,
+	const float *dark, const float *gain, float exptime, float pedestal, size_t n)
+{
+	size_t i;
+	float v;
+
+	for(i = 0; i < n; i++) {
+		v = (float) in[i] - bias[i];
+		v = v - exptime * dark[i];
+		v = v * gain[i] + pedestal;
+		if(v < 0.0f) v = 0.0f;
+		if(v > 65535.0f) v = 65535.0f;
+		out[i] = (pi16u) (int) (v + 0.5f);
+	}
+}
+
+#ifdef HAVE_SSE2
+/* 4 pixels, widened to float, corrected and clamped */
+static __m128i correct4_sse2(__m128i raw, const float *bias, const float *dark,
+	const float *gain, __m128 t, __m128 pedestal)
+{
+	const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535.0f), half = _mm_set1_ps(0.5f);
+	__m128 v;
+
+	v = _mm_sub_ps(_mm_cvtepi32_ps(raw), _mm_loadu_ps(bias));
+	v = _mm_sub_ps(v, _mm_mul_ps(t, _mm_loadu_ps(dark)));
+	v = _mm_add_ps(_mm_mul_ps(v, _mm_loadu_ps(gain)), pedestal);
+	v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+	return _mm_cvttps_epi32(_mm_add_ps(v, half));
+}
+
+static void correct_sse2(const pi16u *in, pi16u *out, const float *bias,
+	const float *dark, const float *gain, float exptime, float pedestal, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i offset = _mm_set1_epi32(32768), flip = _mm_set1_epi16((short) 0x8000);
+	const __m128 t = _mm_set1_ps(exptime), p = _mm_set1_ps(pedestal);
+	__m128i raw, a, b;
+	size_t i;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		raw = _mm_loadu_si128((const __m128i *) (in + i));
+		a = correct4_sse2(_mm_unpacklo_epi16(raw, zero), bias + i, dark + i, gain + i, t, p);
+		b = correct4_sse2(_mm_unpackhi_epi16(raw, zero), bias + i + 4, dark + i + 4, gain + i + 4, t, p);
+
+		/* No unsigned pack in SSE2: pack signed about 32768 and flip back */
+		a = _mm_packs_epi32(_mm_sub_epi32(a, offset), _mm_sub_epi32(b, offset));
+		_mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(a, flip));
+	}
+	correct_scalar(in + i, out + i, bias + i, dark + i, gain + i, exptime, pedestal, n - i);
+}
+#endif
+
+#ifdef HAVE_SSE2
+static const correct_fn corrector = correct_sse2;
+static const char *corrector_name = "sse2";
+#else
+static const correct_fn corrector = correct_scalar;
+static const char *corrector_name = "scalar";
+#endif
+
+const char *calib_kernel(void)
+{
+	return corrector_name;
+}
+
+
+static void free_calibration(struct calibration *cal)
+{
+	pi_mutex_destroy(&cal->lock);
+	free(cal->bias);
+	free(cal->dark);
+	free(cal->gain);
+	free(cal);
+}
+
+static struct calibration *new_calibration(piint width, piint height)
+{
+	struct calibration *cal = calloc(1, sizeof(*cal));
+	size_t i, npix = (size_t) width * height;
+
+	if(!cal) return NULL;
+	pi_mutex_init(&cal->lock);
+	cal->refs = 1;
+	cal->width = width;
+	cal->height = height;
+	cal->bias = calloc(npix, sizeof(float));
+	cal->dark = calloc(npix, sizeof(float));
+	cal->gain = malloc(npix * sizeof(float));
+	if(!cal->bias || !cal->dark || !cal->gain) {
+		free_calibration(cal);
+		return NULL;
+	}
+	for(i = 0; i < npix; i++)
+		cal->gain[i] = 1.0f;
+	sprintf_s(cal->bias_name, CAL_NAME_LEN, "none");
+	sprintf_s(cal->dark_name, CAL_NAME_LEN, "none");
+	sprintf_s(cal->flat_name, CAL_NAME_LEN, "none");
+	return cal;
+}
+
+void calib_start(void)
+{
+	static int started = 0;
+
+	if(started) return;
+	pi_mutex_init(&current_lock);
+	started = 1;
+}
+
+struct calibration *calib_current(void)
+{
+	struct calibration *cal;
+
+	calib_start();
+	pi_mutex_lock(&current_lock);
+	cal = current;
+	if(cal) {
+		pi_mutex_lock(&cal->lock);
+		cal->refs++;
+		pi_mutex_unlock(&cal->lock);
+	}
+	pi_mutex_unlock(&current_lock);
+	return cal;
+}
+
+void calib_release(struct calibration *cal)
+{
+	int refs;
+
+	pi_mutex_lock(&cal->lock);
+	refs = --cal->refs;
+	pi_mutex_unlock(&cal->lock);
+	if(refs == 0) free_calibration(cal);
+}
+
+/* Makes cal (may be NULL) the calibration in use, taking its reference */
+static void set_current(struct calibration *cal)
+{
+	struct calibration *old;
+
+	calib_start();
+	pi_mutex_lock(&current_lock);
+	old = current;
+	current = cal;
+	pi_mutex_unlock(&current_lock);
+	if(old) calib_release(old);
+}
+
+void calib_shutdown(void)
+{
+	set_current(NULL);
+}
+
+int calib_output(const struct calibration *cal)
+{
+	return cal->output;
+}
+
+/* parallel_fn, corrects one row tile */
+static void correct_tile(void *ctx, int tile)
+{
+	struct calib_job *job = ctx;
+	const struct calibration *cal = job->cal;
+	size_t start, end, npix = (size_t) cal->width * cal->height;
+
+	start = (size_t) tile * job->rows_per_tile * cal->width;
+	end = start + (size_t) job->rows_per_tile * cal->width;
+	if(end > npix) end = npix;
+
+	corrector(job->in + start, job->out + start, cal->bias + start, cal->dark + start,
+		cal->gain + start, job->exptime, cal->pedestal, end - start);
+}
+
+struct frame *calib_apply(struct calibration *cal, const struct frame *raw,
+	struct metadata *md, char *errmsg)
+{
+	struct calib_job job;
+	struct frame *out;
+	size_t npix = (size_t) cal->width * cal->height;
+
+	if(md->nrois > 1) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Frame has %i ROIs, masters cover one\n", md->nrois);
+		return NULL;
+	}
+	if(md->width != cal->width || md->height != cal->height) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Frame is %ix%i, the masters %ix%i\n",
+			md->width, md->height, cal->width, cal->height);
+		return NULL;
+	}
+	out = frame_new(npix * sizeof(pi16u));
+	if(!out) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory calibrating frame\n");
+		return NULL;
+	}
+
+	job.cal = cal;
+	job.in = raw->pixels;
+	job.out = out->pixels;
+	job.exptime = (float) md->exptime;
+	job.rows_per_tile = cal->width < CAL_TILE_PIXELS ? CAL_TILE_PIXELS / cal->width : 1;
+	parallel_for((int) ((cal->height + job.rows_per_tile - 1) / job.rows_per_tile), correct_tile, &job);
+
+	md->calibrated = 1;
+	sprintf_s(md->calbias, CAL_NAME_LEN, "%s", cal->bias_name);
+	sprintf_s(md->caldark, CAL_NAME_LEN, "%s", cal->dark_name);
+	sprintf_s(md->calflat, CAL_NAME_LEN, "%s", cal->flat_name);
+	md->pedestal = cal->pedestal;
+	return out;
+}
+
+
+/*
+	Lua interface. Masters are images (e.g. from a stack) or paths of
+	FITS files.
+*/
+
+/* A master as float pixels */
+struct master {
+	float *pixels;
+	piint width, height;
+	double exptime;
+	char name[CAL_NAME_LEN];
+};
+
+/* Reads the primary image of a FITS file, returns 0 on success */
+static int read_master_file(const char *path, struct master *m, char *errmsg)
+{
+	fitsfile *ff;
+	int status = 0;
+	long naxes[2] = {0, 0};
+	const char *base;
+
+	if(fits_open_file(&ff, path, READONLY, &status)) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not open %s", path);
+		return -1;
+	}
+	fits_get_img_size(ff, 2, naxes, &status);
+	if(status || naxes[0] < 1 || naxes[1] < 1) {
+		fits_close_file(ff, &status);
+		sprintf_s(errmsg, STR_BUF_SIZE, "%s is not an image", path);
+		return -1;
+	}
+	m->width = (piint) naxes[0];
+	m->height = (piint) naxes[1];
+	m->pixels = malloc((size_t) naxes[0] * naxes[1] * sizeof(float));
+	if(!m->pixels) {
+		fits_close_file(ff, &status);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory reading %s", path);
+		return -1;
+	}
+	fits_read_img(ff, TFLOAT, 1, (LONGLONG) naxes[0] * naxes[1], NULL, m->pixels, NULL, &status);
+	if(status) {
+		free(m->pixels);
+		m->pixels = NULL;
+		fits_close_file(ff, &status);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not read %s", path);
+		return -1;
+	}
+	if(fits_read_key(ff, TDOUBLE, "EXPTIME", &m->exptime, NULL, &status)) {
+		m->exptime = 0;
+		status = 0;
+	}
+	fits_close_file(ff, &status);
+
+	base = strrchr(path, PATH_SEP[0]);
+	sprintf_s(m->name, CAL_NAME_LEN, "%.*s", CAL_NAME_LEN - 1, base ? base + 1 : path);
+	return 0;
+}
+
+/* Loads table field key at index 1 into m, returns 0 if the field is
+absent. Raises a Lua error if it is not a usable master */
+static int get_master(lua_State *L, const char *key, struct master *m)
+{
+	char errmsg[STR_BUF_SIZE];
+	struct metadata md;
+	struct frame *f;
+	size_t i, npix;
+
+	memset(m, 0, sizeof(*m));
+	lua_getfield(L, 1, key);
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	if(lua_type(L, -1) == LUA_TSTRING) {
+		if(read_master_file(lua_tostring(L, -1), m, errmsg)) {
+			lua_pushstring(L, errmsg);
+			lua_error(L);
+			return 0;
+		}
+	} else {
+		f = image_check_frame(L, lua_gettop(L), &md);
+		npix = (size_t) md.width * md.height;
+		m->pixels = malloc(npix * sizeof(float));
+		if(!m->pixels) {
+			lua_pushstring(L, "Out of memory");
+			lua_error(L);
+			return 0;
+		}
+		for(i = 0; i < npix; i++)
+			m->pixels[i] = f->pixels[i];
+		m->width = md.width;
+		m->height = md.height;
+		m->exptime = md.exptime;
+		if(md.ncombine > 0)
+			sprintf_s(m->name, CAL_NAME_LEN, "%s of %i (memory)", md.combine, (int) md.ncombine);
+		else
+			sprintf_s(m->name, CAL_NAME_LEN, "frame (memory)");
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+/* What pi_calibrate has loaded so far, kept in a userdata on the Lua
+stack so an error raised part way still frees it */
+struct loading {
+	struct master m[3];	/* bias, dark, flat */
+	struct calibration *cal;
+};
+
+static int loading_gc(lua_State *L)
+{
+	struct loading *ld = luaL_checkudata(L, 1, LOADING_MT);
+	int k;
+
+	for(k = 0; k < 3; k++) {
+		free(ld->m[k].pixels);
+		ld->m[k].pixels = NULL;
+	}
+	if(ld->cal) free_calibration(ld->cal);
+	ld->cal = NULL;
+	return 0;
+}
+
+static struct loading *push_loading(lua_State *L)
+{
+	struct loading *ld = lua_newuserdata(L, sizeof(*ld));
+
+	memset(ld, 0, sizeof(*ld));
+	if(luaL_newmetatable(L, LOADING_MT)) {
+		lua_pushstring(L, "__gc");
+		lua_pushcfunction(L, loading_gc);
+		lua_rawset(L, -3);
+	}
+	lua_setmetatable(L, -2);
+	return ld;
+}
+
+static void calibrate_error(lua_State *L, const char *message)
+{
+	lua_pushstring(L, message);
+	lua_error(L);
+}
+
+static void push_calibration(lua_State *L, const struct calibration *cal)
+{
+	lua_newtable(L);
+	lua_pushstring(L, "bias");
+	lua_pushstring(L, cal->bias_name);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "dark");
+	lua_pushstring(L, cal->dark_name);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "flat");
+	lua_pushstring(L, cal->flat_name);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "output");
+	lua_pushstring(L, output_names[cal->output]);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "pedestal");
+	lua_pushnumber(L, cal->pedestal);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "kernel");
+	lua_pushstring(L, corrector_name);
+	lua_rawset(L, -3);
+}
+
+/*
+	pi_calibrate{bias=, dark=, flat=, output="both"|"corrected", pedestal=}
+
+	Each master is an image or a FITS file name. The dark has the bias
+	subtracted and is scaled by exposure time, the flat has both
+	subtracted and is normalized to its mean. pi_calibrate(false)
+	stops calibrating; pi_calibrate() returns the masters in use, or
+	nil.
+*/
+int picam_calibrate(lua_State *L)
+{
+	static const char *keys[3] = {"bias", "dark", "flat"};
+	struct loading *ld;
+	struct master *m;
+	struct calibration *cal;
+	const char *output;
+	double sum;
+	size_t i, npix;
+	int k, have[3];
+	piint width = 0, height = 0;
+
+	if(lua_isnoneornil(L, 1)) {
+		cal = calib_current();
+		if(!cal) {
+			lua_pushnil(L);
+			return 1;
+		}
+		push_calibration(L, cal);
+		calib_release(cal);
+		return 1;
+	}
+	if(lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+		set_current(NULL);
+		printf("Calibration off\n");
+		return 0;
+	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	ld = push_loading(L);
+	m = ld->m;
+	for(k = 0; k < 3; k++) {
+		have[k] = get_master(L, keys[k], &m[k]);
+		if(!have[k]) continue;
+		if(width == 0) {
+			width = m[k].width;
+			height = m[k].height;
+		} else if(m[k].width != width || m[k].height != height) {
+			calibrate_error(L, "Masters differ in size");
+			return 0;
+		}
+	}
+	if(width == 0) {
+		calibrate_error(L, "No bias, dark or flat given");
+		return 0;
+	}
+	if(have[1] && m[1].exptime <= 0) {
+		calibrate_error(L, "Dark master has no exposure time");
+		return 0;
+	}
+
+	cal = ld->cal = new_calibration(width, height);
+	if(!cal) {
+		calibrate_error(L, "Out of memory");
+		return 0;
+	}
+	npix = (size_t) width * height;
+
+	cal->pedestal = CAL_DEFAULT_PEDESTAL;
+	lua_getfield(L, 1, "pedestal");
+	if(!lua_isnil(L, -1)) cal->pedestal = (float) luaL_checknumber(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "output");
+	output = lua_isnil(L, -1) ? output_names[CAL_BOTH] : lua_tostring(L, -1);
+	for(cal->output = 0; cal->output < NUM_CAL_OUTPUTS; cal->output++)
+		if(output && strcmp(output, output_names[cal->output]) == 0) break;
+	lua_pop(L, 1);
+	if(cal->output == NUM_CAL_OUTPUTS) {
+		calibrate_error(L, "output must be both or corrected");
+		return 0;
+	}
+
+	if(have[0]) {
+		memcpy(cal->bias, m[0].pixels, npix * sizeof(float));
+		sprintf_s(cal->bias_name, CAL_NAME_LEN, "%s", m[0].name);
+	}
+	if(have[1]) {
+		for(i = 0; i < npix; i++)
+			cal->dark[i] = (float) ((m[1].pixels[i] - cal->bias[i]) / m[1].exptime);
+		sprintf_s(cal->dark_name, CAL_NAME_LEN, "%s", m[1].name);
+	}
+	if(have[2]) {
+		sum = 0.0;
+		for(i = 0; i < npix; i++) {
+			m[2].pixels[i] -= cal->bias[i] + (float) m[2].exptime * cal->dark[i];
+			sum += m[2].pixels[i];
+		}
+		if(sum <= 0) {
+			calibrate_error(L, "Flat master has no signal");
+			return 0;
+		}
+		sum /= npix;
+		for(i = 0; i < npix; i++)
+			cal->gain[i] = m[2].pixels[i] > CAL_MIN_FLAT * sum ? (float) (sum / m[2].pixels[i]) : 0.0f;
+		sprintf_s(cal->flat_name, CAL_NAME_LEN, "%s", m[2].name);
+	}
+	for(k = 0; k < 3; k++) {
+		free(m[k].pixels);
+		m[k].pixels = NULL;
+	}
+	ld->cal = NULL;
+
+	printf("Calibrating %ix%i frames: bias %s, dark %s, flat %s (%s kernel)\n", width, height,
+		cal->bias_name, cal->dark_name, cal->flat_name, corrector_name);
+	set_current(cal);
+	return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef calib_h
+#define calib_h
+
+/*
+	Calibration of frames on their way to the writer. Master bias,
+	dark and flat frames are converted once into per-pixel float
+	offsets and gains, then every frame is corrected as
+
+		(raw - bias - exptime * dark) * gain + pedestal
+
+	by a SIMD kernel over row tiles on the parallel pool. Output stays
+	16 bit; the pedestal keeps noise about zero from clipping.
+
+	The Lua side is pi_calibrate{bias=, dark=, flat=, output=}, see
+	picam_calibrate in calib.c.
+*/
+
+#include "frame.h"
+#include "writer.h"
+
+enum calib_output {
+	CAL_BOTH,		/* raw and calibrated files */
+	CAL_CORRECTED,		/* the calibrated file only */
+	NUM_CAL_OUTPUTS
+};
+
+#define CAL_DEFAULT_PEDESTAL 100.0
+
+/* Prefix of calibrated files written alongside the raw ones */
+#define CAL_PREFIX "cal_"
+
+struct calibration;
+
+/* Sets up the stage, first called from the Lua thread */
+void calib_start(void);
+
+/* The calibration in use, holding a reference, or NULL if none */
+struct calibration *calib_current(void);
+void calib_release(struct calibration *cal);
+
+int calib_output(const struct calibration *cal);
+
+/* Corrects a frame described by md into a new frame holding one
+reference, recording the masters in md. NULL with a message in errmsg
+if the frame does not match the masters or out of memory */
+struct frame *calib_apply(struct calibration *cal, const struct frame *raw,
+	struct metadata *md, char *errmsg);
+
+/* Name of the conversion kernel, e.g. "sse2" */
+const char *calib_kernel(void);
+
+/* Drops the calibration in use */
+void calib_shutdown(void);
+
+#endif
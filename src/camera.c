@@ -12,153 +12,58 @@
 #include <time.h>
 #include <string.h>
 #include <stdio.h>
-#include <Windows.h>
-#include <direct.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "fitsio.h"
+#include "lauxlib.h"
+#include "platform.h"
 #include "camera.h"
-#include "picam.h"
-#include "picam_advanced.h"
-#include "pil_platform.h"
+#include "sdk.h"
+#include "writer.h"
+#include "state.h"
+#include "compress.h"
+#include "parallel.h"
+#include "fitsdirect.h"
+#include "framestats.h"
+#include "frame.h"
+#include "image.h"
+#include "stack.h"
+#include "calib.h"
+#include "trace.h"
+#include "preview.h"
+#include "publish.h"
+#include "rawfile.h"
+#include "outpath.h"
 
 
 /* Local function declarations */
-#define STR_BUF_SIZE 2048
+#define NUM_FRAMES  1
+#define NO_TIMEOUT  -1
+#define ACQUISITION_MT "picam.acquisition"
+#define CAMERA_MT "picam.camera"
+#define DEFAULT_RING_FRAMES 8
+#define MAX_WAIT_HANDLES 64
 
-static char months[13][15] = {"", "jan", "feb", "mar", 
-	"apr", "may", "jun", "jul", "aug", "sep", 
-	"oct", "nov", "dec"};
 
-static char path_prefix[STR_BUF_SIZE] = "\\sedm";
 
-struct metadata {
-	piflt exptime, adcspeed, temp;
-	piint bitdepth, gain, adc;
-	PicamCameraID *id;
-};
-
-
-
-
-static void camera_to_lua_table(lua_State *L,  PicamCameraID available, PicamHandle handle);
-static PicamCameraID lua_table_to_camera(lua_State *L, int index, PicamHandle *handle);
-static void set_exposure_time(PicamHandle model, piflt exptime_s, lua_State *L);
-static void set_exposure_time(PicamHandle model, piflt exptime_s, lua_State *L);
-static void set_gain(PicamHandle model, PicamAdcAnalogGain gain, lua_State *L);
-static void set_amplifier(PicamHandle model, PicamAdcQuality amplifier, lua_State *L);
-static void set_adc_speed(PicamHandle model, piflt adc_speed, lua_State *L);
-static void write_data_to_file(pi16u * buf, struct metadata * md, char * prepend, lua_State *L);
-static BOOL DirectoryExists(LPCTSTR szPath);
-
-
-static BOOL DirectoryExists(LPCTSTR szPath)
-{
-  DWORD dwAttrib = GetFileAttributes(szPath);
-
-  return (dwAttrib != INVALID_FILE_ATTRIBUTES && 
-         (dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
-}
-
-
-static void write_data_to_file(pi16u * buf, struct metadata * md, char * prepend, lua_State *L)
-{
-	fitsfile *ff;
-	int status = 0, retcode = 0;
-	long naxes[2] = {2048, 2048};
-	char outdir[STR_BUF_SIZE];
-	char outfile[STR_BUF_SIZE];
-	float bscale1 = 1.0, bzero32768 = 32768.0;
-	SYSTEMTIME str_t;
-
-	/* Create output directory */
-	GetLocalTime(&str_t);
-	
-	sprintf_s(outdir, STR_BUF_SIZE, "%s\\%4d%s%2d", path_prefix,
-		str_t.wYear, months[str_t.wMonth], str_t.wDay);
-
-	if(!DirectoryExists((LPCTSTR) outdir)) {
-		printf("Creating directory %s\n", outdir);
-		
-		if(!mkdir(outdir)) {
-			lua_pushstring(L,"Could not create path\n");
-			lua_error(L);
-			return;
-		}
-	}
-
-
-	sprintf_s(outfile, STR_BUF_SIZE, "!%s\\%s%4.4d%2.2d%2.2d_%2.2i_%2.2i_%2.2i.fits", outdir, prepend, 
-		str_t.wYear, str_t.wMonth, str_t.wDay, str_t.wHour, str_t.wMinute, str_t.wSecond);
-
-	/* FITS housekeeping */
-	retcode = fits_create_file(&ff, outfile, &status);
-
-	if(retcode) {
-		lua_pushstring(L,"Could not create FITS file\n");
-		fits_report_error(stderr, status);
-		lua_error(L);
-		return;
-	}
-
-
-	retcode = fits_create_img(ff, 
-		SHORT_IMG , // bitpix
-		2, // naxis
-		naxes, // naxes
-		&status);
-	if(retcode) {
-		lua_pushstring(L,"Could not create image \n");
-		fits_report_error(stderr, status);
-		lua_error(L);
-		fits_close_file(ff, &status);
-		return;
-	}
-		
-	// Following line is required to handle ushort, see:
-	// "Support for Unsigned Integers and Signed Bytes" in
-	// cfitsio manual
-	fits_write_key(ff, TFLOAT, "BSCALE", &bscale1, NULL, &status);
-	fits_write_key(ff, TFLOAT, "BZERO", &bzero32768, NULL, &status);
-	fits_set_bscale(ff, 1, //BSCALE Factor
-						32768, // BZERO factor
-						&status); 
-
-	fits_write_key(ff, TDOUBLE, "EXPTIME", &md->exptime, "Exposure time in s", &status);
-	fits_write_key(ff, TDOUBLE, "ADCSPEED", &md->adcspeed, "Readout speed in MHz", &status);
-	fits_write_key(ff, TDOUBLE, "TEMP", &md->temp, "Detector temp in deg C", &status);
-	fits_write_key(ff, TINT, "BITDEPTH", &md->bitdepth, "Bit depth", &status);
-	fits_write_key(ff, TINT, "GAIN_SET", &md->gain, "1: low, 2: medium, 3: high gain", &status);
-	fits_write_key(ff, TINT, "ADC", &md->adc, "1: Low noise, 2: high capacity",  &status);
-	fits_write_key(ff, TINT, "MODEL", &md->id->model, "PI Model #", &status);
-	fits_write_key(ff, TINT, "INTERFC", &md->id->computer_interface, "PI Computer Interface", &status);
-	fits_write_key(ff, TSTRING, "SNSR_NM", &md->id->sensor_name, "PI sensor name", &status);
-	fits_write_key(ff, TSTRING, "SER_NO", &md->id->serial_number, "PI serial #", &status);
-
-
-	retcode = fits_write_img(ff,
-		TUSHORT, // (T)ype is unsigned short (USHORT)
-		1, // Copy from [0, 0] but fits format is indexed by 1
-		naxes[0] * naxes[1], // Number of elements
-		buf,
-		&status);
-	if(retcode && status==412) {
-		printf("Overflow\n");
-	} else if(retcode) {
-		lua_pushstring(L,"Could not copy data over \n");
-		fits_report_error(stderr, status);
-		lua_error(L);
-		fits_close_file(ff, &status);
-		return;
-	}
 
+static void camera_to_lua_table(lua_State *L,  PicamCameraID available);
+static PicamCameraID lua_table_to_camera(lua_State *L, int index);
+static struct camera_state *check_camera(lua_State *L, int index);
+static void push_failed_parameters(lua_State *L, const int *failed);
+static int compute_frame_stats(const pi16u *pixels, struct metadata *md,
+	unsigned int *histogram, struct stats_scratch *scratch);
+static void push_frame_stats(lua_State *L, const struct frame_stats *st,
+	const unsigned int *histogram);
+static int get_number_field(lua_State *L, int index, const char *key, piflt *value);
+static void push_rois(lua_State *L, const struct metadata *md);
+static void acquisitions_start(void);
 
-	fits_close_file(ff, &status);
-	printf("Wrote '%s'.\n", outfile);
-}
 
-static PicamCameraID lua_table_to_camera(lua_State *L, int index, PicamHandle *handle)
+/* The ID in a pi_list entry */
+static PicamCameraID lua_table_to_camera(lua_State *L, int index)
 {
 	PicamCameraID id = {0};
 	pichar  *str;
@@ -175,11 +80,6 @@ static PicamCameraID lua_table_to_camera(lua_State *L, int index, PicamHandle *h
 	id.model = lua_tointeger(L,-1);
 	lua_pop(L,1);
 
-	lua_pushstring(L, "handle");
-	lua_gettable(L, index);
-	*handle = (PicamHandle) lua_tointeger(L, -1);
-	lua_pop(L,1);
-
 	///////
 	lua_pushstring(L, "serial");
 	lua_gettable(L, index);
@@ -201,19 +101,12 @@ static PicamCameraID lua_table_to_camera(lua_State *L, int index, PicamHandle *h
 		lua_error(L);
 	}
 	strncpy_s(id.sensor_name, PicamStringSize_SensorName, str, len);
-
-	printf("Interface: %i, model: %i, serial: %s, sensor: %s\n", 
-		id.computer_interface, id.model, id.serial_number, id.sensor_name);
 	return id;
 }
 
-static void camera_to_lua_table(lua_State *L,  PicamCameraID available, PicamHandle handle)
+static void camera_to_lua_table(lua_State *L,  PicamCameraID available)
 {
 	lua_newtable(L);
-	lua_pushstring(L, "handle");
-	lua_pushinteger(L, (int) handle);
-	lua_rawset(L, -3);
-
 	lua_pushstring(L, "interface");
 	lua_pushinteger(L, available.computer_interface);
 	lua_rawset(L, -3);
@@ -228,113 +121,259 @@ static void camera_to_lua_table(lua_State *L,  PicamCameraID available, PicamHan
 	lua_rawset(L, -3);
 }
 
-static void set_exposure_time(PicamHandle model, piflt exptime_s, lua_State *L)
+/*
+	An open camera as Lua holds it, returned by pi_open. The handles
+	and ID are resolved once; cam is NULL once closed, and is checked
+	against opened since a closed camera's slot is reused.
+*/
+struct camera_ref {
+	struct camera_state *cam;
+	unsigned long opened;
+	PicamHandle handle, model;
+	PicamCameraID id;
+};
+
+static struct camera_state *check_camera(lua_State *L, int index)
 {
-	PicamParameter* failed_parameter_array;
-	piint num_errors;
-	PicamError error = 0;
+	struct camera_ref *ref = luaL_checkudata(L, index, CAMERA_MT);
 
-	error = Picam_SetParameterFloatingPointValue(
-		model, 
-		PicamParameter_ExposureTime, 
-		exptime_s*1000.0 );
-	if( error != PicamError_None )
-	{
-		lua_pushstring(L, "Failed to set exposure time ");
+	if(!ref->cam || !ref->cam->used || ref->cam->opened != ref->opened) {
+		lua_pushfstring(L, "Camera %s is closed", ref->id.serial_number);
 		lua_error(L);
 	}
+	return ref->cam;
+}
 
-	error = Picam_CommitParameters(model, &failed_parameter_array, &num_errors);
-    if( error != PicamError_None )
-    {
-        lua_pushstring(L,"Failed to commit to camera device." );
-        lua_error(L);
-	} else {
-		printf("Commited exposure time %3.1f.\n", exptime_s);
-	}
+/* cam:close(), finishing acquisitions queued on it first */
+static int camera_close(lua_State *L)
+{
+	struct camera_ref *ref = luaL_checkudata(L, 1, CAMERA_MT);
+
+	check_camera(L, 1);
+	camera_state_release(ref->cam);
+	Picam_CloseCamera(ref->handle);
+	ref->cam = NULL;
+	printf("Camera %s closed\n", ref->id.serial_number);
+	return 0;
 }
 
-static void set_gain(PicamHandle model, PicamAdcAnalogGain gain, lua_State *L)
+/* Methods, then the ID as pi_list has it */
+static int camera_index(lua_State *L)
 {
-	PicamParameter* failed_parameter_array;
-	piint num_errors;
-	PicamError error = 0;
+	struct camera_ref *ref = luaL_checkudata(L, 1, CAMERA_MT);
+	const char *key;
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	if(!lua_isnil(L, -1)) return 1;
+
+	key = luaL_checkstring(L, 2);
+	if(strcmp(key, "serial") == 0)
+		lua_pushstring(L, ref->id.serial_number);
+	else if(strcmp(key, "sensor") == 0)
+		lua_pushstring(L, ref->id.sensor_name);
+	else if(strcmp(key, "model") == 0)
+		lua_pushinteger(L, ref->id.model);
+	else if(strcmp(key, "interface") == 0)
+		lua_pushinteger(L, ref->id.computer_interface);
+	else
+		lua_pushnil(L);
+	return 1;
+}
 
-	error = Picam_SetParameterIntegerValue(
-		model, 
-		PicamParameter_AdcAnalogGain, 
-		gain );
-	if( error != PicamError_None )
-	{
-		lua_pushstring(L, "Failed to set exposure time ");
-		lua_error(L);
-	}
+static int camera_tostring(lua_State *L)
+{
+	struct camera_ref *ref = luaL_checkudata(L, 1, CAMERA_MT);
 
-	error = Picam_CommitParameters(model, &failed_parameter_array, &num_errors);
-    if( error != PicamError_None )
-    {
-        lua_pushstring(L,"Failed to commit to camera device." );
-        lua_error(L);
-	} else {
-		printf("Commited gain %i.\n", gain);
+	lua_pushfstring(L, "camera %s (%s)%s", ref->id.serial_number, ref->id.sensor_name,
+		ref->cam ? "" : ", closed");
+	return 1;
+}
+
+static const luaL_Reg camera_methods[] = {
+	{"set", picam_set},
+	{"configure", picam_configure},
+	{"roi", picam_roi},
+	{"acquire", picam_acquire},
+	{"acquire_async", picam_acquire_async},
+	{"stats", picam_stats},
+	{"telemetry", picam_telemetry},
+	{"wait_temperature", picam_wait_temperature},
+	{"close", camera_close},
+	{NULL, NULL}
+};
+
+static void push_camera_metatable(lua_State *L)
+{
+	if(luaL_newmetatable(L, CAMERA_MT)) {
+		lua_pushstring(L, "__index");
+		lua_newtable(L);
+		luaL_register(L, NULL, camera_methods);
+		lua_pushcclosure(L, camera_index, 1);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "__tostring");
+		lua_pushcfunction(L, camera_tostring);
+		lua_rawset(L, -3);
 	}
 }
 
-static void set_adc_speed(PicamHandle model, piflt adc_speed, lua_State *L)
+/* Pushes a table of the names of failed parameters */
+static void push_failed_parameters(lua_State *L, const int *failed)
 {
-	PicamParameter* failed_parameter_array;
-	piint num_errors;
-	PicamError error = 0;
+	int p, n = 0;
 
-	error = Picam_SetParameterFloatingPointValue(
-		model,
-		PicamParameter_AdcSpeed, 
-		adc_speed );
-	if( error != PicamError_None )
-	{
-		lua_pushstring(L, "Failed to set adc speed");
-		lua_error(L);
-		return;
+	lua_newtable(L);
+	for(p = 0; p < NUM_CONFIG; p++) {
+		if(!failed[p]) continue;
+		lua_pushstring(L, config_name(p));
+		lua_rawseti(L, -2, ++n);
 	}
+}
 
-	error = Picam_CommitParameters(model, &failed_parameter_array, &num_errors);
-    if( error != PicamError_None )
-    {
-        lua_pushstring(L,"Failed to commit to camera device." );
-        lua_error(L);
-		return;
-    }
-	printf("Committed ADC Speed to %1.1f MHz.\n", adc_speed);
+/* Pixels at or above the ADC's full scale count as saturated */
+static pi16u saturation_level(const struct metadata *md)
+{
+	if(md->bitdepth >= 1 && md->bitdepth <= 16)
+		return (pi16u) ((1L << md->bitdepth) - 1);
+	return 65535;
+}
+
+/* Fills md->stats from a readout, histogram may be NULL */
+static int compute_frame_stats(const pi16u *pixels, struct metadata *md,
+	unsigned int *histogram, struct stats_scratch *scratch)
+{
+	return frame_stats_compute(pixels, metadata_pixels(md),
+		saturation_level(md), &md->stats, histogram, scratch);
 }
 
+/* Reads t[key] into value if it is a number, returns 1 if found */
+static int get_number_field(lua_State *L, int index, const char *key, piflt *value)
+{
+	int found;
+
+	lua_pushstring(L, key);
+	lua_gettable(L, index);
+	found = lua_isnumber(L, -1);
+	if(found) *value = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return found;
+}
 
-static void set_amplifier(PicamHandle model, PicamAdcQuality amplifier, lua_State *L)
+/* Pushes a list of {x=, y=, width=, height=, xbin=, ybin=}, in sensor
+pixels from 1 with the extent unbinned, as pi_roi takes them */
+static void push_rois(lua_State *L, const struct metadata *md)
 {
-	
-	PicamParameter* failed_parameter_array;
-	piint num_errors;
-	PicamError error = 0;
+	const struct frame_roi *r;
+	int k;
+
+	lua_createtable(L, md->nrois, 0);
+	for(k = 0; k < md->nrois; k++) {
+		r = &md->rois[k];
+		lua_createtable(L, 0, 6);
+		lua_pushstring(L, "x");
+		lua_pushinteger(L, r->x + 1);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "y");
+		lua_pushinteger(L, r->y + 1);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "width");
+		lua_pushinteger(L, r->width * r->xbin);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "height");
+		lua_pushinteger(L, r->height * r->ybin);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "xbin");
+		lua_pushinteger(L, r->xbin);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "ybin");
+		lua_pushinteger(L, r->ybin);
+		lua_rawset(L, -3);
+		lua_rawseti(L, -2, k + 1);
+	}
+}
+
+/* Pushes {min=, max=, mean=, std=, median=, clipped_std=, saturated=,
+histogram={[adu]=count}}, the histogram only holding non-empty bins */
+static void push_frame_stats(lua_State *L, const struct frame_stats *st,
+	const unsigned int *histogram)
+{
+	long v;
+
+	lua_newtable(L);
+	lua_pushstring(L, "min");
+	lua_pushinteger(L, st->min);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "max");
+	lua_pushinteger(L, st->max);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "mean");
+	lua_pushnumber(L, st->mean);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "std");
+	lua_pushnumber(L, st->std);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "median");
+	lua_pushnumber(L, st->median);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "clipped_std");
+	lua_pushnumber(L, st->clipped_std);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "saturated");
+	lua_pushnumber(L, (lua_Number) st->saturated);
+	lua_rawset(L, -3);
 
-	error = Picam_SetParameterIntegerValue(
-		model,
-		PicamParameter_AdcQuality, 
-		amplifier );
-	if( error != PicamError_None )
-	{
-		lua_pushstring(L, "Failed to set amplifier ");
+	if(!histogram || !st->valid) return;
+	lua_pushstring(L, "histogram");
+	lua_newtable(L);
+	for(v = st->min; v <= st->max; v++) {
+		if(!histogram[v]) continue;
+		lua_pushnumber(L, histogram[v]);
+		lua_rawseti(L, -2, v);
+	}
+	lua_rawset(L, -3);
+}
+/* Runs fn(arg) on cam's worker after the acquisitions queued on it, so
+nothing else is talking to the camera meanwhile. Raises a Lua error if
+it could not be queued; fn must not */
+static void run_on_camera(lua_State *L, struct camera_state *cam, camera_job_fn fn, void *arg)
+{
+	if(camera_state_run(cam, fn, arg)) {
+		lua_pushstring(L, "Out of memory queueing camera job");
 		lua_error(L);
-		return;
 	}
+}
 
-	error = Picam_CommitParameters(model, &failed_parameter_array, &num_errors);
-    if( error != PicamError_None )
-    {
-        lua_pushstring(L,"Failed to commit to camera device." );
-        lua_error(L);
-		return;
-    }
-	printf("Committed amplifier to %i.\n", amplifier);
+/* pi_set and pi_configure's commit, run on the camera's worker */
+struct configure_job {
+	struct camera_state *cam;
+	piflt values[NUM_CONFIG];
+	int requested[NUM_CONFIG], failed[NUM_CONFIG];
+	int changed;
+	pibln committed;
+};
+
+static void configure_job(void *arg)
+{
+	struct configure_job *job = arg;
+
+	job->changed = camera_configure(job->cam, job->values, job->requested, job->failed);
+	Picam_AreParametersCommitted(job->cam->handle, &job->committed);
+}
+
+/* pi_roi's commit, run on the camera's worker */
+struct roi_job {
+	struct camera_state *cam;
+	PicamRoi rois[MAX_ROIS];
+	int nrois, failed;
+};
+
+static void roi_job(void *arg)
+{
+	struct roi_job *job = arg;
+
+	job->failed = camera_set_rois(job->cam, job->rois, job->nrois);
 }
+
 /* Global function declarations */
 
 int picam_start(lua_State *L)
@@ -358,6 +397,12 @@ int picam_start(lua_State *L)
 		return 0;
 	}
 
+	frame_pool_start();
+	writer_start();
+	parallel_start();
+	calib_start();
+	acquisitions_start();
+
 	Picam_GetVersion(&major, &minor, &distribution, &released);
 	printf("Library Initalized. Version: %i.%i.%i.%i\n", 
 		major, minor, distribution, released);
@@ -372,56 +417,193 @@ int picam_start(lua_State *L)
 	amplifier, 
 	adcspeed
 
+	All four go to the camera in a single commit, see pi_configure.
 */
 int picam_set(lua_State *L)
 {
-	PicamCameraID id;
-	PicamHandle handle, model;
-	PicamError error;
-	piflt exptime_s = 0.0, adcspeed;
-	PicamAdcQuality amplifier;
-	PicamAdcAnalogGain gain;
-	clock_t tick, tock;
-	pibln committed;
+	struct configure_job job;
+	double tick;
+	int p;
+
+	tick = pi_now();
+	memset(&job, 0, sizeof(job));
+	job.cam = check_camera(L, 1);
+	job.values[CFG_EXPTIME] = lua_tonumber(L, 2);
+	job.values[CFG_GAIN] = lua_tointeger(L, 3);
+	job.values[CFG_ADC] = lua_tointeger(L, 4);
+	job.values[CFG_ADCSPEED] = lua_tonumber(L, 5);
+	job.requested[CFG_EXPTIME] = job.requested[CFG_GAIN] = 1;
+	job.requested[CFG_ADC] = job.requested[CFG_ADCSPEED] = 1;
 
-	tick = clock();
-	id = lua_table_to_camera(L, 1, &handle);
-	exptime_s = lua_tonumber(L, 2);
-	gain = lua_tointeger(L, 3);
-	amplifier = lua_tointeger(L, 4);
-	adcspeed = lua_tonumber(L, 5);
+	printf("Setting camera %s: exptime %3.1f s, gain %i, amp %i, adcspeed %1.1f MHz\n",
+		job.cam->id.sensor_name, job.values[CFG_EXPTIME], (int) job.values[CFG_GAIN],
+		(int) job.values[CFG_ADC], job.values[CFG_ADCSPEED]);
+
+	run_on_camera(L, job.cam, configure_job, &job);
+	if(job.changed < 0) {
+		lua_pushstring(L, "Camera rejected");
+		for(p = 0; p < NUM_CONFIG; p++) {
+			if(!job.failed[p]) continue;
+			lua_pushstring(L, " ");
+			lua_pushstring(L, config_name(p));
+			lua_concat(L, 3);
+		}
+		lua_error(L);
+	}
+	printf("Committed %i changed parameters in %f seconds\n", job.changed, pi_now() - tick);
+	trace_span("pi_set", tick, pi_now(), job.changed);
 
+	printf("The camera %s all values commited.\n", (job.committed ? "has" : "does not have"));
+
+	lua_pushboolean(L, job.committed);
+	return 1;
+}
+
+
+/*
+	pi_configure(camera, {exptime=, gain=, adc=, adcspeed=, setpoint=})
+
+	Stages only the values that differ from what was last committed and
+	commits them once, after the acquisitions already queued on the
+	camera. Returns true and the number of parameters changed, or false
+	and the names of the parameters the camera rejected, in which case
+	the camera keeps its previous settings.
+*/
+int picam_configure(lua_State *L)
+{
+	struct configure_job job;
+	int p;
+	double tick;
+
+	tick = pi_now();
+	memset(&job, 0, sizeof(job));
+	job.cam = check_camera(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_pushnil(L);
+	while(lua_next(L, 2) != 0) {
+		if(lua_type(L, -2) != LUA_TSTRING || (p = config_lookup(lua_tostring(L, -2))) < 0) {
+			lua_pushfstring(L, "Unknown camera parameter '%s'", lua_type(L, -2) == LUA_TSTRING ?
+				lua_tostring(L, -2) : luaL_typename(L, -2));
+			lua_error(L);
+		}
+		if(!lua_isnumber(L, -1)) {
+			lua_pushfstring(L, "Camera parameter '%s' must be a number", config_name(p));
+			lua_error(L);
+		}
+		job.values[p] = lua_tonumber(L, -1);
+		job.requested[p] = 1;
+		lua_pop(L, 1);
+	}
+
+	run_on_camera(L, job.cam, configure_job, &job);
+	if(job.changed < 0) {
+		printf("Camera %s rejected the configuration\n", job.cam->id.sensor_name);
+		lua_pushboolean(L, 0);
+		push_failed_parameters(L, job.failed);
+		return 2;
+	}
+
+	printf("Configured %i parameters in %f seconds\n", job.changed, pi_now() - tick);
+	trace_span("pi_configure", tick, pi_now(), job.changed);
+	lua_pushboolean(L, 1);
+	lua_pushinteger(L, job.changed);
+	return 2;
+}
 
-	printf("Setting camera %s: exptime %3.1f s, gain %i, amp %i, adcspeed %1.1f MHz\n",
-		id.sensor_name, exptime_s, gain, amplifier, adcspeed);
-	
 
-	error = PicamAdvanced_GetCameraModel( handle, &model );
-	if( error != PicamError_None )
-	{
-		lua_pushstring(L, "Failed to get camera model.");
+/*
+	pi_roi(camera, {x=, y=, width=, height=, xbin=, ybin=}, ...)
+
+	Sets the regions of the sensor read out, one table each, in sensor
+	pixels from 1 with the extent unbinned. Omitted fields give the
+	rest of the sensor without binning, bin= sets both binnings. Each
+	ROI comes out as an HDU of its own (writer.h). pi_roi(camera,
+	false) reads out the whole sensor again, pi_roi(camera) changes
+	nothing. The ROIs change after the acquisitions already queued on
+	the camera. Returns the ROIs in use, or false and a message if the
+	camera rejected the new ones and kept the previous ROIs.
+*/
+int picam_roi(lua_State *L)
+{
+	struct camera_state *cam;
+	struct metadata md;
+	struct roi_job job;
+	PicamRoi *rois = job.rois;
+	piint stride, sensor_width, sensor_height;
+	piflt v;
+	int k, nrois = lua_gettop(L) - 1, whole;
+	double tick;
+
+	tick = pi_now();
+	cam = check_camera(L, 1);
+	pi_mutex_lock(&cam->lock);
+	sensor_width = cam->sensor_width;
+	sensor_height = cam->sensor_height;
+	pi_mutex_unlock(&cam->lock);
+
+	whole = nrois == 1 && lua_isboolean(L, 2) && !lua_toboolean(L, 2);
+	if(whole) {
+		rois[0].x = rois[0].y = 0;
+		rois[0].width = sensor_width;
+		rois[0].height = sensor_height;
+		rois[0].x_binning = rois[0].y_binning = 1;
+	} else if(nrois > MAX_ROIS) {
+		lua_pushfstring(L, "At most %d ROIs", MAX_ROIS);
 		lua_error(L);
 		return 0;
 	}
 
-	set_exposure_time(model, exptime_s, L);
-	set_gain(model, gain, L);
-	set_amplifier(model, amplifier, L);
-	set_adc_speed(model, adcspeed, L);
-	
-	tock = clock();
+	for(k = 0; k < nrois && !whole; k++) {
+		luaL_checktype(L, k + 2, LUA_TTABLE);
+		rois[k].x = get_number_field(L, k + 2, "x", &v) ? (piint) v - 1 : 0;
+		rois[k].y = get_number_field(L, k + 2, "y", &v) ? (piint) v - 1 : 0;
+		rois[k].x_binning = rois[k].y_binning = 1;
+		if(get_number_field(L, k + 2, "bin", &v))
+			rois[k].x_binning = rois[k].y_binning = (piint) v;
+		if(get_number_field(L, k + 2, "xbin", &v)) rois[k].x_binning = (piint) v;
+		if(get_number_field(L, k + 2, "ybin", &v)) rois[k].y_binning = (piint) v;
+		if(rois[k].x_binning < 1 || rois[k].y_binning < 1) {
+			lua_pushstring(L, "Binning must be positive");
+			lua_error(L);
+			return 0;
+		}
 
-	printf("set took %f seconds\n", ((float) tock-tick)/CLOCKS_PER_SEC);
+		/* The rest of the sensor, in whole binned pixels */
+		if(get_number_field(L, k + 2, "width", &v))
+			rois[k].width = (piint) v;
+		else
+			rois[k].width = (sensor_width - rois[k].x) / rois[k].x_binning * rois[k].x_binning;
+		if(get_number_field(L, k + 2, "height", &v))
+			rois[k].height = (piint) v;
+		else
+			rois[k].height = (sensor_height - rois[k].y) / rois[k].y_binning * rois[k].y_binning;
+	}
 
-	Picam_AreParametersCommitted(handle, &committed);
-	printf("The camera %s all values commited.\n", (committed ? "has" : "does not have"));
+	if(nrois > 0) {
+		job.cam = cam;
+		job.nrois = nrois;
+		run_on_camera(L, cam, roi_job, &job);
+		if(job.failed) {
+			printf("Camera %s rejected the ROIs\n", cam->id.sensor_name);
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "ROIs must lie on the sensor without overlapping, "
+				"with width and height multiples of the binning");
+			return 2;
+		}
+	}
 
-	lua_pushboolean(L, committed);
+	md.id = NULL;
+	camera_state_metadata(cam, &md, &stride);
+	if(nrois > 0)
+		printf("Set %i ROI(s), %lu pixels per readout, in %f seconds\n", md.nrois,
+			(unsigned long) metadata_pixels(&md), pi_now() - tick);
+	trace_span("pi_roi", tick, pi_now(), md.nrois);
+	push_rois(L, &md);
 	return 1;
 }
 
 
-
 int picam_list(lua_State *L)
 {
 	pibln initialized;
@@ -458,7 +640,7 @@ int picam_list(lua_State *L)
 									available[i].sensor_name, 
 									available[i].serial_number);
 
-		camera_to_lua_table(L, available[i], 0);
+		camera_to_lua_table(L, available[i]);
 		lua_rawseti(L, -2, i);
 	}
 
@@ -466,69 +648,1910 @@ int picam_list(lua_State *L)
 	return 1;
 }
 
+/* cam = pi_open(id), id an entry of pi_list() */
 int picam_open(lua_State *L)
 {
 	PicamHandle handle;
 	PicamCameraID id;
+	struct camera_ref *ref;
+	struct camera_state *cam;
 
-	id = lua_table_to_camera(L, 1, &handle);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	id = lua_table_to_camera(L, 1);
 
 	// Open camera ID and return handle
-	Picam_OpenCamera(&id, &handle);
+	if(Picam_OpenCamera(&id, &handle) != PicamError_None) {
+		lua_pushfstring(L, "Could not open camera %s", id.serial_number);
+		lua_error(L);
+		return 0;
+	}
 
-	printf("Camera opened\n");
+	// Committed settings are shadowed from here on, see pi_configure
+	cam = camera_state_get(handle, &id);
+	if(cam == NULL) {
+		Picam_CloseCamera(handle);
+		lua_pushstring(L, "Too many cameras open");
+		lua_error(L);
+		return 0;
+	}
 
-	camera_to_lua_table(L, id, handle);
+	ref = lua_newuserdata(L, sizeof(*ref));
+	ref->cam = cam;
+	ref->opened = cam->opened;
+	ref->handle = handle;
+	ref->model = cam->model;
+	ref->id = cam->id;
+	push_camera_metatable(L);
+	lua_setmetatable(L, -2);
 
+	printf("Camera %s opened\n", id.serial_number);
 	return 1;
 }
 
 
-int picam_acquire(lua_State *L)
+/*
+	Acquisitions through Picam_StartAcquisition.
+
+	Each acquisition owns a circular buffer of ring_frames readouts, a
+	pooled frame block (frame.h) lent to the SDK with
+	PicamAdvanced_SetAcquisitionBuffer. The readouts are queued for
+	writing (writer.c) in place as they arrive, without a copy; since
+	the next Picam_WaitForAcquisitionUpdate gives them back to the
+	camera, the drain waits for the writer to let go of them first,
+	and a readout that finds the ring full is dropped by the camera.
+	Every acquisition starts and drains on the camera's worker thread
+	(state.h). A burst from pi_acquire (nframes > 1) holds the Lua
+	thread until its drain is over; pi_acquire_async and pi_trigger
+	return handles at once, so several cameras expose together. Once
+	a handle reaches "writing" the camera is free again, and it is
+	done when the writer has every frame on disk. Each queued frame
+	holds a reference to the acquisition.
+*/
+
+enum acquisition_state {
+	ACQ_EXPOSING,	/* integrating or reading out */
+	ACQ_WRITING,	/* read out, camera free, files being written */
+	ACQ_DONE,
+	ACQ_FAILED
+};
+
+static const char *acquisition_states[] = {"exposing", "writing", "done", "failed"};
+
+/* Acquisitions of a synchronized pi_trigger hold the same gate, none
+starts its camera before all have their camera set up */
+struct start_gate {
+	pi_mutex lock;
+	pi_cond open;
+	int expected, arrived, refs;
+};
+
+/* Broadcast whenever an acquisition changes state, for pi_wait_any
+and pi_wait_all. Taken before an acquisition's lock, never while one
+is held */
+static pi_mutex acquisitions_lock;
+static pi_cond acquisitions_changed;
+static int acquisitions_ready = 0;
+
+static void acquisitions_start(void)
 {
+	if(acquisitions_ready) return;
+	pi_mutex_init(&acquisitions_lock);
+	pi_cond_init(&acquisitions_changed);
+	acquisitions_ready = 1;
+}
+
+struct acquisition {
+	pi_mutex lock;
+	pi_cond changed;
+	int state, refs;	/* refs: the Lua handle and the worker */
+	char error[STR_BUF_SIZE];
 
+	PicamHandle handle;
 	PicamCameraID id;
-	PicamHandle handle = 0, model = 0;
-	PicamError error = 0;
-	PicamAvailableData data;
-	PicamAcquisitionErrorsMask errors;
-	clock_t tick, tock;
-	struct metadata md;
-	pi16u * buf;
-	char * prepend;
+	struct camera_state *cam;
+	struct metadata md;	/* as the camera starts */
+	char prepend[STR_BUF_SIZE];
+	int save;		/* 0 if prepend was false, nothing is written */
+
+	pi64s nframes, received, written, write_failed, dropped;
+	struct start_gate *gate;	/* NULL unless synchronized */
+	struct frame_block *ring;
+	piint stride;
+	pi64s ring_frames;
+
+	/* The newest frame as Lua sees it, with its statistics. The drain
+	thread fills spare and swaps it with histogram under the lock. A
+	readout is let go of once it goes back to the camera, the
+	statistics stay */
+	struct frame *frame;
+	struct metadata frame_md;
+	int have_stats;
+	unsigned int *histogram, *spare;
+	struct stats_scratch scratch;	/* the drain thread's */
+	struct stack *stack;	/* fed every frame if not NULL */
+
+	/* Files the frames are appended to with pi_writer{sequence=true},
+	opened with the first frame written to each */
+	int sequence;
+	struct writer_sequence *seq, *cal_seq;
+
+	double started, read_out, finished;
+};
 
+/* Points the SDK at memory for the next acquisition, NULL for its own buffer */
+static PicamError use_acquisition_buffer(PicamHandle handle, void * memory, pi64s size)
+{
+	PicamAcquisitionBuffer buffer;
 
-	tick = clock();
-	id = lua_table_to_camera(L, 1, &handle);
-	prepend = lua_tostring(L, 2);
-	printf("Prepend: %s\n", prepend);
-
-	Picam_GetParameterFloatingPointValue( handle, PicamParameter_ExposureTime, &md.exptime );
-	md.exptime /= 1000;
-	Picam_GetParameterFloatingPointValue( handle, PicamParameter_AdcSpeed, &md.adcspeed );
-	Picam_GetParameterIntegerValue( handle, PicamParameter_AdcBitDepth, &md.bitdepth );
-	Picam_GetParameterIntegerValue( handle, PicamParameter_AdcAnalogGain, &md.gain );
-	Picam_GetParameterIntegerValue( handle, PicamParameter_AdcQuality, &md.adc );
-	Picam_GetParameterFloatingPointValue( handle, PicamParameter_SensorTemperatureReading, &md.temp );
-	
-	md.id = &id;
+	buffer.memory = memory;
+	buffer.memory_size = size;
+	return PicamAdvanced_SetAcquisitionBuffer(handle, &buffer);
+}
 
+static void pass_gate(struct start_gate *gate, int abandon);
 
-	#define NUM_FRAMES  1
-	#define NO_TIMEOUT  -1	
-	Picam_Acquire(handle,	NUM_FRAMES, // Readout count
-		NO_TIMEOUT, // Readout timeout, if 0 not relevant
-		&data,
-		&errors);
+static void release_acquisition(struct acquisition *acq)
+{
+	int refs;
+
+	pi_mutex_lock(&acq->lock);
+	refs = --acq->refs;
+	pi_mutex_unlock(&acq->lock);
+	if(refs) return;
+
+	pi_cond_destroy(&acq->changed);
+	pi_mutex_destroy(&acq->lock);
+	if(acq->ring) frame_block_release(acq->ring);
+	free(acq->histogram);
+	free(acq->spare);
+	stats_scratch_free(&acq->scratch);
+	if(acq->frame) frame_release(acq->frame);
+	if(acq->stack) stack_release(acq->stack);
+	if(acq->gate) pass_gate(acq->gate, 1);
+	free(acq);
+}
+
+static void notify_acquisitions(void)
+{
+	pi_mutex_lock(&acquisitions_lock);
+	pi_cond_broadcast(&acquisitions_changed);
+	pi_mutex_unlock(&acquisitions_lock);
+}
+
+static void set_acquisition_state(struct acquisition *acq, int state, const char *error)
+{
+	pi_mutex_lock(&acq->lock);
+	acq->state = state;
+	if(error) sprintf_s(acq->error, STR_BUF_SIZE, "%s", error);
+	pi_cond_broadcast(&acq->changed);
+	pi_mutex_unlock(&acq->lock);
+	notify_acquisitions();
+}
+
+static struct start_gate *new_gate(int expected)
+{
+	struct start_gate *gate = malloc(sizeof(*gate));
+
+	if(!gate) return NULL;
+	pi_mutex_init(&gate->lock);
+	pi_cond_init(&gate->open);
+	gate->expected = gate->refs = expected;
+	gate->arrived = 0;
+	return gate;
+}
+
+/* Waits for every holder of the gate to arrive, or to leave it if
+abandon, then drops this holder's reference */
+static void pass_gate(struct start_gate *gate, int abandon)
+{
+	int refs;
+
+	pi_mutex_lock(&gate->lock);
+	if(abandon)
+		gate->expected--;
+	else
+		gate->arrived++;
+	if(gate->arrived >= gate->expected)
+		pi_cond_broadcast(&gate->open);
+	while(!abandon && gate->arrived < gate->expected)
+		pi_cond_wait(&gate->open, &gate->lock);
+	refs = --gate->refs;
+	pi_mutex_unlock(&gate->lock);
+	if(refs) return;
+
+	pi_cond_destroy(&gate->open);
+	pi_mutex_destroy(&gate->lock);
+	free(gate);
+}
+
+/*
+	Sets up an acquisition of nframes for cam, written under prepend
+	unless save is 0, and added to stack if not NULL. Nothing is asked
+	of the camera until begin_acquisition. Raises a Lua error on
+	failure; the returned acquisition holds one reference.
+*/
+static struct acquisition *new_acquisition(lua_State *L, struct camera_state *cam,
+	const char *prepend, int save, struct stack *stack, pi64s nframes, pi64s ring_frames)
+{
+	struct acquisition *acq;
+	struct writer_status st;
 
-	tock = clock();
+	if(nframes < 1 || ring_frames < 1) {
+		lua_pushstring(L, "Frame and buffer counts must be positive");
+		lua_error(L);
+		return NULL;
+	}
 
-	buf = data.initial_readout;
-	if(data.readout_count != 1) {
-		lua_pushstring(L, "More than 1 count found");
+	acq = calloc(1, sizeof(*acq));
+	if(!acq) {
+		lua_pushstring(L, "Out of memory");
 		lua_error(L);
+		return NULL;
 	}
-	write_data_to_file(buf, &md, prepend, L);
-	printf("Acquisition took %5.2f s\n", ((float) tock-tick)/CLOCKS_PER_SEC);
-	return 0;
-}
\ No newline at end of file
+	acq->id = cam->id;
+	acq->handle = cam->handle;
+	acq->cam = cam;
+	acq->nframes = nframes;
+	acq->ring_frames = ring_frames;
+	sprintf_s(acq->prepend, STR_BUF_SIZE, "%s", prepend ? prepend : "");
+	acq->save = save;
+	acq->stack = stack;
+	if(save && nframes > 1) {
+		writer_get_status(&st, 0);
+		acq->sequence = st.fmt.sequence && st.fmt.raw == RAW_OFF;
+	}
+
+	acq->histogram = malloc(HISTOGRAM_BINS * sizeof(unsigned int));
+	acq->spare = malloc(HISTOGRAM_BINS * sizeof(unsigned int));
+	if(!acq->histogram || !acq->spare) {
+		free(acq->histogram);
+		free(acq->spare);
+		free(acq);
+		lua_pushstring(L, "Out of memory");
+		lua_error(L);
+		return NULL;
+	}
+
+	if(stack) stack_retain(stack);
+	pi_mutex_init(&acq->lock);
+	pi_cond_init(&acq->changed);
+	acq->state = ACQ_EXPOSING;
+	acq->refs = 1;
+	return acq;
+}
+
+/* Takes the camera's settings as they are now, points the camera at a
+ring for them and starts it, once every acquisition sharing its gate
+has got as far. Runs on the thread that drains it, returns the SDK's
+error */
+static PicamError begin_acquisition(struct acquisition *acq)
+{
+	const PicamParameter *failed_parameter_array;
+	piint num_errors;
+	PicamError error;
+	pi64s readout_count;
+	double tick = pi_now(), commit, setup;
+
+	acq->md.id = &acq->id;
+	camera_state_metadata(acq->cam, &acq->md, &acq->stride);
+	acq->ring = frame_block_new((size_t) acq->stride, (int) acq->ring_frames);
+	error = acq->ring ? PicamError_None : PicamError_UnexpectedError;
+
+	/* Start* acquires ReadoutCount readouts, only commit if it changed */
+	Picam_GetParameterLargeIntegerValue(acq->handle, PicamParameter_ReadoutCount, &readout_count);
+	if(error == PicamError_None && readout_count != acq->nframes) {
+		Picam_SetParameterLargeIntegerValue(acq->handle, PicamParameter_ReadoutCount, acq->nframes);
+		commit = pi_now();
+		error = Picam_CommitParameters(acq->handle, &failed_parameter_array, &num_errors);
+		latency_record(acq->cam->latency, LAT_COMMIT, pi_now() - commit);
+		Picam_DestroyParameters(failed_parameter_array);
+	}
+	if(error == PicamError_None) {
+		frame_block_lend(acq->ring, 1);
+		error = use_acquisition_buffer(acq->handle, frame_block_memory(acq->ring),
+			acq->ring_frames * acq->stride);
+	}
+	setup = pi_now() - tick;
+
+	/* Waiting for the other cameras is not start latency */
+	if(acq->gate) {
+		pass_gate(acq->gate, error != PicamError_None);
+		acq->gate = NULL;
+	}
+
+	acq->started = pi_now();
+	if(error == PicamError_None) {
+		error = Picam_StartAcquisition(acq->handle);
+		latency_record(acq->cam->latency, LAT_START, setup + pi_now() - acq->started);
+	}
+	return error;
+}
+
+/* Moves a fully read out acquisition to done once its frames are written */
+static void finish_if_written(struct acquisition *acq)
+{
+	pi_mutex_lock(&acq->lock);
+	if(acq->state == ACQ_WRITING &&
+		acq->written + acq->write_failed == acq->received) {
+		acq->finished = pi_now();
+		acq->state = acq->write_failed ? ACQ_FAILED : ACQ_DONE;
+		if(acq->dropped)
+			printf("Dropped %lld of %lld frames, buffer of %lld overran\n",
+				acq->dropped, acq->nframes, acq->ring_frames);
+		printf("Acquisition of %lld frame(s) on %s took %5.2f s (readout done at %5.2f s)\n",
+			acq->written, acq->id.sensor_name, acq->finished - acq->started,
+			acq->read_out - acq->started);
+		pi_cond_broadcast(&acq->changed);
+		pi_mutex_unlock(&acq->lock);
+		notify_acquisitions();
+		return;
+	}
+	pi_mutex_unlock(&acq->lock);
+}
+
+/* writer_done_fn, runs on a writer thread */
+static void frame_written(void *ctx, int failed, const char *errmsg)
+{
+	struct acquisition *acq = ctx;
+
+	pi_mutex_lock(&acq->lock);
+	if(failed) {
+		acq->write_failed++;
+		sprintf_s(acq->error, STR_BUF_SIZE, "%s", errmsg);
+	} else {
+		acq->written++;
+	}
+	pi_mutex_unlock(&acq->lock);
+
+	finish_if_written(acq);
+	release_acquisition(acq);
+}
+
+/*
+	What a readout turns into. raw is the readout itself, in the
+	acquisition buffer; shown is what Lua sees, raw itself or the
+	calibrated frame if a calibration is in use (calib.h). Statistics
+	go in shown_md, and in raw_md when both are written.
+*/
+struct readout_frames {
+	struct frame *raw, *shown;
+	struct metadata raw_md, shown_md;
+	int write_raw;
+};
+
+/* The frame of the readout at address in ring, a copy if the SDK put it
+somewhere else. NULL if out of memory */
+static struct frame *readout_frame(struct frame_block *ring, const pi16u *readout, piint stride)
+{
+	struct frame *f = frame_block_frame(ring, readout);
+
+	return f ? f : frame_copy(readout, stride);
+}
+
+/* Takes over the reference to raw, a readout described by md, adding
+it to stack (may be NULL) and calibrating it. Statistics go in
+histogram, counted in scratch. Returns 0 on success, otherwise
+non-zero with a message in errmsg */
+static int prepare_frames(struct camera_state *cam, struct frame *raw, const struct metadata *md,
+	struct stack *stack, unsigned int *histogram, struct stats_scratch *scratch,
+	struct readout_frames *rf, char *errmsg)
+{
+	struct calibration *cal;
+	struct frame *corrected;
+	struct telemetry t;
+	struct pi_time now;
+
+	rf->raw = raw;
+	if(!rf->raw) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory copying frame\n");
+		return -1;
+	}
+	rf->raw_md = *md;
+	pi_utctime(&now);
+	sprintf_s(rf->raw_md.date_obs, sizeof(rf->raw_md.date_obs),
+		"%4d-%02d-%02dT%02d:%02d:%02d.%03d", now.year, now.month, now.day,
+		now.hour, now.minute, now.second, now.millisecond);
+
+	/* The sampler's latest reading, long bursts follow the sensor */
+	camera_state_telemetry(cam, &t);
+	rf->raw_md.temp = t.temp;
+	rf->shown = rf->raw;
+	frame_retain(rf->shown);
+	rf->write_raw = 1;
+
+	/* Masters are built from raw frames */
+	if(stack && stack_add(stack, rf->raw, &rf->raw_md, errmsg))
+		printf("Not stacked: %s", errmsg);
+
+	rf->shown_md = rf->raw_md;
+	cal = calib_current();
+	if(cal) {
+		corrected = calib_apply(cal, rf->raw, &rf->shown_md, errmsg);
+		if(corrected) {
+			frame_release(rf->shown);
+			rf->shown = corrected;
+			rf->write_raw = calib_output(cal) == CAL_BOTH;
+			if(rf->write_raw) compute_frame_stats(rf->raw->pixels, &rf->raw_md, NULL, scratch);
+		} else {
+			printf("Not calibrated: %s", errmsg);
+		}
+		calib_release(cal);
+	}
+	compute_frame_stats(rf->shown->pixels, &rf->shown_md, histogram, scratch);
+	return 0;
+}
+
+/* writer_submit_frame, or the next frame of seq if there is one */
+static int submit_frame(struct writer_sequence *seq, struct frame *frame,
+	const struct metadata *md, const char *name, writer_done_fn done, void *ctx)
+{
+	if(seq) return writer_submit_sequence(seq, frame, md, done, ctx);
+	return writer_submit_frame(frame, md, name, done, ctx);
+}
+
+/* Queues the files for a readout under name, done (may be NULL) is
+called for the raw file, or for the calibrated one if it replaces the
+raw one. A calibrated file alongside is written as CAL_PREFIX name.
+The frames go to seq and cal_seq instead if they are not NULL. Returns
+0 if the file done is for was queued */
+static int write_frames(struct readout_frames *rf, const char *name,
+	struct writer_sequence *seq, struct writer_sequence *cal_seq,
+	writer_done_fn done, void *ctx)
+{
+	char cal_name[STR_BUF_SIZE];
+
+	if(rf->shown == rf->raw)
+		return submit_frame(seq, rf->raw, &rf->shown_md, name, done, ctx);
+	if(!rf->write_raw)
+		return submit_frame(seq, rf->shown, &rf->shown_md, name, done, ctx);
+
+	sprintf_s(cal_name, STR_BUF_SIZE, "%s%s", CAL_PREFIX, name);
+	if(submit_frame(cal_seq, rf->shown, &rf->shown_md, cal_name, NULL, NULL))
+		printf("Out of memory queueing calibrated frame\n");
+	return submit_frame(seq, rf->raw, &rf->raw_md, name, done, ctx);
+}
+
+/* The sequences frames of acq go to, opened as they are needed. Frames
+are written to files of their own if opening fails */
+static void open_sequences(struct acquisition *acq, struct readout_frames *rf)
+{
+	char cal_name[STR_BUF_SIZE];
+
+	if(!acq->sequence) return;
+	if(!acq->seq) acq->seq = writer_sequence_open(acq->prepend);
+	if(!acq->cal_seq && rf->shown != rf->raw && rf->write_raw) {
+		sprintf_s(cal_name, STR_BUF_SIZE, "%s%s", CAL_PREFIX, acq->prepend);
+		acq->cal_seq = writer_sequence_open(cal_name);
+	}
+}
+
+/* Ends the sequences of acq, their files close once written */
+static void close_sequences(struct acquisition *acq)
+{
+	if(acq->seq) writer_sequence_close(acq->seq);
+	if(acq->cal_seq) writer_sequence_close(acq->cal_seq);
+	acq->seq = acq->cal_seq = NULL;
+}
+
+static void release_frames(struct readout_frames *rf)
+{
+	frame_release(rf->raw);
+	frame_release(rf->shown);
+}
+
+/* Lets go of the readouts the next Picam_WaitForAcquisitionUpdate
+hands back to the camera, waiting for the writer to finish with them */
+static void return_readouts(struct acquisition *acq)
+{
+	struct frame *old = NULL;
+	double tick;
+
+	/* Once every readout is in the camera writes nothing more */
+	if(acq->received >= acq->nframes) return;
+
+	pi_mutex_lock(&acq->lock);
+	if(acq->frame && frame_borrowed(acq->frame)) {
+		old = acq->frame;
+		acq->frame = NULL;
+	}
+	pi_mutex_unlock(&acq->lock);
+	if(old) frame_release(old);
+
+	tick = trace_begin();
+	frame_block_wait_idle(acq->ring);
+	trace_end("return readouts", tick, acq->received);
+}
+
+/* Queues readouts for writing as they arrive until the acquisition
+ends, keeping the newest as acq->frame */
+static void drain_acquisition(struct acquisition *acq)
+{
+	PicamAvailableData data;
+	PicamAcquisitionStatus status;
+	PicamError error;
+	pi64s i;
+	pi16u * readout;
+	char name[STR_BUF_SIZE], errmsg[STR_BUF_SIZE];
+	struct readout_frames rf;
+	unsigned int *h;
+	struct frame *old;
+	int failed;
+	double last = acq->started, now, tick;
+
+	do {
+		return_readouts(acq);
+		error = Picam_WaitForAcquisitionUpdate(acq->handle, NO_TIMEOUT, &data, &status);
+		if(error != PicamError_None) {
+			close_sequences(acq);
+			set_acquisition_state(acq, ACQ_FAILED, "Failed waiting for acquisition");
+			return;
+		}
+
+		/* Readouts arriving together share the wait */
+		if(data.readout_count > 0) {
+			now = pi_now();
+			for(i = 0; i < data.readout_count; i++)
+				latency_record(acq->cam->latency, LAT_READOUT, (now - last) / data.readout_count);
+			last = now;
+		}
+
+		for(i = 0; i < data.readout_count; i++) {
+			readout = (pi16u *) ((char *) data.initial_readout + i * acq->stride);
+
+			tick = pi_now();
+			failed = prepare_frames(acq->cam, readout_frame(acq->ring, readout, acq->stride),
+				&acq->md, acq->stack, acq->spare, &acq->scratch, &rf, errmsg);
+			latency_record(acq->cam->latency, LAT_CONVERT, pi_now() - tick);
+
+			pi_mutex_lock(&acq->lock);
+			acq->received++;
+			acq->refs++;
+			old = NULL;
+			if(!failed) {
+				old = acq->frame;
+				acq->frame = rf.shown;
+				frame_retain(rf.shown);
+				acq->frame_md = rf.shown_md;
+				acq->frame_md.id = &acq->id;
+				acq->have_stats = 1;
+				h = acq->histogram;
+				acq->histogram = acq->spare;
+				acq->spare = h;
+			}
+			pi_mutex_unlock(&acq->lock);
+			if(old) frame_release(old);
+
+			if(failed) {
+				frame_written(acq, 1, errmsg);
+				continue;
+			}
+			publish_frame(rf.shown, &rf.shown_md, last);
+			if(!acq->save) {
+				release_frames(&rf);
+				frame_written(acq, 0, NULL);
+				continue;
+			}
+
+			if(acq->nframes > 1)
+				sprintf_s(name, STR_BUF_SIZE, "%s%4.4lld_", acq->prepend, acq->received);
+			else
+				sprintf_s(name, STR_BUF_SIZE, "%s", acq->prepend);
+			open_sequences(acq, &rf);
+
+			/* Blocks while the writer queue is full */
+			tick = trace_begin();
+			if(write_frames(&rf, name, acq->seq, acq->cal_seq, frame_written, acq))
+				frame_written(acq, 1, "Out of memory queueing frame");
+			trace_end("queue", tick, acq->received);
+			release_frames(&rf);
+		}
+	} while(status.running);
+	close_sequences(acq);
+
+	/* The readouts left are the acquisition's to keep */
+	if(use_acquisition_buffer(acq->handle, NULL, 0) == PicamError_None)
+		frame_block_lend(acq->ring, 0);
+
+	pi_mutex_lock(&acq->lock);
+	acq->read_out = pi_now();
+	acq->dropped = acq->nframes - acq->received;
+	pi_mutex_unlock(&acq->lock);
+	trace_span("acquisition", acq->started, acq->read_out, acq->received);
+
+	set_acquisition_state(acq, ACQ_WRITING, NULL);
+	finish_if_written(acq);
+}
+
+/* camera_job_fn, runs an acquisition on its camera's worker for
+pi_acquire to wait for */
+static void run_acquisition(void *arg)
+{
+	struct acquisition *acq = arg;
+
+	if(begin_acquisition(acq) != PicamError_None)
+		set_acquisition_state(acq, ACQ_FAILED, "Failed to start acquisition");
+	else
+		drain_acquisition(acq);
+}
+
+/* camera_job_fn, runs an acquisition nobody waits for, dropping the
+worker's reference */
+static void acquisition_worker(void *arg)
+{
+	run_acquisition(arg);
+	release_acquisition(arg);
+}
+
+/* A single frame pi_acquire reads out on its camera's worker */
+struct single_job {
+	struct camera_state *cam;
+	struct metadata md;
+	piint stride;
+	struct frame *raw;	/* NULL if it could not be copied */
+	const char *error;	/* NULL if read out */
+	double tick, tock;	/* acquiring, read out */
+};
+
+/* camera_job_fn, a single readout through Picam_Acquire into a pooled
+frame, the SDK's own buffer if it will not take it */
+static void single_readout(void *arg)
+{
+	struct single_job *job = arg;
+	PicamHandle handle = job->cam->handle;
+	PicamAvailableData data;
+	PicamAcquisitionErrorsMask errors;
+	struct frame_block *block;
+	PicamError error;
+
+	camera_state_metadata(job->cam, &job->md, &job->stride);
+	block = frame_block_new((size_t) job->stride, NUM_FRAMES);
+	if(!block) {
+		job->error = "Out of memory";
+		return;
+	}
+	if(use_acquisition_buffer(handle, frame_block_memory(block), NUM_FRAMES * job->stride) != PicamError_None)
+		use_acquisition_buffer(handle, NULL, 0);
+
+	job->tick = pi_now();
+	error = Picam_Acquire(handle,	NUM_FRAMES, // Readout count
+		NO_TIMEOUT, // Readout timeout, if 0 not relevant
+		&data,
+		&errors);
+	use_acquisition_buffer(handle, NULL, 0);
+	job->tock = pi_now();
+	if(error != PicamError_None)
+		job->error = "Acquisition failed";
+	else if(data.readout_count != 1)
+		job->error = "More than 1 count found";
+	else
+		job->raw = readout_frame(block, data.initial_readout, job->stride);
+	frame_block_release(block);
+	if(!job->error) latency_record(job->cam->latency, LAT_READOUT, job->tock - job->tick);
+}
+
+static pi64s default_ring_frames(pi64s nframes)
+{
+	return nframes < DEFAULT_RING_FRAMES ? nframes : DEFAULT_RING_FRAMES;
+}
+
+
+/*
+	pi_acquire(avail, prepend, [nframes, [buffer_frames, [stack]]])
+
+	A single frame goes through Picam_Acquire. A burst of nframes is
+	one acquisition into a circular buffer of buffer_frames readouts.
+	Either waits for the acquisitions already queued on the camera
+	(pi_acquire_async, pi_trigger) before it starts. Returns once the
+	frames are read out and queued for writing, with the number of
+	frames acquired, the number dropped, the statistics of the last
+	frame (see push_frame_stats), which are also written to its
+	header, and the last frame as an image (image.h). A false prepend
+	only returns the image. Every frame is also added to the stack if
+	one is given (stack.h). pi_flush() waits for the files.
+*/
+int picam_acquire(lua_State *L)
+{
+	struct camera_state *cam;
+	PicamCameraID id;
+	struct single_job job;
+	struct acquisition *acq;
+	const char * prepend;
+	char errmsg[STR_BUF_SIZE];
+	pi64s nframes, ring_frames, received, dropped;
+	int failed, save;
+	struct readout_frames rf;
+	struct stack *stack;
+	double span = trace_begin();
+
+
+	nframes = luaL_optinteger(L, 3, NUM_FRAMES);
+	if(nframes > 1) {
+		ring_frames = luaL_optinteger(L, 4, default_ring_frames(nframes));
+		cam = check_camera(L, 1);
+		stack = lua_isnoneornil(L, 5) ? NULL : stack_check(L, 5);
+		acq = new_acquisition(L, cam, lua_tostring(L, 2), !lua_isboolean(L, 2) || lua_toboolean(L, 2),
+			stack, nframes, ring_frames);
+		if(camera_state_run(cam, run_acquisition, acq)) {
+			release_acquisition(acq);
+			lua_pushstring(L, "Failed to queue acquisition");
+			lua_error(L);
+			return 0;
+		}
+
+		pi_mutex_lock(&acq->lock);
+		failed = acq->state == ACQ_FAILED;
+		sprintf_s(errmsg, STR_BUF_SIZE, "%s", acq->error);
+		received = acq->received;
+		dropped = acq->dropped;
+		pi_mutex_unlock(&acq->lock);
+
+		if(failed) {
+			release_acquisition(acq);
+			lua_pushstring(L, errmsg);
+			lua_error(L);
+			return 0;
+		}
+		lua_pushinteger(L, (lua_Integer) received);
+		lua_pushinteger(L, (lua_Integer) dropped);
+		if(acq->have_stats)
+			push_frame_stats(L, &acq->frame_md.stats, acq->histogram);
+		else
+			lua_pushnil(L);
+		if(acq->frame)
+			image_push(L, acq->frame, &acq->frame_md);
+		else
+			lua_pushnil(L);
+		release_acquisition(acq);
+		trace_end("pi_acquire", span, received);
+		return 4;
+	}
+
+	cam = check_camera(L, 1);
+	id = cam->id;
+	prepend = lua_tostring(L, 2);
+	save = !lua_isboolean(L, 2) || lua_toboolean(L, 2);
+	stack = lua_isnoneornil(L, 5) ? NULL : stack_check(L, 5);
+	if(save) printf("Prepend: %s\n", prepend);
+
+	memset(&job, 0, sizeof(job));
+	job.cam = cam;
+	job.md.id = &id;
+	run_on_camera(L, cam, single_readout, &job);
+	if(job.error) {
+		lua_pushstring(L, job.error);
+		lua_error(L);
+		return 0;
+	}
+
+	if(!cam->histogram) cam->histogram = malloc(HISTOGRAM_BINS * sizeof(unsigned int));
+	if(!cam->histogram) {
+		if(job.raw) frame_release(job.raw);
+		lua_pushstring(L, "Out of memory");
+		lua_error(L);
+		return 0;
+	}
+	if(prepare_frames(cam, job.raw, &job.md, stack, cam->histogram, &cam->scratch, &rf, errmsg)) {
+		lua_pushstring(L, errmsg);
+		lua_error(L);
+		return 0;
+	}
+	latency_record(cam->latency, LAT_CONVERT, pi_now() - job.tock);
+	publish_frame(rf.shown, &rf.shown_md, job.tock);
+	if(save && write_frames(&rf, prepend ? prepend : "", NULL, NULL, NULL, NULL)) {
+		release_frames(&rf);
+		lua_pushstring(L, "Out of memory queueing frame");
+		lua_error(L);
+		return 0;
+	}
+	printf("Acquisition took %5.2f s, %5.3f s to queue\n", job.tock - job.tick, pi_now() - job.tock);
+
+	lua_pushinteger(L, 1);
+	lua_pushinteger(L, 0);
+	push_frame_stats(L, &rf.shown_md.stats, cam->histogram);
+	image_push(L, rf.shown, &rf.shown_md);
+	release_frames(&rf);
+	trace_end("pi_acquire", span, 1);
+	return 4;
+}
+
+
+static struct acquisition *check_acquisition(lua_State *L, int index)
+{
+	return *(struct acquisition **) luaL_checkudata(L, index, ACQUISITION_MT);
+}
+
+/* Waits until acq reaches at least state, or timeout (s, < 0 forever) */
+static int wait_acquisition(struct acquisition *acq, int state, double timeout)
+{
+	double deadline = pi_now() + timeout;
+	int reached;
+
+	pi_mutex_lock(&acq->lock);
+	while(acq->state < state) {
+		if(timeout < 0) {
+			pi_cond_wait(&acq->changed, &acq->lock);
+		} else if(pi_now() >= deadline) {
+			break;
+		} else {
+			pi_cond_timedwait(&acq->changed, &acq->lock, deadline - pi_now());
+		}
+	}
+	reached = acq->state >= state;
+	pi_mutex_unlock(&acq->lock);
+	return reached;
+}
+
+/* Pushes true if finished, raises the worker's error if it failed */
+static int push_acquisition_result(lua_State *L, struct acquisition *acq, int reached)
+{
+	if(reached && acq->state == ACQ_FAILED) {
+		lua_pushstring(L, acq->error);
+		lua_error(L);
+		return 0;
+	}
+	lua_pushboolean(L, reached);
+	return 1;
+}
+
+/* h:poll() -> finished, state */
+static int acquisition_poll(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+	int state;
+
+	pi_mutex_lock(&acq->lock);
+	state = acq->state;
+	pi_mutex_unlock(&acq->lock);
+
+	lua_pushboolean(L, state >= ACQ_DONE);
+	lua_pushstring(L, acquisition_states[state]);
+	return 2;
+}
+
+/* h:frames() -> written, dropped, requested */
+static int acquisition_frames(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+
+	pi_mutex_lock(&acq->lock);
+	lua_pushinteger(L, (lua_Integer) acq->written);
+	lua_pushinteger(L, (lua_Integer) acq->dropped);
+	lua_pushinteger(L, (lua_Integer) acq->nframes);
+	pi_mutex_unlock(&acq->lock);
+	return 3;
+}
+
+/* h:stats() -> statistics of the newest frame read out, or nil */
+static int acquisition_stats(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+
+	pi_mutex_lock(&acq->lock);
+	if(acq->have_stats)
+		push_frame_stats(L, &acq->frame_md.stats, acq->histogram);
+	else
+		lua_pushnil(L);
+	pi_mutex_unlock(&acq->lock);
+	return 1;
+}
+
+/* h:image() -> the newest frame read out, or nil. While the camera is
+still exposing, only until that readout goes back to it */
+static int acquisition_image(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+	struct frame *frame;
+	struct metadata md;
+	PicamCameraID id;
+
+	pi_mutex_lock(&acq->lock);
+	frame = acq->frame;
+	if(frame) frame_retain(frame);
+	md = acq->frame_md;
+	id = acq->id;
+	md.id = &id;
+	pi_mutex_unlock(&acq->lock);
+
+	if(!frame) {
+		lua_pushnil(L);
+		return 1;
+	}
+	image_push(L, frame, &md);
+	frame_release(frame);
+	return 1;
+}
+
+/* h:wait([timeout_s]) -> true when written, false on timeout */
+static int acquisition_wait(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+	double timeout = luaL_optnumber(L, 2, -1);
+
+	return push_acquisition_result(L, acq, wait_acquisition(acq, ACQ_DONE, timeout));
+}
+
+/* h:wait_readout([timeout_s]) -> true once the camera is free again */
+static int acquisition_wait_readout(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+	double timeout = luaL_optnumber(L, 2, -1);
+
+	return push_acquisition_result(L, acq, wait_acquisition(acq, ACQ_WRITING, timeout));
+}
+
+/*
+	h:yield() -> true when written. Inside a coroutine an unfinished
+	acquisition yields the handle to the resumer instead of blocking,
+	so a scheduler can do "repeat until h:yield()". On the main
+	thread it is the same as h:wait().
+*/
+static int acquisition_yield(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+	int main_thread;
+
+	if(wait_acquisition(acq, ACQ_DONE, 0))
+		return push_acquisition_result(L, acq, 1);
+
+	main_thread = lua_pushthread(L);
+	lua_pop(L, 1);
+	if(main_thread)
+		return push_acquisition_result(L, acq, wait_acquisition(acq, ACQ_DONE, -1));
+
+	lua_settop(L, 1);
+	return lua_yield(L, 1);
+}
+
+static int acquisition_gc(lua_State *L)
+{
+	struct acquisition *acq = check_acquisition(L, 1);
+
+	/* NULL if pi_acquire_async failed after creating the userdata */
+	if(acq) release_acquisition(acq);
+	return 0;
+}
+
+static const luaL_Reg acquisition_methods[] = {
+	{"poll", acquisition_poll},
+	{"frames", acquisition_frames},
+	{"stats", acquisition_stats},
+	{"image", acquisition_image},
+	{"wait", acquisition_wait},
+	{"wait_readout", acquisition_wait_readout},
+	{"yield", acquisition_yield},
+	{NULL, NULL}
+};
+
+static void push_acquisition_metatable(lua_State *L)
+{
+	if(luaL_newmetatable(L, ACQUISITION_MT)) {
+		lua_pushstring(L, "__index");
+		lua_newtable(L);
+		luaL_register(L, NULL, acquisition_methods);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "__gc");
+		lua_pushcfunction(L, acquisition_gc);
+		lua_rawset(L, -3);
+	}
+}
+
+/* h = pi_acquire_async(avail, prepend, [nframes, [buffer_frames, [stack]]]) */
+int picam_acquire_async(lua_State *L)
+{
+	struct acquisition *acq, **ud;
+	struct camera_state *cam;
+	struct stack *stack;
+	pi64s nframes, ring_frames;
+
+	nframes = luaL_optinteger(L, 3, NUM_FRAMES);
+	ring_frames = luaL_optinteger(L, 4, default_ring_frames(nframes));
+	cam = check_camera(L, 1);
+	stack = lua_isnoneornil(L, 5) ? NULL : stack_check(L, 5);
+
+	/* Make the userdata first so a Lua error cannot leak acq */
+	ud = lua_newuserdata(L, sizeof(*ud));
+	*ud = NULL;
+	push_acquisition_metatable(L);
+	lua_setmetatable(L, -2);
+
+	acq = new_acquisition(L, cam, lua_tostring(L, 2), !lua_isboolean(L, 2) || lua_toboolean(L, 2),
+		stack, nframes, ring_frames);
+	*ud = acq;
+	acq->refs = 2;
+	if(camera_state_submit(cam, acquisition_worker, acq) != 0) {
+		acq->refs = 1;
+		lua_pushstring(L, "Failed to queue acquisition");
+		lua_error(L);
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+	pi_trigger({cam1, cam2, ...}, prepend, [nframes, [buffer_frames, [sync]]])
+
+	Acquires nframes on every camera at once, each on its own worker,
+	and returns a list of handles in the same order (see
+	pi_acquire_async). A string prepend is followed by each camera's
+	serial number so their files do not collide, a list gives one per
+	camera, false writes nothing. Unless sync is false no camera starts
+	until all are set up and free, so they start together.
+*/
+int picam_trigger(lua_State *L)
+{
+	struct camera_state *cams[MAX_CAMERAS];
+	struct acquisition *acqs[MAX_CAMERAS], **ud;
+	struct start_gate *gate = NULL;
+	char prepend[STR_BUF_SIZE];
+	pi64s nframes, ring_frames;
+	int k, j, n, save, sync, queued;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = (int) lua_objlen(L, 1);
+	nframes = luaL_optinteger(L, 3, NUM_FRAMES);
+	ring_frames = luaL_optinteger(L, 4, default_ring_frames(nframes));
+	sync = lua_isnoneornil(L, 5) || lua_toboolean(L, 5);
+	save = !lua_isboolean(L, 2) || lua_toboolean(L, 2);
+	if(n < 1 || n > MAX_CAMERAS) {
+		lua_pushfstring(L, "Between 1 and %d cameras", MAX_CAMERAS);
+		lua_error(L);
+		return 0;
+	}
+
+	/* A camera listed twice would wait at the gate for itself */
+	for(k = 0; k < n; k++) {
+		lua_rawgeti(L, 1, k + 1);
+		cams[k] = check_camera(L, lua_gettop(L));
+		lua_pop(L, 1);
+		for(j = 0; j < k; j++) {
+			if(cams[j] == cams[k]) {
+				lua_pushstring(L, "Camera listed twice");
+				lua_error(L);
+				return 0;
+			}
+		}
+	}
+
+	/* Every acquisition is made before any is queued, a Lua error on
+	the way leaves only handles nobody started */
+	lua_createtable(L, n, 0);
+	for(k = 0; k < n; k++) {
+		if(lua_istable(L, 2)) {
+			lua_rawgeti(L, 2, k + 1);
+			sprintf_s(prepend, STR_BUF_SIZE, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+			lua_pop(L, 1);
+		} else {
+			sprintf_s(prepend, STR_BUF_SIZE, "%s%s_", lua_isstring(L, 2) ? lua_tostring(L, 2) : "",
+				cams[k]->id.serial_number);
+		}
+
+		ud = lua_newuserdata(L, sizeof(*ud));
+		*ud = NULL;
+		push_acquisition_metatable(L);
+		lua_setmetatable(L, -2);
+		lua_rawseti(L, -2, k + 1);
+		acqs[k] = *ud = new_acquisition(L, cams[k], prepend, save, NULL, nframes, ring_frames);
+	}
+
+	/* Unsynchronized frames are no substitute for the ones asked for */
+	if(sync && n > 1) {
+		gate = new_gate(n);
+		if(!gate) {
+			lua_pushstring(L, "Out of memory synchronizing cameras");
+			lua_error(L);
+			return 0;
+		}
+	}
+	for(k = 0, queued = 0; k < n; k++) {
+		acqs[k]->gate = gate;
+		acqs[k]->refs = 2;
+		if(camera_state_submit(cams[k], acquisition_worker, acqs[k]) != 0) {
+			acqs[k]->refs = 1;
+			set_acquisition_state(acqs[k], ACQ_FAILED, "Failed to queue acquisition");
+			if(gate) pass_gate(gate, 1);
+			acqs[k]->gate = NULL;
+			continue;
+		}
+		queued++;
+	}
+
+	printf("Triggered %i of %i camera(s)%s\n", queued, n, gate ? ", synchronized" : "");
+	return 1;
+}
+
+/* The handles in the list at index, at most MAX_WAIT_HANDLES */
+static int check_acquisitions(lua_State *L, int index, struct acquisition **acqs)
+{
+	int k, n;
+
+	luaL_checktype(L, index, LUA_TTABLE);
+	n = (int) lua_objlen(L, index);
+	if(n > MAX_WAIT_HANDLES) {
+		lua_pushfstring(L, "At most %d handles", MAX_WAIT_HANDLES);
+		lua_error(L);
+		return 0;
+	}
+	for(k = 0; k < n; k++) {
+		lua_rawgeti(L, index, k + 1);
+		acqs[k] = check_acquisition(L, lua_gettop(L));
+		lua_pop(L, 1);
+		if(!acqs[k]) {
+			lua_pushstring(L, "Acquisition never started");
+			lua_error(L);
+			return 0;
+		}
+	}
+	return n;
+}
+
+/* Waits until all (or any) of acqs are done or failed, or timeout (s,
+< 0 forever). Returns the index of the first one done, or -1 if not
+all (any) are */
+static int wait_acquisitions(struct acquisition **acqs, int n, int all, double timeout)
+{
+	double deadline = pi_now() + timeout;
+	int k, first, done;
+
+	pi_mutex_lock(&acquisitions_lock);
+	for(;;) {
+		first = -1;
+		done = 0;
+		for(k = 0; k < n; k++) {
+			pi_mutex_lock(&acqs[k]->lock);
+			if(acqs[k]->state >= ACQ_DONE) {
+				done++;
+				if(first < 0) first = k;
+			}
+			pi_mutex_unlock(&acqs[k]->lock);
+		}
+		if(all ? done == n : first >= 0) break;
+
+		if(timeout < 0) {
+			pi_cond_wait(&acquisitions_changed, &acquisitions_lock);
+		} else if(pi_now() >= deadline) {
+			break;
+		} else {
+			pi_cond_timedwait(&acquisitions_changed, &acquisitions_lock, deadline - pi_now());
+		}
+	}
+	pi_mutex_unlock(&acquisitions_lock);
+
+	if(all && done < n) return -1;
+	return first;
+}
+
+/*
+	pi_wait_all(handles, [timeout_s]) -> true once every acquisition is
+	written, false on timeout. Raises the error of the first that failed.
+*/
+int picam_wait_all(lua_State *L)
+{
+	struct acquisition *acqs[MAX_WAIT_HANDLES];
+	double timeout = luaL_optnumber(L, 2, -1);
+	int k, n, failed, waited;
+	double span = trace_begin();
+
+	n = check_acquisitions(L, 1, acqs);
+	waited = wait_acquisitions(acqs, n, 1, timeout);
+	trace_end("pi_wait_all", span, n);
+	if(waited < 0 && n > 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	for(k = 0; k < n; k++) {
+		pi_mutex_lock(&acqs[k]->lock);
+		failed = acqs[k]->state == ACQ_FAILED;
+		pi_mutex_unlock(&acqs[k]->lock);
+		if(failed) return push_acquisition_result(L, acqs[k], 1);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+	pi_wait_any(handles, [timeout_s]) -> index, state of the first
+	acquisition in the list that is done or failed, nil on timeout.
+	Finished handles keep counting, remove them to wait for the next.
+*/
+int picam_wait_any(lua_State *L)
+{
+	struct acquisition *acqs[MAX_WAIT_HANDLES];
+	double timeout = luaL_optnumber(L, 2, -1);
+	int k, n, state;
+	double span = trace_begin();
+
+	n = check_acquisitions(L, 1, acqs);
+	k = n > 0 ? wait_acquisitions(acqs, n, 0, timeout) : -1;
+	trace_end("pi_wait_any", span, k + 1);
+	if(k < 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	pi_mutex_lock(&acqs[k]->lock);
+	state = acqs[k]->state;
+	pi_mutex_unlock(&acqs[k]->lock);
+	lua_pushinteger(L, k + 1);
+	lua_pushstring(L, acquisition_states[state]);
+	return 2;
+}
+
+/* {phase = {count, p50, p99, max, mean}} for a camera, clearing its
+histograms after if reset */
+static void push_latency(lua_State *L, struct camera_state *cam, int reset)
+{
+	struct latency_summary sum;
+	int p;
+
+	lua_createtable(L, 0, NUM_LATENCY);
+	for(p = 0; p < NUM_LATENCY; p++) {
+		latency_summarize(cam->latency, p, &sum);
+		lua_createtable(L, 0, 5);
+		lua_pushnumber(L, (lua_Number) sum.count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, sum.p50);
+		lua_setfield(L, -2, "p50");
+		lua_pushnumber(L, sum.p99);
+		lua_setfield(L, -2, "p99");
+		lua_pushnumber(L, sum.max);
+		lua_setfield(L, -2, "max");
+		lua_pushnumber(L, sum.mean);
+		lua_setfield(L, -2, "mean");
+		lua_setfield(L, -2, latency_name(p));
+	}
+	if(reset) latency_reset(cam->latency);
+}
+
+/*
+	pi_stats([camera], [reset]) -> {stage=, commit=, start=, readout=,
+	convert=, header=, data=, fsync=}
+
+	Wall clock latency of each phase since the camera was opened or
+	last reset, {count, p50, p99, max, mean} in seconds (percentiles
+	to about 9%), see latency.h. Without a camera, a table of them by
+	serial number for every open camera. reset=true clears them once
+	read.
+*/
+int picam_stats(lua_State *L)
+{
+	struct camera_state *cams[MAX_CAMERAS];
+	int i, n;
+
+	if(lua_isuserdata(L, 1)) {
+		push_latency(L, check_camera(L, 1), lua_toboolean(L, 2));
+		return 1;
+	}
+
+	n = camera_state_list(cams);
+	lua_createtable(L, 0, n);
+	for(i = 0; i < n; i++) {
+		push_latency(L, cams[i], lua_toboolean(L, 1));
+		lua_setfield(L, -2, cams[i]->id.serial_number);
+	}
+	return 1;
+}
+
+static const char *temperature_status(int status)
+{
+	switch(status) {
+	case PicamSensorTemperatureStatus_Unlocked: return "unlocked";
+	case PicamSensorTemperatureStatus_Locked: return "locked";
+	case PicamSensorTemperatureStatus_Faulted: return "faulted";
+	default: return "unknown";
+	}
+}
+
+static void push_telemetry(lua_State *L, struct camera_state *cam)
+{
+	struct telemetry t;
+
+	camera_state_telemetry(cam, &t);
+	lua_newtable(L);
+	lua_pushnumber(L, t.temp);
+	lua_setfield(L, -2, "temp");
+	lua_pushnumber(L, t.setpoint);
+	lua_setfield(L, -2, "setpoint");
+	lua_pushstring(L, temperature_status(t.status));
+	lua_setfield(L, -2, "status");
+	lua_pushnumber(L, t.readout_time);
+	lua_setfield(L, -2, "readout_time");
+	lua_pushnumber(L, pi_now() - t.time);
+	lua_setfield(L, -2, "age");
+	lua_pushnumber(L, (lua_Number) t.samples);
+	lua_setfield(L, -2, "samples");
+	lua_pushnumber(L, (lua_Number) t.errors);
+	lua_setfield(L, -2, "errors");
+}
+
+/*
+	pi_telemetry([camera]) -> {temp=, setpoint=, status=, readout_time=,
+	age=, samples=, errors=}
+
+	What a background thread per camera last read from it, without
+	querying the camera: the sensor temperature and set point (deg C),
+	status "locked", "unlocked", "faulted" or "unknown", the readout
+	time (s), how old that is (s) and how many samples were taken and
+	failed. Without a camera, a table of them by serial number for
+	every open camera. pi_telemetry{period=1} samples every period
+	seconds from now on.
+*/
+int picam_telemetry(lua_State *L)
+{
+	struct camera_state *cams[MAX_CAMERAS];
+	piflt period;
+	int i, n;
+
+	if(lua_isuserdata(L, 1)) {
+		push_telemetry(L, check_camera(L, 1));
+		return 1;
+	}
+
+	if(lua_istable(L, 1)) {
+		if(get_number_field(L, 1, "period", &period)) {
+			if(period <= 0) {
+				lua_pushstring(L, "period must be positive");
+				lua_error(L);
+				return 0;
+			}
+			camera_state_set_period(period);
+		}
+		printf("Telemetry every %1.3f s\n", camera_state_period());
+		return 0;
+	}
+
+	n = camera_state_list(cams);
+	lua_createtable(L, 0, n);
+	for(i = 0; i < n; i++) {
+		push_telemetry(L, cams[i]);
+		lua_setfield(L, -2, cams[i]->id.serial_number);
+	}
+	return 1;
+}
+
+/*
+	pi_wait_temperature(camera, [target], [tol=0.5], [timeout_s]) ->
+	reached, temp
+
+	Waits until the sampled sensor temperature is within tol deg C of
+	target (the set point by default), woken by each telemetry sample
+	rather than polling the camera. Without a timeout waits for ever.
+*/
+int picam_wait_temperature(lua_State *L)
+{
+	struct camera_state *cam = check_camera(L, 1);
+	struct telemetry t;
+	piflt target, tol = luaL_optnumber(L, 3, 0.5);
+	double timeout = luaL_optnumber(L, 4, -1), tick = pi_now();
+	int reached;
+
+	camera_state_telemetry(cam, &t);
+	target = luaL_optnumber(L, 2, camera_state_committed(cam, CFG_SETPOINT));
+	printf("Camera %s at %1.2f C, waiting for %1.2f +/- %1.2f C\n", cam->id.serial_number,
+		t.temp, target, tol);
+	reached = camera_state_wait_temperature(cam, target, tol, timeout, &t);
+	trace_span("pi_wait_temperature", tick, pi_now(), reached);
+	if(reached > 0)
+		printf("Camera %s at %1.2f C after %1.1f s\n", cam->id.serial_number, t.temp, pi_now() - tick);
+	else
+		printf("Camera %s still at %1.2f C after %1.1f s\n", cam->id.serial_number, t.temp, pi_now() - tick);
+	lua_pushboolean(L, reached > 0);
+	lua_pushnumber(L, t.temp);
+	return 2;
+}
+
+
+/*
+	pi_writer{threads=2, memory_mb=256}
+
+	Reconfigures the background FITS writer after flushing it. Frames
+	are queued until memory_mb is used, then acquisitions block until
+	a writer catches up. threads=0 writes on the acquiring thread.
+	fsync=true flushes every file to the disk before it counts as
+	written. spares=4 keeps that many files of the frame size made
+	ahead of time in the night directory for the direct path to write
+	into, 0 makes every file as it is written. sequence=true appends
+	the frames of each burst to one file, an image extension per frame
+	carrying its own keywords, instead of a file per frame. raw="lz4"
+	or "zstd" writes raw containers to convert to FITS later (rawfile.h),
+	raw=false FITS again. checksum=false leaves out the CHECKSUM and
+	DATASUM keywords every HDU otherwise carries.
+*/
+int picam_writer(lua_State *L)
+{
+	struct writer_status st;
+	struct output_format fmt;
+	int threads, workers, spares;
+	size_t memory_cap;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	writer_get_status(&st, 0);
+	fmt = st.fmt;
+
+	lua_getfield(L, 1, "threads");
+	threads = luaL_optint(L, -1, st.threads);
+	lua_getfield(L, 1, "memory_mb");
+	memory_cap = (size_t) (luaL_optnumber(L, -1, st.memory_cap / 1048576.0) * 1048576.0);
+	lua_getfield(L, 1, "workers");
+	workers = luaL_optint(L, -1, -1);
+	lua_getfield(L, 1, "spares");
+	spares = luaL_optint(L, -1, -1);
+	lua_pop(L, 4);
+
+	lua_getfield(L, 1, "compress");
+	if(!lua_isnil(L, -1)) {
+		fmt.compression = compression_lookup(luaL_checkstring(L, -1));
+		if(fmt.compression < 0) {
+			lua_pushstring(L, "Unknown compression, use none, rice, gzip, gzip2 or hcompress");
+			lua_error(L);
+			return 0;
+		}
+	}
+	lua_pop(L, 1);
+
+	/* true, false or "verify" */
+	lua_getfield(L, 1, "direct");
+	if(lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), "verify") == 0)
+		fmt.direct = FITS_VERIFY;
+	else if(!lua_isnil(L, -1))
+		fmt.direct = lua_toboolean(L, -1) ? FITS_DIRECT : FITS_CFITSIO;
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "fsync");
+	if(!lua_isnil(L, -1)) fmt.fsync = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "sequence");
+	if(!lua_isnil(L, -1)) fmt.sequence = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "checksum");
+	if(!lua_isnil(L, -1)) fmt.checksum = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	/* "lz4", "zstd", or false for FITS */
+	lua_getfield(L, 1, "raw");
+	if(lua_isstring(L, -1)) {
+		fmt.raw = raw_codec_lookup(lua_tostring(L, -1));
+		if(fmt.raw < 0 || !raw_codec_available(fmt.raw)) {
+			lua_pushfstring(L, "Raw codec %s is not in this build, use lz4 or zstd", lua_tostring(L, -1));
+			lua_error(L);
+			return 0;
+		}
+	} else if(!lua_isnil(L, -1)) {
+		fmt.raw = RAW_OFF;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "tile");
+	if(lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		fmt.tile[0] = luaL_optint(L, -2, fmt.tile[0]);
+		fmt.tile[1] = luaL_optint(L, -1, fmt.tile[1]);
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+
+	/* Checks everything before changing anything, so an error leaves
+	the writer as it was */
+	if(!writer_format_valid(&fmt)) {
+		lua_pushstring(L, "Invalid tile size");
+		lua_error(L);
+		return 0;
+	}
+	if(!writer_threads_valid(threads)) {
+		lua_pushstring(L, "Invalid writer thread count");
+		lua_error(L);
+		return 0;
+	}
+	if(spares > OUTPATH_MAX_SPARES) {
+		lua_pushfstring(L, "Keep 0 to %d spare files", OUTPATH_MAX_SPARES);
+		lua_error(L);
+		return 0;
+	}
+
+	writer_set_format(&fmt);
+	writer_configure(threads, memory_cap);
+	if(workers >= 0) parallel_configure(workers);
+	if(spares >= 0) outpath_configure(spares);
+
+	printf("Writer: %i thread(s), %1.0f MB queue, %s", threads, memory_cap / 1048576.0,
+		fmt.raw != RAW_OFF ? "raw" : compression_name(fmt.compression));
+	if(fmt.raw != RAW_OFF)
+		printf(" %s chunks of %i rows on %i workers", raw_codec_name(fmt.raw), RAW_CHUNK_ROWS,
+			parallel_threads() + 1);
+	else if(fmt.compression != COMPRESS_NONE)
+		printf(" %ldx%ld tiles on %i workers", fmt.tile[0], fmt.tile[1], parallel_threads() + 1);
+	else if(fmt.direct != FITS_CFITSIO)
+		printf(" (direct, %s%s)", fits_direct_kernel(), fmt.direct == FITS_VERIFY ? ", verified" : "");
+	if(fmt.fsync) printf(", synced");
+	if(fmt.sequence) printf(", bursts in one file");
+	if(fmt.checksum && fmt.raw == RAW_OFF) printf(", checksummed");
+	printf("\n");
+	return 0;
+}
+
+static const char *fits_paths[] = {"cfitsio", "direct", "verify"};
+
+/* pi_writer_status() -> {threads, queued, queued_mb, memory_mb, written, failed,
+last_error, compress, tile, workers, direct, fsync, sequence, raw,
+checksum, spares, spares_ready, spares_taken, spares_missed, night} */
+int picam_writer_status(lua_State *L)
+{
+	struct writer_status st;
+	struct outpath_status op;
+
+	writer_get_status(&st, 0);
+	outpath_get_status(&op);
+	lua_newtable(L);
+	lua_pushinteger(L, st.threads);
+	lua_setfield(L, -2, "threads");
+	lua_pushinteger(L, (lua_Integer) st.queued);
+	lua_setfield(L, -2, "queued");
+	lua_pushnumber(L, st.queued_bytes / 1048576.0);
+	lua_setfield(L, -2, "queued_mb");
+	lua_pushnumber(L, st.memory_cap / 1048576.0);
+	lua_setfield(L, -2, "memory_mb");
+	lua_pushnumber(L, (lua_Number) st.written);
+	lua_setfield(L, -2, "written");
+	lua_pushnumber(L, (lua_Number) st.failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushstring(L, st.last_error);
+	lua_setfield(L, -2, "last_error");
+	lua_pushstring(L, compression_name(st.fmt.compression));
+	lua_setfield(L, -2, "compress");
+	lua_createtable(L, 2, 0);
+	lua_pushinteger(L, st.fmt.tile[0]);
+	lua_rawseti(L, -2, 1);
+	lua_pushinteger(L, st.fmt.tile[1]);
+	lua_rawseti(L, -2, 2);
+	lua_setfield(L, -2, "tile");
+	lua_pushinteger(L, parallel_threads());
+	lua_setfield(L, -2, "workers");
+	lua_pushstring(L, fits_paths[st.fmt.direct]);
+	lua_setfield(L, -2, "direct");
+	lua_pushboolean(L, st.fmt.fsync);
+	lua_setfield(L, -2, "fsync");
+	lua_pushboolean(L, st.fmt.sequence);
+	lua_setfield(L, -2, "sequence");
+	lua_pushstring(L, raw_codec_name(st.fmt.raw));
+	lua_setfield(L, -2, "raw");
+	lua_pushboolean(L, st.fmt.checksum);
+	lua_setfield(L, -2, "checksum");
+	lua_pushinteger(L, op.spares);
+	lua_setfield(L, -2, "spares");
+	lua_pushinteger(L, op.ready);
+	lua_setfield(L, -2, "spares_ready");
+	lua_pushnumber(L, (lua_Number) op.taken);
+	lua_setfield(L, -2, "spares_taken");
+	lua_pushnumber(L, (lua_Number) op.missed);
+	lua_setfield(L, -2, "spares_missed");
+	lua_pushstring(L, op.night);
+	lua_setfield(L, -2, "night");
+	return 1;
+}
+
+/*
+	pi_preview{size=512, stretch="zscale"} makes a quick-look PNG of
+	every frame written from then on, next to its FITS file, block
+	averaged to size pixels on the longer side; stretch="asinh" brings
+	out faint structure. pi_preview(false) stops, pi_preview(true)
+	resumes. pi_preview() returns {enabled, size, stretch, made,
+	skipped, failed, last, last_latency}, the latency from the FITS
+	file of the last preview being written to the PNG, in seconds.
+*/
+int picam_preview(lua_State *L)
+{
+	struct preview_status st;
+	struct preview_config cfg;
+	piflt value;
+
+	preview_get_status(&st);
+	cfg = st.cfg;
+	if(lua_isnoneornil(L, 1)) {
+		lua_newtable(L);
+		lua_pushboolean(L, st.cfg.enabled);
+		lua_setfield(L, -2, "enabled");
+		lua_pushinteger(L, st.cfg.size);
+		lua_setfield(L, -2, "size");
+		lua_pushstring(L, preview_stretch_name(st.cfg.stretch));
+		lua_setfield(L, -2, "stretch");
+		lua_pushnumber(L, (lua_Number) st.made);
+		lua_setfield(L, -2, "made");
+		lua_pushnumber(L, (lua_Number) st.skipped);
+		lua_setfield(L, -2, "skipped");
+		lua_pushnumber(L, (lua_Number) st.failed);
+		lua_setfield(L, -2, "failed");
+		lua_pushstring(L, st.last);
+		lua_setfield(L, -2, "last");
+		lua_pushnumber(L, st.last_latency);
+		lua_setfield(L, -2, "last_latency");
+		return 1;
+	}
+
+	if(lua_isboolean(L, 1)) {
+		cfg.enabled = lua_toboolean(L, 1);
+	} else {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		cfg.enabled = 1;
+		if(get_number_field(L, 1, "size", &value)) cfg.size = (int) value;
+		lua_getfield(L, 1, "stretch");
+		if(!lua_isnil(L, -1)) {
+			cfg.stretch = preview_stretch_lookup(luaL_checkstring(L, -1));
+			if(cfg.stretch < 0) {
+				lua_pushstring(L, "Unknown stretch, use zscale or asinh");
+				lua_error(L);
+				return 0;
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	if(preview_configure(&cfg)) {
+		lua_pushstring(L, "Could not start previews");
+		lua_error(L);
+		return 0;
+	}
+	if(cfg.enabled)
+		printf("Previews: %i pixels, %s stretch\n", cfg.size, preview_stretch_name(cfg.stretch));
+	else
+		printf("Previews off\n");
+	return 0;
+}
+
+/*
+	pi_publish{name="/picam_frames", slots=8, frame_mb=16} copies every
+	frame read out from then on into a shared memory ring of that name
+	for other processes to read in place (shmring.h), slots frames of
+	up to frame_mb each. pi_publish(false) removes the ring. pi_publish()
+	returns {enabled, name, slots, frame_mb, published, skipped}, skipped
+	counting frames too large for a slot.
+*/
+int picam_publish(lua_State *L)
+{
+	struct publish_status st;
+	struct publish_config cfg;
+	piflt value;
+
+	publish_get_status(&st);
+	cfg = st.cfg;
+	if(lua_isnoneornil(L, 1)) {
+		lua_newtable(L);
+		lua_pushboolean(L, st.cfg.enabled);
+		lua_setfield(L, -2, "enabled");
+		lua_pushstring(L, st.cfg.name);
+		lua_setfield(L, -2, "name");
+		lua_pushinteger(L, st.cfg.slots);
+		lua_setfield(L, -2, "slots");
+		lua_pushnumber(L, st.cfg.frame_mb);
+		lua_setfield(L, -2, "frame_mb");
+		lua_pushnumber(L, (lua_Number) st.published);
+		lua_setfield(L, -2, "published");
+		lua_pushnumber(L, (lua_Number) st.skipped);
+		lua_setfield(L, -2, "skipped");
+		return 1;
+	}
+
+	if(lua_isboolean(L, 1)) {
+		cfg.enabled = lua_toboolean(L, 1);
+	} else {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		cfg.enabled = 1;
+		lua_getfield(L, 1, "name");
+		if(!lua_isnil(L, -1))
+			sprintf_s(cfg.name, sizeof(cfg.name), "%s", luaL_checkstring(L, -1));
+		lua_pop(L, 1);
+		if(get_number_field(L, 1, "slots", &value)) cfg.slots = (int) value;
+		if(get_number_field(L, 1, "frame_mb", &value)) cfg.frame_mb = value;
+	}
+
+	if(publish_configure(&cfg)) {
+		lua_pushfstring(L, "Could not create shared memory %s", cfg.name);
+		lua_error(L);
+		return 0;
+	}
+	if(cfg.enabled)
+		printf("Publishing frames to %s, %i slots of %1.0f MB\n", cfg.name, cfg.slots, cfg.frame_mb);
+	else
+		printf("Publishing off\n");
+	return 0;
+}
+
+/*
+	pi_buffers{idle_mb=512, huge_pages=false, lock=false} sets up the
+	pool frames and acquisition buffers come from (frame.h): at most
+	idle_mb of them are kept for reuse once released, and new ones are
+	on huge pages and locked in RAM if asked for and the OS allows it.
+	pi_buffers() returns {idle_mb, cached_mb, total_mb, huge_pages,
+	lock, huge, locked, allocated, reused}, huge and locked counting
+	the blocks that got them.
+*/
+int picam_buffers(lua_State *L)
+{
+	struct frame_pool_status st;
+	piflt value;
+	int flags;
+
+	frame_pool_get_status(&st);
+	if(lua_isnoneornil(L, 1)) {
+		lua_newtable(L);
+		lua_pushnumber(L, st.idle_cap / 1048576.0);
+		lua_setfield(L, -2, "idle_mb");
+		lua_pushnumber(L, st.idle / 1048576.0);
+		lua_setfield(L, -2, "cached_mb");
+		lua_pushnumber(L, st.bytes / 1048576.0);
+		lua_setfield(L, -2, "total_mb");
+		lua_pushboolean(L, st.flags & PI_PAGES_HUGE);
+		lua_setfield(L, -2, "huge_pages");
+		lua_pushboolean(L, st.flags & PI_PAGES_LOCKED);
+		lua_setfield(L, -2, "lock");
+		lua_pushinteger(L, st.huge);
+		lua_setfield(L, -2, "huge");
+		lua_pushinteger(L, st.locked);
+		lua_setfield(L, -2, "locked");
+		lua_pushnumber(L, (lua_Number) st.allocated);
+		lua_setfield(L, -2, "allocated");
+		lua_pushnumber(L, (lua_Number) st.reused);
+		lua_setfield(L, -2, "reused");
+		return 1;
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	flags = st.flags;
+	if(get_number_field(L, 1, "idle_mb", &value)) {
+		if(value < 0) {
+			lua_pushstring(L, "idle_mb must not be negative");
+			lua_error(L);
+			return 0;
+		}
+		st.idle_cap = (size_t) (value * 1048576.0);
+	}
+	lua_getfield(L, 1, "huge_pages");
+	if(!lua_isnil(L, -1))
+		flags = lua_toboolean(L, -1) ? flags | PI_PAGES_HUGE : flags & ~PI_PAGES_HUGE;
+	lua_getfield(L, 1, "lock");
+	if(!lua_isnil(L, -1))
+		flags = lua_toboolean(L, -1) ? flags | PI_PAGES_LOCKED : flags & ~PI_PAGES_LOCKED;
+	lua_pop(L, 2);
+
+	frame_pool_configure(st.idle_cap, flags);
+	printf("Buffers: %1.0f MB kept for reuse%s%s\n", st.idle_cap / 1048576.0,
+		flags & PI_PAGES_HUGE ? ", huge pages" : "", flags & PI_PAGES_LOCKED ? ", locked" : "");
+	return 0;
+}
+
+/*
+	pi_flush([timeout_s]) -> true once every queued frame is on disk,
+	false on timeout. Raises an error if any frame failed to write
+	since the last flush.
+*/
+int picam_flush(lua_State *L)
+{
+	struct writer_status st;
+	int drained;
+	double span = trace_begin();
+
+	drained = writer_flush(luaL_optnumber(L, 1, -1));
+	trace_end("pi_flush", span, -1);
+	writer_get_status(&st, 1);
+	if(st.failed) {
+		lua_pushfstring(L, "%d frame(s) failed to write: %s", (int) st.failed, st.last_error);
+		lua_error(L);
+		return 0;
+	}
+	lua_pushboolean(L, drained);
+	return 1;
+}
+
+/*
+	pi_trace(true) starts recording a timeline, pi_trace(false) stops
+	it and pi_trace(path) writes what was recorded as Chrome trace
+	event JSON (chrome://tracing, ui.perfetto.dev), returning the
+	number of spans. See trace.h.
+*/
+int picam_trace(lua_State *L)
+{
+	long n;
+
+	if(lua_isboolean(L, 1)) {
+		if(lua_toboolean(L, 1)) trace_thread_name("lua");
+		trace_enable(lua_toboolean(L, 1));
+		return 0;
+	}
+	n = trace_dump(luaL_checkstring(L, 1));
+	if(n < 0) {
+		lua_pushfstring(L, "Could not write trace to %s", lua_tostring(L, 1));
+		lua_error(L);
+		return 0;
+	}
+	printf("Wrote %ld trace events to '%s'\n", n, lua_tostring(L, 1));
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/* Called by the interpreter on exit */
+void picam_shutdown(void)
+{
+	camera_state_shutdown();
+	writer_shutdown();
+	preview_shutdown();
+	publish_shutdown();
+	calib_shutdown();
+	parallel_shutdown();
+}
+
+
+#ifdef PICAM_SIM
+
+/*
+	pi_simulate{cameras=1, width=2048, height=2048, bias=1000,
+		read_noise=4, dark_current=0.001, signal=0, temperature=-70,
+		cooling_rate=0.5, time_scale=1, readout={[0.1]=42, [2]=2.2}}
+
+	Configures the simulated camera. Fields left out keep their
+	current value. readout maps ADC speed (MHz) to readout time (s),
+	a time of 0 derives it from the sensor size. temperature is the
+	sensor at power on, which then moves towards the set point at
+	cooling_rate deg C per second.
+*/
+int picam_simulate(lua_State *L)
+{
+	struct simcam_config cfg;
+	piflt value, speed, seconds;
+	int i;
+
+	if(!lua_istable(L, 1)) {
+		lua_pushstring(L, "pi_simulate expects a table");
+		lua_error(L);
+		return 0;
+	}
+
+	simcam_get_config(&cfg);
+	if(get_number_field(L, 1, "cameras", &value)) cfg.cameras = (piint) value;
+	if(get_number_field(L, 1, "width", &value)) cfg.width = (piint) value;
+	if(get_number_field(L, 1, "height", &value)) cfg.height = (piint) value;
+	get_number_field(L, 1, "bias", &cfg.bias);
+	get_number_field(L, 1, "read_noise", &cfg.read_noise);
+	get_number_field(L, 1, "dark_current", &cfg.dark_current);
+	get_number_field(L, 1, "signal", &cfg.signal);
+	get_number_field(L, 1, "temperature", &cfg.temperature);
+	get_number_field(L, 1, "cooling_rate", &cfg.cooling_rate);
+	get_number_field(L, 1, "time_scale", &cfg.time_scale);
+
+	lua_pushstring(L, "readout");
+	lua_gettable(L, 1);
+	if(lua_istable(L, -1)) {
+		cfg.num_speeds = 0;
+		lua_pushnil(L);
+		while(lua_next(L, -2) != 0) {
+			speed = lua_tonumber(L, -2);
+			seconds = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+			if(cfg.num_speeds == SIMCAM_MAX_SPEEDS || speed <= 0) continue;
+
+			/* Keep speeds sorted, the slowest is the power-on default */
+			for(i = cfg.num_speeds; i > 0 && cfg.adc_speeds[i-1] > speed; i--) {
+				cfg.adc_speeds[i] = cfg.adc_speeds[i-1];
+				cfg.readout_s[i] = cfg.readout_s[i-1];
+			}
+			cfg.adc_speeds[i] = speed;
+			cfg.readout_s[i] = seconds;
+			cfg.num_speeds++;
+		}
+	}
+	lua_pop(L, 1);
+
+	if(cfg.cameras < 1 || cfg.width < 1 || cfg.height < 1 || cfg.num_speeds < 1) {
+		lua_pushstring(L, "pi_simulate: invalid camera count, geometry or readout table");
+		lua_error(L);
+		return 0;
+	}
+
+	simcam_set_config(&cfg);
+	printf("Simulating %i camera(s) %ix%i, %i ADC speed(s), time scale %1.2f\n",
+		cfg.cameras, cfg.width, cfg.height, cfg.num_speeds, cfg.time_scale);
+	return 0;
+}
+
+#endif
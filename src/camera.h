@@ -4,7 +4,7 @@
 #define picam_h
 
 #include "lua.h"
-#include "picam.h"
+#include "sdk.h"
 
 /* pi_start() to initialize camera */
 int picam_start(lua_State *L);
@@ -12,15 +12,83 @@ int picam_start(lua_State *L);
 /* available = pi_list() to list available cameras */
 int picam_list(lua_State *L);
 
-/* pi_acquire(avail) */
+/* written, dropped, stats, image = pi_acquire(avail, prepend, [nframes, [buffer_frames, [stack]]]) */
 int picam_acquire(lua_State *L);
 
+/* h = pi_acquire_async(avail, prepend, [nframes, [buffer_frames, [stack]]]);
+   h:poll(), h:frames(), h:stats(), h:image(), h:wait(), h:wait_readout(), h:yield() */
+int picam_acquire_async(lua_State *L);
+
+/* handles = pi_trigger({avail, ...}, prepend, [nframes, [buffer_frames, [sync]]]),
+   one pi_acquire_async handle per camera, started together */
+int picam_trigger(lua_State *L);
+
+/* done = pi_wait_all(handles, [timeout]); index, state = pi_wait_any(handles, [timeout]) */
+int picam_wait_all(lua_State *L);
+int picam_wait_any(lua_State *L);
+
+/* latency = pi_stats([avail], [reset]), per phase {count, p50, p99, max, mean} */
+int picam_stats(lua_State *L);
+
+/* telemetry = pi_telemetry([avail]) | pi_telemetry{period=},
+   {temp, setpoint, status, readout_time, age, samples, errors} */
+int picam_telemetry(lua_State *L);
+
+/* reached, temp = pi_wait_temperature(avail, [target], [tol], [timeout]) */
+int picam_wait_temperature(lua_State *L);
+
+/* pi_trace(true | false | path), count = pi_trace(path) writes Chrome trace JSON */
+int picam_trace(lua_State *L);
+
+/* pi_preview{size=, stretch="zscale" | "asinh"} | pi_preview(enabled), status = pi_preview() */
+int picam_preview(lua_State *L);
+
+/* pi_publish{name=, slots=, frame_mb=} | pi_publish(enabled), status = pi_publish() */
+int picam_publish(lua_State *L);
+
+/* pi_buffers{idle_mb=, huge_pages=, lock=}, status = pi_buffers() */
+int picam_buffers(lua_State *L);
+
 /* pi_set(avail, exptime, gain, ??) */
 int picam_set(lua_State *L);
 
-/* pi_open(avail) */
+/* ok, changed_or_failed = pi_configure(avail, {exptime=, gain=, adc=, adcspeed=, setpoint=}) */
+int picam_configure(lua_State *L);
+
+/* rois_or_false, message = pi_roi(avail, [{x=, y=, width=, height=, xbin=, ybin=}, ... | false]) */
+int picam_roi(lua_State *L);
+
+/* cam = pi_open(avail): cam:set(), cam:configure(), cam:roi(), cam:acquire(),
+   cam:acquire_async(), cam:stats(), cam:telemetry() and cam:wait_temperature()
+   take the arguments of the pi_ functions after the camera; cam:close();
+   cam.serial, cam.sensor, cam.model, cam.interface */
 int picam_open(lua_State *L);
 
+/* pi_writer{threads=, memory_mb=, compress=, tile={nx, ny}, workers=, direct=} */
+int picam_writer(lua_State *L);
+
+/* status = pi_writer_status() */
+int picam_writer_status(lua_State *L);
+
+/* s = pi_stack{method=, sigma=}; s:add(image), s:count(), s:reset(),
+   s:result(), s:save(prepend), s:info(). In stack.c */
+int picam_stack(lua_State *L);
+
+/* pi_calibrate{bias=, dark=, flat=, output=, pedestal=}, pi_calibrate(false)
+   to stop, info = pi_calibrate(). In calib.c */
+int picam_calibrate(lua_State *L);
+
+/* pi_flush([timeout]) waits for queued frames to be written */
+int picam_flush(lua_State *L);
+
+/* Flushes and stops background work, call before exiting */
+void picam_shutdown(void);
+
+#ifdef PICAM_SIM
+/* pi_simulate{width=, height=, read_noise=, readout={[MHz]=s}, ...} */
+int picam_simulate(lua_State *L);
+#endif
+
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Tile compression codecs, see compress.h. The byte streams are the
+	ones cfitsio reads back (ricecomp.c and the zlib gzip wrapper).
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "compress.h"
+
+/* RICE_1 parameters for 16 bit pixels */
+#define RICE_FSBITS 4
+#define RICE_FSMAX 14
+#define RICE_BBITS 16
+
+static const char *names[NUM_COMPRESSION] = {"none", "rice", "gzip", "gzip2", "hcompress"};
+static const char *zcmptypes[NUM_COMPRESSION] = {"NOCOMPRESS", "RICE_1", "GZIP_1", "GZIP_2", "HCOMPRESS_1"};
+
+
+const char *compression_name(int c)
+{
+	return names[c];
+}
+
+const char *compression_zcmptype(int c)
+{
+	return zcmptypes[c];
+}
+
+int compression_lookup(const char *name)
+{
+	int c;
+
+	for(c = 0; c < NUM_COMPRESSION; c++)
+		if(strcmp(names[c], name) == 0) return c;
+	return -1;
+}
+
+size_t compress_bound(int c, long n)
+{
+	switch(c) {
+	case COMPRESS_RICE:
+		/* Worst case block is a little over 16 bits per pixel */
+		return 2 * (size_t) n + (size_t) n / 4 + 64;
+	case COMPRESS_GZIP:
+	case COMPRESS_GZIP2:
+		return compressBound((uLong) (2 * n)) + 32;
+	default:
+		return 0;
+	}
+}
+
+
+/* MSB first bit output for the Rice coder */
+struct bit_writer {
+	unsigned char *p, *end;
+	unsigned long long acc;
+	int nbits;		/* bits pending in acc, < 8 between calls */
+	int overflow;
+};
+
+static void put_bits(struct bit_writer *w, unsigned int value, int n)
+{
+	w->acc = (w->acc << n) | (value & ((1ULL << n) - 1));
+	w->nbits += n;
+	while(w->nbits >= 8) {
+		w->nbits -= 8;
+		if(w->p == w->end) {
+			w->overflow = 1;
+			return;
+		}
+		*w->p++ = (unsigned char) (w->acc >> w->nbits);
+	}
+}
+
+/* value coded as value zeros followed by a one */
+static void put_unary(struct bit_writer *w, unsigned int value)
+{
+	for(; value >= 24; value -= 24)
+		put_bits(w, 0, 24);
+	put_bits(w, 1, value + 1);
+}
+
+static void flush_bits(struct bit_writer *w)
+{
+	if(w->nbits > 0) put_bits(w, 0, 8 - w->nbits);
+}
+
+static size_t rice_compress(const short *a, long n, unsigned char *out, size_t outsize)
+{
+	struct bit_writer w;
+	unsigned int diff[RICE_BLOCKSIZE];
+	unsigned short psum;
+	short last, pdiff;
+	double pixelsum, dpsum;
+	long i, j, block;
+	int fs;
+
+	w.p = out;
+	w.end = out + outsize;
+	w.acc = 0;
+	w.nbits = 0;
+	w.overflow = 0;
+
+	/* The first pixel verbatim, then differences in blocks */
+	put_bits(&w, (unsigned short) a[0], 16);
+	last = a[0];
+
+	for(i = 0; i < n && !w.overflow; i += RICE_BLOCKSIZE) {
+		block = n - i < RICE_BLOCKSIZE ? n - i : RICE_BLOCKSIZE;
+		pixelsum = 0.0;
+		for(j = 0; j < block; j++) {
+			pdiff = (short) (a[i+j] - last);
+			diff[j] = pdiff < 0 ? ~((unsigned int) pdiff << 1) : (unsigned int) pdiff << 1;
+			pixelsum += diff[j];
+			last = a[i+j];
+		}
+
+		/* Split point from the mean mapped difference */
+		dpsum = (pixelsum - (block / 2) - 1) / block;
+		if(dpsum < 0) dpsum = 0.0;
+		psum = ((unsigned short) dpsum) >> 1;
+		for(fs = 0; psum > 0; fs++) psum >>= 1;
+
+		if(fs >= RICE_FSMAX) {
+			/* High entropy, differences verbatim */
+			put_bits(&w, RICE_FSMAX + 1, RICE_FSBITS);
+			for(j = 0; j < block; j++)
+				put_bits(&w, diff[j], RICE_BBITS);
+		} else if(fs == 0 && pixelsum == 0) {
+			/* Flat block */
+			put_bits(&w, 0, RICE_FSBITS);
+		} else {
+			put_bits(&w, fs + 1, RICE_FSBITS);
+			for(j = 0; j < block; j++) {
+				put_unary(&w, diff[j] >> fs);
+				if(fs > 0) put_bits(&w, diff[j], fs);
+			}
+		}
+	}
+	flush_bits(&w);
+
+	return w.overflow ? 0 : (size_t) (w.p - out);
+}
+
+/* deflate with a gzip header, as cfitsio's compress2mem_from_mem */
+static size_t gzip_compress(const unsigned char *bytes, size_t nbytes, unsigned char *out, size_t outsize)
+{
+	z_stream zs;
+	size_t written;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, 1, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	zs.next_in = (Bytef *) bytes;
+	zs.avail_in = (uInt) nbytes;
+	zs.next_out = out;
+	zs.avail_out = (uInt) outsize;
+	ret = deflate(&zs, Z_FINISH);
+	written = zs.total_out;
+	deflateEnd(&zs);
+
+	return ret == Z_STREAM_END ? written : 0;
+}
+
+size_t compress_tile(int c, const short *pixels, long n, unsigned char *out, size_t outsize)
+{
+	unsigned char *bytes;
+	unsigned short v;
+	size_t size;
+	long i;
+
+	if(n <= 0) return 0;
+	switch(c) {
+	case COMPRESS_RICE:
+		return rice_compress(pixels, n, out, outsize);
+
+	case COMPRESS_GZIP:
+	case COMPRESS_GZIP2:
+		bytes = malloc(2 * (size_t) n);
+		if(!bytes) return 0;
+
+		/* Big endian pixels, GZIP_2 puts all high bytes first */
+		for(i = 0; i < n; i++) {
+			v = (unsigned short) pixels[i];
+			if(c == COMPRESS_GZIP) {
+				bytes[2*i] = (unsigned char) (v >> 8);
+				bytes[2*i+1] = (unsigned char) v;
+			} else {
+				bytes[i] = (unsigned char) (v >> 8);
+				bytes[n+i] = (unsigned char) v;
+			}
+		}
+		size = gzip_compress(bytes, 2 * (size_t) n, out, outsize);
+		free(bytes);
+		return size;
+
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef compress_h
+#define compress_h
+
+/*
+	Tile compression for tile-compressed FITS images (the ZIMAGE
+	binary table convention). The codecs here are thread safe so the
+	writer can compress all tiles of a frame in parallel; HCOMPRESS is
+	left to cfitsio, whose coder keeps global state.
+*/
+
+#include <stddef.h>
+
+enum compression {
+	COMPRESS_NONE,
+	COMPRESS_RICE,		/* RICE_1, blocks of 32 */
+	COMPRESS_GZIP,		/* GZIP_1 */
+	COMPRESS_GZIP2,		/* GZIP_2, bytes shuffled before deflating */
+	COMPRESS_HCOMPRESS,	/* HCOMPRESS_1, lossless, through cfitsio */
+	NUM_COMPRESSION
+};
+
+#define RICE_BLOCKSIZE 32
+
+/* Lua name ("none", "rice", "gzip", "gzip2", "hcompress") and back,
+-1 if unknown */
+const char *compression_name(int c);
+int compression_lookup(const char *name);
+
+/* ZCMPTYPE keyword value */
+const char *compression_zcmptype(int c);
+
+/* Largest output compress_tile can produce for n pixels */
+size_t compress_bound(int c, long n);
+
+/*
+	Compresses n pixels, already offset to signed (BZERO = 32768) and
+	in host byte order, into out. Returns the compressed size, or 0 if
+	it did not fit or c is not handled here.
+*/
+size_t compress_tile(int c, const short *pixels, long n, unsigned char *out, size_t outsize);
+
+#endif
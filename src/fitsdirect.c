@@ -0,0 +1,674 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Direct FITS output, see fitsdirect.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fitsio.h"
+#include "platform.h"
+#include "writer.h"
+#include "fitsdirect.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(HAVE_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define HAVE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#define HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#define FITS_BLOCK 2880
+#define CARD_LEN 80
+
+/* Pixels are converted into this much staging memory per write */
+#define CHUNK_BYTES (1024 * 1024)
+#define CHUNK_ALIGN 4096
+
+/* fits_checksum hands the kernels at most this many words at a time */
+#define SUM_WORDS (1 << 24)
+
+typedef void (*convert_fn)(const pi16u *in, unsigned char *out, size_t n);
+
+/* Sums of the high and low halves of big-endian 32 bit words, the high
+one shifted up 16 bits: folded into the ones' complement sum after */
+typedef unsigned long long (*sum_fn)(const unsigned char *data, size_t words);
+
+
+/* Value formatting, following cfitsio's ffl2c, ffi2c, ffr2e, ffd2e and
+ffs2c */
+static void format_real(char *cval, double value, int digits)
+{
+	sprintf_s(cval, CARD_LEN, "%.*G", digits, value);
+
+	/* An exponent needs a decimal point, and so does an integral value */
+	if(!strchr(cval, '.') && strchr(cval, 'E'))
+		sprintf_s(cval, CARD_LEN, "%.1E", value);
+	else if(!strchr(cval, '.') && !strchr(cval, 'E') && !strchr(cval, 'N'))
+		strcat(cval, ".");
+}
+
+static void format_string(char *cval, const char *s)
+{
+	int i = 0;
+
+	cval[i++] = '\'';
+	for(; *s && i < 69; s++) {
+		cval[i++] = *s;
+		if(*s == '\'') cval[i++] = '\'';
+	}
+
+	/* Quoted strings are at least 8 characters */
+	while(i < 9)
+		cval[i++] = ' ';
+	cval[i++] = '\'';
+	cval[i] = '\0';
+}
+
+void fits_format_card(char *card, const struct fits_key *key)
+{
+	char value[CARD_LEN + 1], line[2 * CARD_LEN + 1];
+	size_t len;
+
+	switch(key->type) {
+	case TLOGICAL: sprintf_s(value, sizeof(value), "%s", *(const int *) key->value ? "T" : "F"); break;
+	case TINT: sprintf_s(value, sizeof(value), "%d", *(const int *) key->value); break;
+	case TLONG: sprintf_s(value, sizeof(value), "%ld", *(const long *) key->value); break;
+	case TLONGLONG: sprintf_s(value, sizeof(value), "%lld", *(const long long *) key->value); break;
+	case TFLOAT: format_real(value, *(const float *) key->value, 7); break;
+	case TDOUBLE: format_real(value, *(const double *) key->value, 15); break;
+	case TSTRING: format_string(value, (const char *) key->value); break;
+	default: value[0] = '\0'; break;
+	}
+
+	/* Strings are left justified in 20 columns, other values right */
+	len = strlen(value);
+	if(key->type == TSTRING)
+		sprintf_s(line, sizeof(line), "%-8.8s= %-20s", key->name, value);
+	else
+		sprintf_s(line, sizeof(line), "%-8.8s= %20s", key->name, value);
+
+	len = strlen(line);
+	if(len < 77 && key->comment && key->comment[0]) {
+		strcat(line, " / ");
+		strncat(line, key->comment, 77 - len);
+	}
+
+	memset(card, ' ', CARD_LEN);
+	len = strlen(line);
+	memcpy(card, line, len < CARD_LEN ? len : CARD_LEN);
+}
+
+static void comment_card(char *card, const char *text)
+{
+	memset(card, ' ', CARD_LEN);
+	memcpy(card, "COMMENT ", 8);
+	memcpy(card + 8, text, strlen(text));
+}
+
+
+/* Conversion kernels */
+
+static void convert_scalar(const pi16u *in, unsigned char *out, size_t n)
+{
+	size_t i;
+	pi16u v;
+
+	for(i = 0; i < n; i++) {
+		v = in[i] ^ 0x8000;
+		out[2*i] = (unsigned char) (v >> 8);
+		out[2*i+1] = (unsigned char) v;
+	}
+}
+
+static unsigned long long sum_scalar(const unsigned char *data, size_t words)
+{
+	unsigned long long hi = 0, lo = 0;
+	size_t i;
+
+	for(i = 0; i < words; i++, data += 4) {
+		hi += (unsigned) data[0] << 8 | data[1];
+		lo += (unsigned) data[2] << 8 | data[3];
+	}
+	return (hi << 16) + lo;
+}
+
+#ifdef HAVE_SSE2
+static void convert_sse2(const pi16u *in, unsigned char *out, size_t n)
+{
+	const __m128i bias = _mm_set1_epi16((short) 0x8000);
+	__m128i v;
+	size_t i;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (in + i)), bias);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) (out + 2*i), v);
+	}
+	convert_scalar(in + i, out + 2*i, n - i);
+}
+
+/* Back to 16 bit values, then the high halves of the words are the low
+halves of 32 bit lanes. A lane takes 65536 of them before it could
+overflow, so every 65536 iterations the lanes go into 64 bit sums */
+static unsigned long long sum_sse2(const unsigned char *data, size_t words)
+{
+	const __m128i low16 = _mm_set1_epi32(0xffff), zero = _mm_setzero_si128();
+	__m128i v, hi, lo, hi64 = zero, lo64 = zero;
+	unsigned long long h[2], l[2];
+	size_t i = 0, end;
+
+	while(words - i >= 4) {
+		end = words - i > 4 * 65536 ? i + 4 * 65536 : i + (words - i) / 4 * 4;
+		hi = lo = zero;
+		for(; i < end; i += 4) {
+			v = _mm_loadu_si128((const __m128i *) (data + 4*i));
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			hi = _mm_add_epi32(hi, _mm_and_si128(v, low16));
+			lo = _mm_add_epi32(lo, _mm_srli_epi32(v, 16));
+		}
+		hi64 = _mm_add_epi64(hi64, _mm_add_epi64(_mm_unpacklo_epi32(hi, zero), _mm_unpackhi_epi32(hi, zero)));
+		lo64 = _mm_add_epi64(lo64, _mm_add_epi64(_mm_unpacklo_epi32(lo, zero), _mm_unpackhi_epi32(lo, zero)));
+	}
+	_mm_storeu_si128((__m128i *) h, hi64);
+	_mm_storeu_si128((__m128i *) l, lo64);
+	return ((h[0] + h[1]) << 16) + l[0] + l[1] + sum_scalar(data + 4*i, words - i);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET_AVX2 static void convert_avx2(const pi16u *in, unsigned char *out, size_t n)
+{
+	const __m256i bias = _mm256_set1_epi16((short) 0x8000);
+	__m256i v;
+	size_t i;
+
+	for(i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (in + i)), bias);
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) (out + 2*i), v);
+	}
+	convert_scalar(in + i, out + 2*i, n - i);
+}
+
+/* As sum_sse2 */
+TARGET_AVX2 static unsigned long long sum_avx2(const unsigned char *data, size_t words)
+{
+	const __m256i low16 = _mm256_set1_epi32(0xffff), zero = _mm256_setzero_si256();
+	__m256i v, hi, lo, hi64 = zero, lo64 = zero;
+	unsigned long long h[4], l[4];
+	size_t i = 0, end;
+
+	while(words - i >= 8) {
+		end = words - i > 8 * 65536 ? i + 8 * 65536 : i + (words - i) / 8 * 8;
+		hi = lo = zero;
+		for(; i < end; i += 8) {
+			v = _mm256_loadu_si256((const __m256i *) (data + 4*i));
+			v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+			hi = _mm256_add_epi32(hi, _mm256_and_si256(v, low16));
+			lo = _mm256_add_epi32(lo, _mm256_srli_epi32(v, 16));
+		}
+		hi64 = _mm256_add_epi64(hi64, _mm256_add_epi64(_mm256_unpacklo_epi32(hi, zero),
+			_mm256_unpackhi_epi32(hi, zero)));
+		lo64 = _mm256_add_epi64(lo64, _mm256_add_epi64(_mm256_unpacklo_epi32(lo, zero),
+			_mm256_unpackhi_epi32(lo, zero)));
+	}
+	_mm256_storeu_si256((__m256i *) h, hi64);
+	_mm256_storeu_si256((__m256i *) l, lo64);
+	return ((h[0] + h[1] + h[2] + h[3]) << 16) + l[0] + l[1] + l[2] + l[3]
+		+ sum_scalar(data + 4*i, words - i);
+}
+
+static int cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	int regs[4];
+
+	__cpuid(regs, 0);
+	if(regs[0] < 7) return 0;
+	__cpuid(regs, 1);
+	/* OSXSAVE, and the OS saves the YMM registers */
+	if(!(regs[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return 0;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef HAVE_NEON
+static void convert_neon(const pi16u *in, unsigned char *out, size_t n)
+{
+	const uint16x8_t bias = vdupq_n_u16(0x8000);
+	uint16x8_t v;
+	size_t i;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		v = veorq_u16(vld1q_u16(in + i), bias);
+		vst1q_u8(out + 2*i, vrev16q_u8(vreinterpretq_u8_u16(v)));
+	}
+	convert_scalar(in + i, out + 2*i, n - i);
+}
+
+/* As sum_sse2 */
+static unsigned long long sum_neon(const unsigned char *data, size_t words)
+{
+	const uint32x4_t low16 = vdupq_n_u32(0xffff), zero = vdupq_n_u32(0);
+	uint32x4_t v, hi, lo;
+	uint64x2_t hi64 = vdupq_n_u64(0), lo64 = vdupq_n_u64(0);
+	size_t i = 0, end;
+
+	while(words - i >= 4) {
+		end = words - i > 4 * 65536 ? i + 4 * 65536 : i + (words - i) / 4 * 4;
+		hi = lo = zero;
+		for(; i < end; i += 4) {
+			v = vreinterpretq_u32_u8(vrev16q_u8(vld1q_u8(data + 4*i)));
+			hi = vaddq_u32(hi, vandq_u32(v, low16));
+			lo = vaddq_u32(lo, vshrq_n_u32(v, 16));
+		}
+		hi64 = vpadalq_u32(hi64, hi);
+		lo64 = vpadalq_u32(lo64, lo);
+	}
+	return ((vgetq_lane_u64(hi64, 0) + vgetq_lane_u64(hi64, 1)) << 16)
+		+ vgetq_lane_u64(lo64, 0) + vgetq_lane_u64(lo64, 1) + sum_scalar(data + 4*i, words - i);
+}
+#endif
+
+static convert_fn converter;
+static sum_fn summer;
+static const char *converter_name;
+
+/* Every thread picks the same kernel, so the race is harmless */
+static void select_kernel(void)
+{
+	convert_fn fn = convert_scalar;
+	sum_fn sum = sum_scalar;
+	const char *name = "scalar";
+
+#ifdef HAVE_SSE2
+	fn = convert_sse2;
+	sum = sum_sse2;
+	name = "sse2";
+#endif
+#ifdef HAVE_AVX2
+	if(cpu_has_avx2()) {
+		fn = convert_avx2;
+		sum = sum_avx2;
+		name = "avx2";
+	}
+#endif
+#ifdef HAVE_NEON
+	fn = convert_neon;
+	sum = sum_neon;
+	name = "neon";
+#endif
+	converter_name = name;
+	summer = sum;
+	converter = fn;
+}
+
+void fits_ushort_to_be(const pi16u *in, unsigned char *out, size_t n)
+{
+	if(!converter) select_kernel();
+	converter(in, out, n);
+}
+
+const char *fits_direct_kernel(void)
+{
+	if(!converter) select_kernel();
+	return converter_name;
+}
+
+/* End-around carry, as the ones' complement sum folds */
+static unsigned long long fold(unsigned long long sum)
+{
+	while(sum >> 32)
+		sum = (sum & 0xffffffff) + (sum >> 32);
+	return sum;
+}
+
+unsigned int fits_checksum(const unsigned char *data, size_t n, unsigned int sum)
+{
+	unsigned char tail[4] = {0, 0, 0, 0};
+	unsigned long long total = sum;
+	size_t words;
+
+	if(!converter) select_kernel();
+	while(n >= 4) {
+		words = n / 4 < SUM_WORDS ? n / 4 : SUM_WORDS;
+		total = fold(total + summer(data, words));
+		data += 4 * words;
+		n -= 4 * words;
+	}
+	/* A last partial word is padded with zeros, as the data unit is */
+	if(n) {
+		memcpy(tail, data, n);
+		total = fold(total + sum_scalar(tail, 1));
+	}
+	return (unsigned int) total;
+}
+
+/* As cfitsio's ffesum: each byte of the complement spread over four
+characters from '0', none of them punctuation */
+void fits_encode_checksum(unsigned int sum, char *ascii)
+{
+	static const unsigned char exclude[13] = {0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40,
+		0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60};
+	unsigned int value = 0xffffffff - sum;
+	char asc[16];
+	int byte, ch[4], check, i, j, k;
+
+	for(i = 0; i < 4; i++) {
+		byte = (value >> (24 - 8 * i)) & 0xff;
+		for(j = 0; j < 4; j++)
+			ch[j] = byte / 4 + '0';
+		ch[0] += byte % 4;
+
+		/* Move pairs apart until neither is punctuation */
+		do {
+			check = 0;
+			for(k = 0; k < 13; k++) {
+				for(j = 0; j < 4; j += 2) {
+					if(ch[j] == exclude[k] || ch[j+1] == exclude[k]) {
+						ch[j]++;
+						ch[j+1]--;
+						check = 1;
+					}
+				}
+			}
+		} while(check);
+
+		for(j = 0; j < 4; j++)
+			asc[4*j + i] = (char) ch[j];
+	}
+
+	/* Rotated one character to the right */
+	for(i = 0; i < 16; i++)
+		ascii[i] = asc[(i + 15) % 16];
+}
+
+
+/* Standard cards, keys, checksums, COMMENTs (primary) and END in whole
+blocks */
+static size_t header_size(const struct fits_image *img, int index)
+{
+	int cards = img->nkeys + (index ? 8 : 9) - (img->pixels ? 0 : 2) + (img->checksum ? 2 : 0);
+
+	return ((size_t) cards * CARD_LEN + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+}
+
+/* Formats the header of HDU index (0 is the primary) into whole blocks
+at out, as fits_create_img and fits_write_key write it, with checksum
+and datasum if the image has them. Returns its size, or 0 if it is
+larger than max bytes */
+static size_t format_header(unsigned char *out, size_t max, const struct fits_image *img, int index,
+	const char *checksum, unsigned int datasum)
+{
+	struct fits_key key;
+	char dsum[16];
+	size_t header_bytes, pos = 0;
+	int logical = 1, bitpix = SHORT_IMG, naxis = img->pixels ? 2 : 0, i;
+	long pcount = 0, gcount = 1;
+
+	header_bytes = header_size(img, index);
+	if(header_bytes > max) return 0;
+
+	memset(out, ' ', header_bytes);
+	if(index == 0) {
+		key.type = TLOGICAL; key.name = "SIMPLE"; key.value = &logical;
+		key.comment = "file does conform to FITS standard";
+	} else {
+		key.type = TSTRING; key.name = "XTENSION"; key.value = "IMAGE";
+		key.comment = "IMAGE extension";
+	}
+	fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+	key.type = TINT; key.name = "BITPIX"; key.value = &bitpix;
+	key.comment = "number of bits per data pixel";
+	fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+	key.name = "NAXIS"; key.value = &naxis; key.comment = "number of data axes";
+	fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+	if(naxis) {
+		key.type = TLONG; key.name = "NAXIS1"; key.value = &img->naxis1;
+		key.comment = "length of data axis 1";
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+		key.name = "NAXIS2"; key.value = &img->naxis2; key.comment = "length of data axis 2";
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+	}
+	if(index == 0) {
+		key.type = TLOGICAL; key.name = "EXTEND"; key.value = &logical;
+		key.comment = "FITS dataset may contain extensions";
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+		comment_card((char *) out + pos,
+			"  FITS (Flexible Image Transport System) format is defined in 'Astronomy");
+		pos += CARD_LEN;
+		comment_card((char *) out + pos,
+			"  and Astrophysics', volume 376, page 359; bibcode: 2001A&A...376..359H");
+		pos += CARD_LEN;
+	} else {
+		key.name = "PCOUNT"; key.value = &pcount; key.comment = "required keyword; must = 0";
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+		key.name = "GCOUNT"; key.value = &gcount; key.comment = "required keyword; must = 1";
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+	}
+
+	for(i = 0; i < img->nkeys; i++, pos += CARD_LEN)
+		fits_format_card((char *) out + pos, &img->keys[i]);
+
+	/* cfitsio leaves DATASUM as it first wrote it if the sum is 0 */
+	if(img->checksum) {
+		key.type = TSTRING; key.name = "CHECKSUM"; key.value = checksum;
+		key.comment = FITS_CHECKSUM_COMMENT;
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+		if(datasum)
+			sprintf_s(dsum, sizeof(dsum), "%u", datasum);
+		else
+			sprintf_s(dsum, sizeof(dsum), "%s", FITS_DATASUM_ZERO);
+		key.name = "DATASUM"; key.value = dsum; key.comment = FITS_DATASUM_COMMENT;
+		fits_format_card((char *) out + pos, &key); pos += CARD_LEN;
+	}
+	memcpy(out + pos, "END", 3);
+	return header_bytes;
+}
+
+/* The header of an HDU whose data unit sums to datasum, its CHECKSUM
+bringing the whole HDU to 0xffffffff. Returns as format_header */
+static size_t checksum_header(unsigned char *out, size_t max, const struct fits_image *img,
+	int index, unsigned int datasum)
+{
+	char checksum[17];
+	size_t header_bytes;
+
+	header_bytes = format_header(out, max, img, index, FITS_CHECKSUM_ZERO, datasum);
+	if(header_bytes == 0 || !img->checksum) return header_bytes;
+	fits_encode_checksum(fits_checksum(out, header_bytes, datasum), checksum);
+	checksum[16] = '\0';
+	return format_header(out, max, img, index, checksum, datasum);
+}
+
+size_t fits_direct_size(const struct fits_image *images, int nimages)
+{
+	size_t bytes = 0, data;
+	int k;
+
+	for(k = 0; k < nimages; k++) {
+		data = images[k].pixels ? (size_t) images[k].naxis1 * images[k].naxis2 * sizeof(pi16u) : 0;
+		bytes += header_size(&images[k], k) + (data + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+	}
+	return bytes;
+}
+
+struct fits_direct_file {
+	FILE *f;
+	unsigned char *mem, *chunk;	/* CHUNK_BYTES of staging, aligned */
+	int nhdus;
+	long long offset;		/* written so far */
+	char path[STR_BUF_SIZE];
+};
+
+/* Writes len bytes at the end of df, returns 0 on success */
+static int write_all(struct fits_direct_file *df, const unsigned char *buf, size_t len)
+{
+	if(fwrite(buf, 1, len, df->f) != len) return -1;
+	df->offset += len;
+	return 0;
+}
+
+static int seek_to(FILE *f, long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, (off_t) offset, SEEK_SET);
+#endif
+}
+
+/* Writes the final header of an HDU over the one at offset, the same
+size, and goes back to the end */
+static int rewrite_header(struct fits_direct_file *df, long long offset,
+	const unsigned char *header, size_t len)
+{
+	if(seek_to(df->f, offset) || fwrite(header, 1, len, df->f) != len) return -1;
+	return seek_to(df->f, df->offset);
+}
+
+static struct fits_direct_file *open_file(const char *path, const char *mode, char *errmsg)
+{
+	struct fits_direct_file *df = calloc(1, sizeof(*df));
+
+	if(df) df->mem = malloc(CHUNK_BYTES + CHUNK_ALIGN);
+	if(!df || !df->mem) {
+		free(df);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory writing frame\n");
+		return NULL;
+	}
+	df->chunk = (unsigned char *) (((size_t) df->mem + CHUNK_ALIGN - 1) & ~(size_t) (CHUNK_ALIGN - 1));
+
+	df->f = fopen(path, mode);
+	if(!df->f) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not create FITS file\n");
+		free(df->mem);
+		free(df);
+		return NULL;
+	}
+	/* Every write is a whole chunk, stdio buffering would only copy */
+	setvbuf(df->f, NULL, _IONBF, 0);
+	sprintf_s(df->path, STR_BUF_SIZE, "%s", path);
+	return df;
+}
+
+struct fits_direct_file *fits_direct_create(const char *path, char *errmsg)
+{
+	return open_file(path, "wb", errmsg);
+}
+
+int fits_direct_append(struct fits_direct_file *df, const struct fits_image *images,
+	int nimages, char *errmsg)
+{
+	const struct fits_image *img;
+	unsigned char *chunk = df->chunk;
+	size_t data_bytes, pad, pos, n, total, done, summed;
+	long long header_offset;
+	unsigned int datasum;
+	int k, failed = 0;
+
+	for(k = 0; k < nimages && !failed; k++, df->nhdus++) {
+		img = &images[k];
+		header_offset = df->offset;
+		if(img->pixels)
+			pos = format_header(chunk, CHUNK_BYTES, img, df->nhdus, FITS_CHECKSUM_ZERO, 0);
+		else
+			pos = checksum_header(chunk, CHUNK_BYTES, img, df->nhdus, 0);
+		if(pos == 0) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Too many header keywords\n");
+			return -1;
+		}
+		if(!img->pixels) {
+			failed = write_all(df, chunk, pos);
+			continue;
+		}
+
+		/* Data, converted straight into the staging chunk after the
+		header and summed there while it is in the cache */
+		total = (size_t) img->naxis1 * img->naxis2;
+		data_bytes = total * sizeof(pi16u);
+		datasum = 0;
+		summed = pos;
+		for(done = 0; done < total && !failed; done += n) {
+			n = (CHUNK_BYTES - pos) / sizeof(pi16u);
+			if(n > total - done) n = total - done;
+			fits_ushort_to_be(img->pixels + done, chunk + pos, n);
+			pos += n * sizeof(pi16u);
+			if(img->checksum) datasum = fits_checksum(chunk + summed, pos - summed, datasum);
+
+			if(done + n == total) {
+				/* Zero fill to the end of the last block */
+				pad = (FITS_BLOCK - data_bytes % FITS_BLOCK) % FITS_BLOCK;
+				if(pos + pad > CHUNK_BYTES) {
+					failed = write_all(df, chunk, pos);
+					pos = 0;
+				}
+				memset(chunk + pos, 0, pad);
+				pos += pad;
+			}
+			if(!failed) failed = write_all(df, chunk, pos);
+			pos = summed = 0;
+		}
+
+		/* The header again, now that DATASUM and CHECKSUM are known */
+		if(img->checksum && !failed) {
+			pos = checksum_header(chunk, CHUNK_BYTES, img, df->nhdus, datasum);
+			failed = rewrite_header(df, header_offset, chunk, pos);
+		}
+	}
+
+	if(failed) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not write FITS file %s\n", df->path);
+		return -1;
+	}
+	return 0;
+}
+
+int fits_direct_close(struct fits_direct_file *df, char *errmsg)
+{
+	int failed = fclose(df->f) != 0;
+
+	if(failed)
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not write FITS file %s\n", df->path);
+	free(df->mem);
+	free(df);
+	return failed ? -1 : 0;
+}
+
+int fits_direct_write(const char *path, const struct fits_image *images, int nimages,
+	int in_place, char *errmsg)
+{
+	struct fits_direct_file *df;
+	char closing[STR_BUF_SIZE];
+	int failed;
+
+	df = open_file(path, in_place ? "r+b" : "wb", errmsg);
+	if(!df) return -1;
+	failed = fits_direct_append(df, images, nimages, errmsg);
+	if(fits_direct_close(df, failed ? closing : errmsg)) failed = -1;
+	return failed;
+}
@@ -0,0 +1,92 @@
+#ifndef fitsdirect_h
+#define fitsdirect_h
+
+/*
+	Direct FITS writer for the uncompressed frame. Formats the header
+	cards the way cfitsio does and converts the pixels straight into
+	big-endian BZERO-offset order, so the file is byte for byte what
+	fits_create_img/fits_write_key/fits_write_img would produce,
+	without cfitsio's per-element scaling and buffering.
+*/
+
+#include <stddef.h>
+
+#include "sdk.h"
+
+/* A header keyword as passed to fits_write_key. type is one of
+cfitsio's TLOGICAL, TINT, TLONG, TLONGLONG,
+TFLOAT, TDOUBLE or TSTRING */
+struct fits_key {
+	int type;
+	const char *name;
+	const void *value;
+	const char *comment;
+};
+
+/* Formats key into an 80 character card (not terminated), as ffmkky */
+void fits_format_card(char *card, const struct fits_key *key);
+
+/* out = big-endian (in - 32768), with the best kernel for this CPU */
+void fits_ushort_to_be(const pi16u *in, unsigned char *out, size_t n);
+
+/* Name of the kernel fits_ushort_to_be uses ("avx2", "sse2", "neon" or
+"scalar") */
+const char *fits_direct_kernel(void);
+
+/*
+	The FITS checksum (Seaman et al., the ones' complement sum of
+	big-endian 32 bit words) of n bytes at data, a multiple of 4 but
+	for the last call on a data unit, added to sum. A DATASUM is this
+	of the data unit from 0, and an HDU is intact if its header then
+	adds up to 0xffffffff.
+*/
+unsigned int fits_checksum(const unsigned char *data, size_t n, unsigned int sum);
+
+/* CHECKSUM's 16 character ASCII encoding of the complement of sum, not
+terminated */
+void fits_encode_checksum(unsigned int sum, char *ascii);
+
+/* CHECKSUM and DATASUM before their values are known, and the comments
+every writer gives them */
+#define FITS_CHECKSUM_ZERO "0000000000000000"
+#define FITS_DATASUM_ZERO "         0"
+#define FITS_CHECKSUM_COMMENT "HDU checksum"
+#define FITS_DATASUM_COMMENT "data unit checksum"
+
+/* A 16 bit unsigned image and the keys that follow its standard
+cards, in order. BSCALE and BZERO must be among them, unless pixels is
+NULL: a header only primary HDU (NAXIS = 0). With checksum, CHECKSUM
+and DATASUM follow the keys, summed as the data is written */
+struct fits_image {
+	const pi16u *pixels;
+	long naxis1, naxis2;
+	const struct fits_key *keys;
+	int nkeys;
+	int checksum;
+};
+
+/* Size of the file fits_direct_write makes of images */
+size_t fits_direct_size(const struct fits_image *images, int nimages);
+
+/*
+	Writes a file holding images[0] as the primary array and the rest
+	as IMAGE extensions: a new one, or with in_place over an existing
+	file of fits_direct_size bytes (see outpath.h). Returns 0 on
+	success, otherwise non-zero with a message in errmsg.
+*/
+int fits_direct_write(const char *path, const struct fits_image *images, int nimages,
+	int in_place, char *errmsg);
+
+/*
+	A file written HDU by HDU, for sequences kept open across frames:
+	the first image appended is the primary, the rest extensions. Each
+	returns 0 (non-NULL) on success, otherwise a message in errmsg;
+	fits_direct_close frees df either way.
+*/
+struct fits_direct_file;
+struct fits_direct_file *fits_direct_create(const char *path, char *errmsg);
+int fits_direct_append(struct fits_direct_file *df, const struct fits_image *images,
+	int nimages, char *errmsg);
+int fits_direct_close(struct fits_direct_file *df, char *errmsg);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Reference counted frames and the pool of blocks behind them, see
+	frame.h.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+
+/* Frames of a block are its slots, their refs guarded by their own
+lock, everything else by the block's */
+struct frame_block {
+	struct frame_block *next;	/* idle in the pool */
+	pi_mutex lock;
+	pi_cond idle;
+	int refs;		/* the owner and every live slot */
+	int live, lent;
+
+	char *memory;
+	size_t bytes, size;	/* a slot, the whole block */
+	int count, got;
+	struct frame *slots;
+};
+
+/* Idle blocks, newest first, everything guarded by lock */
+static struct {
+	int ready;
+	pi_mutex lock;
+	struct frame_block *idle_blocks;
+	size_t idle_cap, idle, bytes;
+	int flags, huge, locked;
+	long long allocated, reused;
+} pool;
+
+void frame_pool_start(void)
+{
+	if(pool.ready) return;
+	pi_mutex_init(&pool.lock);
+	pool.idle_cap = FRAME_POOL_DEFAULT_IDLE;
+	pool.ready = 1;
+}
+
+/* Frees a block that is in no list, with the pool lock held */
+static void destroy_block(struct frame_block *b)
+{
+	int i;
+
+	pool.bytes -= b->size;
+	if(b->got & PI_PAGES_HUGE) pool.huge--;
+	if(b->got & PI_PAGES_LOCKED) pool.locked--;
+	for(i = 0; i < b->count; i++)
+		pi_mutex_destroy(&b->slots[i].lock);
+	pi_free_pages(b->memory, b->size, b->got);
+	pi_cond_destroy(&b->idle);
+	pi_mutex_destroy(&b->lock);
+	free(b->slots);
+	free(b);
+}
+
+/* Frees idle blocks, oldest first, until at most keep bytes are idle */
+static void trim_idle(size_t keep)
+{
+	struct frame_block **last, *b;
+
+	while(pool.idle > keep) {
+		last = &pool.idle_blocks;
+		while((*last)->next) last = &(*last)->next;
+		b = *last;
+		*last = NULL;
+		pool.idle -= b->size;
+		destroy_block(b);
+	}
+}
+
+static struct frame_block *allocate_block(size_t bytes, int count, int flags)
+{
+	struct frame_block *b = calloc(1, sizeof(*b));
+	int i;
+
+	if(!b) return NULL;
+	b->bytes = bytes;
+	b->count = count;
+	b->size = bytes * count;
+	b->slots = calloc(count, sizeof(struct frame));
+	b->memory = b->slots ? pi_alloc_pages(b->size, flags, &b->got) : NULL;
+	if(!b->memory) {
+		free(b->slots);
+		free(b);
+		return NULL;
+	}
+	for(i = 0; i < count; i++) {
+		pi_mutex_init(&b->slots[i].lock);
+		b->slots[i].pixels = (pi16u *) (b->memory + i * bytes);
+		b->slots[i].bytes = bytes;
+		b->slots[i].block = b;
+	}
+	pi_mutex_init(&b->lock);
+	pi_cond_init(&b->idle);
+	return b;
+}
+
+struct frame_block *frame_block_new(size_t bytes, int count)
+{
+	struct frame_block **prev, *b;
+	int flags;
+
+	if(bytes == 0 || count < 1) return NULL;
+	frame_pool_start();
+	pi_mutex_lock(&pool.lock);
+	for(prev = &pool.idle_blocks; *prev; prev = &(*prev)->next)
+		if((*prev)->bytes == bytes && (*prev)->count == count) break;
+	b = *prev;
+	if(b) {
+		*prev = b->next;
+		pool.idle -= b->size;
+		pool.reused++;
+	}
+	flags = pool.flags;
+	pi_mutex_unlock(&pool.lock);
+
+	if(!b) {
+		b = allocate_block(bytes, count, flags);
+		if(!b) return NULL;
+		pi_mutex_lock(&pool.lock);
+		pool.allocated++;
+		pool.bytes += b->size;
+		if(b->got & PI_PAGES_HUGE) pool.huge++;
+		if(b->got & PI_PAGES_LOCKED) pool.locked++;
+		pi_mutex_unlock(&pool.lock);
+	}
+	b->next = NULL;
+	b->refs = 1;
+	b->live = b->lent = 0;
+	return b;
+}
+
+void *frame_block_memory(struct frame_block *b)
+{
+	return b->memory;
+}
+
+/* Drops a reference to b, back to the pool with the last */
+static void block_unref(struct frame_block *b)
+{
+	int refs;
+
+	pi_mutex_lock(&b->lock);
+	refs = --b->refs;
+	pi_mutex_unlock(&b->lock);
+	if(refs) return;
+
+	pi_mutex_lock(&pool.lock);
+	if(b->size > pool.idle_cap || b->got != (b->got & pool.flags)) {
+		destroy_block(b);
+	} else {
+		trim_idle(pool.idle_cap - b->size);
+		b->next = pool.idle_blocks;
+		pool.idle_blocks = b;
+		pool.idle += b->size;
+	}
+	pi_mutex_unlock(&pool.lock);
+}
+
+void frame_block_release(struct frame_block *b)
+{
+	block_unref(b);
+}
+
+struct frame *frame_block_frame(struct frame_block *b, const void *address)
+{
+	struct frame *f;
+	size_t offset;
+
+	if((const char *) address < b->memory) return NULL;
+	offset = (size_t) ((const char *) address - b->memory);
+	if(offset % b->bytes || offset / b->bytes >= (size_t) b->count) return NULL;
+	f = &b->slots[offset / b->bytes];
+
+	pi_mutex_lock(&b->lock);
+	pi_mutex_lock(&f->lock);
+	if(f->refs++ == 0) {
+		b->live++;
+		b->refs++;
+	}
+	pi_mutex_unlock(&f->lock);
+	pi_mutex_unlock(&b->lock);
+	return f;
+}
+
+void frame_block_lend(struct frame_block *b, int lent)
+{
+	pi_mutex_lock(&b->lock);
+	b->lent = lent;
+	pi_mutex_unlock(&b->lock);
+}
+
+void frame_block_wait_idle(struct frame_block *b)
+{
+	pi_mutex_lock(&b->lock);
+	while(b->live)
+		pi_cond_wait(&b->idle, &b->lock);
+	pi_mutex_unlock(&b->lock);
+}
+
+
+struct frame *frame_new(size_t bytes)
+{
+	struct frame_block *b = frame_block_new(bytes, 1);
+	struct frame *f;
+
+	if(!b) return NULL;
+	f = frame_block_frame(b, b->memory);
+	block_unref(b);
+	return f;
+}
+
+struct frame *frame_copy(const pi16u *pixels, size_t bytes)
+{
+	struct frame *f = frame_new(bytes);
+
+	if(f) memcpy(f->pixels, pixels, bytes);
+	return f;
+}
+
+void frame_retain(struct frame *f)
+{
+	pi_mutex_lock(&f->lock);
+	f->refs++;
+	pi_mutex_unlock(&f->lock);
+}
+
+void frame_release(struct frame *f)
+{
+	struct frame_block *b = f->block;
+	int refs;
+
+	/* The block lock first, as frame_block_frame takes them */
+	pi_mutex_lock(&b->lock);
+	pi_mutex_lock(&f->lock);
+	refs = --f->refs;
+	pi_mutex_unlock(&f->lock);
+	if(refs == 0 && --b->live == 0)
+		pi_cond_broadcast(&b->idle);
+	pi_mutex_unlock(&b->lock);
+	if(refs == 0) block_unref(b);
+}
+
+int frame_borrowed(struct frame *f)
+{
+	int lent;
+
+	pi_mutex_lock(&f->block->lock);
+	lent = f->block->lent;
+	pi_mutex_unlock(&f->block->lock);
+	return lent;
+}
+
+struct frame *frame_keep(struct frame *f)
+{
+	/* A slot of a ring would hold the whole ring out of the pool */
+	if(f->block->count > 1 || frame_borrowed(f))
+		return frame_copy(f->pixels, f->bytes);
+	frame_retain(f);
+	return f;
+}
+
+
+void frame_pool_configure(size_t idle_cap, int flags)
+{
+	frame_pool_start();
+	pi_mutex_lock(&pool.lock);
+	if(flags != pool.flags) trim_idle(0);
+	pool.flags = flags;
+	pool.idle_cap = idle_cap;
+	trim_idle(idle_cap);
+	pi_mutex_unlock(&pool.lock);
+}
+
+void frame_pool_get_status(struct frame_pool_status *st)
+{
+	frame_pool_start();
+	pi_mutex_lock(&pool.lock);
+	st->idle_cap = pool.idle_cap;
+	st->idle = pool.idle;
+	st->bytes = pool.bytes;
+	st->flags = pool.flags;
+	st->huge = pool.huge;
+	st->locked = pool.locked;
+	st->allocated = pool.allocated;
+	st->reused = pool.reused;
+	pi_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,95 @@
+#ifndef frame_h
+#define frame_h
+
+/*
+	Reference counted frame of pixels, shared without copying by the
+	acquisition, the writer queue and Lua images (image.h). The
+	pixels are read only once the frame is shared.
+
+	Pixels live in page aligned blocks of one or more frames that go
+	back to a pool when their last frame is released and are handed
+	out again for the next frames of that size, so the steady state
+	allocates nothing. An acquisition's circular buffer is such a
+	block, lent to the camera (PicamAdvanced_SetAcquisitionBuffer):
+	its readouts become frames in place, but while the block is lent
+	they are only borrowed. Anything keeping a frame for longer than
+	it takes to write it uses frame_keep, which copies borrowed ones
+	and any frame of a block of several, so that what Lua holds on
+	to never keeps a whole ring from the next acquisition.
+*/
+
+#include <stddef.h>
+
+#include "sdk.h"
+#include "platform.h"
+
+#define FRAME_POOL_DEFAULT_IDLE (512 * 1024 * 1024)
+
+struct frame_block;
+
+struct frame {
+	pi_mutex lock;
+	int refs;
+	pi16u *pixels;
+	size_t bytes;
+	struct frame_block *block;	/* holding pixels */
+};
+
+/* A frame of bytes holding one reference, NULL if out of memory */
+struct frame *frame_new(size_t bytes);
+
+/* frame_new filled with a copy of pixels */
+struct frame *frame_copy(const pi16u *pixels, size_t bytes);
+
+void frame_retain(struct frame *f);
+
+/* Drops a reference, returning the frame's memory to the pool with
+the last */
+void frame_release(struct frame *f);
+
+/* f with a reference for the caller to keep, a copy if f is borrowed
+or shares its block. NULL if out of memory */
+struct frame *frame_keep(struct frame *f);
+
+/* 1 if f is a readout in a block still lent to a camera */
+int frame_borrowed(struct frame *f);
+
+
+/* A block of count frames of bytes each, back to back, holding one
+reference. NULL if out of memory */
+struct frame_block *frame_block_new(size_t bytes, int count);
+
+void *frame_block_memory(struct frame_block *b);
+
+/* The frame at address in b with a reference for the caller, NULL if
+address is not the start of one of its frames */
+struct frame *frame_block_frame(struct frame_block *b, const void *address);
+
+/* Marks b as lent to a camera (lent 1) or back (0) */
+void frame_block_lend(struct frame_block *b, int lent);
+
+/* Waits until none of b's frames is referenced */
+void frame_block_wait_idle(struct frame_block *b);
+
+/* Drops the reference from frame_block_new */
+void frame_block_release(struct frame_block *b);
+
+
+struct frame_pool_status {
+	size_t idle_cap;	/* most bytes kept idle */
+	size_t idle, bytes;	/* idle, and held in all */
+	int flags;		/* PI_PAGES_* asked for */
+	int huge, locked;	/* blocks that got them */
+	long long allocated, reused;	/* blocks */
+};
+
+/* Must first be called from the Lua thread, before any frame */
+void frame_pool_start(void);
+
+/* Keeps at most idle_cap bytes of idle blocks, new blocks asking for
+flags (PI_PAGES_*). Idle blocks are freed if flags change */
+void frame_pool_configure(size_t idle_cap, int flags);
+
+void frame_pool_get_status(struct frame_pool_status *st);
+
+#endif
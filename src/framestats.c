@@ -0,0 +1,145 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Frame statistics, see framestats.h.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "parallel.h"
+#include "framestats.h"
+
+/* Each slab has its own histogram, merged afterwards */
+#define MAX_SLABS 16
+
+struct stats_job {
+	const pi16u *pixels;
+	size_t n;
+	int nslabs;
+	unsigned int *hist;	/* nslabs * HISTOGRAM_BINS */
+};
+
+/* parallel_fn, histograms one contiguous slab of the frame */
+static void histogram_slab(void *ctx, int slab)
+{
+	struct stats_job *job = ctx;
+	unsigned int *h = job->hist + (size_t) slab * HISTOGRAM_BINS;
+	const pi16u *p = job->pixels + job->n * slab / job->nslabs;
+	const pi16u *end = job->pixels + job->n * (slab + 1) / job->nslabs;
+
+	memset(h, 0, HISTOGRAM_BINS * sizeof(unsigned int));
+	for(; p + 4 <= end; p += 4) {
+		h[p[0]]++;
+		h[p[1]]++;
+		h[p[2]]++;
+		h[p[3]]++;
+	}
+	for(; p < end; p++)
+		h[*p]++;
+}
+
+/* Median of the histogram between lo and hi inclusive, interpolated
+within the median bin; also the mean and standard deviation there */
+static double histogram_median(const unsigned int *h, long lo, long hi,
+	double *mean, double *std)
+{
+	unsigned long long count = 0, sum = 0;
+	double sumsq = 0.0, half, cum = 0.0, var;
+	long v;
+
+	for(v = lo; v <= hi; v++) {
+		count += h[v];
+		sum += (unsigned long long) h[v] * v;
+		sumsq += (double) h[v] * v * v;
+	}
+	if(count == 0) {
+		*mean = *std = 0.0;
+		return 0.0;
+	}
+	*mean = (double) sum / count;
+	var = sumsq / count - *mean * *mean;
+	*std = var > 0 ? sqrt(var) : 0.0;
+
+	half = count / 2.0;
+	for(v = lo; v <= hi; v++) {
+		if(cum + h[v] >= half && h[v] > 0)
+			return v - 0.5 + (half - cum) / h[v];
+		cum += h[v];
+	}
+	return (double) hi;
+}
+
+void stats_scratch_free(struct stats_scratch *scratch)
+{
+	free(scratch->hist);
+	scratch->hist = NULL;
+	scratch->slabs = 0;
+}
+
+int frame_stats_compute(const pi16u *pixels, size_t n, pi16u saturation,
+	struct frame_stats *st, unsigned int *histogram, struct stats_scratch *scratch)
+{
+	struct stats_scratch own = {NULL, 0};
+	struct stats_job job;
+	unsigned int *h;
+	double mean, std;
+	long v, lo, hi, newlo, newhi;
+	int s, iter;
+
+	memset(st, 0, sizeof(*st));
+	if(n == 0) return 0;
+
+	job.pixels = pixels;
+	job.n = n;
+	job.nslabs = parallel_threads() + 1;
+	if(job.nslabs > MAX_SLABS) job.nslabs = MAX_SLABS;
+	if(!scratch) scratch = &own;
+	if(scratch->slabs < job.nslabs) {
+		stats_scratch_free(scratch);
+		scratch->hist = malloc((size_t) job.nslabs * HISTOGRAM_BINS * sizeof(unsigned int));
+		if(!scratch->hist) return -1;
+		scratch->slabs = job.nslabs;
+	}
+	job.hist = scratch->hist;
+
+	parallel_for(job.nslabs, histogram_slab, &job);
+
+	h = job.hist;
+	for(s = 1; s < job.nslabs; s++) {
+		for(v = 0; v < HISTOGRAM_BINS; v++)
+			h[v] += job.hist[(size_t) s * HISTOGRAM_BINS + v];
+	}
+
+	for(lo = 0; h[lo] == 0; lo++)
+		;
+	for(hi = HISTOGRAM_BINS - 1; h[hi] == 0; hi--)
+		;
+	st->min = (piint) lo;
+	st->max = (piint) hi;
+	for(v = saturation; v < HISTOGRAM_BINS; v++)
+		st->saturated += h[v];
+	st->median = histogram_median(h, lo, hi, &st->mean, &st->std);
+
+	/* Clip around the median until the range settles */
+	std = st->std;
+	for(iter = 0; iter < 10; iter++) {
+		newlo = (long) ceil(st->median - STATS_CLIP_SIGMA * std);
+		newhi = (long) floor(st->median + STATS_CLIP_SIGMA * std);
+		if(newlo < st->min) newlo = st->min;
+		if(newhi > st->max) newhi = st->max;
+		if(newlo > newhi || (newlo == lo && newhi == hi)) break;
+		lo = newlo;
+		hi = newhi;
+		st->median = histogram_median(h, lo, hi, &mean, &std);
+	}
+	st->clipped_std = std;
+	st->valid = 1;
+
+	if(histogram) memcpy(histogram, h, HISTOGRAM_BINS * sizeof(unsigned int));
+	stats_scratch_free(&own);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef framestats_h
+#define framestats_h
+
+/*
+	Per-frame statistics, from one pass over the readout that builds a
+	16 bit histogram on the parallel pool (parallel.h). Everything
+	else comes exactly from the histogram.
+*/
+
+#include <stddef.h>
+
+#include "sdk.h"
+
+#define HISTOGRAM_BINS 65536
+
+/* The clipped median ignores pixels further than this many standard
+deviations from it */
+#define STATS_CLIP_SIGMA 3.0
+
+struct frame_stats {
+	int valid;
+	piint min, max;
+	double mean, std;
+	double median, clipped_std;	/* after sigma clipping */
+	long long saturated;		/* pixels at or above the saturation level */
+};
+
+/* The per-slab histograms frame_stats_compute counts into, kept by
+callers that compute statistics for every frame so the readout path
+does not allocate them. Starts zeroed and grows with the pool */
+struct stats_scratch {
+	unsigned int *hist;	/* slabs * HISTOGRAM_BINS */
+	int slabs;
+};
+
+void stats_scratch_free(struct stats_scratch *scratch);
+
+/* Fills st from n pixels, and histogram (HISTOGRAM_BINS counts) unless
+it is NULL. scratch may be NULL for a one-off. Returns 0 on success,
+-1 if out of memory */
+int frame_stats_compute(const pi16u *pixels, size_t n, pi16u saturation,
+	struct frame_stats *st, unsigned int *histogram, struct stats_scratch *scratch);
+
+#endif
@@ -0,0 +1,281 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Image userdata, see image.h.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "image.h"
+
+#define IMAGE_MT "picam.image"
+
+struct image {
+	struct frame *frame;
+	struct metadata md;	/* md.width, md.height are the view's */
+	PicamCameraID id;
+	piint x0, y0;		/* view origin in the frame */
+	piint pitch, rows;	/* frame geometry, pixels */
+	size_t offset;		/* of the ROI it is in, pixels */
+};
+
+static struct image *check_image(lua_State *L, int index)
+{
+	return luaL_checkudata(L, index, IMAGE_MT);
+}
+
+static void push_image_metatable(lua_State *L);
+
+/* Pushes a view of src at x0, y0 (0-based) of width by height */
+static void push_view(lua_State *L, const struct image *src, piint x0, piint y0,
+	piint width, piint height)
+{
+	struct image *img;
+
+	img = lua_newuserdata(L, sizeof(*img));
+	*img = *src;
+	img->md.id = &img->id;
+	img->md.width = width;
+	img->md.height = height;
+	img->x0 = src->x0 + x0;
+	img->y0 = src->y0 + y0;
+	frame_retain(img->frame);
+
+	/* Statistics were of the whole frame, and the view is one region
+	of the sensor */
+	if(width != src->md.width || height != src->md.height) {
+		img->md.stats.valid = 0;
+		if(src->md.nrois > 0) {
+			img->md.nrois = 1;
+			img->md.rois[0] = src->md.rois[0];
+			img->md.rois[0].x += x0 * src->md.rois[0].xbin;
+			img->md.rois[0].y += y0 * src->md.rois[0].ybin;
+			img->md.rois[0].width = width;
+			img->md.rois[0].height = height;
+		}
+	}
+
+	push_image_metatable(L);
+	lua_setmetatable(L, -2);
+}
+
+void image_push(lua_State *L, struct frame *frame, const struct metadata *md)
+{
+	struct image img;
+
+	/* Lua may hold it for as long as it likes */
+	frame = frame_keep(frame);
+	if(!frame) {
+		lua_pushstring(L, "Out of memory");
+		lua_error(L);
+		return;
+	}
+
+	memset(&img, 0, sizeof(img));
+	img.frame = frame;
+	img.md = *md;
+	img.md.latency = NULL;	/* saved images are not readout latency */
+	img.id = *md->id;
+	img.pitch = md->width;
+	img.rows = md->height;
+	push_view(L, &img, 0, 0, md->width, md->height);
+	frame_release(frame);
+
+	/* The collector only sees the userdata, tell it about the pixels
+	so large frames nobody holds are reclaimed promptly */
+	lua_gc(L, LUA_GCSTEP, (int) (frame->bytes >> 10));
+}
+
+/* A whole frame can be handed on without copying */
+static int whole_frame(const struct image *img)
+{
+	return img->offset == 0 && img->x0 == 0 && img->y0 == 0 &&
+		img->md.width == img->pitch && img->md.height == img->rows;
+}
+
+static const pi16u *image_row(const struct image *img, piint y)
+{
+	return img->frame->pixels + img->offset + (size_t) (img->y0 + y) * img->pitch + img->x0;
+}
+
+struct frame *image_check_frame(lua_State *L, int index, struct metadata *md)
+{
+	struct image *img = check_image(L, index);
+
+	if(!whole_frame(img)) {
+		lua_pushstring(L, "Image is a view, not a whole frame");
+		lua_error(L);
+		return NULL;
+	}
+	*md = img->md;
+	return img->frame;
+}
+
+/* img:width() */
+static int image_width(lua_State *L)
+{
+	lua_pushinteger(L, check_image(L, 1)->md.width);
+	return 1;
+}
+
+/* img:height() */
+static int image_height(lua_State *L)
+{
+	lua_pushinteger(L, check_image(L, 1)->md.height);
+	return 1;
+}
+
+/* img:get(x, y) */
+static int image_get(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+	lua_Integer x = luaL_checkinteger(L, 2), y = luaL_checkinteger(L, 3);
+
+	if(x < 1 || x > img->md.width || y < 1 || y > img->md.height) {
+		lua_pushstring(L, "Pixel outside the image");
+		lua_error(L);
+		return 0;
+	}
+	lua_pushinteger(L, image_row(img, (piint) y - 1)[x - 1]);
+	return 1;
+}
+
+/* img:row(y) */
+static int image_row_view(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+	lua_Integer y = luaL_checkinteger(L, 2);
+
+	if(y < 1 || y > img->md.height) {
+		lua_pushstring(L, "Row outside the image");
+		lua_error(L);
+		return 0;
+	}
+	push_view(L, img, 0, (piint) y - 1, img->md.width, 1);
+	return 1;
+}
+
+/* img:view(x, y, w, h) */
+static int image_view(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+	lua_Integer x = luaL_checkinteger(L, 2), y = luaL_checkinteger(L, 3);
+	lua_Integer w = luaL_checkinteger(L, 4), h = luaL_checkinteger(L, 5);
+
+	if(x < 1 || y < 1 || w < 1 || h < 1 ||
+		x - 1 + w > img->md.width || y - 1 + h > img->md.height) {
+		lua_pushstring(L, "View outside the image");
+		lua_error(L);
+		return 0;
+	}
+	push_view(L, img, (piint) x - 1, (piint) y - 1, (piint) w, (piint) h);
+	return 1;
+}
+
+/* img:roi(k), ROI k of a frame read out in several (pi_roi) */
+static int image_roi(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+	lua_Integer k = luaL_checkinteger(L, 2);
+	struct image roi;
+	int i;
+
+	if(!whole_frame(img) || k < 1 || k > (img->md.nrois > 0 ? img->md.nrois : 1)) {
+		lua_pushstring(L, "No such ROI in the image");
+		lua_error(L);
+		return 0;
+	}
+	if(img->md.nrois == 0) {
+		push_view(L, img, 0, 0, img->md.width, img->md.height);
+		return 1;
+	}
+
+	roi = *img;
+	for(i = 0; i < k - 1; i++)
+		roi.offset += (size_t) img->md.rois[i].width * img->md.rois[i].height;
+	roi.md.nrois = 1;
+	roi.md.rois[0] = img->md.rois[k - 1];
+	roi.md.width = roi.pitch = roi.md.rois[0].width;
+	roi.md.height = roi.rows = roi.md.rois[0].height;
+	if(img->md.nrois > 1) roi.md.stats.valid = 0;
+	push_view(L, &roi, 0, 0, roi.md.width, roi.md.height);
+	return 1;
+}
+
+/* img:save(prepend). A whole frame is queued as it is, a view is
+first copied out into a frame of its own */
+static int image_save(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+	const char *prepend = luaL_optstring(L, 2, "");
+	struct frame *frame;
+	size_t row_bytes = img->md.width * sizeof(pi16u);
+	piint y;
+	int error;
+
+	if(whole_frame(img)) {
+		frame = img->frame;
+		frame_retain(frame);
+	} else {
+		frame = frame_new(img->md.height * row_bytes);
+		if(frame) {
+			for(y = 0; y < img->md.height; y++)
+				memcpy(frame->pixels + (size_t) y * img->md.width, image_row(img, y), row_bytes);
+		}
+	}
+
+	error = frame ? writer_submit_frame(frame, &img->md, prepend, NULL, NULL) : -1;
+	if(frame) frame_release(frame);
+	if(error) {
+		lua_pushstring(L, "Out of memory queueing image");
+		lua_error(L);
+	}
+	return 0;
+}
+
+static int image_tostring(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+
+	lua_pushfstring(L, "image %dx%d", (int) img->md.width, (int) img->md.height);
+	return 1;
+}
+
+static int image_gc(lua_State *L)
+{
+	struct image *img = check_image(L, 1);
+
+	frame_release(img->frame);
+	return 0;
+}
+
+static const luaL_Reg image_methods[] = {
+	{"width", image_width},
+	{"height", image_height},
+	{"get", image_get},
+	{"row", image_row_view},
+	{"view", image_view},
+	{"roi", image_roi},
+	{"save", image_save},
+	{NULL, NULL}
+};
+
+static void push_image_metatable(lua_State *L)
+{
+	if(luaL_newmetatable(L, IMAGE_MT)) {
+		lua_pushstring(L, "__index");
+		lua_newtable(L);
+		luaL_register(L, NULL, image_methods);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "__tostring");
+		lua_pushcfunction(L, image_tostring);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "__gc");
+		lua_pushcfunction(L, image_gc);
+		lua_rawset(L, -3);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef image_h
+#define image_h
+
+/*
+	Frames as Lua values. An image is a view (the whole frame, a row
+	or a sub-rectangle) onto a reference counted frame (frame.h), so
+	views and the writer queue share the pixels without copying.
+
+	img:width(), img:height()
+	img:get(x, y)		pixel value, 1-based like FITS
+	img:row(y)		view of one row
+	img:view(x, y, w, h)	view of a sub-rectangle
+	img:roi(k)		ROI k of a frame with several, the image
+				itself shows the first
+	img:save(prepend)	queues the view to be written as a FITS file
+*/
+
+#include "lua.h"
+#include "frame.h"
+#include "writer.h"
+
+/* Pushes an image of the whole frame, taking a reference to it (a
+copy if it is borrowed, see frame_keep). md describes the frame and is
+copied */
+void image_push(lua_State *L, struct frame *frame, const struct metadata *md);
+
+/* The frame behind the image at index, which must be a whole frame,
+and its metadata (md->id points into the image). Raises a Lua error
+otherwise; no reference is taken */
+struct frame *image_check_frame(lua_State *L, int index, struct metadata *md);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Per-phase latency histograms, see latency.h.
+
+*/
+
+#include <string.h>
+#include <math.h>
+
+#include "latency.h"
+#include "trace.h"
+
+/* Lower edge of the first octave, shorter times land in bucket 0 */
+#define LATENCY_MIN 1e-6
+
+static const char *latency_names[NUM_LATENCY] = {
+	"stage", "commit", "start", "readout", "convert", "header", "data", "fsync", "preview"
+};
+
+const char *latency_name(int phase)
+{
+	return latency_names[phase];
+}
+
+/* Bucket 0 is everything under LATENCY_MIN, then LATENCY_SUBBUCKETS
+linear steps per octave */
+static int bucket_of(double seconds)
+{
+	double m;
+	int e, b;
+
+	if(seconds < LATENCY_MIN) return 0;
+	m = frexp(seconds / LATENCY_MIN, &e);	/* m in [0.5, 1) */
+	b = 1 + (e - 1) * LATENCY_SUBBUCKETS + (int) ((2 * m - 1) * LATENCY_SUBBUCKETS);
+	return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+/* Upper edge of a bucket */
+static double bucket_top(int b)
+{
+	int octave, sub;
+
+	if(b == 0) return LATENCY_MIN;
+	octave = (b - 1) / LATENCY_SUBBUCKETS;
+	sub = (b - 1) % LATENCY_SUBBUCKETS;
+	return ldexp(LATENCY_MIN, octave) * (1 + (sub + 1) / (double) LATENCY_SUBBUCKETS);
+}
+
+void latency_init(struct latency *lat)
+{
+	pi_mutex_init(&lat->lock);
+	memset(lat->phase, 0, sizeof(lat->phase));
+}
+
+void latency_record(struct latency *lat, int phase, double seconds)
+{
+	struct latency_hist *h;
+	double now;
+
+	if(seconds < 0) seconds = 0;
+	if(trace_on) {
+		now = pi_now();
+		trace_span(latency_names[phase], now - seconds, now, -1);
+	}
+	if(!lat) return;
+	pi_mutex_lock(&lat->lock);
+	h = &lat->phase[phase];
+	h->count++;
+	h->sum += seconds;
+	if(seconds > h->max) h->max = seconds;
+	h->buckets[bucket_of(seconds)]++;
+	pi_mutex_unlock(&lat->lock);
+}
+
+void latency_reset(struct latency *lat)
+{
+	pi_mutex_lock(&lat->lock);
+	memset(lat->phase, 0, sizeof(lat->phase));
+	pi_mutex_unlock(&lat->lock);
+}
+
+/* Top of the bucket holding the sample of rank ceil(q * count), never
+more than the largest sample */
+static double percentile(const struct latency_hist *h, double q)
+{
+	long long rank, seen = 0;
+	int b;
+	double top;
+
+	rank = (long long) ceil(q * h->count);
+	if(rank < 1) rank = 1;
+	for(b = 0; b < LATENCY_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if(seen >= rank) break;
+	}
+	top = bucket_top(b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1);
+	return top < h->max ? top : h->max;
+}
+
+void latency_summarize(struct latency *lat, int phase, struct latency_summary *sum)
+{
+	const struct latency_hist *h;
+
+	pi_mutex_lock(&lat->lock);
+	h = &lat->phase[phase];
+	sum->count = h->count;
+	sum->max = h->max;
+	if(h->count) {
+		sum->mean = h->sum / h->count;
+		sum->p50 = percentile(h, 0.50);
+		sum->p99 = percentile(h, 0.99);
+	} else {
+		sum->mean = sum->p50 = sum->p99 = 0;
+	}
+	pi_mutex_unlock(&lat->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef latency_h
+#define latency_h
+
+/*
+	Wall clock time spent in each phase of getting a frame from a
+	parameter change onto the disk, kept per camera as log spaced
+	histograms (about 9% wide buckets from 1 us to about 18 minutes)
+	so percentiles come without keeping the samples. Each time also
+	goes to the trace while one is taken, see trace.h.
+*/
+
+#include "platform.h"
+
+enum latency_phase {
+	LAT_STAGE,	/* setting parameters on the camera model */
+	LAT_COMMIT,	/* Picam_CommitParameters */
+	LAT_START,	/* from taking the settings to the camera exposing */
+	LAT_READOUT,	/* exposure start (or the last readout) to a readout */
+	LAT_CONVERT,	/* copying, stacking, calibrating and statistics */
+	LAT_HEADER,	/* header keywords and opening the file */
+	LAT_DATA,	/* pixels to the file, closed */
+	LAT_FSYNC,	/* pi_writer{fsync=true} only */
+	LAT_PREVIEW,	/* making a quick-look PNG, see preview.h */
+	NUM_LATENCY
+};
+
+#define LATENCY_SUBBUCKETS 8
+#define LATENCY_OCTAVES 30
+#define LATENCY_BUCKETS (LATENCY_SUBBUCKETS * LATENCY_OCTAVES + 1)
+
+struct latency_hist {
+	long long count;
+	double sum, max;
+	unsigned int buckets[LATENCY_BUCKETS];
+};
+
+struct latency {
+	pi_mutex lock;
+	struct latency_hist phase[NUM_LATENCY];
+};
+
+struct latency_summary {
+	long long count;
+	double p50, p99, max, mean;	/* s */
+};
+
+/* Lua name of a phase */
+const char *latency_name(int phase);
+
+void latency_init(struct latency *lat);
+
+/* Adds a duration in seconds that ended now, lat may be NULL */
+void latency_record(struct latency *lat, int phase, double seconds);
+
+/* Clears every phase */
+void latency_reset(struct latency *lat);
+
+void latency_summarize(struct latency *lat, int phase, struct latency_summary *sum);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Night directory, file names and preallocated spares, see outpath.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "trace.h"
+#include "outpath.h"
+
+static const char months[13][4] = {"", "jan", "feb", "mar",
+	"apr", "may", "jun", "jul", "aug", "sep",
+	"oct", "nov", "dec"};
+
+#ifdef _WIN32
+static const char path_prefix[] = "\\sedm";
+#else
+static const char path_prefix[] = ".";
+#endif
+
+/* Everything but sequence guarded by lock */
+static struct {
+	int ready, started, stopping;
+	pi_thread thread;
+	pi_mutex lock;
+	pi_cond wake;
+
+	/* The night directory and the date it is for */
+	char night[STR_BUF_SIZE];
+	int year, month, day;
+
+	/* Spares wanted, of bytes each, in night; spare holds the ready
+	ones, of spare_bytes in spare_night */
+	int spares;
+	size_t bytes;
+	char spare[OUTPATH_MAX_SPARES][STR_BUF_SIZE];
+	int nspare;
+	size_t spare_bytes;
+	char spare_night[STR_BUF_SIZE];
+	long made;
+
+	long long taken, missed;
+} op;
+
+static volatile long sequence = 0;
+
+/* Drops the ready spares */
+static void remove_spares(void)
+{
+	int k;
+
+	for(k = 0; k < op.nspare; k++)
+		remove(op.spare[k]);
+	op.nspare = 0;
+}
+
+/* Something for the spare thread to do, with lock held */
+static int spares_wanted(void)
+{
+	if(op.nspare > 0 && (op.spare_bytes != op.bytes || strcmp(op.spare_night, op.night) != 0))
+		return 1;
+	return op.bytes > 0 && op.night[0] && op.nspare < op.spares;
+}
+
+static void spare_thread(void *arg)
+{
+	char path[STR_BUF_SIZE];
+	size_t bytes;
+	int failed;
+
+	(void) arg;
+	trace_thread_name("spares");
+	pi_mutex_lock(&op.lock);
+	for(;;) {
+		while(!op.stopping && !spares_wanted())
+			pi_cond_wait(&op.wake, &op.lock);
+		if(op.stopping) break;
+
+		/* A new night, or frames of another size */
+		if(op.spare_bytes != op.bytes || strcmp(op.spare_night, op.night) != 0) {
+			remove_spares();
+			op.spare_bytes = op.bytes;
+			sprintf_s(op.spare_night, STR_BUF_SIZE, "%s", op.night);
+			if(!spares_wanted()) continue;
+		}
+
+		bytes = op.bytes;
+		sprintf_s(path, STR_BUF_SIZE, "%s" PATH_SEP ".spare_%ld", op.night, ++op.made);
+		pi_mutex_unlock(&op.lock);
+		failed = pi_preallocate(path, bytes);
+		pi_mutex_lock(&op.lock);
+
+		if(failed) {
+			/* Out of disk, most likely; wait for the writer to ask again */
+			printf("Could not preallocate %s\n", path);
+			op.bytes = 0;
+		} else if(bytes != op.spare_bytes || strcmp(op.spare_night, op.night) != 0 ||
+			op.nspare >= op.spares) {
+			remove(path);
+		} else {
+			sprintf_s(op.spare[op.nspare++], STR_BUF_SIZE, "%s", path);
+		}
+	}
+	remove_spares();
+	pi_mutex_unlock(&op.lock);
+}
+
+void outpath_start(void)
+{
+	if(op.ready) return;
+	pi_mutex_init(&op.lock);
+	pi_cond_init(&op.wake);
+	op.spares = OUTPATH_DEFAULT_SPARES;
+	op.ready = 1;
+	op.started = pi_thread_start(&op.thread, spare_thread, NULL) == 0;
+}
+
+int outpath_name(const char *prepend, const char *suffix, char *outfile, char *errmsg)
+{
+	char night[STR_BUF_SIZE];
+	struct pi_time t;
+	long seq;
+
+	pi_localtime(&t);
+	pi_mutex_lock(&op.lock);
+	if(t.day != op.day || t.month != op.month || t.year != op.year) {
+		sprintf_s(night, STR_BUF_SIZE, "%s" PATH_SEP "%4d%s%2d", path_prefix,
+			t.year, months[t.month], t.day);
+		if(!pi_directory_exists(night)) {
+			printf("Creating directory %s\n", night);
+			if(pi_mkdir(night) != 0 && !pi_directory_exists(night)) {
+				pi_mutex_unlock(&op.lock);
+				sprintf_s(errmsg, STR_BUF_SIZE, "Could not create path %s\n", night);
+				return -1;
+			}
+		}
+		sprintf_s(op.night, STR_BUF_SIZE, "%s", night);
+		op.year = t.year;
+		op.month = t.month;
+		op.day = t.day;
+		pi_cond_signal(&op.wake);
+	}
+	sprintf_s(night, STR_BUF_SIZE, "%s", op.night);
+	pi_mutex_unlock(&op.lock);
+
+	seq = pi_atomic_add(&sequence, 1);
+	sprintf_s(outfile, STR_BUF_SIZE, "%s" PATH_SEP "%s%4.4d%2.2d%2.2d_%2.2i_%2.2i_%2.2i_%3.3i_%6.6ld.fits%s",
+		night, prepend, t.year, t.month, t.day, t.hour, t.minute, t.second, t.millisecond,
+		seq, suffix);
+	return 0;
+}
+
+int outpath_take(const char *outfile, size_t bytes)
+{
+	char spare[STR_BUF_SIZE];
+
+	if(!op.started) return 0;
+	pi_mutex_lock(&op.lock);
+	if(op.spares == 0) {
+		pi_mutex_unlock(&op.lock);
+		return 0;
+	}
+	if(op.nspare == 0 || op.spare_bytes != bytes || strcmp(op.spare_night, op.night) != 0) {
+		op.bytes = bytes;
+		op.missed++;
+		pi_cond_signal(&op.wake);
+		pi_mutex_unlock(&op.lock);
+		return 0;
+	}
+	sprintf_s(spare, STR_BUF_SIZE, "%s", op.spare[--op.nspare]);
+	pi_cond_signal(&op.wake);
+	pi_mutex_unlock(&op.lock);
+
+	if(rename(spare, outfile) != 0) {
+		remove(spare);
+		pi_mutex_lock(&op.lock);
+		op.missed++;
+		pi_mutex_unlock(&op.lock);
+		return 0;
+	}
+	pi_mutex_lock(&op.lock);
+	op.taken++;
+	pi_mutex_unlock(&op.lock);
+	return 1;
+}
+
+int outpath_configure(int spares)
+{
+	if(spares < 0 || spares > OUTPATH_MAX_SPARES) return -1;
+	outpath_start();
+	pi_mutex_lock(&op.lock);
+	op.spares = spares;
+	while(op.nspare > spares)
+		remove(op.spare[--op.nspare]);
+	pi_cond_signal(&op.wake);
+	pi_mutex_unlock(&op.lock);
+	return 0;
+}
+
+void outpath_get_status(struct outpath_status *st)
+{
+	outpath_start();
+	pi_mutex_lock(&op.lock);
+	st->spares = op.spares;
+	st->ready = op.nspare;
+	st->bytes = op.spare_bytes;
+	st->taken = op.taken;
+	st->missed = op.missed;
+	sprintf_s(st->night, STR_BUF_SIZE, "%s", op.night);
+	pi_mutex_unlock(&op.lock);
+}
+
+void outpath_shutdown(void)
+{
+	if(!op.started) return;
+	pi_mutex_lock(&op.lock);
+	op.stopping = 1;
+	pi_cond_signal(&op.wake);
+	pi_mutex_unlock(&op.lock);
+	pi_thread_join(op.thread);
+	op.started = 0;
+}
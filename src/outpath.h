@@ -0,0 +1,52 @@
+#ifndef outpath_h
+#define outpath_h
+
+/*
+	Output file names and the files behind them. The night directory
+	(YYYYmonDD under the output prefix) is resolved and created once
+	per date instead of looked up for every frame. Names carry the
+	time to the millisecond and a sequence number, so frames written
+	within a second of each other never collide.
+
+	A background thread keeps a few spare files of the size the
+	direct writer last asked for preallocated in the night directory.
+	A frame of that size is written in place into one, renamed to its
+	name, so creating and growing files stays off the per-frame path.
+*/
+
+#include <stddef.h>
+
+#include "writer.h"
+
+#define OUTPATH_DEFAULT_SPARES 4
+#define OUTPATH_MAX_SPARES 32
+
+struct outpath_status {
+	int spares, ready;		/* wanted, and preallocated now */
+	size_t bytes;			/* their size */
+	long long taken, missed;	/* frames that found one, or not */
+	char night[STR_BUF_SIZE];	/* "" before the first name */
+};
+
+/* Starts the spare file thread. Must first be called from the Lua
+thread, before any name is made */
+void outpath_start(void);
+
+/* Names a new file prepend<time>_<sequence>.fits<suffix> in the night
+directory, creating it with the first name of a night. Returns 0 on
+success, otherwise non-zero with a message in errmsg */
+int outpath_name(const char *prepend, const char *suffix, char *outfile, char *errmsg);
+
+/* Renames a spare of exactly bytes to outfile and returns 1, or 0 if
+none is ready, asking for spares of that size from now on */
+int outpath_take(const char *outfile, size_t bytes);
+
+/* Spares kept ready, 0 turns preallocation off. Returns 0 on success */
+int outpath_configure(int spares);
+
+void outpath_get_status(struct outpath_status *st);
+
+/* Stops the thread and removes the spares */
+void outpath_shutdown(void);
+
+#endif
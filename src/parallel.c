@@ -0,0 +1,182 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Worker pool for data parallel loops, see parallel.h.
+
+*/
+
+#include <stdlib.h>
+
+#include "platform.h"
+#include "parallel.h"
+
+#define MAX_PARALLEL_THREADS 64
+
+/* Lives on the stack of the parallel_for caller */
+struct parallel_job {
+	struct parallel_job *next_job;
+	parallel_fn fn;
+	void *ctx;
+	int n, next, done;
+	pi_cond finished;
+};
+
+/* Everything guarded by lock. Jobs stay on the list until their last
+index has been handed out */
+static struct {
+	int started, stopping;
+	int threads;
+	pi_thread thread[MAX_PARALLEL_THREADS];
+	pi_mutex lock;
+	pi_cond work;
+	struct parallel_job *jobs;
+} pool;
+
+
+static void unlink_job(struct parallel_job *job)
+{
+	struct parallel_job **p;
+
+	for(p = &pool.jobs; *p; p = &(*p)->next_job) {
+		if(*p == job) {
+			*p = job->next_job;
+			return;
+		}
+	}
+}
+
+/* Hands out the next index of job, call with lock held */
+static int take_index(struct parallel_job *job)
+{
+	int i = job->next++;
+
+	if(job->next == job->n) unlink_job(job);
+	return i;
+}
+
+static void finish_index(struct parallel_job *job)
+{
+	if(++job->done == job->n) pi_cond_signal(&job->finished);
+}
+
+static void parallel_thread(void *arg)
+{
+	struct parallel_job *job;
+	int i;
+
+	(void) arg;
+	pi_mutex_lock(&pool.lock);
+	for(;;) {
+		while(!pool.jobs && !pool.stopping)
+			pi_cond_wait(&pool.work, &pool.lock);
+		if(pool.stopping) break;
+
+		job = pool.jobs;
+		i = take_index(job);
+		pi_mutex_unlock(&pool.lock);
+		job->fn(job->ctx, i);
+		pi_mutex_lock(&pool.lock);
+		finish_index(job);
+	}
+	pi_mutex_unlock(&pool.lock);
+}
+
+static void start_threads(int threads)
+{
+	int i;
+
+	if(threads > MAX_PARALLEL_THREADS) threads = MAX_PARALLEL_THREADS;
+	pool.stopping = 0;
+	for(i = 0; i < threads; i++) {
+		if(pi_thread_start(&pool.thread[i], parallel_thread, NULL) != 0) break;
+	}
+	pool.threads = i;
+}
+
+static void stop_threads(void)
+{
+	int i, threads;
+
+	pi_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	threads = pool.threads;
+	pool.threads = 0;
+	pi_cond_broadcast(&pool.work);
+	pi_mutex_unlock(&pool.lock);
+
+	for(i = 0; i < threads; i++)
+		pi_thread_join(pool.thread[i]);
+}
+
+void parallel_start(void)
+{
+	if(pool.started) return;
+	pi_mutex_init(&pool.lock);
+	pi_cond_init(&pool.work);
+	pool.started = 1;
+
+	/* The caller of parallel_for is the last core */
+	start_threads(pi_cpu_count() - 1);
+}
+
+void parallel_configure(int threads)
+{
+	if(!pool.started) return;
+	stop_threads();
+
+	/* Jobs still listed are finished by their callers meanwhile */
+	pi_mutex_lock(&pool.lock);
+	start_threads(threads < 0 ? 0 : threads);
+	pi_mutex_unlock(&pool.lock);
+}
+
+int parallel_threads(void)
+{
+	return pool.threads;
+}
+
+void parallel_for(int n, parallel_fn fn, void *ctx)
+{
+	struct parallel_job job;
+	int i;
+
+	if(n <= 0) return;
+	if(!pool.started || n == 1) {
+		for(i = 0; i < n; i++) fn(ctx, i);
+		return;
+	}
+
+	job.fn = fn;
+	job.ctx = ctx;
+	job.n = n;
+	job.next = job.done = 0;
+	pi_cond_init(&job.finished);
+
+	pi_mutex_lock(&pool.lock);
+	job.next_job = pool.jobs;
+	pool.jobs = &job;
+	pi_cond_broadcast(&pool.work);
+
+	while(job.next < job.n) {
+		i = take_index(&job);
+		pi_mutex_unlock(&pool.lock);
+		fn(ctx, i);
+		pi_mutex_lock(&pool.lock);
+		finish_index(&job);
+	}
+	while(job.done < job.n)
+		pi_cond_wait(&job.finished, &pool.lock);
+	pi_mutex_unlock(&pool.lock);
+
+	pi_cond_destroy(&job.finished);
+}
+
+void parallel_shutdown(void)
+{
+	if(!pool.started) return;
+	stop_threads();
+	pi_cond_destroy(&pool.work);
+	pi_mutex_destroy(&pool.lock);
+	pool.started = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef parallel_h
+#define parallel_h
+
+/*
+	Shared pool of worker threads for splitting one frame's work
+	(tiles, row bands) across cores. Any thread may call parallel_for,
+	including several at once; the caller works on its own job too, so
+	a job always finishes even with no workers.
+*/
+
+typedef void (*parallel_fn)(void *ctx, int index);
+
+/* Starts the workers, by default one per processor besides the caller */
+void parallel_start(void);
+
+/* Changes the number of workers, 0 runs everything on the caller */
+void parallel_configure(int threads);
+int parallel_threads(void);
+
+/* Runs fn(ctx, i) for i in [0, n) and returns when all are done */
+void parallel_for(int n, parallel_fn fn, void *ctx);
+
+void parallel_shutdown(void);
+
+#endif
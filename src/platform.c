@@ -0,0 +1,577 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Platform specific helpers, see platform.h
+
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+
+#include "platform.h"
+
+struct thread_start {
+	pi_thread_fn fn;
+	void *arg;
+};
+
+#ifdef _WIN32
+
+static void system_time(struct pi_time *t, const SYSTEMTIME *st)
+{
+	t->year = st->wYear;
+	t->month = st->wMonth;
+	t->day = st->wDay;
+	t->hour = st->wHour;
+	t->minute = st->wMinute;
+	t->second = st->wSecond;
+	t->millisecond = st->wMilliseconds;
+}
+
+void pi_utctime(struct pi_time *t)
+{
+	SYSTEMTIME str_t;
+
+	GetSystemTime(&str_t);
+	system_time(t, &str_t);
+}
+
+void pi_localtime(struct pi_time *t)
+{
+	SYSTEMTIME str_t;
+
+	GetLocalTime(&str_t);
+	system_time(t, &str_t);
+}
+
+double pi_now(void)
+{
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER count;
+
+	if(freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+
+	return (double) count.QuadPart / (double) freq.QuadPart;
+}
+
+void pi_sleep(double seconds)
+{
+	if(seconds <= 0) return;
+	Sleep((DWORD) (seconds * 1000.0 + 0.5));
+}
+
+int pi_directory_exists(const char *path)
+{
+	DWORD dwAttrib = GetFileAttributes((LPCTSTR) path);
+
+	return (dwAttrib != INVALID_FILE_ATTRIBUTES &&
+		(dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
+}
+
+int pi_mkdir(const char *path)
+{
+	return _mkdir(path);
+}
+
+int pi_list_directory(const char *path, pi_entry_fn fn, void *ctx)
+{
+	WIN32_FIND_DATAA found;
+	HANDLE find;
+	char pattern[MAX_PATH];
+
+	sprintf_s(pattern, sizeof(pattern), "%s\\*", path);
+	find = FindFirstFileA(pattern, &found);
+	if(find == INVALID_HANDLE_VALUE) return -1;
+	do {
+		if(strcmp(found.cFileName, ".") && strcmp(found.cFileName, ".."))
+			fn(ctx, found.cFileName);
+	} while(FindNextFileA(find, &found));
+	FindClose(find);
+	return 0;
+}
+
+int pi_preallocate(const char *path, size_t bytes)
+{
+	HANDLE f;
+	LARGE_INTEGER size;
+	BOOL ok;
+
+	f = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f == INVALID_HANDLE_VALUE) return -1;
+	size.QuadPart = (LONGLONG) bytes;
+	ok = SetFilePointerEx(f, size, NULL, FILE_BEGIN) && SetEndOfFile(f);
+	CloseHandle(f);
+	if(!ok) DeleteFileA(path);
+	return ok ? 0 : -1;
+}
+
+int pi_sync_file(const char *path)
+{
+	HANDLE f;
+	BOOL ok;
+
+	f = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f == INVALID_HANDLE_VALUE) return -1;
+	ok = FlushFileBuffers(f);
+	CloseHandle(f);
+	return ok ? 0 : -1;
+}
+
+int pi_cpu_count(void)
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+/* Large pages need SeLockMemoryPrivilege and are always locked */
+void *pi_alloc_pages(size_t bytes, int flags, int *got)
+{
+	SIZE_T large = GetLargePageMinimum();
+	void *memory = NULL;
+
+	*got = 0;
+	if((flags & PI_PAGES_HUGE) && large) {
+		memory = VirtualAlloc(NULL, (bytes + large - 1) / large * large,
+			MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if(memory) *got = PI_PAGES_HUGE | PI_PAGES_LOCKED;
+	}
+	if(!memory) {
+		memory = VirtualAlloc(NULL, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if(memory && (flags & PI_PAGES_LOCKED) && VirtualLock(memory, bytes))
+			*got = PI_PAGES_LOCKED;
+	}
+	return memory;
+}
+
+void pi_free_pages(void *memory, size_t bytes, int got)
+{
+	if(got == PI_PAGES_LOCKED) VirtualUnlock(memory, bytes);
+	VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+/* Kernel objects of the session, the name without its '/' */
+static void shm_object_name(const char *name, char *object, size_t size)
+{
+	sprintf_s(object, size, "Local\\%s", name[0] == '/' ? name + 1 : name);
+}
+
+int pi_shm_create(struct pi_shm *shm, const char *name, size_t bytes)
+{
+	char object[MAX_PATH];
+
+	shm_object_name(name, object, sizeof(object));
+	shm->bytes = bytes;
+	shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD) ((unsigned long long) bytes >> 32), (DWORD) bytes, object);
+	if(!shm->mapping) return -1;
+	shm->memory = MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+	if(!shm->memory) {
+		CloseHandle(shm->mapping);
+		return -1;
+	}
+	return 0;
+}
+
+int pi_shm_open(struct pi_shm *shm, const char *name)
+{
+	char object[MAX_PATH];
+	MEMORY_BASIC_INFORMATION info;
+
+	shm_object_name(name, object, sizeof(object));
+	shm->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, object);
+	if(!shm->mapping) return -1;
+	shm->memory = MapViewOfFile(shm->mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!shm->memory || !VirtualQuery(shm->memory, &info, sizeof(info))) {
+		if(shm->memory) UnmapViewOfFile(shm->memory);
+		CloseHandle(shm->mapping);
+		return -1;
+	}
+	shm->bytes = info.RegionSize;
+	return 0;
+}
+
+void pi_shm_close(struct pi_shm *shm)
+{
+	UnmapViewOfFile(shm->memory);
+	CloseHandle(shm->mapping);
+	shm->memory = NULL;
+}
+
+void pi_shm_remove(const char *name)
+{
+	(void) name;
+}
+
+static DWORD WINAPI thread_trampoline(LPVOID param)
+{
+	struct thread_start start = *(struct thread_start *) param;
+
+	free(param);
+	start.fn(start.arg);
+	return 0;
+}
+
+int pi_thread_start(pi_thread *thread, pi_thread_fn fn, void *arg)
+{
+	struct thread_start *start = malloc(sizeof(*start));
+
+	if(!start) return -1;
+	start->fn = fn;
+	start->arg = arg;
+	*thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+	if(*thread == NULL) {
+		free(start);
+		return -1;
+	}
+	return 0;
+}
+
+void pi_thread_join(pi_thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void pi_thread_detach(pi_thread thread)
+{
+	CloseHandle(thread);
+}
+
+void pi_mutex_init(pi_mutex *m) { InitializeCriticalSection(m); }
+void pi_mutex_destroy(pi_mutex *m) { DeleteCriticalSection(m); }
+void pi_mutex_lock(pi_mutex *m) { EnterCriticalSection(m); }
+void pi_mutex_unlock(pi_mutex *m) { LeaveCriticalSection(m); }
+
+void pi_cond_init(pi_cond *c) { InitializeConditionVariable(c); }
+void pi_cond_destroy(pi_cond *c) { (void) c; }
+void pi_cond_signal(pi_cond *c) { WakeConditionVariable(c); }
+void pi_cond_broadcast(pi_cond *c) { WakeAllConditionVariable(c); }
+void pi_cond_wait(pi_cond *c, pi_mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+
+int pi_cond_timedwait(pi_cond *c, pi_mutex *m, double seconds)
+{
+	if(seconds < 0) seconds = 0;
+	if(SleepConditionVariableCS(c, m, (DWORD) (seconds * 1000.0 + 0.5)))
+		return 0;
+	return GetLastError() == ERROR_TIMEOUT ? 1 : 0;
+}
+
+long pi_atomic_add(volatile long *value, long delta)
+{
+	return InterlockedExchangeAdd(value, delta) + delta;
+}
+
+void pi_memory_barrier(void)
+{
+	MemoryBarrier();
+}
+
+#else
+
+static void broken_down_time(struct pi_time *t, int utc)
+{
+	struct timespec ts;
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if(utc)
+		gmtime_r(&ts.tv_sec, &tm);
+	else
+		localtime_r(&ts.tv_sec, &tm);
+	t->year = tm.tm_year + 1900;
+	t->month = tm.tm_mon + 1;
+	t->day = tm.tm_mday;
+	t->hour = tm.tm_hour;
+	t->minute = tm.tm_min;
+	t->second = tm.tm_sec;
+	t->millisecond = (int) (ts.tv_nsec / 1000000);
+}
+
+void pi_localtime(struct pi_time *t)
+{
+	broken_down_time(t, 0);
+}
+
+void pi_utctime(struct pi_time *t)
+{
+	broken_down_time(t, 1);
+}
+
+double pi_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void pi_sleep(double seconds)
+{
+	struct timespec ts;
+
+	if(seconds <= 0) return;
+	ts.tv_sec = (time_t) seconds;
+	ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+int pi_directory_exists(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int pi_mkdir(const char *path)
+{
+	return mkdir(path, 0775);
+}
+
+int pi_list_directory(const char *path, pi_entry_fn fn, void *ctx)
+{
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+
+	if(!dir) return -1;
+	while((entry = readdir(dir)) != NULL) {
+		if(strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+			fn(ctx, entry->d_name);
+	}
+	closedir(dir);
+	return 0;
+}
+
+int pi_preallocate(const char *path, size_t bytes)
+{
+	int fd, error;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0664);
+	if(fd < 0) return -1;
+	error = posix_fallocate(fd, 0, (off_t) bytes);
+	close(fd);
+	if(error) unlink(path);
+	return error ? -1 : 0;
+}
+
+int pi_sync_file(const char *path)
+{
+	int fd, error;
+
+	/* fsync on any descriptor flushes the file's dirty pages */
+	fd = open(path, O_WRONLY);
+	if(fd < 0) return -1;
+	error = fsync(fd);
+	close(fd);
+	return error;
+}
+
+int pi_cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int) n : 1;
+}
+
+/* Size of the default huge page on x86-64 Linux */
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+static size_t mapped_size(size_t bytes, int got)
+{
+	return got & PI_PAGES_HUGE ? (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE : bytes;
+}
+
+void *pi_alloc_pages(size_t bytes, int flags, int *got)
+{
+	void *memory = MAP_FAILED;
+
+	*got = 0;
+#ifdef MAP_HUGETLB
+	if(flags & PI_PAGES_HUGE) {
+		memory = mmap(NULL, mapped_size(bytes, PI_PAGES_HUGE), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(memory != MAP_FAILED) *got = PI_PAGES_HUGE;
+	}
+#endif
+	if(memory == MAP_FAILED) {
+		memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(memory == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+		/* No huge pages reserved, transparent ones may still do */
+		if(flags & PI_PAGES_HUGE) madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+	}
+	if((flags & PI_PAGES_LOCKED) && mlock(memory, mapped_size(bytes, *got)) == 0)
+		*got |= PI_PAGES_LOCKED;
+	return memory;
+}
+
+void pi_free_pages(void *memory, size_t bytes, int got)
+{
+	if(got & PI_PAGES_LOCKED) munlock(memory, mapped_size(bytes, got));
+	munmap(memory, mapped_size(bytes, got));
+}
+
+int pi_shm_create(struct pi_shm *shm, const char *name, size_t bytes)
+{
+	int fd;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0) return -1;
+	if(ftruncate(fd, (off_t) bytes) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	shm->memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm->memory == MAP_FAILED) {
+		shm_unlink(name);
+		return -1;
+	}
+	shm->bytes = bytes;
+	return 0;
+}
+
+int pi_shm_open(struct pi_shm *shm, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	shm->memory = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm->memory == MAP_FAILED) return -1;
+	shm->bytes = (size_t) st.st_size;
+	return 0;
+}
+
+void pi_shm_close(struct pi_shm *shm)
+{
+	munmap(shm->memory, shm->bytes);
+	shm->memory = NULL;
+}
+
+void pi_shm_remove(const char *name)
+{
+	shm_unlink(name);
+}
+
+static void *thread_trampoline(void *param)
+{
+	struct thread_start start = *(struct thread_start *) param;
+
+	free(param);
+	start.fn(start.arg);
+	return NULL;
+}
+
+int pi_thread_start(pi_thread *thread, pi_thread_fn fn, void *arg)
+{
+	struct thread_start *start = malloc(sizeof(*start));
+
+	if(!start) return -1;
+	start->fn = fn;
+	start->arg = arg;
+	if(pthread_create(thread, NULL, thread_trampoline, start) != 0) {
+		free(start);
+		return -1;
+	}
+	return 0;
+}
+
+void pi_thread_join(pi_thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+void pi_thread_detach(pi_thread thread)
+{
+	pthread_detach(thread);
+}
+
+void pi_mutex_init(pi_mutex *m) { pthread_mutex_init(m, NULL); }
+void pi_mutex_destroy(pi_mutex *m) { pthread_mutex_destroy(m); }
+void pi_mutex_lock(pi_mutex *m) { pthread_mutex_lock(m); }
+void pi_mutex_unlock(pi_mutex *m) { pthread_mutex_unlock(m); }
+
+void pi_cond_init(pi_cond *c)
+{
+	pthread_condattr_t attr;
+
+	/* Timed waits are measured on the monotonic clock, like pi_now */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(c, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void pi_cond_destroy(pi_cond *c) { pthread_cond_destroy(c); }
+void pi_cond_signal(pi_cond *c) { pthread_cond_signal(c); }
+void pi_cond_broadcast(pi_cond *c) { pthread_cond_broadcast(c); }
+void pi_cond_wait(pi_cond *c, pi_mutex *m) { pthread_cond_wait(c, m); }
+
+int pi_cond_timedwait(pi_cond *c, pi_mutex *m, double seconds)
+{
+	struct timespec ts;
+
+	if(seconds < 0) seconds = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += (time_t) seconds;
+	ts.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+	if(ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return pthread_cond_timedwait(c, m, &ts) == ETIMEDOUT;
+}
+
+long pi_atomic_add(volatile long *value, long delta)
+{
+	return __sync_add_and_fetch(value, delta);
+}
+
+void pi_memory_barrier(void)
+{
+	__sync_synchronize();
+}
+
+int pi_strncpy(char *dst, size_t dst_size, const char *src, size_t count)
+{
+	if(dst == NULL || dst_size == 0) return EINVAL;
+	if(src == NULL) {
+		dst[0] = '\0';
+		return EINVAL;
+	}
+	if(count >= dst_size) {
+		dst[0] = '\0';
+		return ERANGE;
+	}
+	memcpy(dst, src, count);
+	dst[count] = '\0';
+	return 0;
+}
+
+#endif
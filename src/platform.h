@@ -0,0 +1,144 @@
+#ifndef platform_h
+#define platform_h
+
+/*
+	Portability layer. The bridge was written against the Win32 API
+	on the observatory PC; everything OS specific that camera.c needs
+	goes through here so the same sources also build on Linux
+	(usually against the simulated camera, see simcam.h).
+*/
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <direct.h>
+#define PATH_SEP "\\"
+#else
+#include <unistd.h>
+#include <pthread.h>
+#define PATH_SEP "/"
+
+/* MSVC "secure" string functions used throughout the bridge */
+#define sprintf_s snprintf
+#define strncpy_s(dst, dst_size, src, count) pi_strncpy(dst, dst_size, src, count)
+int pi_strncpy(char *dst, size_t dst_size, const char *src, size_t count);
+#endif
+
+struct pi_time {
+	int year, month, day;
+	int hour, minute, second, millisecond;
+};
+
+/* Local wall clock time, month is 1-12 */
+void pi_localtime(struct pi_time *t);
+
+/* The same in UTC */
+void pi_utctime(struct pi_time *t);
+
+/* Monotonic clock in seconds, only differences are meaningful */
+double pi_now(void);
+
+/* Sleep for (fractional) seconds */
+void pi_sleep(double seconds);
+
+/* Returns 1 if path exists and is a directory */
+int pi_directory_exists(const char *path);
+
+/* Returns 0 on success */
+int pi_mkdir(const char *path);
+
+/* Calls fn with the name of every entry in the directory at path but
+. and .., in no particular order. Returns 0 on success */
+typedef void (*pi_entry_fn)(void *ctx, const char *name);
+int pi_list_directory(const char *path, pi_entry_fn fn, void *ctx);
+
+/* Creates a new file of bytes, its blocks allocated, returns 0 on
+success and -1 if it exists or could not be made */
+int pi_preallocate(const char *path, size_t bytes);
+
+/* Flushes a closed file's data to the disk, returns 0 on success */
+int pi_sync_file(const char *path);
+
+/* Number of online processors, at least 1 */
+int pi_cpu_count(void);
+
+#define PI_PAGES_HUGE 1		/* on huge (large) pages */
+#define PI_PAGES_LOCKED 2	/* locked in RAM, never paged out */
+
+/* Page aligned memory of bytes, with what flags ask for where the OS
+allows it; *got tells what it got, to pass on to pi_free_pages. NULL
+if out of memory */
+void *pi_alloc_pages(size_t bytes, int flags, int *got);
+void pi_free_pages(void *memory, size_t bytes, int got);
+
+/* Named shared memory other processes on the machine can map. name
+starts with a '/' and has no other, as for shm_open */
+struct pi_shm {
+	void *memory;
+	size_t bytes;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+/* Creates bytes of zeroed shared memory called name, replacing any
+there was, and maps it. Returns 0 on success */
+int pi_shm_create(struct pi_shm *shm, const char *name, size_t bytes);
+
+/* Maps all of an existing one read only, returns 0 on success */
+int pi_shm_open(struct pi_shm *shm, const char *name);
+
+void pi_shm_close(struct pi_shm *shm);
+
+/* Removes the name, mappings stay valid until closed. Windows frees the
+memory with the last mapping instead */
+void pi_shm_remove(const char *name);
+
+
+/* Threads */
+#ifdef _WIN32
+typedef HANDLE pi_thread;
+typedef CRITICAL_SECTION pi_mutex;
+typedef CONDITION_VARIABLE pi_cond;
+#else
+typedef pthread_t pi_thread;
+typedef pthread_mutex_t pi_mutex;
+typedef pthread_cond_t pi_cond;
+#endif
+
+typedef void (*pi_thread_fn)(void *arg);
+
+/* Returns 0 on success */
+int pi_thread_start(pi_thread *thread, pi_thread_fn fn, void *arg);
+void pi_thread_join(pi_thread thread);
+void pi_thread_detach(pi_thread thread);
+
+void pi_mutex_init(pi_mutex *m);
+void pi_mutex_destroy(pi_mutex *m);
+void pi_mutex_lock(pi_mutex *m);
+void pi_mutex_unlock(pi_mutex *m);
+
+void pi_cond_init(pi_cond *c);
+void pi_cond_destroy(pi_cond *c);
+void pi_cond_signal(pi_cond *c);
+void pi_cond_broadcast(pi_cond *c);
+void pi_cond_wait(pi_cond *c, pi_mutex *m);
+
+/* Waits at most seconds, returns 0 if woken and 1 on timeout */
+int pi_cond_timedwait(pi_cond *c, pi_mutex *m, double seconds);
+
+/* Adds delta and returns the new value, a full memory barrier */
+long pi_atomic_add(volatile long *value, long delta);
+
+/* A full memory barrier, for memory shared without locks */
+void pi_memory_barrier(void);
+
+/* Storage class of a variable each thread has its own copy of */
+#ifdef _WIN32
+#define PI_THREAD_LOCAL __declspec(thread)
+#else
+#define PI_THREAD_LOCAL __thread
+#endif
+
+#endif
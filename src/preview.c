@@ -0,0 +1,588 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Quick-look PNG previews, see preview.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "zlib.h"
+#include "platform.h"
+#include "parallel.h"
+#include "latency.h"
+#include "trace.h"
+#include "preview.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Pixels of the binned image the stretch limits come from */
+#define PREVIEW_SAMPLES 4096
+
+/* Output rows per parallel_for band */
+#define BAND_ROWS 16
+
+/* Stretch lookup table entries between the limits */
+#define LUT_SIZE 4096
+
+/* IRAF zscale parameters */
+#define ZSCALE_CONTRAST 0.25
+#define ZSCALE_REJECT 2.5
+#define ZSCALE_ITERATIONS 5
+
+/* asinh is linear below this fraction of the range */
+#define ASINH_SOFTENING 0.1
+
+static const char *stretch_names[NUM_STRETCH] = {"zscale", "asinh"};
+
+/* The preview thread and the newest frame waiting for it, everything
+guarded by lock */
+static struct {
+	int ready, started, stopping;
+	pi_thread thread;
+	pi_mutex lock;
+	pi_cond work;
+	struct preview_config cfg;
+
+	struct frame *frame;
+	struct metadata md;
+	char fits_path[STR_BUF_SIZE];
+	double queued;
+	int busy;
+
+	long long made, skipped, failed;
+	char last[STR_BUF_SIZE];
+	double last_latency;
+} pv;
+
+/* pv.cfg until the first preview_configure */
+static const struct preview_config default_cfg = {0, PREVIEW_DEFAULT_SIZE, STRETCH_ZSCALE};
+
+
+const char *preview_stretch_name(int s)
+{
+	return stretch_names[s];
+}
+
+int preview_stretch_lookup(const char *name)
+{
+	int s;
+
+	for(s = 0; s < NUM_STRETCH; s++)
+		if(strcmp(stretch_names[s], name) == 0) return s;
+	return -1;
+}
+
+
+/* Block averaging */
+
+struct bin_job {
+	const pi16u *pixels;
+	piint width, factor, ow, oh;
+	float *out;
+	int failed;
+};
+
+/* acc[i] += row[i], widening */
+static void accumulate_scalar(unsigned int *acc, const pi16u *row, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i < n; i++)
+		acc[i] += row[i];
+}
+
+#ifdef HAVE_SSE2
+static void accumulate_sse2(unsigned int *acc, const pi16u *row, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+	size_t i;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *) (row + i));
+		lo = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (acc + i)), _mm_unpacklo_epi16(v, zero));
+		hi = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (acc + i + 4)), _mm_unpackhi_epi16(v, zero));
+		_mm_storeu_si128((__m128i *) (acc + i), lo);
+		_mm_storeu_si128((__m128i *) (acc + i + 4), hi);
+	}
+	accumulate_scalar(acc + i, row + i, n - i);
+}
+#define accumulate accumulate_sse2
+#else
+#define accumulate accumulate_scalar
+#endif
+
+/* parallel_fn, averages BAND_ROWS output rows */
+static void bin_band(void *ctx, int index)
+{
+	struct bin_job *job = ctx;
+	size_t n = (size_t) job->ow * job->factor;
+	unsigned int *acc, sum;
+	float scale = 1.0f / ((float) job->factor * job->factor);
+	piint y, r, x, k, last;
+
+	acc = malloc(n * sizeof(unsigned int));
+	if(!acc) {
+		job->failed = 1;
+		return;
+	}
+	last = (index + 1) * BAND_ROWS < job->oh ? (index + 1) * BAND_ROWS : job->oh;
+	for(y = index * BAND_ROWS; y < last; y++) {
+		memset(acc, 0, n * sizeof(unsigned int));
+		for(r = 0; r < job->factor; r++)
+			accumulate(acc, job->pixels + ((size_t) y * job->factor + r) * job->width, n);
+		for(x = 0; x < job->ow; x++) {
+			sum = 0;
+			for(k = 0; k < job->factor; k++)
+				sum += acc[(size_t) x * job->factor + k];
+			job->out[(size_t) y * job->ow + x] = sum * scale;
+		}
+	}
+	free(acc);
+}
+
+
+/* Stretch */
+
+struct stretch {
+	float lo, scale;	/* LUT index = (v - lo) * scale */
+	unsigned char lut[LUT_SIZE];
+};
+
+static int compare_floats(const void *a, const void *b)
+{
+	float x = *(const float *) a, y = *(const float *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* IRAF's zscale on sorted samples: a line fitted to them with
+rejection, its slope divided by the contrast, about the median */
+static void zscale_limits(const float *s, int n, float *z1, float *z2)
+{
+	char *bad;
+	double sx, sy, sxx, sxy, a, b, r, sigma, ss;
+	int i, iter, good, rejected;
+
+	*z1 = s[0];
+	*z2 = s[n - 1];
+	bad = calloc(n, 1);
+	if(!bad || n < 3) {
+		free(bad);
+		return;
+	}
+
+	a = s[n / 2];
+	b = 0;
+	good = n;
+	for(iter = 0; iter < ZSCALE_ITERATIONS; iter++) {
+		sx = sy = sxx = sxy = 0;
+		for(i = 0; i < n; i++) {
+			if(bad[i]) continue;
+			sx += i;
+			sy += s[i];
+			sxx += (double) i * i;
+			sxy += (double) i * s[i];
+		}
+		if(sxx * good - sx * sx <= 0) break;
+		b = (good * sxy - sx * sy) / (good * sxx - sx * sx);
+		a = (sy - b * sx) / good;
+
+		ss = 0;
+		for(i = 0; i < n; i++) {
+			if(bad[i]) continue;
+			r = s[i] - (a + b * i);
+			ss += r * r;
+		}
+		sigma = sqrt(ss / good);
+
+		rejected = 0;
+		for(i = 0; i < n; i++) {
+			if(bad[i] || fabs(s[i] - (a + b * i)) <= ZSCALE_REJECT * sigma) continue;
+			bad[i] = 1;
+			rejected++;
+		}
+		good -= rejected;
+		if(rejected == 0 || good < n / 2) break;
+	}
+	free(bad);
+
+	/* Too many rejected to trust the fit, use the full range */
+	if(good < n / 2) return;
+	b /= ZSCALE_CONTRAST;
+	if(s[n / 2] - b * (n / 2) > *z1) *z1 = (float) (s[n / 2] - b * (n / 2));
+	if(s[n / 2] + b * (n / 2) < *z2) *z2 = (float) (s[n / 2] + b * (n / 2));
+}
+
+/* Limits from a sample of the binned image, and the curve between them */
+static int make_stretch(const float *img, size_t n, int method, struct stretch *st)
+{
+	float *s, z1, z2;
+	size_t step, i;
+	int k, ns;
+	double t, soft;
+
+	step = n > PREVIEW_SAMPLES ? n / PREVIEW_SAMPLES : 1;
+	ns = (int) (n / step);
+	s = malloc(ns * sizeof(float));
+	if(!s) return -1;
+	for(k = 0; k < ns; k++)
+		s[k] = img[k * step];
+	qsort(s, ns, sizeof(float), compare_floats);
+
+	if(method == STRETCH_ASINH) {
+		z1 = s[(int) (0.005 * (ns - 1))];
+		z2 = s[(int) (0.995 * (ns - 1))];
+	} else {
+		zscale_limits(s, ns, &z1, &z2);
+	}
+	free(s);
+	if(z2 <= z1) z2 = z1 + 1;
+
+	st->lo = z1;
+	st->scale = LUT_SIZE / (z2 - z1);
+	soft = ASINH_SOFTENING;
+	for(i = 0; i < LUT_SIZE; i++) {
+		t = (i + 0.5) / LUT_SIZE;
+		if(method == STRETCH_ASINH) t = asinh(t / soft) / asinh(1 / soft);
+		st->lut[i] = (unsigned char) (t * 255 + 0.5);
+	}
+	return 0;
+}
+
+static void map_scalar(const float *in, unsigned char *out, size_t n, const struct stretch *st)
+{
+	size_t i;
+	float v;
+
+	for(i = 0; i < n; i++) {
+		v = (in[i] - st->lo) * st->scale;
+		if(v < 0) v = 0;
+		if(v > LUT_SIZE - 1) v = LUT_SIZE - 1;
+		out[i] = st->lut[(int) v];
+	}
+}
+
+#ifdef HAVE_SSE2
+static void map_sse2(const float *in, unsigned char *out, size_t n, const struct stretch *st)
+{
+	const __m128 lo = _mm_set1_ps(st->lo), scale = _mm_set1_ps(st->scale);
+	const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(LUT_SIZE - 1);
+	int idx[4];
+	size_t i;
+	__m128 v;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		v = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in + i), lo), scale);
+		v = _mm_min_ps(_mm_max_ps(v, zero), top);
+		_mm_storeu_si128((__m128i *) idx, _mm_cvttps_epi32(v));
+		out[i] = st->lut[idx[0]];
+		out[i + 1] = st->lut[idx[1]];
+		out[i + 2] = st->lut[idx[2]];
+		out[i + 3] = st->lut[idx[3]];
+	}
+	map_scalar(in + i, out + i, n - i, st);
+}
+#define map_pixels map_sse2
+#else
+#define map_pixels map_scalar
+#endif
+
+
+/* PNG */
+
+static void put_be32(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char) (v >> 24);
+	p[1] = (unsigned char) (v >> 16);
+	p[2] = (unsigned char) (v >> 8);
+	p[3] = (unsigned char) v;
+}
+
+/* Writes a chunk, returns 0 on success */
+static int write_chunk(FILE *f, const char *type, const unsigned char *data, size_t len)
+{
+	unsigned char head[8], tail[4];
+	uLong crc;
+
+	put_be32(head, (unsigned long) len);
+	memcpy(head + 4, type, 4);
+	crc = crc32(0L, head + 4, 4);
+	if(len) crc = crc32(crc, data, (uInt) len);
+	put_be32(tail, crc);
+	return fwrite(head, 1, 8, f) != 8 || (len && fwrite(data, 1, len, f) != len) ||
+		fwrite(tail, 1, 4, f) != 4;
+}
+
+/* 8 bit grayscale, rows is height rows of width bytes each led by
+its filter type byte */
+static int write_png(const char *path, const unsigned char *rows, piint width, piint height)
+{
+	static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+	unsigned char ihdr[13], *z;
+	uLongf zlen;
+	size_t raw = (size_t) (width + 1) * height;
+	FILE *f;
+	int failed;
+
+	zlen = compressBound((uLong) raw);
+	z = malloc(zlen);
+	if(!z) return -1;
+	if(compress2(z, &zlen, rows, (uLong) raw, Z_BEST_SPEED) != Z_OK) {
+		free(z);
+		return -1;
+	}
+
+	put_be32(ihdr, width);
+	put_be32(ihdr + 4, height);
+	ihdr[8] = 8;	/* bit depth */
+	ihdr[9] = 0;	/* grayscale */
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+	f = fopen(path, "wb");
+	if(!f) {
+		free(z);
+		return -1;
+	}
+	failed = fwrite(signature, 1, 8, f) != 8 ||
+		write_chunk(f, "IHDR", ihdr, sizeof(ihdr)) ||
+		write_chunk(f, "IDAT", z, zlen) ||
+		write_chunk(f, "IEND", NULL, 0);
+	if(fclose(f) != 0) failed = 1;
+	free(z);
+	return failed ? -1 : 0;
+}
+
+/* Block averages pixels into job->out, to be freed by the caller.
+Returns 0 on success */
+static int bin_pixels(const pi16u *pixels, piint width, piint height,
+	const struct preview_config *cfg, struct bin_job *job)
+{
+	piint longest;
+
+	longest = width > height ? width : height;
+	job->factor = (longest + cfg->size - 1) / cfg->size;
+	if(job->factor < 1) job->factor = 1;
+	if(job->factor > width) job->factor = width;
+	if(job->factor > height) job->factor = height;
+	job->pixels = pixels;
+	job->width = width;
+	job->ow = width / job->factor;
+	job->oh = height / job->factor;
+	job->failed = 0;
+	job->out = malloc((size_t) job->ow * job->oh * sizeof(float));
+	if(!job->out) return -1;
+
+	parallel_for((job->oh + BAND_ROWS - 1) / BAND_ROWS, bin_band, job);
+	if(job->failed) {
+		free(job->out);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stretches and writes the binned image, freeing job->out */
+static int write_binned(struct bin_job *job, const struct preview_config *cfg,
+	const char *png_path, char *errmsg)
+{
+	struct stretch st;
+	unsigned char *rows;
+	piint y;
+	int failed;
+
+	rows = malloc((size_t) (job->ow + 1) * job->oh);
+	if(!rows || make_stretch(job->out, (size_t) job->ow * job->oh, cfg->stretch, &st)) {
+		free(job->out);
+		free(rows);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory making preview\n");
+		return -1;
+	}
+
+	/* FITS row 1 is the bottom of the image */
+	for(y = 0; y < job->oh; y++) {
+		rows[(size_t) y * (job->ow + 1)] = 0;
+		map_pixels(job->out + (size_t) (job->oh - 1 - y) * job->ow,
+			rows + (size_t) y * (job->ow + 1) + 1, job->ow, &st);
+	}
+	free(job->out);
+
+	failed = write_png(png_path, rows, job->ow, job->oh);
+	free(rows);
+	if(failed) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not write preview %s\n", png_path);
+		return -1;
+	}
+	return 0;
+}
+
+int preview_write(const pi16u *pixels, piint width, piint height,
+	const struct preview_config *cfg, const char *png_path, char *errmsg)
+{
+	struct bin_job job;
+
+	if(bin_pixels(pixels, width, height, cfg, &job)) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory making preview\n");
+		return -1;
+	}
+	return write_binned(&job, cfg, png_path, errmsg);
+}
+
+
+/* The preview thread */
+
+/* fits_path with its .fits... extension replaced by .png */
+static void png_path(const char *fits_path, char *path)
+{
+	char *ext;
+
+	sprintf_s(path, STR_BUF_SIZE, "%s", fits_path);
+	ext = strstr(path, ".fits");
+	if(ext) *ext = '\0';
+	if(strlen(path) + 5 <= STR_BUF_SIZE) strcat(path, ".png");
+}
+
+static void preview_thread(void *arg)
+{
+	struct frame *frame;
+	struct metadata md;
+	struct preview_config cfg;
+	struct bin_job job;
+	char path[STR_BUF_SIZE], errmsg[STR_BUF_SIZE];
+	double queued, tick;
+	int failed;
+
+	(void) arg;
+	trace_thread_name("preview");
+	pi_mutex_lock(&pv.lock);
+	for(;;) {
+		while(!pv.frame && !pv.stopping)
+			pi_cond_wait(&pv.work, &pv.lock);
+		if(!pv.frame) break;
+
+		frame = pv.frame;
+		pv.frame = NULL;
+		md = pv.md;
+		cfg = pv.cfg;
+		queued = pv.queued;
+		png_path(pv.fits_path, path);
+		pv.busy = 1;
+		pi_mutex_unlock(&pv.lock);
+
+		/* The frame may be a readout the camera wants back, it is
+		only needed for the binning */
+		tick = pi_now();
+		failed = bin_pixels(frame->pixels, md.width, md.height, &cfg, &job);
+		frame_release(frame);
+		if(failed)
+			sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory making preview\n");
+		else
+			failed = write_binned(&job, &cfg, path, errmsg);
+		latency_record(md.latency, LAT_PREVIEW, pi_now() - tick);
+		if(failed) printf("%s", errmsg);
+
+		pi_mutex_lock(&pv.lock);
+		pv.busy = 0;
+		if(failed) {
+			pv.failed++;
+		} else {
+			pv.made++;
+			sprintf_s(pv.last, STR_BUF_SIZE, "%s", path);
+			pv.last_latency = pi_now() - queued;
+		}
+	}
+	pi_mutex_unlock(&pv.lock);
+}
+
+int preview_configure(const struct preview_config *cfg)
+{
+	if(cfg->size < 1 || cfg->stretch < 0 || cfg->stretch >= NUM_STRETCH) return -1;
+	if(!pv.ready) {
+		pi_mutex_init(&pv.lock);
+		pi_cond_init(&pv.work);
+		pv.ready = 1;
+	}
+
+	pi_mutex_lock(&pv.lock);
+	pv.cfg = *cfg;
+	pi_mutex_unlock(&pv.lock);
+
+	if(cfg->enabled && !pv.started) {
+		pv.stopping = 0;
+		if(pi_thread_start(&pv.thread, preview_thread, NULL)) return -1;
+		pv.started = 1;
+	}
+	return 0;
+}
+
+void preview_get_status(struct preview_status *st)
+{
+	if(!pv.ready) {
+		memset(st, 0, sizeof(*st));
+		st->cfg = default_cfg;
+		return;
+	}
+	pi_mutex_lock(&pv.lock);
+	st->cfg = pv.cfg;
+	st->made = pv.made;
+	st->skipped = pv.skipped;
+	st->failed = pv.failed;
+	sprintf_s(st->last, STR_BUF_SIZE, "%s", pv.last);
+	st->last_latency = pv.last_latency;
+	pi_mutex_unlock(&pv.lock);
+}
+
+void preview_submit(struct frame *frame, const struct metadata *md, const char *fits_path)
+{
+	struct frame *old = NULL;
+
+	if(!pv.started) return;
+	pi_mutex_lock(&pv.lock);
+	if(!pv.cfg.enabled || pv.stopping) {
+		pi_mutex_unlock(&pv.lock);
+		return;
+	}
+
+	/* A readout waiting here would keep the camera from its buffer */
+	if(pv.busy && frame_borrowed(frame)) {
+		pv.skipped++;
+		pi_mutex_unlock(&pv.lock);
+		return;
+	}
+	if(pv.frame) {
+		old = pv.frame;
+		pv.skipped++;
+	}
+	frame_retain(frame);
+	pv.frame = frame;
+	pv.md = *md;
+	pv.md.id = NULL;
+	sprintf_s(pv.fits_path, STR_BUF_SIZE, "%s", fits_path);
+	pv.queued = pi_now();
+	pi_cond_signal(&pv.work);
+	pi_mutex_unlock(&pv.lock);
+	if(old) frame_release(old);
+}
+
+void preview_shutdown(void)
+{
+	struct frame *old;
+
+	if(!pv.started) return;
+	pi_mutex_lock(&pv.lock);
+	old = pv.frame;
+	pv.frame = NULL;
+	pv.stopping = 1;
+	pi_cond_signal(&pv.work);
+	pi_mutex_unlock(&pv.lock);
+	if(old) frame_release(old);
+	pi_thread_join(pv.thread);
+	pv.started = 0;
+}
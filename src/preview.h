@@ -0,0 +1,60 @@
+#ifndef preview_h
+#define preview_h
+
+/*
+	Quick-look previews. Each frame the writer puts on disk is block
+	averaged down to about size pixels on its longer side, stretched
+	to 8 bits and written as a grayscale PNG next to the FITS file.
+	Previews are made on a thread of their own, off the writer's path,
+	and only the newest frame waiting is kept: a slow preview never
+	holds up acquisitions or files, it only skips frames.
+*/
+
+#include "sdk.h"
+#include "frame.h"
+#include "writer.h"
+
+#define PREVIEW_DEFAULT_SIZE 512
+
+enum preview_stretch {
+	STRETCH_ZSCALE,		/* linear between IRAF zscale limits */
+	STRETCH_ASINH,		/* asinh between the 0.5 and 99.5 percentiles */
+	NUM_STRETCH
+};
+
+struct preview_config {
+	int enabled;
+	int size;	/* longest side, pixels */
+	int stretch;
+};
+
+struct preview_status {
+	struct preview_config cfg;
+	long long made, skipped, failed;
+	char last[STR_BUF_SIZE];	/* the newest PNG written */
+	double last_latency;		/* from its FITS file being written, s */
+};
+
+/* Lua name ("zscale", "asinh") and back, -1 if unknown */
+const char *preview_stretch_name(int s);
+int preview_stretch_lookup(const char *name);
+
+/* Applies cfg, starting the thread the first time previews are
+enabled. Returns 0 on success */
+int preview_configure(const struct preview_config *cfg);
+
+void preview_get_status(struct preview_status *st);
+
+/* Queues a preview of the first ROI of frame for the FITS file at
+fits_path, replacing one still waiting. Nothing unless enabled */
+void preview_submit(struct frame *frame, const struct metadata *md, const char *fits_path);
+
+/* Makes a preview of width x height pixels on the calling thread,
+returns 0 on success, otherwise non-zero with a message in errmsg */
+int preview_write(const pi16u *pixels, piint width, piint height,
+	const struct preview_config *cfg, const char *png_path, char *errmsg);
+
+/* Drops the waiting preview and stops the thread */
+void preview_shutdown(void);
+
+#endif
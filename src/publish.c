@@ -0,0 +1,155 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Frames published to shared memory, see publish.h.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "platform.h"
+#include "trace.h"
+#include "publish.h"
+
+/* The ring, written by one acquisition at a time; everything guarded
+by lock */
+static struct {
+	int ready, open;
+	pi_mutex lock;
+	struct publish_config cfg;
+	struct shm_ring ring;
+	long long published, skipped;
+} pub;
+
+/* pub.cfg until the first publish_configure */
+static const struct publish_config default_cfg = {0, SHM_RING_DEFAULT_NAME, PUBLISH_DEFAULT_SLOTS,
+	PUBLISH_DEFAULT_FRAME_MB};
+
+
+static void close_ring(void)
+{
+	if(!pub.open) return;
+	shm_ring_close(&pub.ring);
+	pub.open = 0;
+}
+
+int publish_configure(const struct publish_config *cfg)
+{
+	int failed = 0;
+
+	if(cfg->slots < 1 || cfg->frame_mb <= 0 || cfg->name[0] != '/') return -1;
+	if(!pub.ready) {
+		pi_mutex_init(&pub.lock);
+		pub.ready = 1;
+	}
+
+	pi_mutex_lock(&pub.lock);
+	if(pub.open && (!cfg->enabled || cfg->slots != pub.cfg.slots
+		|| cfg->frame_mb != pub.cfg.frame_mb || strcmp(cfg->name, pub.cfg.name) != 0))
+		close_ring();
+	pub.cfg = *cfg;
+	if(cfg->enabled && !pub.open) {
+		failed = shm_ring_create(&pub.ring, cfg->name, cfg->slots,
+			(size_t) (cfg->frame_mb * 1048576.0));
+		pub.open = !failed;
+		if(failed) pub.cfg.enabled = 0;
+	}
+	pi_mutex_unlock(&pub.lock);
+	return failed;
+}
+
+void publish_get_status(struct publish_status *st)
+{
+	if(!pub.ready) {
+		memset(st, 0, sizeof(*st));
+		st->cfg = default_cfg;
+		return;
+	}
+	pi_mutex_lock(&pub.lock);
+	st->cfg = pub.cfg;
+	st->published = pub.published;
+	st->skipped = pub.skipped;
+	pi_mutex_unlock(&pub.lock);
+}
+
+/* The description of a frame in the ring, from md */
+static void describe(struct shm_frame *f, const struct metadata *md, size_t bytes)
+{
+	int k;
+
+	f->bytes = (long long) bytes;
+	f->width = md->width;
+	f->height = md->height;
+	f->nrois = md->nrois < SHM_RING_ROIS ? md->nrois : SHM_RING_ROIS;
+	for(k = 0; k < f->nrois; k++) {
+		f->rois[k].x = md->rois[k].x;
+		f->rois[k].y = md->rois[k].y;
+		f->rois[k].width = md->rois[k].width;
+		f->rois[k].height = md->rois[k].height;
+		f->rois[k].xbin = md->rois[k].xbin;
+		f->rois[k].ybin = md->rois[k].ybin;
+	}
+
+	f->exptime = md->exptime;
+	f->adcspeed = md->adcspeed;
+	f->temp = md->temp;
+	f->bitdepth = md->bitdepth;
+	f->gain = md->gain;
+	f->adc = md->adc;
+	f->model = md->id ? md->id->model : 0;
+	sprintf_s(f->serial_number, sizeof(f->serial_number), "%s", md->id ? md->id->serial_number : "");
+	sprintf_s(f->sensor_name, sizeof(f->sensor_name), "%s", md->id ? md->id->sensor_name : "");
+	sprintf_s(f->date_obs, sizeof(f->date_obs), "%s", md->date_obs);
+
+	f->stats_valid = md->stats.valid;
+	f->min = md->stats.min;
+	f->max = md->stats.max;
+	f->mean = md->stats.mean;
+	f->std = md->stats.std;
+	f->median = md->stats.median;
+	f->saturated = md->stats.saturated;
+	f->calibrated = md->calibrated;
+	f->ncombine = md->ncombine;
+}
+
+void publish_frame(struct frame *frame, const struct metadata *md, double readout)
+{
+	struct shm_frame *f;
+	size_t bytes = metadata_pixels(md) * sizeof(pi16u);
+	double span;
+
+	if(!pub.ready) return;
+	if(bytes > frame->bytes) bytes = frame->bytes;
+
+	pi_mutex_lock(&pub.lock);
+	if(!pub.open) {
+		pi_mutex_unlock(&pub.lock);
+		return;
+	}
+	if(bytes > shm_ring_capacity(&pub.ring)) {
+		pub.skipped++;
+		pi_mutex_unlock(&pub.lock);
+		return;
+	}
+
+	span = trace_begin();
+	f = shm_ring_begin(&pub.ring);
+	describe(f, md, bytes);
+	memcpy(shm_frame_pixels(&pub.ring, f), frame->pixels, bytes);
+	f->readout = readout;
+	f->published = pi_now();
+	shm_ring_publish(&pub.ring, f);
+	pub.published++;
+	trace_end("publish", span, pub.published);
+	pi_mutex_unlock(&pub.lock);
+}
+
+void publish_shutdown(void)
+{
+	if(!pub.ready) return;
+	pi_mutex_lock(&pub.lock);
+	close_ring();
+	pi_mutex_unlock(&pub.lock);
+}
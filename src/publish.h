@@ -0,0 +1,45 @@
+#ifndef publish_h
+#define publish_h
+
+/*
+	Publication of every acquired frame to a shared memory ring
+	(shmring.h) for reduction and quick-look processes on the same
+	machine, which then read it in place without touching the disk.
+	Frames are copied into the ring on the thread that reads them out,
+	before they are queued for writing; a ring nobody reads costs only
+	that copy. Frames larger than a slot are skipped.
+*/
+
+#include "sdk.h"
+#include "frame.h"
+#include "writer.h"
+#include "shmring.h"
+
+#define PUBLISH_DEFAULT_SLOTS 8
+#define PUBLISH_DEFAULT_FRAME_MB 16
+
+struct publish_config {
+	int enabled;
+	char name[256];		/* of the shared memory, starting with '/' */
+	int slots;
+	double frame_mb;	/* largest frame a slot holds */
+};
+
+struct publish_status {
+	struct publish_config cfg;
+	long long published, skipped;
+};
+
+/* Applies cfg, making a new ring if it changed. Returns 0 on success */
+int publish_configure(const struct publish_config *cfg);
+
+void publish_get_status(struct publish_status *st);
+
+/* Copies frame, described by md and read out at pi_now() readout, to
+the ring. Nothing unless enabled */
+void publish_frame(struct frame *frame, const struct metadata *md, double readout);
+
+/* Closes the ring, readers see it closed */
+void publish_shutdown(void);
+
+#endif
@@ -0,0 +1,463 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Raw frame container, see rawfile.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include "lz4.h"
+#endif
+#ifdef HAVE_ZSTD
+#include "zstd.h"
+#endif
+
+#include "platform.h"
+#include "parallel.h"
+#include "rawfile.h"
+
+static const char *codec_names[NUM_RAW_CODECS] = {"off", "lz4", "zstd"};
+
+/* The metadata as stored, every field metadata_keys writes */
+struct raw_metadata {
+	int width, height, nrois, bitdepth;
+	struct {
+		int x, y, width, height, xbin, ybin;
+	} rois[MAX_ROIS];
+	double exptime, adcspeed, temp;
+	int gain, adc, model, computer_interface;
+	char sensor_name[64], serial_number[64];
+	char date_obs[24];
+
+	int stats_valid, min, max, ncombine;
+	double mean, std, median, clipped_std;
+	long long saturated;
+	char combine[16];
+
+	int calibrated;
+	float pedestal;
+	char calbias[CAL_NAME_LEN], caldark[CAL_NAME_LEN], calflat[CAL_NAME_LEN];
+};
+
+/* At the start of a file, followed by nchunks raw_chunk and then the
+chunks themselves */
+struct raw_header {
+	char magic[8];
+	int version, codec;
+	int nchunks, chunk_rows;
+	long long npixels;
+	struct raw_metadata md;
+};
+
+struct raw_chunk {
+	long long bytes;	/* compressed */
+	long long pixels;
+};
+
+/* One frame's chunks being (de)compressed by parallel_for */
+struct chunk_job {
+	pi16u *pixels;
+	long long npixels, chunk_pixels;
+	int nchunks, codec;
+	size_t bound;		/* of a chunk slot in out */
+	unsigned char *data;	/* compressed chunks, in slots when writing */
+	struct raw_chunk *chunks;
+	long long *offsets;	/* of the chunks in data when reading */
+	int failed;
+};
+
+
+const char *raw_codec_name(int c)
+{
+	return codec_names[c];
+}
+
+int raw_codec_lookup(const char *name)
+{
+	int c;
+
+	for(c = 0; c < NUM_RAW_CODECS; c++)
+		if(strcmp(codec_names[c], name) == 0) return c;
+	return -1;
+}
+
+int raw_codec_available(int c)
+{
+	switch(c) {
+	case RAW_OFF:
+		return 1;
+#ifdef HAVE_LZ4
+	case RAW_LZ4:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case RAW_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+static size_t codec_bound(int codec, size_t bytes)
+{
+	(void) bytes;
+	switch(codec) {
+#ifdef HAVE_LZ4
+	case RAW_LZ4:
+		return (size_t) LZ4_compressBound((int) bytes);
+#endif
+#ifdef HAVE_ZSTD
+	case RAW_ZSTD:
+		return ZSTD_compressBound(bytes);
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* Returns the compressed size, 0 on failure */
+static size_t codec_compress(int codec, const unsigned char *in, size_t n,
+	unsigned char *out, size_t outsize)
+{
+	size_t size = 0;
+
+	(void) in; (void) n; (void) out; (void) outsize;
+	switch(codec) {
+#ifdef HAVE_LZ4
+	case RAW_LZ4:
+		size = (size_t) LZ4_compress_default((const char *) in, (char *) out, (int) n, (int) outsize);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case RAW_ZSTD:
+		size = ZSTD_compress(out, outsize, in, n, RAW_ZSTD_LEVEL);
+		if(ZSTD_isError(size)) size = 0;
+		break;
+#endif
+	}
+	return size;
+}
+
+/* Returns 0 if in decompressed to exactly n bytes */
+static int codec_decompress(int codec, const unsigned char *in, size_t size,
+	unsigned char *out, size_t n)
+{
+	size_t got = 0;
+
+	(void) in; (void) size; (void) out;
+	switch(codec) {
+#ifdef HAVE_LZ4
+	case RAW_LZ4:
+		got = (size_t) LZ4_decompress_safe((const char *) in, (char *) out, (int) size, (int) n);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case RAW_ZSTD:
+		got = ZSTD_decompress(out, n, in, size);
+		if(ZSTD_isError(got)) got = 0;
+		break;
+#endif
+	}
+	return got == n ? 0 : -1;
+}
+
+/* parallel_fn, shuffles and compresses chunk index into its slot */
+static void compress_one_chunk(void *ctx, int index)
+{
+	struct chunk_job *cj = ctx;
+	const pi16u *p = cj->pixels + index * cj->chunk_pixels;
+	long long i, n = cj->npixels - index * cj->chunk_pixels;
+	unsigned char *shuffled;
+
+	if(n > cj->chunk_pixels) n = cj->chunk_pixels;
+	cj->chunks[index].pixels = n;
+	cj->chunks[index].bytes = 0;
+	shuffled = malloc(2 * (size_t) n);
+	if(!shuffled) return;
+	for(i = 0; i < n; i++) {
+		shuffled[i] = (unsigned char) p[i];
+		shuffled[n + i] = (unsigned char) (p[i] >> 8);
+	}
+	cj->chunks[index].bytes = (long long) codec_compress(cj->codec, shuffled, 2 * (size_t) n,
+		cj->data + index * cj->bound, cj->bound);
+	free(shuffled);
+}
+
+/* parallel_fn, decompresses and unshuffles chunk index */
+static void decompress_one_chunk(void *ctx, int index)
+{
+	struct chunk_job *cj = ctx;
+	pi16u *p = cj->pixels + index * cj->chunk_pixels;
+	long long i, n = cj->chunks[index].pixels;
+	unsigned char *shuffled;
+
+	shuffled = malloc(2 * (size_t) n);
+	if(!shuffled || codec_decompress(cj->codec, cj->data + cj->offsets[index],
+		(size_t) cj->chunks[index].bytes, shuffled, 2 * (size_t) n)) {
+		free(shuffled);
+		cj->failed = 1;
+		return;
+	}
+	for(i = 0; i < n; i++)
+		p[i] = (pi16u) (shuffled[i] | shuffled[n + i] << 8);
+	free(shuffled);
+}
+
+static void store_metadata(struct raw_metadata *r, const struct metadata *md)
+{
+	int k;
+
+	memset(r, 0, sizeof(*r));
+	r->width = md->width;
+	r->height = md->height;
+	r->nrois = md->nrois;
+	for(k = 0; k < md->nrois && k < MAX_ROIS; k++) {
+		r->rois[k].x = md->rois[k].x;
+		r->rois[k].y = md->rois[k].y;
+		r->rois[k].width = md->rois[k].width;
+		r->rois[k].height = md->rois[k].height;
+		r->rois[k].xbin = md->rois[k].xbin;
+		r->rois[k].ybin = md->rois[k].ybin;
+	}
+	r->exptime = md->exptime;
+	r->adcspeed = md->adcspeed;
+	r->temp = md->temp;
+	r->bitdepth = md->bitdepth;
+	r->gain = md->gain;
+	r->adc = md->adc;
+	r->model = md->id->model;
+	r->computer_interface = md->id->computer_interface;
+	sprintf_s(r->sensor_name, sizeof(r->sensor_name), "%s", md->id->sensor_name);
+	sprintf_s(r->serial_number, sizeof(r->serial_number), "%s", md->id->serial_number);
+	sprintf_s(r->date_obs, sizeof(r->date_obs), "%s", md->date_obs);
+
+	r->stats_valid = md->stats.valid;
+	r->min = md->stats.min;
+	r->max = md->stats.max;
+	r->mean = md->stats.mean;
+	r->std = md->stats.std;
+	r->median = md->stats.median;
+	r->clipped_std = md->stats.clipped_std;
+	r->saturated = md->stats.saturated;
+	r->ncombine = md->ncombine;
+	sprintf_s(r->combine, sizeof(r->combine), "%s", md->combine ? md->combine : "");
+
+	r->calibrated = md->calibrated;
+	r->pedestal = md->pedestal;
+	sprintf_s(r->calbias, sizeof(r->calbias), "%s", md->calbias);
+	sprintf_s(r->caldark, sizeof(r->caldark), "%s", md->caldark);
+	sprintf_s(r->calflat, sizeof(r->calflat), "%s", md->calflat);
+}
+
+static void load_metadata(struct raw_frame *rf, const struct raw_metadata *r)
+{
+	struct metadata *md = &rf->md;
+	int k;
+
+	memset(md, 0, sizeof(*md));
+	memset(&rf->id, 0, sizeof(rf->id));
+	md->width = r->width;
+	md->height = r->height;
+	md->nrois = r->nrois;
+	for(k = 0; k < r->nrois; k++) {
+		md->rois[k].x = r->rois[k].x;
+		md->rois[k].y = r->rois[k].y;
+		md->rois[k].width = r->rois[k].width;
+		md->rois[k].height = r->rois[k].height;
+		md->rois[k].xbin = r->rois[k].xbin;
+		md->rois[k].ybin = r->rois[k].ybin;
+	}
+	md->exptime = r->exptime;
+	md->adcspeed = r->adcspeed;
+	md->temp = r->temp;
+	md->bitdepth = r->bitdepth;
+	md->gain = r->gain;
+	md->adc = r->adc;
+	rf->id.model = (PicamModel) r->model;
+	rf->id.computer_interface = (PicamComputerInterface) r->computer_interface;
+	sprintf_s(rf->id.sensor_name, sizeof(rf->id.sensor_name), "%.63s", r->sensor_name);
+	sprintf_s(rf->id.serial_number, sizeof(rf->id.serial_number), "%.63s", r->serial_number);
+	md->id = &rf->id;
+	sprintf_s(md->date_obs, sizeof(md->date_obs), "%.23s", r->date_obs);
+
+	md->stats.valid = r->stats_valid;
+	md->stats.min = r->min;
+	md->stats.max = r->max;
+	md->stats.mean = r->mean;
+	md->stats.std = r->std;
+	md->stats.median = r->median;
+	md->stats.clipped_std = r->clipped_std;
+	md->stats.saturated = r->saturated;
+	md->ncombine = r->ncombine;
+	sprintf_s(rf->combine, sizeof(rf->combine), "%.15s", r->combine);
+	md->combine = md->ncombine > 0 ? rf->combine : NULL;
+
+	md->calibrated = r->calibrated;
+	md->pedestal = r->pedestal;
+	sprintf_s(md->calbias, sizeof(md->calbias), "%.*s", CAL_NAME_LEN - 1, r->calbias);
+	sprintf_s(md->caldark, sizeof(md->caldark), "%.*s", CAL_NAME_LEN - 1, r->caldark);
+	sprintf_s(md->calflat, sizeof(md->calflat), "%.*s", CAL_NAME_LEN - 1, r->calflat);
+}
+
+int raw_write(const char *path, const pi16u *pixels, const struct metadata *md,
+	int codec, char *errmsg)
+{
+	struct raw_header header;
+	struct chunk_job cj;
+	FILE *f;
+	int k, failed = 0;
+
+	if(codec <= RAW_OFF || codec >= NUM_RAW_CODECS || !raw_codec_available(codec)) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "No raw codec %d in this build\n", codec);
+		return -1;
+	}
+
+	memset(&cj, 0, sizeof(cj));
+	cj.pixels = (pi16u *) pixels;
+	cj.npixels = (long long) metadata_pixels(md);
+	cj.chunk_pixels = (long long) RAW_CHUNK_ROWS * (md->width > 0 ? md->width : 1);
+	cj.nchunks = (int) ((cj.npixels + cj.chunk_pixels - 1) / cj.chunk_pixels);
+	cj.codec = codec;
+	cj.bound = codec_bound(codec, 2 * (size_t) cj.chunk_pixels);
+	cj.data = malloc(cj.nchunks * cj.bound);
+	cj.chunks = malloc(cj.nchunks * sizeof(struct raw_chunk));
+	if(!cj.data || !cj.chunks) {
+		free(cj.data);
+		free(cj.chunks);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory compressing frame\n");
+		return -1;
+	}
+
+	parallel_for(cj.nchunks, compress_one_chunk, &cj);
+
+	for(k = 0; k < cj.nchunks; k++) {
+		if(cj.chunks[k].bytes == 0) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Could not compress chunk %d\n", k + 1);
+			free(cj.data);
+			free(cj.chunks);
+			return -1;
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RAW_MAGIC, sizeof(header.magic));
+	header.version = RAW_VERSION;
+	header.codec = codec;
+	header.nchunks = cj.nchunks;
+	header.chunk_rows = RAW_CHUNK_ROWS;
+	header.npixels = cj.npixels;
+	store_metadata(&header.md, md);
+
+	f = fopen(path, "wb");
+	if(!f) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not create raw file %s\n", path);
+		free(cj.data);
+		free(cj.chunks);
+		return -1;
+	}
+	if(fwrite(&header, sizeof(header), 1, f) != 1
+		|| fwrite(cj.chunks, sizeof(struct raw_chunk), cj.nchunks, f) != (size_t) cj.nchunks)
+		failed = 1;
+	for(k = 0; k < cj.nchunks && !failed; k++)
+		if(fwrite(cj.data + k * cj.bound, 1, (size_t) cj.chunks[k].bytes, f) != (size_t) cj.chunks[k].bytes)
+			failed = 1;
+	if(fclose(f) != 0) failed = 1;
+	free(cj.data);
+	free(cj.chunks);
+	if(failed) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not write raw file %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Fails raw_read with a message */
+static int read_failed(FILE *f, struct chunk_job *cj, char *errmsg, const char *why, const char *path)
+{
+	if(f) fclose(f);
+	free(cj->data);
+	free(cj->chunks);
+	free(cj->offsets);
+	free(cj->pixels);
+	sprintf_s(errmsg, STR_BUF_SIZE, "%s: %s\n", path, why);
+	return -1;
+}
+
+int raw_read(const char *path, struct raw_frame *rf, char *errmsg)
+{
+	struct raw_header header;
+	struct chunk_job cj;
+	long long total = 0, pixels = 0;
+	FILE *f;
+	int k;
+
+	memset(&cj, 0, sizeof(cj));
+	rf->pixels = NULL;
+	f = fopen(path, "rb");
+	if(!f) return read_failed(NULL, &cj, errmsg, "could not open", path);
+	if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, RAW_MAGIC, sizeof(header.magic)) != 0)
+		return read_failed(f, &cj, errmsg, "not a raw frame file", path);
+	if(header.version != RAW_VERSION)
+		return read_failed(f, &cj, errmsg, "raw file of another version", path);
+	if(header.codec <= RAW_OFF || header.codec >= NUM_RAW_CODECS || !raw_codec_available(header.codec))
+		return read_failed(f, &cj, errmsg, "compressed with a codec this build does not have", path);
+	if(header.nchunks < 1 || header.md.nrois < 0 || header.md.nrois > MAX_ROIS)
+		return read_failed(f, &cj, errmsg, "corrupt header", path);
+
+	load_metadata(rf, &header.md);
+	rf->codec = header.codec;
+	cj.codec = header.codec;
+	cj.nchunks = header.nchunks;
+	cj.npixels = header.npixels;
+	cj.chunk_pixels = (long long) header.chunk_rows * (header.md.width > 0 ? header.md.width : 1);
+	if(cj.npixels != (long long) metadata_pixels(&rf->md))
+		return read_failed(f, &cj, errmsg, "pixel count does not match its metadata", path);
+
+	cj.chunks = malloc(cj.nchunks * sizeof(struct raw_chunk));
+	cj.offsets = malloc(cj.nchunks * sizeof(long long));
+	if(!cj.chunks || !cj.offsets)
+		return read_failed(f, &cj, errmsg, "out of memory", path);
+	if(fread(cj.chunks, sizeof(struct raw_chunk), cj.nchunks, f) != (size_t) cj.nchunks)
+		return read_failed(f, &cj, errmsg, "truncated chunk table", path);
+	for(k = 0; k < cj.nchunks; k++) {
+		if(cj.chunks[k].bytes <= 0 || cj.chunks[k].pixels <= 0
+			|| cj.chunks[k].pixels > cj.chunk_pixels
+			|| (k < cj.nchunks - 1 && cj.chunks[k].pixels != cj.chunk_pixels))
+			return read_failed(f, &cj, errmsg, "corrupt chunk table", path);
+		cj.offsets[k] = total;
+		total += cj.chunks[k].bytes;
+		pixels += cj.chunks[k].pixels;
+	}
+	if(pixels != cj.npixels)
+		return read_failed(f, &cj, errmsg, "chunks do not add up to the frame", path);
+
+	cj.data = malloc((size_t) total);
+	cj.pixels = malloc((size_t) cj.npixels * sizeof(pi16u));
+	if(!cj.data || !cj.pixels)
+		return read_failed(f, &cj, errmsg, "out of memory", path);
+	if(fread(cj.data, 1, (size_t) total, f) != (size_t) total)
+		return read_failed(f, &cj, errmsg, "truncated", path);
+	fclose(f);
+
+	parallel_for(cj.nchunks, decompress_one_chunk, &cj);
+	if(cj.failed)
+		return read_failed(NULL, &cj, errmsg, "corrupt chunk", path);
+
+	free(cj.data);
+	free(cj.chunks);
+	free(cj.offsets);
+	rf->pixels = cj.pixels;
+	return 0;
+}
+
+void raw_free(struct raw_frame *rf)
+{
+	free(rf->pixels);
+	rf->pixels = NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef rawfile_h
+#define rawfile_h
+
+/*
+	Raw frame container, for capturing faster than tile-compressed
+	FITS can be written and converting to FITS later (see
+	tools/raw2fits.c). A file holds one frame: a header with the
+	frame's metadata, a table of chunks, then the chunks. Each chunk
+	is RAW_CHUNK_ROWS rows of the frame (the last one shorter), its
+	bytes shuffled (every low byte, then every high byte) and
+	compressed on the parallel pool (parallel.h) with LZ4 or Zstd.
+
+	Everything is stored little endian with the layout of the x86 and
+	x64 compilers the bridge is built with. LZ4 and Zstd are only
+	there if the build defines HAVE_LZ4 and HAVE_ZSTD.
+*/
+
+#include <stddef.h>
+
+#include "sdk.h"
+#include "writer.h"
+
+#define RAW_MAGIC "PICAMRAW"
+#define RAW_VERSION 1
+#define RAW_EXTENSION ".praw"	/* after .fits, as .fz */
+#define RAW_CHUNK_ROWS 64
+#define RAW_ZSTD_LEVEL 1
+
+enum raw_codec {
+	RAW_OFF,	/* FITS files */
+	RAW_LZ4,
+	RAW_ZSTD,
+	NUM_RAW_CODECS
+};
+
+/* Lua name ("off", "lz4", "zstd") and back, -1 if unknown */
+const char *raw_codec_name(int c);
+int raw_codec_lookup(const char *name);
+
+/* 1 if the build has the codec */
+int raw_codec_available(int c);
+
+/* Writes the frame in pixels, described by md, to a new file at path.
+Returns 0 on success, otherwise non-zero with a message in errmsg */
+int raw_write(const char *path, const pi16u *pixels, const struct metadata *md,
+	int codec, char *errmsg);
+
+/* A frame read back, md pointing into the rest of it */
+struct raw_frame {
+	struct metadata md;
+	PicamCameraID id;
+	char combine[16];
+	pi16u *pixels;
+	int codec;
+};
+
+/* Reads the file at path into rf, to be freed with raw_free. Returns 0
+on success, otherwise non-zero with a message in errmsg */
+int raw_read(const char *path, struct raw_frame *rf, char *errmsg);
+void raw_free(struct raw_frame *rf);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef sdk_h
+#define sdk_h
+
+/*
+	Camera backend selection.
+
+	By default the bridge is built against the Princeton Instruments
+	PICam SDK. Defining PICAM_SIM swaps in the simulated camera in
+	simcam.c, which implements the same subset of the Picam_* and
+	PicamAdvanced_* API without any hardware.
+*/
+
+#ifdef PICAM_SIM
+#include "simcam.h"
+#else
+#include "picam.h"
+#include "picam_advanced.h"
+#include "pil_platform.h"
+#endif
+
+#endif
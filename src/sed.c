@@ -390,8 +390,29 @@ int main (int argc, char **argv) {
   lua_register(L, "pi_start", picam_start);
   lua_register(L, "pi_list", picam_list);
   lua_register(L, "pi_acquire", picam_acquire);
+  lua_register(L, "pi_acquire_async", picam_acquire_async);
+  lua_register(L, "pi_trigger", picam_trigger);
+  lua_register(L, "pi_wait_all", picam_wait_all);
+  lua_register(L, "pi_wait_any", picam_wait_any);
+  lua_register(L, "pi_stats", picam_stats);
+  lua_register(L, "pi_telemetry", picam_telemetry);
+  lua_register(L, "pi_wait_temperature", picam_wait_temperature);
+  lua_register(L, "pi_trace", picam_trace);
+  lua_register(L, "pi_preview", picam_preview);
+  lua_register(L, "pi_publish", picam_publish);
+  lua_register(L, "pi_buffers", picam_buffers);
   lua_register(L, "pi_set", picam_set);
+  lua_register(L, "pi_configure", picam_configure);
+  lua_register(L, "pi_roi", picam_roi);
   lua_register(L, "pi_open", picam_open);
+  lua_register(L, "pi_writer", picam_writer);
+  lua_register(L, "pi_writer_status", picam_writer_status);
+  lua_register(L, "pi_flush", picam_flush);
+  lua_register(L, "pi_stack", picam_stack);
+  lua_register(L, "pi_calibrate", picam_calibrate);
+#ifdef PICAM_SIM
+  lua_register(L, "pi_simulate", picam_simulate);
+#endif
 
 
   s.argc = argc;
@@ -399,6 +420,7 @@ int main (int argc, char **argv) {
   status = lua_cpcall(L, &pmain, &s);
   report(L, status);
   lua_close(L);
+  picam_shutdown();
   return (status || s.status) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
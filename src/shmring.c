@@ -0,0 +1,150 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Shared memory ring of frames, see shmring.h.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "shmring.h"
+
+static size_t align_up(size_t bytes)
+{
+	return (bytes + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN;
+}
+
+static struct shm_frame *slot_of(const struct shm_ring *ring, long long sequence)
+{
+	struct shm_ring_header *h = ring->header;
+	size_t slot = (size_t) ((sequence - 1) % h->slots);
+
+	return (struct shm_frame *) ((char *) h + align_up(sizeof(*h)) + slot * h->slot_bytes);
+}
+
+int shm_ring_create(struct shm_ring *ring, const char *name, int slots, size_t frame_bytes)
+{
+	size_t pixel_offset = align_up(sizeof(struct shm_frame));
+	size_t slot_bytes = pixel_offset + align_up(frame_bytes);
+	struct shm_ring_header *h;
+
+	if(slots < 1 || frame_bytes == 0) return -1;
+	if(pi_shm_create(&ring->shm, name, align_up(sizeof(*h)) + slots * slot_bytes))
+		return -1;
+	sprintf_s(ring->name, sizeof(ring->name), "%s", name);
+	ring->writer = 1;
+	h = ring->header = ring->shm.memory;
+	h->version = SHM_RING_VERSION;
+	h->slots = slots;
+	h->slot_bytes = (long long) slot_bytes;
+	h->pixel_offset = (long long) pixel_offset;
+	h->head = 0;
+
+	/* Readers check the magic last */
+	pi_memory_barrier();
+	h->magic = SHM_RING_MAGIC;
+	return 0;
+}
+
+struct shm_frame *shm_ring_begin(struct shm_ring *ring)
+{
+	struct shm_frame *f = slot_of(ring, ring->header->head + 1);
+
+	f->sequence = 0;
+	pi_memory_barrier();
+	return f;
+}
+
+void shm_ring_publish(struct shm_ring *ring, struct shm_frame *frame)
+{
+	long long sequence = ring->header->head + 1;
+
+	pi_memory_barrier();
+	frame->sequence = sequence;
+	pi_memory_barrier();
+	ring->header->head = sequence;
+}
+
+size_t shm_ring_capacity(const struct shm_ring *ring)
+{
+	return (size_t) (ring->header->slot_bytes - ring->header->pixel_offset);
+}
+
+int shm_ring_attach(struct shm_ring *ring, const char *name)
+{
+	struct shm_ring_header *h;
+
+	if(pi_shm_open(&ring->shm, name)) return -1;
+	sprintf_s(ring->name, sizeof(ring->name), "%s", name);
+	ring->writer = 0;
+	h = ring->header = ring->shm.memory;
+	if(ring->shm.bytes < sizeof(*h) || h->magic != SHM_RING_MAGIC
+		|| h->version != SHM_RING_VERSION) {
+		pi_shm_close(&ring->shm);
+		return -2;
+	}
+	pi_memory_barrier();
+	return 0;
+}
+
+const struct shm_frame *shm_ring_wait(struct shm_ring *ring, long long *next,
+	long long *lost, double timeout)
+{
+	struct shm_ring_header *h = ring->header;
+	const struct shm_frame *f;
+	double deadline = pi_now() + timeout;
+	long long head;
+
+	for(;;) {
+		head = h->head;
+		pi_memory_barrier();
+		if(head >= *next) {
+			/* Lapped: everything older than a ring ago is gone */
+			if(head - *next >= h->slots) {
+				*lost += head - h->slots + 1 - *next;
+				*next = head - h->slots + 1;
+			}
+			f = slot_of(ring, *next);
+			if(f->sequence == *next) {
+				pi_memory_barrier();
+				return f;
+			}
+			/* Overwritten since head was read */
+			(*lost)++;
+			(*next)++;
+			continue;
+		}
+		if(h->closed) return NULL;
+		if(timeout >= 0 && pi_now() >= deadline) return NULL;
+		pi_sleep(SHM_RING_POLL);
+	}
+}
+
+int shm_ring_valid(const struct shm_frame *frame, long long sequence)
+{
+	pi_memory_barrier();
+	return frame->sequence == sequence;
+}
+
+long long shm_ring_head(const struct shm_ring *ring)
+{
+	return ring->header->head;
+}
+
+unsigned short *shm_frame_pixels(const struct shm_ring *ring, const struct shm_frame *frame)
+{
+	return (unsigned short *) ((char *) frame + ring->header->pixel_offset);
+}
+
+void shm_ring_close(struct shm_ring *ring)
+{
+	if(ring->writer) {
+		ring->header->closed = 1;
+		pi_memory_barrier();
+	}
+	pi_shm_close(&ring->shm);
+	if(ring->writer) pi_shm_remove(ring->name);
+	ring->header = NULL;
+}
@@ -0,0 +1,111 @@
+#ifndef shmring_h
+#define shmring_h
+
+/*
+	Frames in shared memory for other processes on the same machine,
+	the layout and both ends of it; publish.h is the bridge's side.
+	The memory is a header followed by a ring of slots, each a frame's
+	description and then its pixels. There is one writer and any
+	number of readers; nobody takes a lock and readers never write:
+
+	- the writer zeroes a slot's sequence, fills the slot, sets its
+	  sequence to the frame's number (from 1) and then head to it;
+	- a reader waits for head to reach the frame it wants, uses the
+	  pixels where they are and checks the sequence again afterwards:
+	  if it changed, the writer lapped the reader and the frame is lost.
+
+	The file only depends on platform.h so that consumers can be built
+	without the SDK, from the same architecture as the bridge.
+*/
+
+#include <stddef.h>
+
+#include "platform.h"
+
+#define SHM_RING_MAGIC 0x50494652	/* "PIFR" */
+#define SHM_RING_VERSION 1
+#define SHM_RING_DEFAULT_NAME "/picam_frames"
+#define SHM_RING_ROIS 8
+#define SHM_RING_ALIGN 4096	/* of slots and the pixels in them */
+#define SHM_RING_POLL 0.0001	/* readers look for a new frame this often, s */
+
+struct shm_ring_header {
+	int magic, version;
+	int slots;
+	volatile int closed;		/* the writer is gone */
+	long long slot_bytes;		/* description, pixels and padding */
+	long long pixel_offset;		/* of the pixels in a slot */
+	volatile long long head;	/* newest frame, 0 before the first */
+};
+
+struct shm_ring_roi {
+	int x, y, width, height;
+	int xbin, ybin;
+};
+
+/* A frame as described in writer.h, at the start of its slot. Times
+are pi_now(), which every process on the machine shares */
+struct shm_frame {
+	volatile long long sequence;	/* 0 while being written */
+	double readout, published;	/* when read out, when in the ring */
+	long long bytes;		/* of 16 bit unsigned pixels */
+	int width, height;		/* of the first ROI */
+	int nrois;			/* 0: one width x height image */
+	struct shm_ring_roi rois[SHM_RING_ROIS];
+
+	double exptime, adcspeed, temp;
+	int bitdepth, gain, adc, model;
+	char serial_number[64], sensor_name[64];
+	char date_obs[24];
+
+	int stats_valid, min, max;
+	double mean, std, median;
+	long long saturated;
+	int calibrated, ncombine;
+};
+
+struct shm_ring {
+	struct pi_shm shm;
+	struct shm_ring_header *header;
+	char name[256];
+	int writer;
+};
+
+/* Writer: a ring of slots for frames of up to frame_bytes under name,
+replacing one of that name. Returns 0 on success */
+int shm_ring_create(struct shm_ring *ring, const char *name, int slots, size_t frame_bytes);
+
+/* The slot for the next frame, no longer valid for readers, to fill in
+and hand to shm_ring_publish. Pixels go to shm_frame_pixels */
+struct shm_frame *shm_ring_begin(struct shm_ring *ring);
+void shm_ring_publish(struct shm_ring *ring, struct shm_frame *frame);
+
+/* Largest frame a slot holds, bytes */
+size_t shm_ring_capacity(const struct shm_ring *ring);
+
+
+/* Reader: maps the ring called name, returns 0 on success, -1 if there
+is none and -2 if it is not one of this version */
+int shm_ring_attach(struct shm_ring *ring, const char *name);
+
+/*
+	Waits at most timeout seconds (< 0 forever) for frame *next,
+	returning it in place; NULL on timeout or once the writer has
+	gone. If the writer lapped the reader, *next moves on to the
+	oldest frame left and *lost counts the ones skipped.
+*/
+const struct shm_frame *shm_ring_wait(struct shm_ring *ring, long long *next,
+	long long *lost, double timeout);
+
+/* 1 if frame still holds sequence, whatever was read from it since
+shm_ring_wait is then valid */
+int shm_ring_valid(const struct shm_frame *frame, long long sequence);
+
+/* Both ends: the newest frame published, and the pixels of a frame */
+long long shm_ring_head(const struct shm_ring *ring);
+unsigned short *shm_frame_pixels(const struct shm_ring *ring, const struct shm_frame *frame);
+
+/* Unmaps the ring. The writer marks it closed and removes the name */
+void shm_ring_close(struct shm_ring *ring);
+
+#endif
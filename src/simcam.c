@@ -0,0 +1,1048 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Simulated PICam backend, see simcam.h. Behaves like a PIXIS
+	2048B: parameters are staged with Picam_Set* and only take
+	effect on Picam_CommitParameters, and Picam_Acquire blocks for
+	the exposure plus the readout time of the committed ADC speed
+	before handing back a buffer that stays valid until the next
+	acquisition, its own or one set with
+	PicamAdvanced_SetAcquisitionBuffer. A readout holds the
+	committed ROIs one after the other, binned, and takes time in
+	proportion to its pixels. Picam_StartAcquisition runs the same
+	sequence on a background thread and hands readouts out through
+	Picam_WaitForAcquisitionUpdate.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "platform.h"
+#include "simcam.h"
+
+#define SIMCAM_MAX_CAMERAS 8
+#define NUM_GAUSS 4096
+#define DEFAULT_BUFFER_READOUTS 8
+
+/* Parameters the simulated camera knows about */
+struct sim_param {
+	PicamParameter parameter;
+	int read_only;
+};
+
+static const struct sim_param parameters[] = {
+	{PicamParameter_ExposureTime, 0},
+	{PicamParameter_AdcSpeed, 0},
+	{PicamParameter_AdcBitDepth, 0},
+	{PicamParameter_AdcAnalogGain, 0},
+	{PicamParameter_AdcQuality, 0},
+	{PicamParameter_SensorTemperatureSetPoint, 0},
+	{PicamParameter_ReadoutCount, 0},
+	{PicamParameter_SensorTemperatureReading, 1},
+	{PicamParameter_SensorTemperatureStatus, 1},
+	{PicamParameter_ReadoutTimeCalculation, 1},
+	{PicamParameter_FrameSize, 1},
+	{PicamParameter_ReadoutStride, 1},
+	{PicamParameter_SensorActiveWidth, 1},
+	{PicamParameter_SensorActiveHeight, 1}
+};
+
+#define NUM_PARAMS ((int) (sizeof(parameters) / sizeof(parameters[0])))
+
+struct simcam {
+	int open;
+	PicamCameraID id;
+	piint width, height;
+
+	/* Values as set by Picam_Set*, and as last committed */
+	piflt staged[NUM_PARAMS];
+	piflt committed[NUM_PARAMS];
+
+	/* Value changed callbacks, per parameter */
+	PicamIntegerValueChangedCallback integer_changed[NUM_PARAMS];
+	PicamFloatingPointValueChangedCallback float_changed[NUM_PARAMS];
+
+	/* PicamParameter_Rois, staged and committed like the rest */
+	PicamRoi staged_rois[SIMCAM_MAX_ROIS], committed_rois[SIMCAM_MAX_ROIS];
+	piint staged_nrois, committed_nrois;
+	PicamRoisValueChangedCallback rois_changed;
+
+	/* Internal readout buffer, valid until the next acquisition. Its
+	size is in pixels as the ROIs set the size of a readout */
+	pi16u *buffer;
+	pi64s buffer_pixels;
+
+	/* Buffer set with PicamAdvanced_SetAcquisitionBuffer, if any */
+	void *user_buffer;
+	pi64s user_size;
+
+	/* Asynchronous acquisition. The ring holds ring_frames readouts:
+	the thread fills write_index, readouts handed out by
+	Picam_WaitForAcquisitionUpdate stay in_use until the next call.
+	Everything below is guarded by lock. */
+	pi16u *ring;
+	pi64s ring_frames;
+	pi_mutex lock;
+	pi_cond update;
+	pi_thread thread;
+	int thread_active, running, stop;
+	pi64s readout_target, produced;
+	pi64s write_index, read_index, pending, in_use;
+	PicamAcquisitionErrorsMask errors;
+	piflt started;
+
+	/* Frames are only generated on the acquisition thread, the
+	temperature reading has its own generator */
+	unsigned long long rng, temp_rng;
+
+	/* The sensor as of pi_now() sensor_time, guarded by lock */
+	piflt sensor_temp;
+	double sensor_time;
+};
+
+static int initialized = 0;
+static struct simcam cameras[SIMCAM_MAX_CAMERAS];
+static float gauss[NUM_GAUSS];
+
+static struct simcam_config config = {
+	1,			/* cameras */
+	2048, 2048,		/* width, height */
+	1000.0,			/* bias */
+	4.0,			/* read_noise */
+	0.001,			/* dark_current */
+	0.0,			/* signal */
+	-70.0,			/* temperature */
+	0.5,			/* cooling_rate */
+	2,			/* num_speeds */
+	{0.1, 2.0},		/* adc_speeds */
+	{0.0, 0.0},		/* readout_s */
+	1.0			/* time_scale */
+};
+
+
+static unsigned long long next_random(unsigned long long *state)
+{
+	/* xorshift64* */
+	unsigned long long x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ULL;
+}
+
+static void fill_gauss_table(void)
+{
+	unsigned long long state = 0x5eed5eed5eedULL;
+	double u1, u2, r;
+	int i;
+
+	for(i = 0; i < NUM_GAUSS; i += 2) {
+		u1 = ((next_random(&state) >> 11) + 1.0) / 9007199254740993.0;
+		u2 = (next_random(&state) >> 11) / 9007199254740992.0;
+		r = sqrt(-2.0 * log(u1));
+		gauss[i] = (float) (r * cos(6.283185307179586 * u2));
+		gauss[i+1] = (float) (r * sin(6.283185307179586 * u2));
+	}
+}
+
+static struct simcam *lookup(PicamHandle handle)
+{
+	size_t index = (size_t) handle;
+
+	if(index < 1 || index > SIMCAM_MAX_CAMERAS) return NULL;
+	if(!cameras[index-1].open) return NULL;
+	return &cameras[index-1];
+}
+
+static int param_index(PicamParameter parameter)
+{
+	int i;
+
+	for(i = 0; i < NUM_PARAMS; i++)
+		if(parameters[i].parameter == parameter) return i;
+	return -1;
+}
+
+static piflt get_committed(struct simcam *cam, PicamParameter parameter)
+{
+	return cam->committed[param_index(parameter)];
+}
+
+/* Pixels in one readout of the committed ROIs, after binning */
+static pi64s readout_pixels(struct simcam *cam)
+{
+	pi64s n = 0;
+	int i;
+
+	for(i = 0; i < cam->committed_nrois; i++)
+		n += (pi64s) (cam->committed_rois[i].width / cam->committed_rois[i].x_binning) *
+			(cam->committed_rois[i].height / cam->committed_rois[i].y_binning);
+	return n;
+}
+
+static piflt readout_time(struct simcam *cam, piflt adc_speed)
+{
+	piflt npix = (piflt) readout_pixels(cam);
+	int i;
+
+	for(i = 0; i < config.num_speeds; i++) {
+		if(fabs(config.adc_speeds[i] - adc_speed) < 1e-9 && config.readout_s[i] > 0)
+			return config.readout_s[i] * npix / ((piflt) cam->width * cam->height);
+	}
+	return npix / (adc_speed * 1e6);
+}
+
+/* Moves the sensor towards the committed set point for the time since
+it was last looked at, call with cam->lock held */
+static piflt sensor_temperature(struct simcam *cam)
+{
+	piflt target = get_committed(cam, PicamParameter_SensorTemperatureSetPoint), step;
+	double now = pi_now();
+
+	if(config.cooling_rate <= 0 || config.time_scale <= 0) {
+		cam->sensor_temp = target;
+	} else {
+		step = config.cooling_rate * (now - cam->sensor_time) / config.time_scale;
+		if(fabs(target - cam->sensor_temp) <= step)
+			cam->sensor_temp = target;
+		else
+			cam->sensor_temp += target > cam->sensor_temp ? step : -step;
+	}
+	cam->sensor_time = now;
+	return cam->sensor_temp;
+}
+
+/* Value of a read-only parameter, computed from the committed state */
+static piflt read_only_value(struct simcam *cam, PicamParameter parameter)
+{
+	piflt value;
+
+	switch(parameter) {
+	case PicamParameter_SensorTemperatureReading:
+		/* Read from any thread, the generator is guarded by lock */
+		pi_mutex_lock(&cam->lock);
+		value = sensor_temperature(cam) + 0.01 * gauss[next_random(&cam->temp_rng) % NUM_GAUSS];
+		pi_mutex_unlock(&cam->lock);
+		return value;
+	case PicamParameter_SensorTemperatureStatus:
+		pi_mutex_lock(&cam->lock);
+		value = fabs(sensor_temperature(cam) - get_committed(cam, PicamParameter_SensorTemperatureSetPoint))
+			<= SIMCAM_LOCK_WINDOW ? PicamSensorTemperatureStatus_Locked : PicamSensorTemperatureStatus_Unlocked;
+		pi_mutex_unlock(&cam->lock);
+		return value;
+	case PicamParameter_ReadoutTimeCalculation:
+		return 1000.0 * readout_time(cam, get_committed(cam, PicamParameter_AdcSpeed));
+	case PicamParameter_FrameSize:
+	case PicamParameter_ReadoutStride:
+		return (piflt) readout_pixels(cam) * sizeof(pi16u);
+	case PicamParameter_SensorActiveWidth:
+		return cam->width;
+	case PicamParameter_SensorActiveHeight:
+		return cam->height;
+	default:
+		return 0;
+	}
+}
+
+/* Returns 1 if value is acceptable for parameter */
+static int validate(PicamParameter parameter, piflt value)
+{
+	int i;
+
+	switch(parameter) {
+	case PicamParameter_ExposureTime:
+		return value >= 0;
+	case PicamParameter_AdcSpeed:
+		for(i = 0; i < config.num_speeds; i++)
+			if(fabs(config.adc_speeds[i] - value) < 1e-9) return 1;
+		return 0;
+	case PicamParameter_AdcBitDepth:
+		return value == 16;
+	case PicamParameter_AdcAnalogGain:
+		return value >= PicamAdcAnalogGain_Low && value <= PicamAdcAnalogGain_High;
+	case PicamParameter_AdcQuality:
+		return value == PicamAdcQuality_LowNoise || value == PicamAdcQuality_HighCapacity;
+	case PicamParameter_SensorTemperatureSetPoint:
+		return value >= -120 && value <= 30;
+	case PicamParameter_ReadoutCount:
+		return value >= 0;
+	default:
+		return 1;
+	}
+}
+
+/* Returns 1 if the staged ROIs fit the sensor without overlapping */
+static int validate_rois(struct simcam *cam)
+{
+	const PicamRoi *a, *b;
+	int i, j;
+
+	if(cam->staged_nrois < 1) return 0;
+	for(i = 0; i < cam->staged_nrois; i++) {
+		a = &cam->staged_rois[i];
+		if(a->x < 0 || a->y < 0 || a->width < 1 || a->height < 1 ||
+			a->x + a->width > cam->width || a->y + a->height > cam->height)
+			return 0;
+		if(a->x_binning < 1 || a->y_binning < 1 ||
+			a->width % a->x_binning || a->height % a->y_binning)
+			return 0;
+		for(j = 0; j < i; j++) {
+			b = &cam->staged_rois[j];
+			if(a->x < b->x + b->width && b->x < a->x + a->width &&
+				a->y < b->y + b->height && b->y < a->y + a->height)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void simulate_frame(struct simcam *cam, pi16u *frame)
+{
+	piflt exptime_s, e_per_adu, signal_e, mean, sigma, v, binned;
+	pi64s i, npix;
+	int r;
+	const PicamRoi *roi;
+
+	exptime_s = get_committed(cam, PicamParameter_ExposureTime) / 1000.0;
+
+	switch((int) get_committed(cam, PicamParameter_AdcAnalogGain)) {
+	case PicamAdcAnalogGain_Low: e_per_adu = 4.0; break;
+	case PicamAdcAnalogGain_Medium: e_per_adu = 2.0; break;
+	default: e_per_adu = 1.0; break;
+	}
+	if(get_committed(cam, PicamParameter_AdcQuality) == PicamAdcQuality_HighCapacity)
+		e_per_adu *= 4.0;
+
+	/* Binned pixels collect the charge of the sensor pixels they
+	cover and are read out once */
+	for(r = 0; r < cam->committed_nrois; r++) {
+		roi = &cam->committed_rois[r];
+		binned = (piflt) roi->x_binning * roi->y_binning;
+		signal_e = (config.dark_current + config.signal) * exptime_s * binned;
+		mean = config.bias + signal_e / e_per_adu;
+		sigma = sqrt(config.read_noise * config.read_noise + signal_e) / e_per_adu;
+
+		npix = (pi64s) (roi->width / roi->x_binning) * (roi->height / roi->y_binning);
+		for(i = 0; i < npix; i++) {
+			v = mean + sigma * gauss[next_random(&cam->rng) % NUM_GAUSS] + 0.5;
+			if(v < 0) v = 0;
+			if(v > 65535) v = 65535;
+			frame[i] = (pi16u) v;
+		}
+		frame += npix;
+	}
+}
+
+
+/* Sleeps for seconds unless the acquisition is stopped, returns 1 if stopped */
+static int wait_unless_stopped(struct simcam *cam, piflt seconds)
+{
+	piflt deadline = pi_now() + seconds;
+	int stop;
+
+	pi_mutex_lock(&cam->lock);
+	while(!cam->stop && pi_now() < deadline)
+		pi_cond_timedwait(&cam->update, &cam->lock, deadline - pi_now());
+	stop = cam->stop;
+	pi_mutex_unlock(&cam->lock);
+	return stop;
+}
+
+static void acquisition_thread(void *arg)
+{
+	struct simcam *cam = arg;
+	piflt exptime_s, readout_s;
+	pi64s npix, slot;
+
+	exptime_s = get_committed(cam, PicamParameter_ExposureTime) / 1000.0;
+	readout_s = readout_time(cam, get_committed(cam, PicamParameter_AdcSpeed));
+	npix = readout_pixels(cam);
+
+	while(cam->readout_target == 0 || cam->produced < cam->readout_target) {
+		if(wait_unless_stopped(cam, (exptime_s + readout_s) * config.time_scale))
+			break;
+
+		/* Claim a slot, or lose the readout if the consumer is behind */
+		pi_mutex_lock(&cam->lock);
+		if(cam->pending + cam->in_use >= cam->ring_frames) {
+			cam->errors |= PicamAcquisitionErrorsMask_DataLost;
+			cam->produced++;
+			pi_mutex_unlock(&cam->lock);
+			continue;
+		}
+		slot = cam->write_index;
+		pi_mutex_unlock(&cam->lock);
+
+		simulate_frame(cam, cam->ring + slot * npix);
+
+		pi_mutex_lock(&cam->lock);
+		cam->write_index = (slot + 1) % cam->ring_frames;
+		cam->pending++;
+		cam->produced++;
+		pi_cond_broadcast(&cam->update);
+		pi_mutex_unlock(&cam->lock);
+	}
+
+	pi_mutex_lock(&cam->lock);
+	cam->running = 0;
+	pi_cond_broadcast(&cam->update);
+	pi_mutex_unlock(&cam->lock);
+}
+
+/* Reaps a finished acquisition thread, call without the lock held */
+static void join_acquisition(struct simcam *cam)
+{
+	int active;
+
+	pi_mutex_lock(&cam->lock);
+	active = cam->thread_active;
+	cam->thread_active = 0;
+	pi_mutex_unlock(&cam->lock);
+	if(active) pi_thread_join(cam->thread);
+}
+
+
+/* Library */
+
+PicamError Picam_GetVersion(piint *major, piint *minor, piint *distribution, piint *released)
+{
+	if(!major || !minor || !distribution || !released)
+		return PicamError_UnexpectedNullPointer;
+	*major = 5;
+	*minor = 0;
+	*distribution = 0;
+	*released = 0;
+	return PicamError_None;
+}
+
+PicamError Picam_IsLibraryInitialized(pibln *inited)
+{
+	if(!inited) return PicamError_UnexpectedNullPointer;
+	*inited = initialized;
+	return PicamError_None;
+}
+
+PicamError Picam_InitializeLibrary(void)
+{
+	if(initialized) return PicamError_LibraryAlreadyInitialized;
+	fill_gauss_table();
+	initialized = 1;
+	return PicamError_None;
+}
+
+PicamError Picam_UninitializeLibrary(void)
+{
+	int i;
+
+	if(!initialized) return PicamError_LibraryNotInitialized;
+	for(i = 0; i < SIMCAM_MAX_CAMERAS; i++) {
+		if(cameras[i].open)
+			Picam_CloseCamera((PicamHandle) (size_t) (i+1));
+	}
+	initialized = 0;
+	return PicamError_None;
+}
+
+
+/* Cameras */
+
+static void make_id(int index, PicamCameraID *id)
+{
+	memset(id, 0, sizeof(*id));
+	id->model = PicamModel_Pixis2048B;
+	id->computer_interface = PicamComputerInterface_Usb2;
+	sprintf_s(id->sensor_name, PicamStringSize_SensorName, "SIM%ix%i", config.width, config.height);
+	sprintf_s(id->serial_number, PicamStringSize_SerialNumber, "SIM%04i", index + 1);
+}
+
+PicamError Picam_GetAvailableCameraIDs(const PicamCameraID **id_array, piint *id_count)
+{
+	PicamCameraID *ids;
+	int i;
+
+	if(!initialized) return PicamError_LibraryNotInitialized;
+	if(!id_array || !id_count) return PicamError_UnexpectedNullPointer;
+
+	ids = calloc(config.cameras > 0 ? config.cameras : 1, sizeof(PicamCameraID));
+	if(!ids) return PicamError_UnexpectedError;
+	for(i = 0; i < config.cameras; i++)
+		make_id(i, &ids[i]);
+
+	*id_array = ids;
+	*id_count = config.cameras;
+	return PicamError_None;
+}
+
+PicamError Picam_DestroyCameraIDs(const PicamCameraID *id_array)
+{
+	free((void *) id_array);
+	return PicamError_None;
+}
+
+PicamError Picam_OpenCamera(const PicamCameraID *camera_id, PicamHandle *camera)
+{
+	struct simcam *cam;
+	int index;
+
+	if(!initialized) return PicamError_LibraryNotInitialized;
+	if(!camera_id || !camera) return PicamError_UnexpectedNullPointer;
+
+	if(sscanf(camera_id->serial_number, "SIM%d", &index) != 1 ||
+		index < 1 || index > config.cameras || index > SIMCAM_MAX_CAMERAS)
+		return PicamError_InvalidCameraID;
+
+	cam = &cameras[index-1];
+	if(cam->open) return PicamError_CameraAlreadyOpened;
+
+	memset(cam, 0, sizeof(*cam));
+	pi_mutex_init(&cam->lock);
+	pi_cond_init(&cam->update);
+	make_id(index - 1, &cam->id);
+	cam->width = config.width;
+	cam->height = config.height;
+	cam->rng = 0x9E3779B97F4A7C15ULL * index;
+	cam->temp_rng = cam->rng ^ 0xC2B2AE3D27D4EB4FULL;
+	cam->sensor_temp = config.temperature;
+	cam->sensor_time = pi_now();
+
+	/* Power-on defaults */
+	cam->staged[param_index(PicamParameter_ExposureTime)] = 0.0;
+	cam->staged[param_index(PicamParameter_AdcSpeed)] = config.adc_speeds[0];
+	cam->staged[param_index(PicamParameter_AdcBitDepth)] = 16;
+	cam->staged[param_index(PicamParameter_AdcAnalogGain)] = PicamAdcAnalogGain_Medium;
+	cam->staged[param_index(PicamParameter_AdcQuality)] = PicamAdcQuality_LowNoise;
+	cam->staged[param_index(PicamParameter_SensorTemperatureSetPoint)] = config.temperature;
+	cam->staged[param_index(PicamParameter_ReadoutCount)] = 1;
+	memcpy(cam->committed, cam->staged, sizeof(cam->staged));
+	cam->staged_rois[0].width = cam->width;
+	cam->staged_rois[0].height = cam->height;
+	cam->staged_rois[0].x_binning = cam->staged_rois[0].y_binning = 1;
+	cam->staged_nrois = 1;
+	cam->committed_rois[0] = cam->staged_rois[0];
+	cam->committed_nrois = 1;
+	cam->open = 1;
+
+	*camera = (PicamHandle) (size_t) index;
+	return PicamError_None;
+}
+
+PicamError Picam_CloseCamera(PicamHandle camera)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	Picam_StopAcquisition(camera);
+	join_acquisition(cam);
+	free(cam->buffer);
+	cam->buffer = NULL;
+	cam->buffer_pixels = 0;
+	pi_cond_destroy(&cam->update);
+	pi_mutex_destroy(&cam->lock);
+	cam->open = 0;
+	return PicamError_None;
+}
+
+PicamError PicamAdvanced_GetCameraModel(PicamHandle camera, PicamHandle *model)
+{
+	if(!lookup(camera)) return PicamError_InvalidHandle;
+	if(!model) return PicamError_UnexpectedNullPointer;
+
+	/* The simulated device and its model are the same object */
+	*model = camera;
+	return PicamError_None;
+}
+
+
+/* Parameters */
+
+PicamError Picam_GetParameterFloatingPointValue(PicamHandle camera, PicamParameter parameter, piflt *value)
+{
+	struct simcam *cam = lookup(camera);
+	int i;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!value) return PicamError_UnexpectedNullPointer;
+	if((i = param_index(parameter)) < 0) return PicamError_ParameterDoesNotExist;
+
+	*value = parameters[i].read_only ? read_only_value(cam, parameter) : cam->staged[i];
+	return PicamError_None;
+}
+
+PicamError Picam_SetParameterFloatingPointValue(PicamHandle camera, PicamParameter parameter, piflt value)
+{
+	struct simcam *cam = lookup(camera);
+	int i;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if((i = param_index(parameter)) < 0) return PicamError_ParameterDoesNotExist;
+	if(parameters[i].read_only) return PicamError_ParameterValueIsReadOnly;
+
+	if(cam->staged[i] == value) return PicamError_None;
+	cam->staged[i] = value;
+	if(cam->integer_changed[i])
+		cam->integer_changed[i](camera, parameter, (piint) value);
+	if(cam->float_changed[i])
+		cam->float_changed[i](camera, parameter, value);
+	return PicamError_None;
+}
+
+PicamError Picam_GetParameterIntegerValue(PicamHandle camera, PicamParameter parameter, piint *value)
+{
+	piflt v;
+	PicamError error;
+
+	if(!value) return PicamError_UnexpectedNullPointer;
+	error = Picam_GetParameterFloatingPointValue(camera, parameter, &v);
+	if(error == PicamError_None) *value = (piint) v;
+	return error;
+}
+
+PicamError Picam_SetParameterIntegerValue(PicamHandle camera, PicamParameter parameter, piint value)
+{
+	return Picam_SetParameterFloatingPointValue(camera, parameter, (piflt) value);
+}
+
+PicamError Picam_GetParameterLargeIntegerValue(PicamHandle camera, PicamParameter parameter, pi64s *value)
+{
+	piflt v;
+	PicamError error;
+
+	if(!value) return PicamError_UnexpectedNullPointer;
+	error = Picam_GetParameterFloatingPointValue(camera, parameter, &v);
+	if(error == PicamError_None) *value = (pi64s) v;
+	return error;
+}
+
+PicamError Picam_SetParameterLargeIntegerValue(PicamHandle camera, PicamParameter parameter, pi64s value)
+{
+	return Picam_SetParameterFloatingPointValue(camera, parameter, (piflt) value);
+}
+
+PicamError Picam_GetParameterRoisValue(PicamHandle camera, PicamParameter parameter, const PicamRois **value)
+{
+	struct simcam *cam = lookup(camera);
+	PicamRois *rois;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!value) return PicamError_UnexpectedNullPointer;
+	if(parameter != PicamParameter_Rois) return PicamError_ParameterDoesNotExist;
+
+	/* One allocation, freed by Picam_DestroyRois */
+	rois = malloc(sizeof(PicamRois) + SIMCAM_MAX_ROIS * sizeof(PicamRoi));
+	if(!rois) return PicamError_UnexpectedError;
+	rois->roi_array = (PicamRoi *) (rois + 1);
+	rois->roi_count = cam->staged_nrois;
+	memcpy(rois->roi_array, cam->staged_rois, cam->staged_nrois * sizeof(PicamRoi));
+	*value = rois;
+	return PicamError_None;
+}
+
+PicamError Picam_SetParameterRoisValue(PicamHandle camera, PicamParameter parameter, const PicamRois *value)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!value || !value->roi_array) return PicamError_UnexpectedNullPointer;
+	if(parameter != PicamParameter_Rois) return PicamError_ParameterDoesNotExist;
+	if(value->roi_count < 1 || value->roi_count > SIMCAM_MAX_ROIS)
+		return PicamError_InvalidParameterValue;
+
+	if(value->roi_count == cam->staged_nrois &&
+		memcmp(value->roi_array, cam->staged_rois, value->roi_count * sizeof(PicamRoi)) == 0)
+		return PicamError_None;
+	memcpy(cam->staged_rois, value->roi_array, value->roi_count * sizeof(PicamRoi));
+	cam->staged_nrois = value->roi_count;
+	if(cam->rois_changed)
+		cam->rois_changed(camera, parameter, value);
+	return PicamError_None;
+}
+
+PicamError Picam_DestroyRois(const PicamRois *rois)
+{
+	free((void *) rois);
+	return PicamError_None;
+}
+
+PicamError Picam_AreParametersCommitted(PicamHandle camera, pibln *committed)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!committed) return PicamError_UnexpectedNullPointer;
+
+	*committed = memcmp(cam->staged, cam->committed, sizeof(cam->staged)) == 0 &&
+		cam->staged_nrois == cam->committed_nrois &&
+		memcmp(cam->staged_rois, cam->committed_rois, cam->staged_nrois * sizeof(PicamRoi)) == 0;
+	return PicamError_None;
+}
+
+PicamError Picam_CommitParameters(PicamHandle camera, const PicamParameter **failed_parameter_array, piint *failed_parameter_count)
+{
+	struct simcam *cam = lookup(camera);
+	PicamParameter *failed;
+	int i, nfailed = 0;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!failed_parameter_array || !failed_parameter_count)
+		return PicamError_UnexpectedNullPointer;
+
+	failed = malloc((NUM_PARAMS + 1) * sizeof(PicamParameter));
+	if(!failed) return PicamError_UnexpectedError;
+
+	for(i = 0; i < NUM_PARAMS; i++) {
+		if(!parameters[i].read_only && !validate(parameters[i].parameter, cam->staged[i]))
+			failed[nfailed++] = parameters[i].parameter;
+	}
+	if(!validate_rois(cam))
+		failed[nfailed++] = PicamParameter_Rois;
+
+	*failed_parameter_array = failed;
+	*failed_parameter_count = nfailed;
+	if(nfailed)
+		return PicamError_InvalidParameterValues;
+
+	memcpy(cam->committed, cam->staged, sizeof(cam->staged));
+	memcpy(cam->committed_rois, cam->staged_rois, sizeof(cam->staged_rois));
+	cam->committed_nrois = cam->staged_nrois;
+	return PicamError_None;
+}
+
+PicamError Picam_DestroyParameters(const PicamParameter *parameter_array)
+{
+	free((void *) parameter_array);
+	return PicamError_None;
+}
+
+
+/* Value changed callbacks */
+
+static PicamError find_parameter(PicamHandle camera, PicamParameter parameter,
+	struct simcam **cam_out, int *index)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if((*index = param_index(parameter)) < 0) return PicamError_ParameterDoesNotExist;
+	*cam_out = cam;
+	return PicamError_None;
+}
+
+PicamError PicamAdvanced_RegisterForIntegerValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamIntegerValueChangedCallback changed)
+{
+	struct simcam *cam;
+	PicamError error;
+	int i;
+
+	if(!changed) return PicamError_UnexpectedNullPointer;
+	error = find_parameter(camera, parameter, &cam, &i);
+	if(error == PicamError_None) cam->integer_changed[i] = changed;
+	return error;
+}
+
+PicamError PicamAdvanced_UnregisterForIntegerValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamIntegerValueChangedCallback changed)
+{
+	struct simcam *cam;
+	PicamError error;
+	int i;
+
+	error = find_parameter(camera, parameter, &cam, &i);
+	if(error == PicamError_None && cam->integer_changed[i] == changed)
+		cam->integer_changed[i] = NULL;
+	return error;
+}
+
+PicamError PicamAdvanced_RegisterForFloatingPointValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamFloatingPointValueChangedCallback changed)
+{
+	struct simcam *cam;
+	PicamError error;
+	int i;
+
+	if(!changed) return PicamError_UnexpectedNullPointer;
+	error = find_parameter(camera, parameter, &cam, &i);
+	if(error == PicamError_None) cam->float_changed[i] = changed;
+	return error;
+}
+
+PicamError PicamAdvanced_UnregisterForFloatingPointValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamFloatingPointValueChangedCallback changed)
+{
+	struct simcam *cam;
+	PicamError error;
+	int i;
+
+	error = find_parameter(camera, parameter, &cam, &i);
+	if(error == PicamError_None && cam->float_changed[i] == changed)
+		cam->float_changed[i] = NULL;
+	return error;
+}
+
+PicamError PicamAdvanced_RegisterForRoisValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamRoisValueChangedCallback changed)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!changed) return PicamError_UnexpectedNullPointer;
+	if(parameter != PicamParameter_Rois) return PicamError_ParameterDoesNotExist;
+	cam->rois_changed = changed;
+	return PicamError_None;
+}
+
+PicamError PicamAdvanced_UnregisterForRoisValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamRoisValueChangedCallback changed)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(parameter != PicamParameter_Rois) return PicamError_ParameterDoesNotExist;
+	if(cam->rois_changed == changed) cam->rois_changed = NULL;
+	return PicamError_None;
+}
+
+
+/* Acquisition */
+
+PicamError Picam_Acquire(PicamHandle camera, pi64s readout_count, piint readout_time_out,
+	PicamAvailableData *available, PicamAcquisitionErrorsMask *errors)
+{
+	struct simcam *cam = lookup(camera);
+	piflt exptime_s, readout_s;
+	pi64s i, npix;
+	pi16u *out;
+	pibln committed;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!available || !errors) return PicamError_UnexpectedNullPointer;
+	if(readout_count < 1) return PicamError_InvalidReadoutCount;
+	if(cam->running) return PicamError_AcquisitionInProgress;
+	join_acquisition(cam);
+
+	Picam_AreParametersCommitted(camera, &committed);
+	if(!committed) return PicamError_ParametersNotCommitted;
+
+	*errors = PicamAcquisitionErrorsMask_None;
+	exptime_s = get_committed(cam, PicamParameter_ExposureTime) / 1000.0;
+	readout_s = readout_time(cam, get_committed(cam, PicamParameter_AdcSpeed));
+
+	if(readout_time_out >= 0 &&
+		readout_time_out < 1000.0 * (exptime_s + readout_s)) {
+		pi_sleep(readout_time_out / 1000.0 * config.time_scale);
+		return PicamError_TimeOutOccurred;
+	}
+
+	npix = readout_pixels(cam);
+	if(cam->user_buffer) {
+		if(cam->user_size < readout_count * npix * (pi64s) sizeof(pi16u))
+			return PicamError_InvalidAcquisitionBuffer;
+		out = cam->user_buffer;
+	} else {
+		if(cam->buffer_pixels < readout_count * npix) {
+			free(cam->buffer);
+			cam->buffer = malloc((size_t) (readout_count * npix * sizeof(pi16u)));
+			if(!cam->buffer) {
+				cam->buffer_pixels = 0;
+				return PicamError_UnexpectedError;
+			}
+			cam->buffer_pixels = readout_count * npix;
+		}
+		out = cam->buffer;
+	}
+
+	for(i = 0; i < readout_count; i++) {
+		pi_sleep(exptime_s * config.time_scale);
+		simulate_frame(cam, out + i * npix);
+		pi_sleep(readout_s * config.time_scale);
+	}
+
+	available->initial_readout = out;
+	available->readout_count = readout_count;
+	return PicamError_None;
+}
+
+
+PicamError Picam_StartAcquisition(PicamHandle camera)
+{
+	struct simcam *cam = lookup(camera);
+	pi64s readouts, npix;
+	pibln committed;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(cam->running) return PicamError_AcquisitionInProgress;
+	join_acquisition(cam);
+
+	Picam_AreParametersCommitted(camera, &committed);
+	if(!committed) return PicamError_ParametersNotCommitted;
+
+	npix = readout_pixels(cam);
+	if(cam->user_buffer) {
+		cam->ring = cam->user_buffer;
+		cam->ring_frames = cam->user_size / (npix * (pi64s) sizeof(pi16u));
+	} else {
+		readouts = (pi64s) get_committed(cam, PicamParameter_ReadoutCount);
+		if(readouts == 0 || readouts > DEFAULT_BUFFER_READOUTS)
+			readouts = DEFAULT_BUFFER_READOUTS;
+
+		if(cam->buffer_pixels < readouts * npix) {
+			free(cam->buffer);
+			cam->buffer = malloc((size_t) (readouts * npix * sizeof(pi16u)));
+			if(!cam->buffer) {
+				cam->buffer_pixels = 0;
+				return PicamError_UnexpectedError;
+			}
+			cam->buffer_pixels = readouts * npix;
+		}
+		cam->ring = cam->buffer;
+		cam->ring_frames = readouts;
+	}
+
+	cam->readout_target = (pi64s) get_committed(cam, PicamParameter_ReadoutCount);
+	cam->produced = 0;
+	cam->write_index = cam->read_index = 0;
+	cam->pending = cam->in_use = 0;
+	cam->errors = PicamAcquisitionErrorsMask_None;
+	cam->stop = 0;
+	cam->running = 1;
+	cam->started = pi_now();
+
+	if(pi_thread_start(&cam->thread, acquisition_thread, cam) != 0) {
+		cam->running = 0;
+		return PicamError_UnexpectedError;
+	}
+	cam->thread_active = 1;
+	return PicamError_None;
+}
+
+PicamError Picam_StopAcquisition(PicamHandle camera)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	pi_mutex_lock(&cam->lock);
+	cam->stop = 1;
+	pi_cond_broadcast(&cam->update);
+	pi_mutex_unlock(&cam->lock);
+	return PicamError_None;
+}
+
+PicamError Picam_IsAcquisitionRunning(PicamHandle camera, pibln *running)
+{
+	struct simcam *cam = lookup(camera);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!running) return PicamError_UnexpectedNullPointer;
+	pi_mutex_lock(&cam->lock);
+	*running = cam->running;
+	pi_mutex_unlock(&cam->lock);
+	return PicamError_None;
+}
+
+PicamError Picam_WaitForAcquisitionUpdate(PicamHandle camera, piint readout_time_out,
+	PicamAvailableData *available, PicamAcquisitionStatus *status)
+{
+	struct simcam *cam = lookup(camera);
+	piflt deadline, elapsed;
+	pi64s n, npix;
+	int finished;
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!available || !status) return PicamError_UnexpectedNullPointer;
+
+	npix = readout_pixels(cam);
+	deadline = pi_now() + readout_time_out / 1000.0;
+
+	pi_mutex_lock(&cam->lock);
+	if(!cam->running && !cam->pending && !cam->in_use) {
+		pi_mutex_unlock(&cam->lock);
+		return PicamError_AcquisitionNotInProgress;
+	}
+
+	/* Whatever was handed out last time goes back to the camera */
+	cam->in_use = 0;
+
+	while(cam->pending == 0 && cam->running) {
+		if(readout_time_out < 0) {
+			pi_cond_wait(&cam->update, &cam->lock);
+		} else if(pi_now() >= deadline ||
+			pi_cond_timedwait(&cam->update, &cam->lock, deadline - pi_now())) {
+			if(cam->pending == 0 && cam->running) {
+				pi_mutex_unlock(&cam->lock);
+				return PicamError_TimeOutOccurred;
+			}
+		}
+	}
+
+	available->initial_readout = NULL;
+	available->readout_count = 0;
+	if(cam->pending) {
+		n = cam->ring_frames - cam->read_index;
+		if(n > cam->pending) n = cam->pending;
+		available->initial_readout = cam->ring + cam->read_index * npix;
+		available->readout_count = n;
+		cam->read_index = (cam->read_index + n) % cam->ring_frames;
+		cam->pending -= n;
+		cam->in_use = n;
+	}
+
+	elapsed = pi_now() - cam->started;
+	status->running = cam->running || cam->pending > 0;
+	status->errors = cam->errors;
+	status->readout_rate = elapsed > 0 ? cam->produced / elapsed : 0;
+	finished = !status->running;
+	pi_mutex_unlock(&cam->lock);
+
+	if(finished) join_acquisition(cam);
+	return PicamError_None;
+}
+
+
+PicamError PicamAdvanced_SetAcquisitionBuffer(PicamHandle device, const PicamAcquisitionBuffer *buffer)
+{
+	struct simcam *cam = lookup(device);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!buffer) return PicamError_UnexpectedNullPointer;
+	if(cam->running) return PicamError_AcquisitionInProgress;
+
+	if(buffer->memory &&
+		buffer->memory_size < readout_pixels(cam) * (pi64s) sizeof(pi16u))
+		return PicamError_InvalidAcquisitionBuffer;
+
+	cam->user_buffer = buffer->memory;
+	cam->user_size = buffer->memory ? buffer->memory_size : 0;
+	return PicamError_None;
+}
+
+PicamError PicamAdvanced_GetAcquisitionBuffer(PicamHandle device, PicamAcquisitionBuffer *buffer)
+{
+	struct simcam *cam = lookup(device);
+
+	if(!cam) return PicamError_InvalidHandle;
+	if(!buffer) return PicamError_UnexpectedNullPointer;
+	buffer->memory = cam->user_buffer;
+	buffer->memory_size = cam->user_size;
+	return PicamError_None;
+}
+
+
+/* Configuration */
+
+void simcam_get_config(struct simcam_config *cfg)
+{
+	*cfg = config;
+}
+
+void simcam_set_config(const struct simcam_config *cfg)
+{
+	config = *cfg;
+	if(config.cameras > SIMCAM_MAX_CAMERAS) config.cameras = SIMCAM_MAX_CAMERAS;
+	if(config.num_speeds > SIMCAM_MAX_SPEEDS) config.num_speeds = SIMCAM_MAX_SPEEDS;
+}
@@ -0,0 +1,259 @@
+#ifndef simcam_h
+#define simcam_h
+
+/*
+	Simulated PICam backend.
+
+	Declares the part of the PICam SDK (picam.h / picam_advanced.h)
+	that the bridge uses, with the same names and signatures, and
+	implements it in simcam.c on top of a synthetic camera. Only
+	included when building with PICAM_SIM, see sdk.h.
+*/
+
+/* Basic types */
+typedef int piint;
+typedef double piflt;
+typedef int pibln;
+typedef char pichar;
+typedef unsigned short pi16u;
+typedef long long pi64s;
+typedef void * PicamHandle;
+
+/* Calling convention of SDK callbacks, from pil_platform.h */
+#define PIL_CALL
+
+#define PI_V(v, c, n) \
+	(((PicamConstraintType_##c) << 24) + ((PicamValueType_##v) << 16) + (n))
+
+typedef enum PicamError {
+	PicamError_None = 0,
+	PicamError_LibraryNotInitialized = 1,
+	PicamError_InvalidParameterValue = 2,
+	PicamError_UnexpectedNullPointer = 3,
+	PicamError_UnexpectedError = 4,
+	PicamError_LibraryAlreadyInitialized = 5,
+	PicamError_CameraAlreadyOpened = 7,
+	PicamError_InvalidCameraID = 8,
+	PicamError_InvalidHandle = 9,
+	PicamError_ParameterValueIsReadOnly = 10,
+	PicamError_ParameterDoesNotExist = 12,
+	PicamError_AcquisitionInProgress = 20,
+	PicamError_AcquisitionNotInProgress = 27,
+	PicamError_InvalidParameterValues = 28,
+	PicamError_ParametersNotCommitted = 29,
+	PicamError_InvalidAcquisitionBuffer = 30,
+	PicamError_TimeOutOccurred = 32,
+	PicamError_NoCamerasAvailable = 34,
+	PicamError_InvalidReadoutCount = 36
+} PicamError;
+
+typedef enum PicamValueType {
+	PicamValueType_Integer = 1,
+	PicamValueType_Boolean = 3,
+	PicamValueType_Enumeration = 4,
+	PicamValueType_LargeInteger = 6,
+	PicamValueType_FloatingPoint = 2,
+	PicamValueType_Rois = 5
+} PicamValueType;
+
+typedef enum PicamConstraintType {
+	PicamConstraintType_None = 1,
+	PicamConstraintType_Range = 2,
+	PicamConstraintType_Collection = 3,
+	PicamConstraintType_Rois = 4
+} PicamConstraintType;
+
+typedef enum PicamParameter {
+	PicamParameter_ExposureTime = PI_V(FloatingPoint, Range, 23),
+	PicamParameter_AdcSpeed = PI_V(FloatingPoint, Collection, 33),
+	PicamParameter_AdcBitDepth = PI_V(Integer, Collection, 34),
+	PicamParameter_AdcAnalogGain = PI_V(Enumeration, Collection, 35),
+	PicamParameter_AdcQuality = PI_V(Enumeration, Collection, 36),
+	PicamParameter_SensorTemperatureSetPoint = PI_V(FloatingPoint, Range, 14),
+	PicamParameter_SensorTemperatureReading = PI_V(FloatingPoint, None, 15),
+	PicamParameter_SensorTemperatureStatus = PI_V(Enumeration, None, 16),
+	PicamParameter_ReadoutTimeCalculation = PI_V(FloatingPoint, None, 27),
+	PicamParameter_ReadoutCount = PI_V(LargeInteger, Range, 40),
+	PicamParameter_FrameSize = PI_V(Integer, None, 42),
+	PicamParameter_ReadoutStride = PI_V(Integer, None, 45),
+	PicamParameter_SensorActiveWidth = PI_V(Integer, None, 59),
+	PicamParameter_SensorActiveHeight = PI_V(Integer, None, 60),
+	PicamParameter_Rois = PI_V(Rois, Rois, 37)
+} PicamParameter;
+
+typedef enum PicamAdcAnalogGain {
+	PicamAdcAnalogGain_Low = 1,
+	PicamAdcAnalogGain_Medium = 2,
+	PicamAdcAnalogGain_High = 3
+} PicamAdcAnalogGain;
+
+typedef enum PicamAdcQuality {
+	PicamAdcQuality_LowNoise = 1,
+	PicamAdcQuality_HighCapacity = 2
+} PicamAdcQuality;
+
+typedef enum PicamSensorTemperatureStatus {
+	PicamSensorTemperatureStatus_Unlocked = 1,
+	PicamSensorTemperatureStatus_Locked = 2,
+	PicamSensorTemperatureStatus_Faulted = 3
+} PicamSensorTemperatureStatus;
+
+typedef enum PicamModel {
+	PicamModel_Pixis2048B = 1207
+} PicamModel;
+
+typedef enum PicamComputerInterface {
+	PicamComputerInterface_Usb2 = 1
+} PicamComputerInterface;
+
+typedef enum PicamStringSize {
+	PicamStringSize_SensorName = 64,
+	PicamStringSize_SerialNumber = 64
+} PicamStringSize;
+
+typedef struct PicamCameraID {
+	PicamModel model;
+	PicamComputerInterface computer_interface;
+	pichar sensor_name[PicamStringSize_SensorName];
+	pichar serial_number[PicamStringSize_SerialNumber];
+} PicamCameraID;
+
+/* A region of the sensor, in unbinned pixels from 0. width and height
+are multiples of the binning */
+typedef struct PicamRoi {
+	piint x, width, x_binning;
+	piint y, height, y_binning;
+} PicamRoi;
+
+typedef struct PicamRois {
+	PicamRoi *roi_array;
+	piint roi_count;
+} PicamRois;
+
+typedef enum PicamAcquisitionErrorsMask {
+	PicamAcquisitionErrorsMask_None = 0x0,
+	PicamAcquisitionErrorsMask_DataLost = 0x1,
+	PicamAcquisitionErrorsMask_ConnectionLost = 0x2
+} PicamAcquisitionErrorsMask;
+
+typedef struct PicamAvailableData {
+	void *initial_readout;
+	pi64s readout_count;
+} PicamAvailableData;
+
+typedef struct PicamAcquisitionBuffer {
+	void *memory;
+	pi64s memory_size;
+} PicamAcquisitionBuffer;
+
+typedef struct PicamAcquisitionStatus {
+	pibln running;
+	PicamAcquisitionErrorsMask errors;
+	piflt readout_rate;
+} PicamAcquisitionStatus;
+
+/* Library */
+PicamError Picam_GetVersion(piint *major, piint *minor, piint *distribution, piint *released);
+PicamError Picam_IsLibraryInitialized(pibln *inited);
+PicamError Picam_InitializeLibrary(void);
+PicamError Picam_UninitializeLibrary(void);
+
+/* Cameras */
+PicamError Picam_GetAvailableCameraIDs(const PicamCameraID **id_array, piint *id_count);
+PicamError Picam_DestroyCameraIDs(const PicamCameraID *id_array);
+PicamError Picam_OpenCamera(const PicamCameraID *camera_id, PicamHandle *camera);
+PicamError Picam_CloseCamera(PicamHandle camera);
+PicamError PicamAdvanced_GetCameraModel(PicamHandle camera, PicamHandle *model);
+
+/* Parameters */
+PicamError Picam_GetParameterIntegerValue(PicamHandle camera, PicamParameter parameter, piint *value);
+PicamError Picam_SetParameterIntegerValue(PicamHandle camera, PicamParameter parameter, piint value);
+PicamError Picam_GetParameterFloatingPointValue(PicamHandle camera, PicamParameter parameter, piflt *value);
+PicamError Picam_SetParameterFloatingPointValue(PicamHandle camera, PicamParameter parameter, piflt value);
+PicamError Picam_GetParameterLargeIntegerValue(PicamHandle camera, PicamParameter parameter, pi64s *value);
+PicamError Picam_SetParameterLargeIntegerValue(PicamHandle camera, PicamParameter parameter, pi64s value);
+PicamError Picam_GetParameterRoisValue(PicamHandle camera, PicamParameter parameter, const PicamRois **value);
+PicamError Picam_SetParameterRoisValue(PicamHandle camera, PicamParameter parameter, const PicamRois *value);
+PicamError Picam_DestroyRois(const PicamRois *rois);
+PicamError Picam_AreParametersCommitted(PicamHandle camera, pibln *committed);
+PicamError Picam_CommitParameters(PicamHandle camera, const PicamParameter **failed_parameter_array, piint *failed_parameter_count);
+PicamError Picam_DestroyParameters(const PicamParameter *parameter_array);
+
+/* Acquisition */
+PicamError Picam_Acquire(PicamHandle camera, pi64s readout_count, piint readout_time_out,
+	PicamAvailableData *available, PicamAcquisitionErrorsMask *errors);
+PicamError Picam_StartAcquisition(PicamHandle camera);
+PicamError Picam_StopAcquisition(PicamHandle camera);
+PicamError Picam_IsAcquisitionRunning(PicamHandle camera, pibln *running);
+PicamError Picam_WaitForAcquisitionUpdate(PicamHandle camera, piint readout_time_out,
+	PicamAvailableData *available, PicamAcquisitionStatus *status);
+
+/* Parameter value change notification. Callbacks run on the thread
+that changed the value; a parameter has at most one callback of each
+kind per camera */
+typedef PicamError (PIL_CALL *PicamIntegerValueChangedCallback)(PicamHandle camera,
+	PicamParameter parameter, piint value);
+typedef PicamError (PIL_CALL *PicamFloatingPointValueChangedCallback)(PicamHandle camera,
+	PicamParameter parameter, piflt value);
+typedef PicamError (PIL_CALL *PicamRoisValueChangedCallback)(PicamHandle camera,
+	PicamParameter parameter, const PicamRois *value);
+
+PicamError PicamAdvanced_RegisterForIntegerValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamIntegerValueChangedCallback changed);
+PicamError PicamAdvanced_UnregisterForIntegerValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamIntegerValueChangedCallback changed);
+PicamError PicamAdvanced_RegisterForFloatingPointValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamFloatingPointValueChangedCallback changed);
+PicamError PicamAdvanced_UnregisterForFloatingPointValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamFloatingPointValueChangedCallback changed);
+PicamError PicamAdvanced_RegisterForRoisValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamRoisValueChangedCallback changed);
+PicamError PicamAdvanced_UnregisterForRoisValueChanged(PicamHandle camera,
+	PicamParameter parameter, PicamRoisValueChangedCallback changed);
+
+/* Acquisition buffer for Picam_Acquire and the circular buffer for
+Picam_StartAcquisition, a NULL memory restores the internal buffer */
+PicamError PicamAdvanced_SetAcquisitionBuffer(PicamHandle device, const PicamAcquisitionBuffer *buffer);
+PicamError PicamAdvanced_GetAcquisitionBuffer(PicamHandle device, PicamAcquisitionBuffer *buffer);
+
+
+/*
+	Simulator configuration. Geometry and camera count take effect
+	on the next Picam_OpenCamera / Picam_GetAvailableCameraIDs, the
+	rest immediately.
+*/
+#define SIMCAM_MAX_SPEEDS 8
+#define SIMCAM_MAX_ROIS 8
+#define SIMCAM_LOCK_WINDOW 0.1
+
+struct simcam_config {
+	piint cameras;
+	piint width, height;
+
+	piflt bias;			/* ADU */
+	piflt read_noise;		/* e- rms */
+	piflt dark_current;		/* e-/pixel/s */
+	piflt signal;			/* illumination, e-/pixel/s */
+	piflt temperature;		/* Sensor at power on, deg C */
+
+	/* The sensor moves towards its set point this fast, deg C per
+	(simulated) second, and locks within SIMCAM_LOCK_WINDOW of it.
+	<= 0 gets there at once */
+	piflt cooling_rate;
+
+	/* Available ADC speeds (MHz) and the full frame readout time each
+	takes (s), scaled by the fraction of the sensor read out. A
+	readout time <= 0 means the pixels read out / speed */
+	piint num_speeds;
+	piflt adc_speeds[SIMCAM_MAX_SPEEDS];
+	piflt readout_s[SIMCAM_MAX_SPEEDS];
+
+	/* All waits (exposure and readout) are multiplied by this, so
+	0 runs the acquisition path flat out for load testing */
+	piflt time_scale;
+};
+
+void simcam_get_config(struct simcam_config *cfg);
+void simcam_set_config(const struct simcam_config *cfg);
+
+#endif
@@ -0,0 +1,585 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Frame stacking, see stack.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "lauxlib.h"
+#include "platform.h"
+#include "parallel.h"
+#include "framestats.h"
+#include "image.h"
+#include "camera.h"
+#include "stack.h"
+
+#define STACK_MT "picam.stack"
+
+/* Pixels per row tile, so a tile's accumulators stay in cache */
+#define STACK_TILE_PIXELS 16384
+
+/* Rounds of clipping for STACK_SIGCLIP */
+#define SIGCLIP_ITERATIONS 5
+
+static const char *method_names[NUM_STACK_METHODS] = {"mean", "median", "sigclip"};
+
+struct stack {
+	pi_mutex lock;
+	int refs;
+	int method;
+	double sigma;
+
+	/* Set by the first frame */
+	piint width, height;
+	struct metadata md;
+	PicamCameraID id;
+
+	int nframes;
+	unsigned int *sum;		/* per pixel */
+	unsigned long long *sumsq;
+	struct frame **frames;		/* median and sigclip only */
+	int frames_size;
+};
+
+/* One parallel_for over the row tiles of a stack */
+struct stack_job {
+	struct stack *s;
+	const pi16u *pixels;	/* stack_add */
+	pi16u *out;		/* stack_combine */
+	long rows_per_tile;
+};
+
+
+const char *stack_method_name(int method)
+{
+	return method_names[method];
+}
+
+int stack_method_lookup(const char *name)
+{
+	int m;
+
+	for(m = 0; m < NUM_STACK_METHODS; m++)
+		if(strcmp(name, method_names[m]) == 0) return m;
+	return -1;
+}
+
+struct stack *stack_new(int method, double sigma)
+{
+	struct stack *s = calloc(1, sizeof(*s));
+
+	if(!s) return NULL;
+	s->method = method;
+	s->sigma = sigma;
+	s->refs = 1;
+	pi_mutex_init(&s->lock);
+	return s;
+}
+
+void stack_retain(struct stack *s)
+{
+	pi_mutex_lock(&s->lock);
+	s->refs++;
+	pi_mutex_unlock(&s->lock);
+}
+
+/* Drops the frames and accumulators, call with s->lock held */
+static void clear_stack(struct stack *s)
+{
+	int i;
+
+	for(i = 0; i < s->nframes && s->frames; i++)
+		frame_release(s->frames[i]);
+	free(s->frames);
+	free(s->sum);
+	free(s->sumsq);
+	s->frames = NULL;
+	s->frames_size = 0;
+	s->sum = NULL;
+	s->sumsq = NULL;
+	s->nframes = 0;
+	s->width = s->height = 0;
+}
+
+void stack_release(struct stack *s)
+{
+	int refs;
+
+	pi_mutex_lock(&s->lock);
+	refs = --s->refs;
+	if(refs == 0) clear_stack(s);
+	pi_mutex_unlock(&s->lock);
+	if(refs) return;
+
+	pi_mutex_destroy(&s->lock);
+	free(s);
+}
+
+static long tile_rows(piint width)
+{
+	return width < STACK_TILE_PIXELS ? STACK_TILE_PIXELS / width : 1;
+}
+
+static int num_tiles(const struct stack *s, long rows_per_tile)
+{
+	return (int) ((s->height + rows_per_tile - 1) / rows_per_tile);
+}
+
+/* parallel_fn, accumulates one row tile of a new frame */
+static void accumulate_tile(void *ctx, int tile)
+{
+	struct stack_job *job = ctx;
+	size_t i, start, end;
+	unsigned int v;
+
+	start = (size_t) tile * job->rows_per_tile * job->s->width;
+	end = start + (size_t) job->rows_per_tile * job->s->width;
+	if(end > (size_t) job->s->width * job->s->height)
+		end = (size_t) job->s->width * job->s->height;
+
+	for(i = start; i < end; i++) {
+		v = job->pixels[i];
+		job->s->sum[i] += v;
+		job->s->sumsq[i] += (unsigned long long) v * v;
+	}
+}
+
+int stack_add(struct stack *s, struct frame *f, const struct metadata *md, char *errmsg)
+{
+	struct stack_job job;
+	struct frame **frames;
+	size_t npix = (size_t) md->width * md->height;
+
+	if(md->nrois > 1) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Frame has %i ROIs, stacks take one\n", md->nrois);
+		return -1;
+	}
+	if(npix * sizeof(pi16u) > f->bytes) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Frame smaller than %ix%i\n", md->width, md->height);
+		return -1;
+	}
+
+	pi_mutex_lock(&s->lock);
+	if(s->nframes == 0) {
+		s->sum = calloc(npix, sizeof(*s->sum));
+		s->sumsq = calloc(npix, sizeof(*s->sumsq));
+		if(!s->sum || !s->sumsq) {
+			clear_stack(s);
+			pi_mutex_unlock(&s->lock);
+			sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory stacking frame\n");
+			return -1;
+		}
+		s->width = md->width;
+		s->height = md->height;
+		s->md = *md;
+		s->id = *md->id;
+		s->md.id = &s->id;
+	} else if(md->width != s->width || md->height != s->height) {
+		pi_mutex_unlock(&s->lock);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Frame is %ix%i, the stack %ix%i\n",
+			md->width, md->height, s->width, s->height);
+		return -1;
+	}
+
+	if(s->method != STACK_MEAN) {
+		if(s->nframes == s->frames_size) {
+			frames = realloc(s->frames, (s->frames_size * 2 + 8) * sizeof(*frames));
+			if(!frames) {
+				pi_mutex_unlock(&s->lock);
+				sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory stacking frame\n");
+				return -1;
+			}
+			s->frames = frames;
+			s->frames_size = s->frames_size * 2 + 8;
+		}
+		/* Kept until the combine */
+		s->frames[s->nframes] = frame_keep(f);
+		if(!s->frames[s->nframes]) {
+			pi_mutex_unlock(&s->lock);
+			sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory stacking frame\n");
+			return -1;
+		}
+	}
+
+	job.s = s;
+	job.pixels = f->pixels;
+	job.rows_per_tile = tile_rows(s->width);
+	parallel_for(num_tiles(s, job.rows_per_tile), accumulate_tile, &job);
+	s->nframes++;
+	pi_mutex_unlock(&s->lock);
+	return 0;
+}
+
+int stack_count(struct stack *s)
+{
+	int n;
+
+	pi_mutex_lock(&s->lock);
+	n = s->nframes;
+	pi_mutex_unlock(&s->lock);
+	return n;
+}
+
+void stack_reset(struct stack *s)
+{
+	pi_mutex_lock(&s->lock);
+	clear_stack(s);
+	pi_mutex_unlock(&s->lock);
+}
+
+static pi16u round_pixel(double v)
+{
+	if(v <= 0) return 0;
+	if(v >= 65535) return 65535;
+	return (pi16u) (v + 0.5);
+}
+
+static int compare_values(const void *a, const void *b)
+{
+	return (int) *(const pi16u *) a - (int) *(const pi16u *) b;
+}
+
+/* Insertion sort is quickest for the usual handful of frames */
+static void sort_values(pi16u *v, int n)
+{
+	int i, j;
+	pi16u x;
+
+	if(n > 32) {
+		qsort(v, n, sizeof(*v), compare_values);
+		return;
+	}
+	for(i = 1; i < n; i++) {
+		x = v[i];
+		for(j = i; j > 0 && v[j - 1] > x; j--)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+}
+
+/* Median of sorted v[lo, hi) */
+static double sorted_median(const pi16u *v, int lo, int hi)
+{
+	int n = hi - lo;
+
+	if(n % 2) return v[lo + n / 2];
+	return (v[lo + n / 2 - 1] + v[lo + n / 2]) / 2.0;
+}
+
+/* Mean of sorted v after clipping values further than sigma standard
+deviations from the median, until nothing more is clipped */
+static double sigclip_mean(const pi16u *v, int n, double sigma)
+{
+	int lo = 0, hi = n, iter;
+	double median, mean, var, sum, sumsq;
+	int i;
+
+	for(iter = 0; iter <= SIGCLIP_ITERATIONS; iter++) {
+		sum = sumsq = 0.0;
+		for(i = lo; i < hi; i++) {
+			sum += v[i];
+			sumsq += (double) v[i] * v[i];
+		}
+		mean = sum / (hi - lo);
+		if(iter == SIGCLIP_ITERATIONS || hi - lo < 3) break;
+
+		var = sumsq / (hi - lo) - mean * mean;
+		median = sorted_median(v, lo, hi);
+		var = sigma * sigma * (var > 0 ? var : 0);
+
+		i = hi - lo;
+		while(lo < hi && (v[lo] - median) * (v[lo] - median) > var) lo++;
+		while(hi > lo && (v[hi - 1] - median) * (v[hi - 1] - median) > var) hi--;
+		if(hi - lo == i) break;
+	}
+	return mean;
+}
+
+/* parallel_fn, combines one row tile into job->out */
+static void combine_tile(void *ctx, int tile)
+{
+	struct stack_job *job = ctx;
+	struct stack *s = job->s;
+	size_t i, start, end;
+	pi16u *values = NULL;
+	int f;
+
+	start = (size_t) tile * job->rows_per_tile * s->width;
+	end = start + (size_t) job->rows_per_tile * s->width;
+	if(end > (size_t) s->width * s->height)
+		end = (size_t) s->width * s->height;
+
+	if(s->method == STACK_MEAN) {
+		for(i = start; i < end; i++)
+			job->out[i] = round_pixel((double) s->sum[i] / s->nframes);
+		return;
+	}
+
+	values = malloc(s->nframes * sizeof(*values));
+	if(!values) {
+		/* Fall back to the mean rather than leave a hole */
+		for(i = start; i < end; i++)
+			job->out[i] = round_pixel((double) s->sum[i] / s->nframes);
+		return;
+	}
+	for(i = start; i < end; i++) {
+		for(f = 0; f < s->nframes; f++)
+			values[f] = s->frames[f]->pixels[i];
+		sort_values(values, s->nframes);
+		if(s->method == STACK_MEDIAN)
+			job->out[i] = round_pixel(sorted_median(values, 0, s->nframes));
+		else
+			job->out[i] = round_pixel(sigclip_mean(values, s->nframes, s->sigma));
+	}
+	free(values);
+}
+
+struct frame *stack_combine(struct stack *s, struct metadata *md)
+{
+	struct stack_job job;
+	struct frame *out;
+	PicamCameraID *id = md->id;
+	size_t npix;
+
+	pi_mutex_lock(&s->lock);
+	if(s->nframes == 0) {
+		pi_mutex_unlock(&s->lock);
+		return NULL;
+	}
+	npix = (size_t) s->width * s->height;
+	out = frame_new(npix * sizeof(pi16u));
+	if(!out) {
+		pi_mutex_unlock(&s->lock);
+		return NULL;
+	}
+
+	job.s = s;
+	job.out = out->pixels;
+	job.rows_per_tile = tile_rows(s->width);
+	parallel_for(num_tiles(s, job.rows_per_tile), combine_tile, &job);
+
+	*md = s->md;
+	*id = s->id;
+	md->id = id;
+	md->latency = NULL;
+	md->ncombine = s->nframes;
+	md->combine = method_names[s->method];
+	pi_mutex_unlock(&s->lock);
+
+	frame_stats_compute(out->pixels, npix, 65535, &md->stats, NULL, NULL);
+	return out;
+}
+
+/* Mean level and temporal noise (rms over pixels of each pixel's
+standard deviation across frames), from the accumulators */
+static void stack_noise(struct stack *s, double *mean, double *noise)
+{
+	size_t i, npix;
+	double sum = 0.0, var = 0.0, m, n;
+
+	pi_mutex_lock(&s->lock);
+	npix = (size_t) s->width * s->height;
+	n = s->nframes;
+	for(i = 0; i < npix; i++) {
+		m = s->sum[i] / n;
+		sum += m;
+		if(n > 1) var += (s->sumsq[i] - s->sum[i] * m) / (n - 1);
+	}
+	*mean = npix ? sum / npix : 0.0;
+	*noise = npix ? sqrt(var / npix) : 0.0;
+	pi_mutex_unlock(&s->lock);
+}
+
+
+/*
+	Lua interface. The userdata holds a reference, as does any
+	acquisition feeding the stack.
+*/
+
+struct stack *stack_check(lua_State *L, int index)
+{
+	return *(struct stack **) luaL_checkudata(L, index, STACK_MT);
+}
+
+/* s:add(image) */
+static int lua_stack_add(lua_State *L)
+{
+	struct stack *s = stack_check(L, 1);
+	struct metadata md;
+	struct frame *f = image_check_frame(L, 2, &md);
+	char errmsg[STR_BUF_SIZE];
+
+	if(stack_add(s, f, &md, errmsg)) {
+		lua_pushstring(L, errmsg);
+		lua_error(L);
+		return 0;
+	}
+	lua_pushinteger(L, stack_count(s));
+	return 1;
+}
+
+/* s:count() */
+static int lua_stack_count(lua_State *L)
+{
+	lua_pushinteger(L, stack_count(stack_check(L, 1)));
+	return 1;
+}
+
+/* s:reset() */
+static int lua_stack_reset(lua_State *L)
+{
+	stack_reset(stack_check(L, 1));
+	return 0;
+}
+
+/* Combines the stack at index 1 and pushes the master image, which
+holds the returned frame */
+static struct frame *push_master(lua_State *L, struct metadata *md)
+{
+	struct stack *s = stack_check(L, 1);
+	struct frame *master;
+	double t0 = pi_now();
+
+	if(stack_count(s) == 0) {
+		lua_pushstring(L, "Stack is empty");
+		lua_error(L);
+		return NULL;
+	}
+	master = stack_combine(s, md);
+	if(!master) {
+		lua_pushstring(L, "Out of memory combining stack");
+		lua_error(L);
+		return NULL;
+	}
+	printf("Combined %i frame(s) (%s) in %5.2f s\n", md->ncombine, md->combine, pi_now() - t0);
+	image_push(L, master, md);
+	frame_release(master);
+	return master;
+}
+
+/* s:result() -> master image */
+static int lua_stack_result(lua_State *L)
+{
+	struct metadata md;
+	PicamCameraID id;
+
+	md.id = &id;
+	push_master(L, &md);
+	return 1;
+}
+
+/* s:save(prepend) -> master image, queued for writing */
+static int lua_stack_save(lua_State *L)
+{
+	struct metadata md;
+	PicamCameraID id;
+	const char *prepend = luaL_optstring(L, 2, "master_");
+	struct frame *master;
+
+	md.id = &id;
+	master = push_master(L, &md);
+	if(writer_submit_frame(master, &md, prepend, NULL, NULL)) {
+		lua_pushstring(L, "Out of memory queueing master");
+		lua_error(L);
+		return 0;
+	}
+	return 1;
+}
+
+/* s:info() -> {frames=, method=, mean=, noise=} */
+static int lua_stack_info(lua_State *L)
+{
+	struct stack *s = stack_check(L, 1);
+	double mean, noise;
+
+	stack_noise(s, &mean, &noise);
+	lua_newtable(L);
+	lua_pushstring(L, "frames");
+	lua_pushinteger(L, stack_count(s));
+	lua_rawset(L, -3);
+	lua_pushstring(L, "method");
+	lua_pushstring(L, method_names[s->method]);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "mean");
+	lua_pushnumber(L, mean);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "noise");
+	lua_pushnumber(L, noise);
+	lua_rawset(L, -3);
+	return 1;
+}
+
+static int lua_stack_gc(lua_State *L)
+{
+	struct stack *s = stack_check(L, 1);
+
+	/* NULL if pi_stack failed after creating the userdata */
+	if(s) stack_release(s);
+	return 0;
+}
+
+static const luaL_Reg stack_methods[] = {
+	{"add", lua_stack_add},
+	{"count", lua_stack_count},
+	{"reset", lua_stack_reset},
+	{"result", lua_stack_result},
+	{"save", lua_stack_save},
+	{"info", lua_stack_info},
+	{NULL, NULL}
+};
+
+/* s = pi_stack{method="mean"|"median"|"sigclip", sigma=3} */
+int picam_stack(lua_State *L)
+{
+	struct stack **ud;
+	int method = STACK_MEAN;
+	double sigma = STACK_DEFAULT_SIGMA;
+
+	if(lua_istable(L, 1)) {
+		lua_getfield(L, 1, "method");
+		if(!lua_isnil(L, -1)) {
+			method = stack_method_lookup(luaL_checkstring(L, -1));
+			if(method < 0) {
+				lua_pushstring(L, "method must be mean, median or sigclip");
+				lua_error(L);
+				return 0;
+			}
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 1, "sigma");
+		if(!lua_isnil(L, -1)) sigma = luaL_checknumber(L, -1);
+		lua_pop(L, 1);
+	}
+	if(sigma <= 0) {
+		lua_pushstring(L, "sigma must be positive");
+		lua_error(L);
+		return 0;
+	}
+
+	ud = lua_newuserdata(L, sizeof(*ud));
+	*ud = NULL;
+	if(luaL_newmetatable(L, STACK_MT)) {
+		lua_pushstring(L, "__index");
+		lua_newtable(L);
+		luaL_register(L, NULL, stack_methods);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "__gc");
+		lua_pushcfunction(L, lua_stack_gc);
+		lua_rawset(L, -3);
+	}
+	lua_setmetatable(L, -2);
+
+	*ud = stack_new(method, sigma);
+	if(!*ud) {
+		lua_pushstring(L, "Out of memory");
+		lua_error(L);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,61 @@
+#ifndef stack_h
+#define stack_h
+
+/*
+	Co-adding and combining frames into a master (bias, flat, ...).
+
+	Every frame added is summed into 32 bit accumulators, with 64 bit
+	sums of squares for the running variance, in row tiles spread over
+	the parallel pool (parallel.h). Median and sigma-clipped stacks
+	also keep a reference to each frame (frame.h) for the combine,
+	copying only readouts still in a camera's buffer (frame_keep).
+
+	The Lua side is pi_stack{method=, sigma=}, see picam_stack in
+	stack.c, and the stack argument of pi_acquire.
+*/
+
+#include "lua.h"
+#include "frame.h"
+#include "writer.h"
+
+enum stack_method {
+	STACK_MEAN,
+	STACK_MEDIAN,
+	STACK_SIGCLIP,		/* mean after iterative clipping about the median */
+	NUM_STACK_METHODS
+};
+
+#define STACK_DEFAULT_SIGMA 3.0
+
+struct stack;
+
+/* Name of a method and back (-1 if unknown) */
+const char *stack_method_name(int method);
+int stack_method_lookup(const char *name);
+
+/* A new empty stack holding one reference, NULL if out of memory */
+struct stack *stack_new(int method, double sigma);
+
+void stack_retain(struct stack *s);
+void stack_release(struct stack *s);
+
+/* Adds a frame described by md; the first sets the geometry and the
+metadata of the master. Safe from any thread. Returns 0 on success,
+otherwise non-zero with a message in errmsg */
+int stack_add(struct stack *s, struct frame *f, const struct metadata *md, char *errmsg);
+
+/* Number of frames added */
+int stack_count(struct stack *s);
+
+/* Forgets every frame */
+void stack_reset(struct stack *s);
+
+/* Combines the frames into a new frame holding one reference, with
+its metadata in md (md->id must point to storage for the camera id).
+NULL if the stack is empty or out of memory */
+struct frame *stack_combine(struct stack *s, struct metadata *md);
+
+/* Stack userdata at index, raises a Lua error otherwise */
+struct stack *stack_check(lua_State *L, int index);
+
+#endif
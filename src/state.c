@@ -0,0 +1,674 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Per-camera state and transactional configuration, see state.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "state.h"
+#include "trace.h"
+
+/* Seconds between telemetry samples unless pi_telemetry{period=} says
+otherwise */
+#define TELEMETRY_PERIOD 1.0
+
+struct config_param_def {
+	const char *name;
+	PicamParameter parameter;
+	int integer;
+	piflt scale;		/* camera units per Lua unit */
+};
+
+static const struct config_param_def config_params[NUM_CONFIG] = {
+	{"exptime", PicamParameter_ExposureTime, 0, 1000.0},
+	{"gain", PicamParameter_AdcAnalogGain, 1, 1.0},
+	{"adc", PicamParameter_AdcQuality, 1, 1.0},
+	{"adcspeed", PicamParameter_AdcSpeed, 0, 1.0},
+	{"setpoint", PicamParameter_SensorTemperatureSetPoint, 0, 1.0}
+};
+
+static struct camera_state cameras[MAX_CAMERAS];
+
+/* Each slot's histograms, initialized with the slot's first camera
+and kept while writers may still time frames into them */
+static struct latency latencies[MAX_CAMERAS];
+static int latency_ready[MAX_CAMERAS];
+
+static unsigned long cameras_opened = 0;
+
+/* Telemetry period of the cameras opened from now on, and the open ones */
+static double telemetry_period = TELEMETRY_PERIOD;
+
+/* Parameters mirrored in camera_state.md, see cache_value */
+static const PicamParameter cached_integers[] = {
+	PicamParameter_AdcBitDepth,
+	PicamParameter_AdcAnalogGain,
+	PicamParameter_AdcQuality,
+	PicamParameter_ReadoutStride,
+	PicamParameter_SensorActiveWidth,
+	PicamParameter_SensorActiveHeight
+};
+
+static const PicamParameter cached_floats[] = {
+	PicamParameter_ExposureTime,
+	PicamParameter_AdcSpeed
+};
+
+#define NUM_CACHED_INTEGERS ((int) (sizeof(cached_integers) / sizeof(cached_integers[0])))
+#define NUM_CACHED_FLOATS ((int) (sizeof(cached_floats) / sizeof(cached_floats[0])))
+
+
+const char *config_name(int param)
+{
+	return config_params[param].name;
+}
+
+int config_lookup(const char *name)
+{
+	int p;
+
+	for(p = 0; p < NUM_CONFIG; p++)
+		if(strcmp(config_params[p].name, name) == 0) return p;
+	return -1;
+}
+
+static PicamError get_param(PicamHandle handle, int p, piflt *value)
+{
+	PicamError error;
+	piint ivalue;
+
+	if(config_params[p].integer) {
+		error = Picam_GetParameterIntegerValue(handle, config_params[p].parameter, &ivalue);
+		*value = ivalue;
+	} else {
+		error = Picam_GetParameterFloatingPointValue(handle, config_params[p].parameter, value);
+	}
+	*value /= config_params[p].scale;
+	return error;
+}
+
+static PicamError set_param(PicamHandle handle, int p, piflt value)
+{
+	value *= config_params[p].scale;
+	if(config_params[p].integer)
+		return Picam_SetParameterIntegerValue(handle, config_params[p].parameter, (piint) floor(value + 0.5));
+	return Picam_SetParameterFloatingPointValue(handle, config_params[p].parameter, value);
+}
+
+static int same_value(piflt a, piflt b)
+{
+	return fabs(a - b) <= 1e-9 * (fabs(a) + fabs(b) + 1e-9);
+}
+
+struct camera_state *camera_state_find(PicamHandle handle)
+{
+	int i;
+
+	for(i = 0; i < MAX_CAMERAS; i++)
+		if(cameras[i].used && cameras[i].handle == handle) return &cameras[i];
+	return NULL;
+}
+
+static struct camera_state *find_model(PicamHandle model)
+{
+	int i;
+
+	for(i = 0; i < MAX_CAMERAS; i++)
+		if(cameras[i].used && cameras[i].model == model) return &cameras[i];
+	return NULL;
+}
+
+/* Stores a parameter value in cam->md, call with cam->lock held */
+static void cache_value(struct camera_state *cam, PicamParameter parameter, piflt value)
+{
+	switch(parameter) {
+	case PicamParameter_ExposureTime: cam->md.exptime = value / 1000.0; break;
+	case PicamParameter_AdcSpeed: cam->md.adcspeed = value; break;
+	case PicamParameter_AdcBitDepth: cam->md.bitdepth = (piint) value; break;
+	case PicamParameter_AdcAnalogGain: cam->md.gain = (piint) value; break;
+	case PicamParameter_AdcQuality: cam->md.adc = (piint) value; break;
+	case PicamParameter_ReadoutStride: cam->stride = (piint) value; break;
+	case PicamParameter_SensorActiveWidth: cam->sensor_width = (piint) value; break;
+	case PicamParameter_SensorActiveHeight: cam->sensor_height = (piint) value; break;
+	default: break;
+	}
+}
+
+/* Stores the ROIs in cam->md, the frame geometry follows from them.
+Call with cam->lock held */
+static void cache_rois(struct camera_state *cam, const PicamRois *rois)
+{
+	const PicamRoi *r;
+	int k;
+
+	cam->md.nrois = rois->roi_count < MAX_ROIS ? rois->roi_count : MAX_ROIS;
+	for(k = 0; k < cam->md.nrois; k++) {
+		r = &rois->roi_array[k];
+		cam->md.rois[k].x = r->x;
+		cam->md.rois[k].y = r->y;
+		cam->md.rois[k].xbin = r->x_binning > 0 ? r->x_binning : 1;
+		cam->md.rois[k].ybin = r->y_binning > 0 ? r->y_binning : 1;
+		cam->md.rois[k].width = r->width / cam->md.rois[k].xbin;
+		cam->md.rois[k].height = r->height / cam->md.rois[k].ybin;
+	}
+	if(cam->md.nrois > 0) {
+		cam->md.width = cam->md.rois[0].width;
+		cam->md.height = cam->md.rois[0].height;
+	}
+}
+
+static PicamError PIL_CALL integer_changed(PicamHandle model, PicamParameter parameter, piint value)
+{
+	struct camera_state *cam = find_model(model);
+
+	if(cam) {
+		pi_mutex_lock(&cam->lock);
+		cache_value(cam, parameter, value);
+		pi_mutex_unlock(&cam->lock);
+	}
+	return PicamError_None;
+}
+
+static PicamError PIL_CALL float_changed(PicamHandle model, PicamParameter parameter, piflt value)
+{
+	struct camera_state *cam = find_model(model);
+
+	if(cam) {
+		pi_mutex_lock(&cam->lock);
+		cache_value(cam, parameter, value);
+		pi_mutex_unlock(&cam->lock);
+	}
+	return PicamError_None;
+}
+
+static PicamError PIL_CALL rois_changed(PicamHandle model, PicamParameter parameter, const PicamRois *value)
+{
+	struct camera_state *cam = find_model(model);
+
+	(void) parameter;
+	if(cam && value) {
+		pi_mutex_lock(&cam->lock);
+		cache_rois(cam, value);
+		pi_mutex_unlock(&cam->lock);
+	}
+	return PicamError_None;
+}
+
+/* Reads every cached parameter from the camera */
+static void refresh_cache(struct camera_state *cam)
+{
+	const PicamRois *rois;
+	piint ivalue;
+	piflt value;
+	int i;
+
+	pi_mutex_lock(&cam->lock);
+	for(i = 0; i < NUM_CACHED_INTEGERS; i++) {
+		if(Picam_GetParameterIntegerValue(cam->model, cached_integers[i], &ivalue) == PicamError_None)
+			cache_value(cam, cached_integers[i], ivalue);
+	}
+	for(i = 0; i < NUM_CACHED_FLOATS; i++) {
+		if(Picam_GetParameterFloatingPointValue(cam->model, cached_floats[i], &value) == PicamError_None)
+			cache_value(cam, cached_floats[i], value);
+	}
+	if(Picam_GetParameterRoisValue(cam->model, PicamParameter_Rois, &rois) == PicamError_None) {
+		cache_rois(cam, rois);
+		Picam_DestroyRois(rois);
+	}
+
+	/* Without ROIs the frame is the whole sensor */
+	if(cam->md.nrois == 0) {
+		cam->md.width = cam->sensor_width;
+		cam->md.height = cam->sensor_height;
+	}
+	pi_mutex_unlock(&cam->lock);
+}
+
+/* Reads the camera's readable parameters and publishes them. Only the
+sampler writes the telemetry once the camera is registered */
+static void sample_telemetry(struct camera_state *cam)
+{
+	struct telemetry t = cam->telemetry;
+	piflt value;
+	piint status;
+
+	t.samples++;
+	if(Picam_GetParameterFloatingPointValue(cam->handle, PicamParameter_SensorTemperatureReading, &value) == PicamError_None)
+		t.temp = value;
+	else
+		t.errors++;
+	if(Picam_GetParameterIntegerValue(cam->handle, PicamParameter_SensorTemperatureStatus, &status) == PicamError_None)
+		t.status = status;
+	else
+		t.status = 0;
+	if(Picam_GetParameterFloatingPointValue(cam->handle, PicamParameter_SensorTemperatureSetPoint, &value) == PicamError_None)
+		t.setpoint = value;
+	if(Picam_GetParameterFloatingPointValue(cam->handle, PicamParameter_ReadoutTimeCalculation, &value) == PicamError_None)
+		t.readout_time = value / 1000.0;
+	t.time = pi_now();
+
+	/* Seqlock, as shmring.c publishes frames */
+	cam->telemetry_seq++;
+	pi_memory_barrier();
+	cam->telemetry = t;
+	pi_memory_barrier();
+	cam->telemetry_seq++;
+
+	pi_mutex_lock(&cam->lock);
+	pi_cond_broadcast(&cam->sampled);
+	pi_mutex_unlock(&cam->lock);
+}
+
+static void telemetry_sampler(void *arg)
+{
+	struct camera_state *cam = arg;
+
+	pi_mutex_lock(&cam->lock);
+	while(!cam->stop) {
+		pi_cond_timedwait(&cam->wake, &cam->lock, cam->period);
+		if(cam->stop) break;
+		pi_mutex_unlock(&cam->lock);
+		sample_telemetry(cam);
+		pi_mutex_lock(&cam->lock);
+	}
+	pi_cond_broadcast(&cam->sampled);
+	pi_mutex_unlock(&cam->lock);
+}
+
+static void camera_worker(void *arg)
+{
+	struct camera_state *cam = arg;
+	struct camera_job *job;
+	char name[32];
+
+	sprintf_s(name, sizeof(name), "camera %s", cam->id.serial_number);
+	trace_thread_name(name);
+
+	pi_mutex_lock(&cam->lock);
+	for(;;) {
+		while(!cam->jobs && !cam->stop)
+			pi_cond_wait(&cam->job_ready, &cam->lock);
+		if(!cam->jobs) break;
+
+		job = cam->jobs;
+		cam->jobs = job->next;
+		if(!cam->jobs) cam->last_job = NULL;
+		pi_mutex_unlock(&cam->lock);
+		job->fn(job->arg);
+		free(job);
+		pi_mutex_lock(&cam->lock);
+	}
+	pi_mutex_unlock(&cam->lock);
+}
+
+int camera_state_submit(struct camera_state *cam, camera_job_fn fn, void *arg)
+{
+	struct camera_job *job = malloc(sizeof(*job));
+
+	if(!job) return -1;
+	job->next = NULL;
+	job->fn = fn;
+	job->arg = arg;
+
+	pi_mutex_lock(&cam->lock);
+	if(cam->last_job)
+		cam->last_job->next = job;
+	else
+		cam->jobs = job;
+	cam->last_job = job;
+	pi_cond_signal(&cam->job_ready);
+	pi_mutex_unlock(&cam->lock);
+	return 0;
+}
+
+/* A job camera_state_run waits for */
+struct waited_job {
+	struct camera_state *cam;
+	camera_job_fn fn;
+	void *arg;
+	int done;
+};
+
+static void run_waited_job(void *arg)
+{
+	struct waited_job *w = arg;
+
+	w->fn(w->arg);
+	pi_mutex_lock(&w->cam->lock);
+	w->done = 1;
+	pi_cond_broadcast(&w->cam->job_done);
+	pi_mutex_unlock(&w->cam->lock);
+}
+
+int camera_state_run(struct camera_state *cam, camera_job_fn fn, void *arg)
+{
+	struct waited_job w;
+
+	w.cam = cam;
+	w.fn = fn;
+	w.arg = arg;
+	w.done = 0;
+	if(camera_state_submit(cam, run_waited_job, &w)) return -1;
+
+	pi_mutex_lock(&cam->lock);
+	while(!w.done)
+		pi_cond_wait(&cam->job_done, &cam->lock);
+	pi_mutex_unlock(&cam->lock);
+	return 0;
+}
+
+static void register_callbacks(struct camera_state *cam)
+{
+	int i;
+
+	for(i = 0; i < NUM_CACHED_INTEGERS; i++)
+		PicamAdvanced_RegisterForIntegerValueChanged(cam->model, cached_integers[i], integer_changed);
+	for(i = 0; i < NUM_CACHED_FLOATS; i++)
+		PicamAdvanced_RegisterForFloatingPointValueChanged(cam->model, cached_floats[i], float_changed);
+	PicamAdvanced_RegisterForRoisValueChanged(cam->model, PicamParameter_Rois, rois_changed);
+}
+
+static void unregister_callbacks(struct camera_state *cam)
+{
+	int i;
+
+	for(i = 0; i < NUM_CACHED_INTEGERS; i++)
+		PicamAdvanced_UnregisterForIntegerValueChanged(cam->model, cached_integers[i], integer_changed);
+	for(i = 0; i < NUM_CACHED_FLOATS; i++)
+		PicamAdvanced_UnregisterForFloatingPointValueChanged(cam->model, cached_floats[i], float_changed);
+	PicamAdvanced_UnregisterForRoisValueChanged(cam->model, PicamParameter_Rois, rois_changed);
+}
+
+/* Tells the sampler and worker to finish, and anyone waiting on a
+sample to give up */
+static void stop_threads(struct camera_state *cam)
+{
+	pi_mutex_lock(&cam->lock);
+	cam->stop = 1;
+	pi_cond_signal(&cam->wake);
+	pi_cond_broadcast(&cam->sampled);
+	pi_cond_signal(&cam->job_ready);
+	pi_mutex_unlock(&cam->lock);
+}
+
+static void forget_camera(struct camera_state *cam)
+{
+	unregister_callbacks(cam);
+	pi_cond_destroy(&cam->job_ready);
+	pi_cond_destroy(&cam->job_done);
+	free(cam->histogram);
+	cam->histogram = NULL;
+	stats_scratch_free(&cam->scratch);
+	pi_cond_destroy(&cam->sampled);
+	pi_cond_destroy(&cam->wake);
+	pi_mutex_destroy(&cam->lock);
+	cam->used = 0;
+}
+
+struct camera_state *camera_state_get(PicamHandle handle, const PicamCameraID *id)
+{
+	struct camera_state *cam = camera_state_find(handle);
+	int i, p;
+
+	if(cam) return cam;
+
+	for(i = 0; i < MAX_CAMERAS && cameras[i].used; i++)
+		;
+	if(i == MAX_CAMERAS) return NULL;
+
+	cam = &cameras[i];
+	memset(cam, 0, sizeof(*cam));
+	if(!latency_ready[i]) {
+		latency_init(&latencies[i]);
+		latency_ready[i] = 1;
+	}
+	cam->latency = &latencies[i];
+	latency_reset(cam->latency);
+	cam->md.latency = cam->latency;
+	cam->opened = ++cameras_opened;
+	cam->handle = handle;
+	cam->id = *id;
+	if(PicamAdvanced_GetCameraModel(handle, &cam->model) != PicamError_None)
+		cam->model = handle;
+
+	/* The camera's committed values are the starting shadow */
+	for(p = 0; p < NUM_CONFIG; p++)
+		get_param(cam->model, p, &cam->committed[p]);
+
+	pi_mutex_init(&cam->lock);
+	pi_cond_init(&cam->wake);
+	pi_cond_init(&cam->sampled);
+	pi_cond_init(&cam->job_ready);
+	pi_cond_init(&cam->job_done);
+	cam->period = telemetry_period;
+	cam->used = 1;
+	register_callbacks(cam);
+	refresh_cache(cam);
+	sample_telemetry(cam);
+
+	if(pi_thread_start(&cam->sampler, telemetry_sampler, cam)) {
+		forget_camera(cam);
+		return NULL;
+	}
+	if(pi_thread_start(&cam->worker, camera_worker, cam)) {
+		stop_threads(cam);
+		pi_thread_join(cam->sampler);
+		forget_camera(cam);
+		return NULL;
+	}
+	return cam;
+}
+
+int camera_state_list(struct camera_state **cams)
+{
+	int i, n = 0;
+
+	for(i = 0; i < MAX_CAMERAS; i++)
+		if(cameras[i].used) cams[n++] = &cameras[i];
+	return n;
+}
+
+void camera_state_release(struct camera_state *cam)
+{
+	stop_threads(cam);
+	pi_thread_join(cam->sampler);
+	pi_thread_join(cam->worker);
+	forget_camera(cam);
+}
+
+void camera_state_shutdown(void)
+{
+	int i;
+
+	for(i = 0; i < MAX_CAMERAS; i++)
+		if(cameras[i].used) camera_state_release(&cameras[i]);
+}
+
+void camera_state_metadata(struct camera_state *cam, struct metadata *md, piint *stride)
+{
+	PicamCameraID *id = md->id;
+
+	struct telemetry t;
+
+	camera_state_telemetry(cam, &t);
+	pi_mutex_lock(&cam->lock);
+	*md = cam->md;
+	*stride = cam->stride;
+	pi_mutex_unlock(&cam->lock);
+	md->id = id;
+	md->temp = t.temp;
+}
+
+void camera_state_set_period(double seconds)
+{
+	int i;
+
+	telemetry_period = seconds;
+	for(i = 0; i < MAX_CAMERAS; i++) {
+		if(!cameras[i].used) continue;
+		pi_mutex_lock(&cameras[i].lock);
+		cameras[i].period = seconds;
+		pi_cond_signal(&cameras[i].wake);
+		pi_mutex_unlock(&cameras[i].lock);
+	}
+}
+
+double camera_state_period(void)
+{
+	return telemetry_period;
+}
+
+piflt camera_state_committed(struct camera_state *cam, int p)
+{
+	piflt value;
+
+	pi_mutex_lock(&cam->lock);
+	value = cam->committed[p];
+	pi_mutex_unlock(&cam->lock);
+	return value;
+}
+
+void camera_state_telemetry(struct camera_state *cam, struct telemetry *t)
+{
+	long seq;
+
+	for(;;) {
+		seq = cam->telemetry_seq;
+		pi_memory_barrier();
+		if(seq & 1) continue;
+		*t = cam->telemetry;
+		pi_memory_barrier();
+		if(cam->telemetry_seq == seq) return;
+	}
+}
+
+int camera_state_wait_temperature(struct camera_state *cam, piflt target, piflt tol,
+	double timeout, struct telemetry *t)
+{
+	double deadline = pi_now() + timeout, left;
+	int result = 0;
+
+	pi_mutex_lock(&cam->lock);
+	for(;;) {
+		camera_state_telemetry(cam, t);
+		if(fabs(t->temp - target) <= tol) {
+			result = 1;
+			break;
+		}
+		if(cam->stop) {
+			result = -1;
+			break;
+		}
+		if(timeout < 0) {
+			pi_cond_wait(&cam->sampled, &cam->lock);
+			continue;
+		}
+		left = deadline - pi_now();
+		if(left <= 0) break;
+		pi_cond_timedwait(&cam->sampled, &cam->lock, left);
+	}
+	pi_mutex_unlock(&cam->lock);
+	return result;
+}
+
+int camera_configure(struct camera_state *cam, const piflt *values, const int *requested, int *failed)
+{
+	const PicamParameter *failed_parameter_array = NULL;
+	piint num_failed = 0, i;
+	int staged[NUM_CONFIG];
+	int p, nstaged = 0, rejected = 0;
+	PicamError error;
+	double tick = pi_now();
+
+	for(p = 0; p < NUM_CONFIG; p++) {
+		failed[p] = 0;
+		staged[p] = requested[p] && !same_value(values[p], cam->committed[p]);
+		if(!staged[p]) continue;
+
+		/* The SDK may refuse a value outright rather than at commit */
+		if(set_param(cam->model, p, values[p]) != PicamError_None) {
+			failed[p] = 1;
+			rejected = 1;
+		}
+		nstaged++;
+	}
+
+	if(nstaged == 0) return 0;
+	latency_record(cam->latency, LAT_STAGE, pi_now() - tick);
+
+	if(!rejected) {
+		tick = pi_now();
+		error = Picam_CommitParameters(cam->model, &failed_parameter_array, &num_failed);
+		latency_record(cam->latency, LAT_COMMIT, pi_now() - tick);
+		if(error == PicamError_None && num_failed == 0) {
+			pi_mutex_lock(&cam->lock);
+			for(p = 0; p < NUM_CONFIG; p++)
+				if(staged[p]) cam->committed[p] = values[p];
+			pi_mutex_unlock(&cam->lock);
+			Picam_DestroyParameters(failed_parameter_array);
+
+			/* Picks up parameters the commit changed as a side effect */
+			refresh_cache(cam);
+			return nstaged;
+		}
+
+		for(i = 0; i < num_failed; i++) {
+			for(p = 0; p < NUM_CONFIG; p++)
+				if(config_params[p].parameter == failed_parameter_array[i]) failed[p] = 1;
+		}
+		Picam_DestroyParameters(failed_parameter_array);
+
+		/* A rejected commit with no parameter named blames them all */
+		if(num_failed == 0) {
+			for(p = 0; p < NUM_CONFIG; p++)
+				failed[p] = staged[p];
+		}
+	}
+
+	/* Roll back so the camera matches the shadow again */
+	for(p = 0; p < NUM_CONFIG; p++)
+		if(staged[p]) set_param(cam->model, p, cam->committed[p]);
+	return -1;
+}
+
+int camera_set_rois(struct camera_state *cam, const PicamRoi *rois, int nrois)
+{
+	const PicamParameter *failed_parameter_array = NULL;
+	const PicamRois *previous;
+	PicamRois value;
+	piint num_failed = 0;
+	PicamError error;
+	double tick;
+
+	if(Picam_GetParameterRoisValue(cam->model, PicamParameter_Rois, &previous) != PicamError_None)
+		return -1;
+
+	value.roi_array = (PicamRoi *) rois;
+	value.roi_count = nrois;
+	tick = pi_now();
+	error = Picam_SetParameterRoisValue(cam->model, PicamParameter_Rois, &value);
+	latency_record(cam->latency, LAT_STAGE, pi_now() - tick);
+	if(error == PicamError_None) {
+		tick = pi_now();
+		error = Picam_CommitParameters(cam->model, &failed_parameter_array, &num_failed);
+		latency_record(cam->latency, LAT_COMMIT, pi_now() - tick);
+		Picam_DestroyParameters(failed_parameter_array);
+		if(error == PicamError_None && num_failed == 0) {
+			Picam_DestroyRois(previous);
+
+			/* The readout stride follows the ROIs */
+			refresh_cache(cam);
+			return 0;
+		}
+	}
+
+	Picam_SetParameterRoisValue(cam->model, PicamParameter_Rois, previous);
+	Picam_DestroyRois(previous);
+	return -1;
+}
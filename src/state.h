@@ -0,0 +1,165 @@
+#ifndef state_h
+#define state_h
+
+#include "sdk.h"
+#include "platform.h"
+#include "writer.h"
+#include "latency.h"
+#include "framestats.h"
+
+/*
+	Per-camera state kept by the bridge for every open camera,
+	looked up by PicamHandle.
+*/
+
+#define MAX_CAMERAS 8
+
+/* Work run on a camera's own thread, see camera_state_submit */
+typedef void (*camera_job_fn)(void *arg);
+
+struct camera_job {
+	struct camera_job *next;
+	camera_job_fn fn;
+	void *arg;
+};
+
+/* Parameters handled by camera_configure, see config_params in state.c */
+enum config_param {
+	CFG_EXPTIME,		/* s */
+	CFG_GAIN,		/* PicamAdcAnalogGain */
+	CFG_ADC,		/* PicamAdcQuality */
+	CFG_ADCSPEED,		/* MHz */
+	CFG_SETPOINT,		/* deg C */
+	NUM_CONFIG
+};
+
+/* What the sampler last read from the camera, see camera_state_telemetry */
+struct telemetry {
+	double time;		/* pi_now() of the sample, 0 before the first */
+	piflt temp;		/* sensor reading, deg C */
+	piflt setpoint;		/* deg C */
+	int status;		/* PicamSensorTemperatureStatus, 0 if unreadable */
+	piflt readout_time;	/* s, as the camera calculates it */
+	long long samples;	/* taken since the camera was opened */
+	long long errors;	/* of those, readings the camera refused */
+};
+
+struct camera_state {
+	int used;
+	PicamHandle handle, model;
+	PicamCameraID id;
+	unsigned long opened;	/* different for each camera a slot holds */
+
+	/* Shadow of the values last committed to the camera, in the
+	units above. Written by the worker under lock */
+	piflt committed[NUM_CONFIG];
+
+	/* What acquisitions need to know about the camera, so the
+	exposure path does not query it. Filled on open and after each
+	commit, kept current by value changed callbacks in between. md.id
+	is unused, md.temp comes from the telemetry, md.rois mirror
+	PicamParameter_Rois. Guarded by lock */
+	pi_mutex lock;
+	struct metadata md;
+	piint stride;
+	piint sensor_width, sensor_height;
+
+	/* Readable parameters sampled every camera_state_period() by a
+	background thread, published without locks: telemetry_seq is odd
+	while the sampler writes telemetry. sampled is broadcast under
+	lock after each sample */
+	volatile long telemetry_seq;
+	struct telemetry telemetry;
+	pi_thread sampler;
+	pi_cond wake, sampled;
+	double period;		/* guarded by lock */
+	int stop;
+
+	/* Acquisitions run one after the other on the camera's worker,
+	so cameras expose and read out concurrently. Everything else that
+	changes the camera runs there too (camera_state_run), so it never
+	meets an acquisition. Guarded by lock */
+	pi_thread worker;
+	pi_cond job_ready, job_done;
+	struct camera_job *jobs, *last_job;
+
+	/* Statistics of single frame acquisitions, reused from one to
+	the next. histogram is NULL until the first */
+	unsigned int *histogram;
+	struct stats_scratch scratch;
+
+	/* Where the time goes, from configuring to the files on disk.
+	Outlives the camera, frames still being written time into it;
+	md.latency points here */
+	struct latency *latency;
+};
+
+/* Lua table key for a parameter, and back (-1 if unknown) */
+const char *config_name(int param);
+int config_lookup(const char *name);
+
+/* State for handle, registering it and loading its shadow from the
+camera if it is new. NULL if MAX_CAMERAS are already in use */
+struct camera_state *camera_state_get(PicamHandle handle, const PicamCameraID *id);
+
+/* State for handle, or NULL if it was never registered */
+struct camera_state *camera_state_find(PicamHandle handle);
+
+/* Fills cams with the cameras in use, returns how many */
+int camera_state_list(struct camera_state **cams);
+
+/* Queues fn(arg) to run on the camera's worker thread after the jobs
+queued before it. Returns 0 if queued */
+int camera_state_submit(struct camera_state *cam, camera_job_fn fn, void *arg);
+
+/* camera_state_submit, then waits for fn to return. Returns 0 once it
+has run, -1 if it could not be queued */
+int camera_state_run(struct camera_state *cam, camera_job_fn fn, void *arg);
+
+/* Runs the jobs still queued, stops the worker and telemetry
+sampler and forgets the camera */
+void camera_state_release(struct camera_state *cam);
+
+/* Releases every camera, before the library is uninitialized */
+void camera_state_shutdown(void);
+
+/* Cached metadata (md->id untouched) and readout stride, no camera
+queries */
+void camera_state_metadata(struct camera_state *cam, struct metadata *md, piint *stride);
+
+/* Seconds between telemetry samples, for every camera. Setting it
+wakes the samplers so it takes effect at once */
+void camera_state_set_period(double seconds);
+double camera_state_period(void);
+
+/* Locked copy of the committed value of config parameter p, for
+threads other than the worker */
+piflt camera_state_committed(struct camera_state *cam, int p);
+
+/* The latest telemetry, without locks or camera queries */
+void camera_state_telemetry(struct camera_state *cam, struct telemetry *t);
+
+/* Waits for the sampler to read a temperature within tol of target,
+at most timeout seconds (< 0 for ever), leaving the last sample in
+*t. Returns 1 once it does, 0 on timeout, -1 if the camera is closed
+meanwhile */
+int camera_state_wait_temperature(struct camera_state *cam, piflt target, piflt tol,
+	double timeout, struct telemetry *t);
+
+/*
+	Stages values[p] for every requested[p] that differs from the
+	shadow and commits them with a single Picam_CommitParameters.
+	Returns the number of parameters changed. If the camera rejects
+	the commit the staged values are rolled back, failed[p] is set for
+	each rejected parameter and -1 is returned.
+*/
+int camera_configure(struct camera_state *cam, const piflt *values, const int *requested, int *failed);
+
+/*
+	Sets the regions read out, in sensor pixels as PicamRoi has them,
+	with a single commit. Returns 0 on success; if the camera rejects
+	them the previous ROIs are restored and -1 is returned.
+*/
+int camera_set_rois(struct camera_state *cam, const PicamRoi *rois, int nrois);
+
+#endif
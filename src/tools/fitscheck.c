@@ -0,0 +1,303 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Verifies the CHECKSUM and DATASUM keywords of a night's FITS files,
+	as written with pi_writer{checksum=true}, before or after they are
+	copied off the mountain. Every HDU of every .fits and .fits.fz file
+	in the directories given (and any files named) is read once and
+	summed with the writer's kernel (fitsdirect.h), files in parallel.
+
+		fitscheck [-j threads] [-v] night_directory|file...
+
+	-j reads that many files at once, by default one per processor.
+	-v lists every file, not only those that are damaged or have
+	HDUs without checksums. Exits with 1 if any file is damaged.
+
+	Build with
+		gcc -O2 -DPICAM_SIM -o fitscheck src/tools/fitscheck.c src/fitsdirect.c \
+			src/parallel.c src/platform.c -lpthread -lrt
+	PICAM_SIM only stands in for the SDK's types here.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../platform.h"
+#include "../parallel.h"
+#include "../fitsdirect.h"
+#include "../writer.h"
+
+#define FITS_BLOCK 2880
+#define CARD_LEN 80
+
+/* Data is read this much at a time, whole blocks */
+#define READ_BYTES (FITS_BLOCK * 1456)
+
+/* Longest header read before giving up on finding END */
+#define MAX_HEADER_BLOCKS 1000
+
+struct check {
+	char path[STR_BUF_SIZE];
+	int hdus, unsummed;	/* HDUs read, those without checksums */
+	long long bytes;
+	char problem[STR_BUF_SIZE];	/* "" if intact */
+};
+
+struct night {
+	struct check *files;
+	int n, max;
+	const char *dir;
+};
+
+/* Value of keyword name in a header of ncards cards, NULL if it is not
+there */
+static const char *card_value(const char *header, int ncards, const char *name)
+{
+	size_t len = strlen(name);
+	const char *card;
+	int i;
+
+	for(i = 0; i < ncards; i++) {
+		card = header + i * CARD_LEN;
+		if(strncmp(card, name, len) == 0 && (len == 8 || card[len] == ' ')
+			&& card[8] == '=')
+			return card + 10;
+		if(strncmp(card, "END     ", 8) == 0) break;
+	}
+	return NULL;
+}
+
+static long long card_integer(const char *header, int ncards, const char *name, long long missing)
+{
+	const char *value = card_value(header, ncards, name);
+
+	return value ? strtoll(value, NULL, 10) : missing;
+}
+
+/* Bytes of data following a header, in whole blocks */
+static long long data_size(const char *header, int ncards)
+{
+	char name[9];
+	long long bitpix, naxis, pixels = 1, i;
+
+	bitpix = card_integer(header, ncards, "BITPIX", 0);
+	naxis = card_integer(header, ncards, "NAXIS", 0);
+	if(naxis == 0) return 0;
+	for(i = 1; i <= naxis && i < 1000; i++) {
+		sprintf_s(name, sizeof(name), "NAXIS%lld", i);
+		pixels *= card_integer(header, ncards, name, 0);
+	}
+	pixels = (card_integer(header, ncards, "PCOUNT", 0) + pixels)
+		* card_integer(header, ncards, "GCOUNT", 1);
+	pixels *= (bitpix < 0 ? -bitpix : bitpix) / 8;
+	return (pixels + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+}
+
+/* Reads the header at the file position into *header (grown as it
+needs to be), returns its cards: 0 at the end of the file, -1 if it is
+cut short or has no END */
+static int read_header(FILE *f, char **header, size_t *size)
+{
+	size_t blocks = 0, got;
+	char *grown;
+	int i;
+
+	for(;;) {
+		if((blocks + 1) * FITS_BLOCK > *size) {
+			grown = realloc(*header, (blocks + 1) * FITS_BLOCK);
+			if(!grown) return -1;
+			*header = grown;
+			*size = (blocks + 1) * FITS_BLOCK;
+		}
+		got = fread(*header + blocks * FITS_BLOCK, 1, FITS_BLOCK, f);
+		if(got == 0 && blocks == 0) return 0;
+		if(got != FITS_BLOCK) return -1;
+		for(i = 0; i < FITS_BLOCK / CARD_LEN; i++) {
+			if(strncmp(*header + blocks * FITS_BLOCK + i * CARD_LEN, "END     ", 8) == 0)
+				return (int) ((blocks + 1) * (FITS_BLOCK / CARD_LEN));
+		}
+		if(++blocks == MAX_HEADER_BLOCKS) return -1;
+	}
+}
+
+/* One file, on the parallel pool */
+static void check_file(void *ctx, int index)
+{
+	struct check *c = &((struct check *) ctx)[index];
+	unsigned char *buf = malloc(READ_BYTES);
+	char *header = NULL;
+	const char *checksum, *datasum;
+	size_t size = 0, got;
+	long long data, left;
+	unsigned int dsum, sum;
+	unsigned long stored;
+	int ncards;
+	FILE *f = fopen(c->path, "rb");
+
+	if(!f || !buf) {
+		sprintf_s(c->problem, STR_BUF_SIZE, "could not be read");
+		if(f) fclose(f);
+		free(buf);
+		return;
+	}
+
+	while(!c->problem[0]) {
+		ncards = read_header(f, &header, &size);
+		if(ncards == 0 && c->hdus > 0) break;
+		if(ncards <= 0) {
+			sprintf_s(c->problem, STR_BUF_SIZE, "HDU %d: header cut short or without END", c->hdus + 1);
+			break;
+		}
+		if(c->hdus == 0 && strncmp(header, "SIMPLE  =", 9) != 0) {
+			sprintf_s(c->problem, STR_BUF_SIZE, "not a FITS file");
+			break;
+		}
+
+		data = data_size(header, ncards);
+		dsum = 0;
+		for(left = data; left > 0; left -= got) {
+			got = fread(buf, 1, left < READ_BYTES ? (size_t) left : READ_BYTES, f);
+			if(got == 0) break;
+			dsum = fits_checksum(buf, got, dsum);
+		}
+		c->hdus++;
+		c->bytes += (long long) ncards * CARD_LEN + data - left;
+		if(left > 0) {
+			sprintf_s(c->problem, STR_BUF_SIZE, "HDU %d: data cut short by %lld bytes", c->hdus, left);
+			break;
+		}
+
+		checksum = card_value(header, ncards, "CHECKSUM");
+		datasum = card_value(header, ncards, "DATASUM");
+		if(!checksum && !datasum) {
+			c->unsummed++;
+			continue;
+		}
+		stored = datasum ? strtoul(datasum + strspn(datasum, "' "), NULL, 10) : dsum;
+		if(stored != dsum) {
+			sprintf_s(c->problem, STR_BUF_SIZE, "HDU %d: data sums to %u, DATASUM is %lu",
+				c->hdus, dsum, stored);
+			break;
+		}
+		/* The whole HDU adds up to -0, as cfitsio's ffvcks has it */
+		sum = fits_checksum((const unsigned char *) header, (size_t) ncards * CARD_LEN, dsum);
+		if(checksum && sum != 0 && sum != 0xffffffff)
+			sprintf_s(c->problem, STR_BUF_SIZE, "HDU %d: sums to %08x with its CHECKSUM, not ffffffff",
+				c->hdus, sum);
+	}
+
+	fclose(f);
+	free(header);
+	free(buf);
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), len = strlen(suffix);
+
+	return n >= len && strcmp(name + n - len, suffix) == 0;
+}
+
+static int add_file(struct night *night, const char *path)
+{
+	struct check *grown;
+
+	if(night->n == night->max) {
+		night->max = night->max ? 2 * night->max : 256;
+		grown = realloc(night->files, night->max * sizeof(*grown));
+		if(!grown) return -1;
+		night->files = grown;
+	}
+	memset(&night->files[night->n], 0, sizeof(struct check));
+	sprintf_s(night->files[night->n].path, STR_BUF_SIZE, "%s", path);
+	night->n++;
+	return 0;
+}
+
+/* pi_list_directory callback: the night's FITS files, not the hidden
+spares (outpath.h) the bridge keeps there while it runs */
+static void add_entry(void *ctx, const char *name)
+{
+	struct night *night = ctx;
+	char path[STR_BUF_SIZE];
+
+	if(name[0] == '.') return;
+	if(!has_suffix(name, ".fits") && !has_suffix(name, ".fits.fz")) return;
+	sprintf_s(path, STR_BUF_SIZE, "%s%s%s", night->dir, PATH_SEP, name);
+	add_file(night, path);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(((const struct check *) a)->path, ((const struct check *) b)->path);
+}
+
+int main(int argc, char **argv)
+{
+	struct night night;
+	struct check *c;
+	int i, first = 1, verbose = 0, threads = 0, damaged = 0, unchecked = 0;
+	long long bytes = 0;
+	double tick, seconds;
+
+	memset(&night, 0, sizeof(night));
+	for(; first < argc && argv[first][0] == '-'; first++) {
+		if(strcmp(argv[first], "-v") == 0)
+			verbose = 1;
+		else if(strcmp(argv[first], "-j") == 0 && first + 1 < argc)
+			threads = atoi(argv[++first]);
+		else
+			break;
+	}
+	if(first >= argc) {
+		fprintf(stderr, "usage: fitscheck [-j threads] [-v] night_directory|file...\n");
+		return 2;
+	}
+
+	for(i = first; i < argc; i++) {
+		if(pi_directory_exists(argv[i])) {
+			night.dir = argv[i];
+			if(pi_list_directory(argv[i], add_entry, &night))
+				fprintf(stderr, "Could not list %s\n", argv[i]);
+		} else {
+			add_file(&night, argv[i]);
+		}
+	}
+	if(night.n == 0) {
+		printf("No FITS files\n");
+		return 0;
+	}
+	qsort(night.files, night.n, sizeof(*night.files), compare_paths);
+
+	parallel_start();
+	if(threads > 0) parallel_configure(threads - 1);
+	tick = pi_now();
+	parallel_for(night.n, check_file, night.files);
+	seconds = pi_now() - tick;
+
+	for(i = 0; i < night.n; i++) {
+		c = &night.files[i];
+		bytes += c->bytes;
+		if(c->problem[0]) {
+			printf("DAMAGED %s: %s\n", c->path, c->problem);
+			damaged++;
+		} else if(c->unsummed) {
+			printf("UNCHECKED %s: %d of %d HDU(s) without checksums\n", c->path,
+				c->unsummed, c->hdus);
+			unchecked++;
+		} else if(verbose) {
+			printf("OK %s (%d HDU(s))\n", c->path, c->hdus);
+		}
+	}
+
+	printf("Checked %d file(s), %.1f MB in %.2f s (%.0f MB/s, %s on %d thread(s)): "
+		"%d intact, %d damaged, %d without checksums\n", night.n, bytes / 1048576.0, seconds,
+		seconds > 0 ? bytes / 1048576.0 / seconds : 0.0, fits_direct_kernel(),
+		parallel_threads() + 1, night.n - damaged - unchecked, damaged, unchecked);
+	parallel_shutdown();
+	free(night.files);
+	return damaged ? 1 : 0;
+}
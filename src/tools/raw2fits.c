@@ -0,0 +1,93 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Converts raw frame containers (rawfile.h), as written with
+	pi_writer{raw="lz4"} or "zstd", to the FITS files the bridge would
+	have written for them: name.fits.praw becomes name.fits next to it,
+	uncompressed, checksummed and byte for byte what write_data_to_file
+	makes of the same frame. Chunks are decompressed on every core.
+
+		raw2fits [-d] file.praw...
+
+	-d removes each raw file once its FITS file is written.
+
+	Build against the bridge's own writer, with the codecs it was
+	built with, e.g.
+		gcc -O2 -DPICAM_SIM -DHAVE_LZ4 -DHAVE_ZSTD -Isrc -o raw2fits src/tools/raw2fits.c \
+			src/rawfile.c src/writer.c src/fitsdirect.c src/compress.c src/parallel.c \
+			src/frame.c src/outpath.c src/preview.c src/latency.c src/trace.c \
+			src/platform.c -lcfitsio -llz4 -lzstd -lz -lm -lpthread
+	PICAM_SIM only stands in for the SDK's types here.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../platform.h"
+#include "../parallel.h"
+#include "../compress.h"
+#include "../fitsdirect.h"
+#include "../rawfile.h"
+
+/* path without its .praw extension: the bridge names raw files
+name.fits.praw. Anything else gets .fits added */
+static void fits_name(const char *path, char *out)
+{
+	size_t n = strlen(path), ext = strlen(RAW_EXTENSION);
+
+	if(n >= ext && strcmp(path + n - ext, RAW_EXTENSION) == 0) n -= ext;
+	if(n >= 5 && strncmp(path + n - 5, ".fits", 5) == 0)
+		sprintf_s(out, STR_BUF_SIZE, "%.*s", (int) n, path);
+	else
+		sprintf_s(out, STR_BUF_SIZE, "%.*s.fits", (int) n, path);
+}
+
+int main(int argc, char **argv)
+{
+	struct output_format fmt;
+	struct raw_frame rf;
+	char outfile[STR_BUF_SIZE], errmsg[STR_BUF_SIZE];
+	int i, first = 1, remove_raw = 0, converted = 0, failed = 0;
+	double tick = pi_now();
+
+	if(argc > 1 && strcmp(argv[1], "-d") == 0) {
+		remove_raw = 1;
+		first = 2;
+	}
+	if(first >= argc) {
+		fprintf(stderr, "usage: raw2fits [-d] file%s...\n", RAW_EXTENSION);
+		return 2;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.compression = COMPRESS_NONE;
+	fmt.direct = FITS_DIRECT;
+	fmt.checksum = 1;
+	parallel_start();
+
+	for(i = first; i < argc; i++) {
+		errmsg[0] = '\0';
+		if(raw_read(argv[i], &rf, errmsg)) {
+			fprintf(stderr, "%s", errmsg);
+			failed++;
+			continue;
+		}
+		fits_name(argv[i], outfile);
+		if(write_fits_file(rf.pixels, &rf.md, &fmt, outfile, errmsg)) {
+			fprintf(stderr, "%s: %s", outfile, errmsg);
+			failed++;
+		} else {
+			printf("Wrote '%s' (%s).\n", outfile, raw_codec_name(rf.codec));
+			converted++;
+			if(remove_raw) remove(argv[i]);
+		}
+		raw_free(&rf);
+	}
+
+	printf("Converted %d file(s) in %.2f s with %s, %d failed\n", converted, pi_now() - tick,
+		fits_direct_kernel(), failed);
+	parallel_shutdown();
+	return failed ? 1 : 0;
+}
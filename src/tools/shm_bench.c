@@ -0,0 +1,96 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Latency of frames from readout to a process reading them from
+	shared memory (see shm_consumer.c), for pi_publish. Collects
+	frames, touching every pixel of each as an analysis would, and
+	prints percentiles of the time from readout, and from the frame
+	entering the ring, to the consumer having read it.
+
+		shm_bench [name] [frames=1000]
+
+	Build as shm_consumer.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../shmring.h"
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts n samples and prints their percentiles in ms */
+static void report(const char *what, double *samples, long long n)
+{
+	qsort(samples, (size_t) n, sizeof(double), compare_doubles);
+	printf("%-22s p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n", what,
+		samples[n / 2] * 1e3, samples[n * 9 / 10] * 1e3, samples[n * 99 / 100] * 1e3,
+		samples[n - 1] * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : SHM_RING_DEFAULT_NAME;
+	long long frames = argc > 2 ? atoll(argv[2]) : 1000;
+	struct shm_ring ring;
+	const struct shm_frame *f;
+	const unsigned short *pixels;
+	double *from_readout, *from_ring, now, first = 0, bytes = 0;
+	long long next, lost = 0, seen = 0, sequence;
+	size_t i, n;
+	unsigned long checksum = 0;
+
+	if(frames < 1) frames = 1;
+	from_readout = malloc((size_t) frames * sizeof(double));
+	from_ring = malloc((size_t) frames * sizeof(double));
+	if(!from_readout || !from_ring) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if(shm_ring_attach(&ring, name)) {
+		fprintf(stderr, "Could not attach to %s, start pi_publish first\n", name);
+		return 1;
+	}
+	next = shm_ring_head(&ring) + 1;
+
+	while(seen < frames) {
+		f = shm_ring_wait(&ring, &next, &lost, -1);
+		if(!f) break;
+		sequence = next++;
+
+		pixels = shm_frame_pixels(&ring, f);
+		n = (size_t) f->bytes / sizeof(unsigned short);
+		for(i = 0; i < n; i++)
+			checksum += pixels[i];
+		now = pi_now();
+		if(!shm_ring_valid(f, sequence)) {
+			lost++;
+			continue;
+		}
+		if(seen == 0) first = now;
+		from_readout[seen] = now - f->readout;
+		from_ring[seen] = now - f->published;
+		bytes += (double) f->bytes;
+		seen++;
+	}
+	shm_ring_close(&ring);
+
+	if(seen == 0) {
+		printf("No frames\n");
+		return 1;
+	}
+	printf("%lld frames (%.1f MB), %lld lost, %.1f frames/s, checksum %lu\n", seen,
+		bytes / 1048576.0, lost, seen > 1 ? (seen - 1) / (now - first) : 0.0, checksum);
+	report("readout to consumer", from_readout, seen);
+	report("ring to consumer", from_ring, seen);
+	free(from_readout);
+	free(from_ring);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Reference consumer of the frames pi_publish puts in shared memory
+	(shmring.h): prints each frame's number, size and mean as it
+	arrives, computed on the pixels where they are, and how many were
+	lost to the writer lapping it.
+
+		shm_consumer [name] [frames]
+
+	Build next to the bridge, e.g.
+		gcc -O2 -o shm_consumer src/tools/shm_consumer.c src/shmring.c src/platform.c -lpthread -lrt
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../shmring.h"
+
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : SHM_RING_DEFAULT_NAME;
+	long long frames = argc > 2 ? atoll(argv[2]) : -1;
+	struct shm_ring ring;
+	const struct shm_frame *f;
+	const unsigned short *pixels;
+	long long next, lost = 0, seen = 0, sequence;
+	size_t i, n;
+	double sum, latency;
+	int error;
+
+	error = shm_ring_attach(&ring, name);
+	if(error) {
+		fprintf(stderr, "%s: %s\n", name, error == -2 ? "not a frame ring of this version"
+			: "no such shared memory, start pi_publish first");
+		return 1;
+	}
+	next = shm_ring_head(&ring) + 1;
+	printf("Attached to %s at frame %lld\n", name, next);
+
+	while(frames < 0 || seen < frames) {
+		f = shm_ring_wait(&ring, &next, &lost, -1);
+		if(!f) break;
+		sequence = next++;
+
+		pixels = shm_frame_pixels(&ring, f);
+		n = (size_t) f->bytes / sizeof(unsigned short);
+		for(i = 0, sum = 0; i < n; i++)
+			sum += pixels[i];
+		latency = pi_now() - f->readout;
+
+		/* The writer may have reused the slot while we were at it */
+		if(!shm_ring_valid(f, sequence)) {
+			lost++;
+			continue;
+		}
+		seen++;
+		printf("#%lld %s %dx%d mean %.1f, %.2f ms after readout, %lld lost\n", sequence,
+			f->serial_number, f->width, f->height, n ? sum / n : 0.0, latency * 1e3, lost);
+	}
+
+	printf("%lld frames, %lld lost%s\n", seen, lost, ring.header->closed ? ", publisher closed" : "");
+	shm_ring_close(&ring);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	Per-thread trace rings and Chrome trace event output, see trace.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define TRACE_NAME_LEN 32
+
+struct trace_event {
+	const char *name;
+	double start, end;
+	long long arg;
+};
+
+/* Written only by its thread; head counts every span ever recorded
+and is bumped after the span is in place */
+struct trace_ring {
+	volatile long head;
+	char name[TRACE_NAME_LEN];
+	struct trace_event events[TRACE_RING_EVENTS];
+};
+
+volatile int trace_on = 0;
+
+/* pi_now() when tracing was last turned on, earlier spans are stale */
+static double trace_origin;
+
+static struct trace_ring *volatile rings[TRACE_MAX_THREADS];
+static volatile long nrings = 0;
+
+static PI_THREAD_LOCAL struct trace_ring *own_ring;
+static PI_THREAD_LOCAL int no_ring;
+static PI_THREAD_LOCAL char own_name[TRACE_NAME_LEN];
+
+/* The calling thread's ring, made on its first span. NULL if out of
+memory or TRACE_MAX_THREADS already have one */
+static struct trace_ring *thread_ring(void)
+{
+	struct trace_ring *ring;
+	long k;
+
+	if(own_ring || no_ring) return own_ring;
+	no_ring = 1;
+	ring = malloc(sizeof(*ring));
+	if(!ring) return NULL;
+	k = pi_atomic_add(&nrings, 1) - 1;
+	if(k >= TRACE_MAX_THREADS) {
+		free(ring);
+		return NULL;
+	}
+	ring->head = 0;
+	if(own_name[0])
+		strcpy(ring->name, own_name);
+	else
+		sprintf_s(ring->name, TRACE_NAME_LEN, "thread %ld", k + 1);
+	rings[k] = ring;
+	own_ring = ring;
+	return ring;
+}
+
+void trace_span(const char *name, double start, double end, long long arg)
+{
+	struct trace_ring *ring;
+	struct trace_event *ev;
+
+	if(!trace_on) return;
+	ring = thread_ring();
+	if(!ring) return;
+	ev = &ring->events[ring->head % TRACE_RING_EVENTS];
+	ev->name = name;
+	ev->start = start;
+	ev->end = end;
+	ev->arg = arg;
+	pi_atomic_add(&ring->head, 1);
+}
+
+void trace_thread_name(const char *name)
+{
+	sprintf_s(own_name, TRACE_NAME_LEN, "%s", name);
+	if(own_ring) strcpy(own_ring->name, own_name);
+}
+
+void trace_enable(int on)
+{
+	if(on && !trace_on) trace_origin = pi_now();
+	trace_on = on;
+}
+
+/* Writes ring's spans as tid, leaving out any overwritten while they
+were copied */
+static long dump_ring(FILE *f, struct trace_ring *ring, int tid, int *first)
+{
+	struct trace_event *copy;
+	long head, tail, i, n = 0;
+	const struct trace_event *ev;
+
+	copy = malloc(TRACE_RING_EVENTS * sizeof(*copy));
+	if(!copy) return 0;
+	head = pi_atomic_add(&ring->head, 0);
+	tail = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+	for(i = tail; i < head; i++)
+		copy[i % TRACE_RING_EVENTS] = ring->events[i % TRACE_RING_EVENTS];
+	i = pi_atomic_add(&ring->head, 0) - TRACE_RING_EVENTS;
+	if(i > tail) tail = i;
+
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s\"}}",
+		*first ? "" : ",", tid, ring->name);
+	*first = 0;
+	for(i = tail; i < head; i++) {
+		ev = &copy[i % TRACE_RING_EVENTS];
+		if(ev->start < trace_origin) continue;
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"picam\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,"
+			"\"ts\":%.3f,\"dur\":%.3f", ev->name, tid,
+			(ev->start - trace_origin) * 1e6, (ev->end - ev->start) * 1e6);
+		if(ev->arg >= 0)
+			fprintf(f, ",\"args\":{\"n\":%lld}", ev->arg);
+		fprintf(f, "}");
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+long trace_dump(const char *path)
+{
+	FILE *f;
+	long k, count, n = 0;
+	int first = 1;
+
+	f = fopen(path, "w");
+	if(!f) return -1;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	count = pi_atomic_add(&nrings, 0);
+	if(count > TRACE_MAX_THREADS) count = TRACE_MAX_THREADS;
+	for(k = 0; k < count; k++)
+		if(rings[k]) n += dump_ring(f, rings[k], (int) k + 1, &first);
+	fprintf(f, "\n]}\n");
+	if(fclose(f) != 0) return -1;
+	return n;
+}
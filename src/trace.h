@@ -0,0 +1,42 @@
+#ifndef trace_h
+#define trace_h
+
+/*
+	Optional timeline of what each thread was doing, dumped as Chrome
+	trace event JSON for chrome://tracing or Perfetto, one row per
+	thread: the Lua thread, each camera's worker and each writer.
+	Threads record spans into rings of their own without locks, the
+	oldest spans are overwritten once a ring is full. While tracing
+	is off a span costs a test of trace_on.
+*/
+
+#include "platform.h"
+
+/* Spans kept per thread, and threads traced */
+#define TRACE_RING_EVENTS 32768
+#define TRACE_MAX_THREADS 64
+
+extern volatile int trace_on;
+
+/* Start of a span, 0 while tracing is off */
+#define trace_begin() (trace_on ? pi_now() : 0.0)
+
+/* Ends a span begun by trace_begin now, see trace_span */
+#define trace_end(name, start, arg) \
+	do { if(start) trace_span(name, start, pi_now(), arg); } while(0)
+
+/* Records name (kept by pointer, a literal) on the calling thread from
+start to end, pi_now() times, with arg shown unless it is < 0 */
+void trace_span(const char *name, double start, double end, long long arg);
+
+/* Labels the calling thread's row, copied */
+void trace_thread_name(const char *name);
+
+/* Turns tracing on, forgetting earlier spans, or off */
+void trace_enable(int on);
+
+/* Writes the spans recorded since tracing was turned on to path,
+returns how many or -1 if the file could not be written */
+long trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,1147 @@
+/*
+
+	LUA -- Princeton Camera software bridge
+
+	FITS output and the background writer pool, see writer.h.
+
+	Frames are queued with a reference to their pixels (frame.h) and a
+	copy of their metadata, without copying the pixels: a readout is
+	written in place from the acquisition ring, which only goes back
+	to the camera once the writer has released it. Each ROI of a
+	frame is an HDU of its own: the primary array and IMAGE
+	extensions, or compressed extensions after an empty primary.
+	cfitsio has to be built reentrant (--enable-reentrant) for more
+	than one writer thread.
+
+	A sequence keeps one file open across the frames of a burst. Its
+	frames are queued like any other, but a writer holding one waits
+	for the frame before it to be appended, so the file grows in order.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fitsio.h"
+#include "platform.h"
+#include "writer.h"
+#include "compress.h"
+#include "parallel.h"
+#include "fitsdirect.h"
+#include "frame.h"
+#include "trace.h"
+#include "preview.h"
+#include "outpath.h"
+#include "rawfile.h"
+
+#define DEFAULT_WRITER_THREADS 2
+#define DEFAULT_MEMORY_CAP (256 * 1024 * 1024)
+#define MAX_WRITER_THREADS 16
+#define DEFAULT_TILE_COLS 2048
+#define DEFAULT_TILE_ROWS 16
+#define MAX_KEYS 32
+
+struct writer_job {
+	struct writer_job *next;
+	struct frame *frame;
+	size_t bytes;
+	struct metadata md;
+	PicamCameraID id;
+	char prepend[STR_BUF_SIZE];
+	struct output_format fmt;
+	writer_done_fn done;
+	void *ctx;
+
+	struct writer_sequence *seq;	/* NULL for a file of its own */
+	long index;			/* in seq, from 0 */
+};
+
+/* A file frames are appended to, see writer_sequence_open. Frame index
+next is the one to append, the file is only touched by its writer. refs
+are the opener and every queued frame, the file is closed with the last */
+struct writer_sequence {
+	pi_mutex lock;
+	pi_cond turn;		/* next went up */
+	int refs;
+	long submitted, next, written;
+	int failed;
+
+	char prepend[STR_BUF_SIZE];
+	struct output_format fmt;
+	char path[STR_BUF_SIZE];	/* "" until the first frame */
+	struct fits_direct_file *df;	/* open by fitsdirect.c, */
+	fitsfile *ff;			/* or by cfitsio */
+	struct latency *latency;
+};
+
+/* The pool, everything guarded by lock */
+static struct {
+	int started, stopping;
+	int threads;
+	size_t memory_cap;
+	pi_thread thread[MAX_WRITER_THREADS];
+	struct output_format fmt;
+
+	pi_mutex lock;
+	pi_cond work;		/* a job was queued, or stopping */
+	pi_cond space;		/* queued bytes went down */
+	pi_cond idle;		/* a job finished */
+	struct writer_job *head, *tail;
+	size_t queued, queued_bytes;
+	int in_flight;
+
+	long long written, failed;
+	char last_error[STR_BUF_SIZE];
+} pool = {0, 0, DEFAULT_WRITER_THREADS, DEFAULT_MEMORY_CAP, {0},
+	{COMPRESS_NONE, {DEFAULT_TILE_COLS, DEFAULT_TILE_ROWS}, FITS_DIRECT, 0, 0, RAW_OFF, 1}};
+
+/* cfitsio's HCOMPRESS coder is not reentrant */
+static pi_mutex hcompress_lock;
+
+/* One image HDU of a frame, see frame_hdus */
+struct hdu {
+	const pi16u *pixels;
+	struct metadata md;	/* the one ROI in it */
+	int frame;		/* FRAMENUM in a sequence, otherwise 0 */
+	char extname[16], ccdsec[48], ccdsum[16];
+};
+
+/* One frame being tile compressed by parallel_for */
+struct tile_job {
+	const pi16u *pixels;
+	long width, height;
+	long ntiles1, ntiles;
+	struct output_format fmt;
+	size_t bound;
+	unsigned char *out;	/* ntiles slots of bound bytes */
+	size_t *sizes;
+};
+
+
+static void add_key(struct fits_key *keys, int *n, int type, const char *name,
+	const void *value, const char *comment)
+{
+	keys[*n].type = type;
+	keys[*n].name = name;
+	keys[*n].value = value;
+	keys[*n].comment = comment;
+	(*n)++;
+}
+
+size_t metadata_pixels(const struct metadata * md)
+{
+	size_t n = 0;
+	int k;
+
+	if(md->nrois <= 0) return (size_t) md->width * md->height;
+	for(k = 0; k < md->nrois; k++)
+		n += (size_t) md->rois[k].width * md->rois[k].height;
+	return n;
+}
+
+/* Splits the frame in buf into an HDU per ROI, returns how many.
+Statistics are of the whole frame and only go in the first */
+static int frame_hdus(const pi16u * buf, const struct metadata * md, struct hdu *hdus)
+{
+	const struct frame_roi *r;
+	struct hdu *h;
+	int k, n = md->nrois > 0 ? md->nrois : 1;
+
+	for(k = 0; k < n; k++) {
+		h = &hdus[k];
+		h->pixels = buf;
+		h->md = *md;
+		h->frame = 0;
+		h->extname[0] = h->ccdsec[0] = h->ccdsum[0] = '\0';
+		if(md->nrois > 0) {
+			r = &md->rois[k];
+			h->md.width = r->width;
+			h->md.height = r->height;
+			h->md.nrois = 1;
+			h->md.rois[0] = *r;
+			sprintf_s(h->ccdsec, sizeof(h->ccdsec), "[%d:%d,%d:%d]", r->x + 1,
+				r->x + r->width * r->xbin, r->y + 1, r->y + r->height * r->ybin);
+			sprintf_s(h->ccdsum, sizeof(h->ccdsum), "%d %d", r->xbin, r->ybin);
+			if(md->nrois > 1)
+				sprintf_s(h->extname, sizeof(h->extname), "ROI%d", k + 1);
+		}
+		if(k > 0) h->md.stats.valid = 0;
+		buf += (size_t) h->md.width * h->md.height;
+	}
+	return n;
+}
+
+/* Keywords of an HDU, in order, shared by every output path. EXTNAME
+leads if there is one and extname is set */
+static int metadata_keys(struct hdu *h, int extname, struct fits_key *keys)
+{
+	static const float bscale1 = 1.0, bzero32768 = 32768.0;
+	struct metadata *md = &h->md;
+	int n = 0;
+
+	if(extname && h->extname[0])
+		add_key(keys, &n, TSTRING, "EXTNAME", h->extname,
+			h->frame ? "Frame and region of interest" : "Region of interest");
+
+	// BSCALE/BZERO are required to handle ushort, see:
+	// "Support for Unsigned Integers and Signed Bytes" in
+	// cfitsio manual
+	add_key(keys, &n, TFLOAT, "BSCALE", &bscale1, NULL);
+	add_key(keys, &n, TFLOAT, "BZERO", &bzero32768, NULL);
+
+	add_key(keys, &n, TDOUBLE, "EXPTIME", &md->exptime, "Exposure time in s");
+	add_key(keys, &n, TDOUBLE, "ADCSPEED", &md->adcspeed, "Readout speed in MHz");
+	add_key(keys, &n, TDOUBLE, "TEMP", &md->temp, "Detector temp in deg C");
+	add_key(keys, &n, TINT, "BITDEPTH", &md->bitdepth, "Bit depth");
+	add_key(keys, &n, TINT, "GAIN_SET", &md->gain, "1: low, 2: medium, 3: high gain");
+	add_key(keys, &n, TINT, "ADC", &md->adc, "1: Low noise, 2: high capacity");
+	add_key(keys, &n, TINT, "MODEL", &md->id->model, "PI Model #");
+	add_key(keys, &n, TINT, "INTERFC", &md->id->computer_interface, "PI Computer Interface");
+	add_key(keys, &n, TSTRING, "SNSR_NM", md->id->sensor_name, "PI sensor name");
+	add_key(keys, &n, TSTRING, "SER_NO", md->id->serial_number, "PI serial #");
+	if(md->date_obs[0])
+		add_key(keys, &n, TSTRING, "DATE-OBS", md->date_obs, "UTC at readout");
+	if(h->frame)
+		add_key(keys, &n, TINT, "FRAMENUM", &h->frame, "Frame in the sequence, from 1");
+	if(h->ccdsec[0]) {
+		add_key(keys, &n, TSTRING, "CCDSEC", h->ccdsec, "Sensor section read out");
+		add_key(keys, &n, TSTRING, "CCDSUM", h->ccdsum, "On-chip binning");
+	}
+
+	if(md->stats.valid) {
+		add_key(keys, &n, TINT, "DATAMIN", &md->stats.min, "Minimum pixel value");
+		add_key(keys, &n, TINT, "DATAMAX", &md->stats.max, "Maximum pixel value");
+		add_key(keys, &n, TDOUBLE, "DATAMEAN", &md->stats.mean, "Mean pixel value");
+		add_key(keys, &n, TDOUBLE, "DATASTD", &md->stats.std, "Pixel standard deviation");
+		add_key(keys, &n, TDOUBLE, "DATAMED", &md->stats.median, "Sigma clipped median");
+		add_key(keys, &n, TLONGLONG, "NSATURAT", &md->stats.saturated, "Saturated pixels");
+	}
+	if(md->ncombine > 0) {
+		add_key(keys, &n, TINT, "NCOMBINE", &md->ncombine, "Number of frames combined");
+		add_key(keys, &n, TSTRING, "COMBINE", md->combine, "Combination method");
+	}
+	if(md->calibrated) {
+		add_key(keys, &n, TSTRING, "CALBIAS", md->calbias, "Master bias subtracted");
+		add_key(keys, &n, TSTRING, "CALDARK", md->caldark, "Master dark, scaled by EXPTIME");
+		add_key(keys, &n, TSTRING, "CALFLAT", md->calflat, "Master flat divided out");
+		add_key(keys, &n, TFLOAT, "PEDESTAL", &md->pedestal, "ADU added after calibration");
+	}
+	return n;
+}
+
+static void write_header_keys(fitsfile *ff, struct hdu *h, int extname, int *status)
+{
+	struct fits_key keys[MAX_KEYS];
+	int i, n;
+
+	n = metadata_keys(h, extname, keys);
+	for(i = 0; i < n; i++)
+		fits_write_key(ff, keys[i].type, keys[i].name, (void *) keys[i].value, keys[i].comment, status);
+}
+
+/* CHECKSUM and DATASUM ahead of the data, where the direct writer puts
+them, to be filled in once the HDU is written */
+static void write_checksum_keys(fitsfile *ff, int *status)
+{
+	fits_write_key(ff, TSTRING, "CHECKSUM", FITS_CHECKSUM_ZERO, FITS_CHECKSUM_COMMENT, status);
+	fits_write_key(ff, TSTRING, "DATASUM", FITS_DATASUM_ZERO, FITS_DATASUM_COMMENT, status);
+}
+
+/* Fills in the keys given the sum of the data unit written, so cfitsio
+only reads the header back, not the data as fits_write_chksum would */
+static int update_checksum_keys(fitsfile *ff, unsigned int datasum, int *status)
+{
+	char value[16];
+
+	sprintf_s(value, sizeof(value), "%u", datasum);
+	fits_update_key(ff, TSTRING, "DATASUM", value, FITS_DATASUM_COMMENT, status);
+	return fits_update_chksum(ff, status);
+}
+
+/* An empty primary HDU, which the frame's extensions follow */
+static int create_primary(fitsfile *ff, int checksum, int *status)
+{
+	fits_create_img(ff, SHORT_IMG, 0, NULL, status);
+	if(checksum) {
+		write_checksum_keys(ff, status);
+		update_checksum_keys(ff, 0, status);
+	}
+	return *status;
+}
+
+/* Moves the compressed tiles back to back at the start of tj->out, as
+they go in the heap, and returns the DATASUM of the table: a 1PB
+descriptor (count, offset) per tile, big endian, then the heap */
+static unsigned int pack_heap(struct tile_job *tj)
+{
+	unsigned char desc[8];
+	unsigned int sum = 0;
+	size_t heap = 0;
+	long i;
+
+	for(i = 0; i < tj->ntiles; i++) {
+		desc[0] = (unsigned char) (tj->sizes[i] >> 24);
+		desc[1] = (unsigned char) (tj->sizes[i] >> 16);
+		desc[2] = (unsigned char) (tj->sizes[i] >> 8);
+		desc[3] = (unsigned char) tj->sizes[i];
+		desc[4] = (unsigned char) (heap >> 24);
+		desc[5] = (unsigned char) (heap >> 16);
+		desc[6] = (unsigned char) (heap >> 8);
+		desc[7] = (unsigned char) heap;
+		sum = fits_checksum(desc, sizeof(desc), sum);
+		memmove(tj->out + heap, tj->out + i * tj->bound, tj->sizes[i]);
+		heap += tj->sizes[i];
+	}
+	return fits_checksum(tj->out, heap, sum);
+}
+
+/* parallel_fn, compresses tile index of a tile_job */
+static void compress_one_tile(void *ctx, int index)
+{
+	struct tile_job *tj = ctx;
+	long x0, y0, nx, ny, x, y;
+	const pi16u *row;
+	short *tile, *p;
+
+	x0 = (index % tj->ntiles1) * tj->fmt.tile[0];
+	y0 = (index / tj->ntiles1) * tj->fmt.tile[1];
+	nx = tj->width - x0 < tj->fmt.tile[0] ? tj->width - x0 : tj->fmt.tile[0];
+	ny = tj->height - y0 < tj->fmt.tile[1] ? tj->height - y0 : tj->fmt.tile[1];
+
+	tj->sizes[index] = 0;
+	tile = malloc(nx * ny * sizeof(short));
+	if(!tile) return;
+
+	/* Stored values are pixel - BZERO */
+	for(y = 0, p = tile; y < ny; y++) {
+		row = tj->pixels + (y0 + y) * tj->width + x0;
+		for(x = 0; x < nx; x++)
+			*p++ = (short) (row[x] ^ 0x8000);
+	}
+	tj->sizes[index] = compress_tile(tj->fmt.compression, tile, nx * ny,
+		tj->out + index * tj->bound, tj->bound);
+	free(tile);
+}
+
+/* The format's tile size, no larger than the frame */
+static void frame_tile(const struct output_format * fmt, const struct metadata * md, long tile[2])
+{
+	tile[0] = fmt->tile[0] < md->width ? fmt->tile[0] : md->width;
+	tile[1] = fmt->tile[1] < md->height ? fmt->tile[1] : md->height;
+}
+
+/*
+	Appends an HDU as a ZIMAGE binary table, named after the ROI if
+	the frame has several. The tiles are compressed in parallel,
+	cfitsio only lays out the table and its heap.
+*/
+static int write_tiles(fitsfile *ff, struct hdu *h, const struct output_format * fmt,
+	char * errmsg, int *status)
+{
+	struct metadata *md = &h->md;
+	struct tile_job tj;
+	char *ttype[] = {"COMPRESSED_DATA"};
+	char *tform[1];
+	char tform1[32];
+	long i, maxsize = 0;
+	size_t heap;
+	unsigned int datasum;
+	int ztrue = 1, zbitpix = SHORT_IMG, znaxis = 2;
+	long znaxis1 = md->width, znaxis2 = md->height;
+	int blocksize = RICE_BLOCKSIZE, bytepix = 2;
+
+	tj.pixels = h->pixels;
+	tj.width = md->width;
+	tj.height = md->height;
+	tj.fmt = *fmt;
+	frame_tile(fmt, md, tj.fmt.tile);
+	tj.ntiles1 = (tj.width + tj.fmt.tile[0] - 1) / tj.fmt.tile[0];
+	tj.ntiles = tj.ntiles1 * ((tj.height + tj.fmt.tile[1] - 1) / tj.fmt.tile[1]);
+	tj.bound = compress_bound(fmt->compression, tj.fmt.tile[0] * tj.fmt.tile[1]);
+	tj.out = malloc(tj.ntiles * tj.bound);
+	tj.sizes = malloc(tj.ntiles * sizeof(size_t));
+	if(!tj.out || !tj.sizes) {
+		free(tj.out);
+		free(tj.sizes);
+		sprintf_s(errmsg, STR_BUF_SIZE, "Out of memory compressing frame\n");
+		return -1;
+	}
+
+	parallel_for((int) tj.ntiles, compress_one_tile, &tj);
+
+	for(i = 0; i < tj.ntiles; i++) {
+		if(tj.sizes[i] == 0) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Could not compress tile %ld\n", i + 1);
+			free(tj.out);
+			free(tj.sizes);
+			return -1;
+		}
+		if((long) tj.sizes[i] > maxsize) maxsize = (long) tj.sizes[i];
+	}
+
+	sprintf_s(tform1, sizeof(tform1), "1PB(%ld)", maxsize);
+	tform[0] = tform1;
+	fits_create_tbl(ff, BINARY_TBL, tj.ntiles, 1, ttype, tform, NULL,
+		h->extname[0] ? h->extname : "COMPRESSED_IMAGE", status);
+
+	fits_write_key(ff, TLOGICAL, "ZIMAGE", &ztrue, "extension contains compressed image", status);
+	fits_write_key(ff, TINT, "ZBITPIX", &zbitpix, "data type of original image", status);
+	fits_write_key(ff, TINT, "ZNAXIS", &znaxis, "dimension of original image", status);
+	fits_write_key(ff, TLONG, "ZNAXIS1", &znaxis1, "length of original image axis", status);
+	fits_write_key(ff, TLONG, "ZNAXIS2", &znaxis2, "length of original image axis", status);
+	fits_write_key(ff, TLONG, "ZTILE1", &tj.fmt.tile[0], "size of tiles to be compressed", status);
+	fits_write_key(ff, TLONG, "ZTILE2", &tj.fmt.tile[1], "size of tiles to be compressed", status);
+	fits_write_key(ff, TSTRING, "ZCMPTYPE", (void *) compression_zcmptype(fmt->compression),
+		"compression algorithm", status);
+	if(fmt->compression == COMPRESS_RICE) {
+		fits_write_key(ff, TSTRING, "ZNAME1", "BLOCKSIZE", "compression block size", status);
+		fits_write_key(ff, TINT, "ZVAL1", &blocksize, "pixels per block", status);
+		fits_write_key(ff, TSTRING, "ZNAME2", "BYTEPIX", "bytes per pixel (1, 2, 4, or 8)", status);
+		fits_write_key(ff, TINT, "ZVAL2", &bytepix, "bytes per pixel (1, 2, 4, or 8)", status);
+	}
+	write_header_keys(ff, h, 0, status);
+	if(fmt->checksum) write_checksum_keys(ff, status);
+
+	/* Summed here while the tiles are still in the cache */
+	datasum = pack_heap(&tj);
+	for(i = 0, heap = 0; i < tj.ntiles && *status == 0; i++) {
+		fits_write_col(ff, TBYTE, 1, i + 1, 1, tj.sizes[i], tj.out + heap, status);
+		heap += tj.sizes[i];
+	}
+	if(fmt->checksum && *status == 0) update_checksum_keys(ff, datasum, status);
+
+	free(tj.out);
+	free(tj.sizes);
+	if(*status) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not write compressed image\n");
+		fits_report_error(stderr, *status);
+		return -1;
+	}
+	return 0;
+}
+
+/* Appends the HDUs to ff, as images or HCOMPRESS tiled images, or as
+tables of tiles compressed here. The caller holds hcompress_lock for
+HCOMPRESS. Adds the time spent on image headers to *header */
+static int append_cfitsio(fitsfile *ff, struct hdu *hdus, int nhdus,
+	int compression, const struct output_format * fmt, double * header, char * errmsg)
+{
+	int status = 0, retcode = 0, k;
+	int checksum = fmt && fmt->checksum && compression != COMPRESS_HCOMPRESS;
+	long naxes[2], tile[2];
+	struct hdu *h;
+	double tick;
+
+	if(compression != COMPRESS_NONE && compression != COMPRESS_HCOMPRESS) {
+		for(k = 0; k < nhdus && retcode == 0; k++)
+			retcode = write_tiles(ff, &hdus[k], fmt, errmsg, &status);
+		return retcode;
+	}
+
+	if(compression == COMPRESS_HCOMPRESS)
+		fits_set_compression_type(ff, HCOMPRESS_1, &status);
+
+	for(k = 0; k < nhdus; k++) {
+		tick = pi_now();
+		h = &hdus[k];
+		naxes[0] = h->md.width;
+		naxes[1] = h->md.height;
+		if(compression == COMPRESS_HCOMPRESS) {
+			frame_tile(fmt, &h->md, tile);
+			fits_set_tile_dim(ff, 2, tile, &status);
+		}
+
+		retcode = fits_create_img(ff, 
+			SHORT_IMG , // bitpix
+			2, // naxis
+			naxes, // naxes
+			&status);
+		if(retcode) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Could not create image \n");
+			fits_report_error(stderr, status);
+			return -1;
+		}
+			
+		write_header_keys(ff, h, 1, &status);
+		if(checksum) write_checksum_keys(ff, &status);
+		fits_set_bscale(ff, 1, //BSCALE Factor
+							32768, // BZERO factor
+							&status); 
+		*header += pi_now() - tick;
+
+		retcode = fits_write_img(ff,
+			TUSHORT, // (T)ype is unsigned short (USHORT)
+			1, // Copy from [0, 0] but fits format is indexed by 1
+			naxes[0] * naxes[1], // Number of elements
+			(void *) h->pixels,
+			&status);
+		if(retcode && status==412) {
+			printf("Overflow\n");
+			status = 0;
+		} else if(retcode) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Could not copy data over \n");
+			fits_report_error(stderr, status);
+			return -1;
+		}
+
+		/* cfitsio reads the HDU back to sum it. HCOMPRESS tiles are
+		compressed inside cfitsio and would need the same, so they go
+		without */
+		if(checksum && fits_write_chksum(ff, &status)) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Could not write checksums\n");
+			fits_report_error(stderr, status);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Writes the HDUs to a new file through cfitsio, see append_cfitsio.
+Adds the time spent creating the file and headers to *header */
+static int write_cfitsio(const char * outfile, struct hdu *hdus, int nhdus,
+	int compression, const struct output_format * fmt, double * header, char * errmsg)
+{
+	fitsfile *ff = NULL;
+	int status = 0, retcode;
+	char clobber[STR_BUF_SIZE];
+	double tick = pi_now();
+
+	/* FITS housekeeping */
+	sprintf_s(clobber, STR_BUF_SIZE, "!%s", outfile);
+	retcode = fits_create_file(&ff, clobber, &status);
+
+	/* Tables of tiles follow an empty primary, cfitsio adds its own
+	for HCOMPRESS */
+	if(!retcode && compression != COMPRESS_NONE && compression != COMPRESS_HCOMPRESS)
+		retcode = create_primary(ff, fmt && fmt->checksum, &status);
+	if(retcode) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not create FITS file\n");
+		fits_report_error(stderr, status);
+		if(ff) fits_close_file(ff, &status);
+		return -1;
+	}
+	*header += pi_now() - tick;
+
+	if(compression == COMPRESS_HCOMPRESS) pi_mutex_lock(&hcompress_lock);
+	retcode = append_cfitsio(ff, hdus, nhdus, compression, fmt, header, errmsg);
+	fits_close_file(ff, &status);
+	if(compression == COMPRESS_HCOMPRESS) pi_mutex_unlock(&hcompress_lock);
+	return retcode;
+}
+
+/* Returns the offset of the first difference between two files, -1 if
+they are identical */
+static long long compare_files(const char * a, const char * b)
+{
+	FILE *fa, *fb;
+	unsigned char bufa[65536], bufb[65536];
+	size_t na, nb, i;
+	long long offset = 0, differs = -1;
+
+	fa = fopen(a, "rb");
+	fb = fopen(b, "rb");
+	if(!fa || !fb) {
+		if(fa) fclose(fa);
+		if(fb) fclose(fb);
+		return 0;
+	}
+	do {
+		na = fread(bufa, 1, sizeof(bufa), fa);
+		nb = fread(bufb, 1, sizeof(bufb), fb);
+		for(i = 0; i < na && i < nb; i++) {
+			if(bufa[i] != bufb[i]) break;
+		}
+		if(i < na || i < nb) differs = offset + i;
+		offset += na;
+	} while(differs < 0 && na > 0);
+
+	fclose(fa);
+	fclose(fb);
+	return differs;
+}
+
+/* Flushes outfile to the disk if fmt asks for it, see output_format */
+static int sync_output(const char * outfile, const struct output_format * fmt,
+	struct latency * lat, char * errmsg)
+{
+	double tick;
+
+	if(!fmt || !fmt->fsync) return 0;
+	tick = pi_now();
+	if(pi_sync_file(outfile)) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not sync %s to disk\n", outfile);
+		return -1;
+	}
+	latency_record(lat, LAT_FSYNC, pi_now() - tick);
+	return 0;
+}
+
+int write_fits_file(pi16u * buf, struct metadata * md, const struct output_format * fmt,
+	const char * outfile, char * errmsg)
+{
+	struct fits_key keys[MAX_ROIS][MAX_KEYS];
+	struct fits_image images[MAX_ROIS];
+	struct hdu hdus[MAX_ROIS];
+	char reference[STR_BUF_SIZE];
+	int k, nhdus, in_place;
+	int compression = fmt ? fmt->compression : COMPRESS_NONE;
+	int direct = fmt && compression == COMPRESS_NONE ? fmt->direct : FITS_CFITSIO;
+	long long differs;
+	double start = pi_now(), header = 0, unused = 0;
+
+	nhdus = frame_hdus(buf, md, hdus);
+	if(direct == FITS_CFITSIO) {
+		header = pi_now() - start;
+		if(write_cfitsio(outfile, hdus, nhdus, compression, fmt, &header, errmsg)) return -1;
+		latency_record(md->latency, LAT_HEADER, header);
+		latency_record(md->latency, LAT_DATA, pi_now() - start - header);
+		return 0;
+	}
+
+	for(k = 0; k < nhdus; k++) {
+		images[k].pixels = hdus[k].pixels;
+		images[k].naxis1 = hdus[k].md.width;
+		images[k].naxis2 = hdus[k].md.height;
+		images[k].keys = keys[k];
+		images[k].nkeys = metadata_keys(&hdus[k], 1, keys[k]);
+		images[k].checksum = fmt && fmt->checksum;
+	}
+	in_place = outpath_take(outfile, fits_direct_size(images, nhdus));
+	header = pi_now() - start;
+	if(fits_direct_write(outfile, images, nhdus, in_place, errmsg))
+		return -1;
+	latency_record(md->latency, LAT_HEADER, header);
+	latency_record(md->latency, LAT_DATA, pi_now() - start - header);
+
+	/* Verification: cfitsio writes the same frame alongside, which is
+	removed again if the two match */
+	if(direct == FITS_VERIFY) {
+		sprintf_s(reference, STR_BUF_SIZE, "%s.cfitsio", outfile);
+		if(write_cfitsio(reference, hdus, nhdus, COMPRESS_NONE, fmt, &unused, errmsg)) return -1;
+		differs = compare_files(outfile, reference);
+		if(differs >= 0) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "%s differs from cfitsio's %s at byte %lld\n",
+				outfile, reference, differs);
+			return -1;
+		}
+		remove(reference);
+	}
+	return 0;
+}
+
+/*
+	Writes one frame to a new file under the dated directory, FITS or
+	a raw container if fmt asks for one (rawfile.h). Does not touch
+	the Lua state so it can run on any thread; returns 0 on success,
+	otherwise non-zero with a message in errmsg. The time spent on the
+	header, the pixels and syncing goes to md->latency.
+*/
+int write_data_to_file(pi16u * buf, struct metadata * md, const char * prepend,
+	const struct output_format * fmt, char * outfile, char * errmsg)
+{
+	int compression = fmt ? fmt->compression : COMPRESS_NONE;
+	int raw = fmt ? fmt->raw : RAW_OFF;
+	double start;
+
+	if(outpath_name(prepend, raw != RAW_OFF ? RAW_EXTENSION : compression == COMPRESS_NONE ? "" : ".fz",
+		outfile, errmsg))
+		return -1;
+
+	if(raw != RAW_OFF) {
+		start = pi_now();
+		if(raw_write(outfile, buf, md, raw, errmsg)) return -1;
+		latency_record(md->latency, LAT_DATA, pi_now() - start);
+	} else if(write_fits_file(buf, md, fmt, outfile, errmsg)) {
+		return -1;
+	}
+
+	if(sync_output(outfile, fmt, md->latency, errmsg)) return -1;
+	printf("Wrote '%s'.\n", outfile);
+	return 0;
+}
+
+
+/* Creates the file of seq, an empty primary HDU the frames follow as
+extensions. Sequences in FITS_VERIFY write directly */
+static int create_sequence(struct writer_sequence *seq, char * errmsg)
+{
+	struct fits_image primary;
+	char clobber[STR_BUF_SIZE];
+	int status = 0, compression = seq->fmt.compression;
+
+	if(outpath_name(seq->prepend, compression == COMPRESS_NONE ? "" : ".fz", seq->path, errmsg))
+		return -1;
+
+	if(compression == COMPRESS_NONE && seq->fmt.direct != FITS_CFITSIO) {
+		memset(&primary, 0, sizeof(primary));
+		primary.checksum = seq->fmt.checksum;
+		seq->df = fits_direct_create(seq->path, errmsg);
+		if(!seq->df) return -1;
+		return fits_direct_append(seq->df, &primary, 1, errmsg);
+	}
+
+	sprintf_s(clobber, STR_BUF_SIZE, "!%s", seq->path);
+	if(!fits_create_file(&seq->ff, clobber, &status))
+		create_primary(seq->ff, seq->fmt.checksum, &status);
+	if(status) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Could not create FITS file\n");
+		fits_report_error(stderr, status);
+		return -1;
+	}
+	return 0;
+}
+
+/* Closes the file of seq if it is open, returns 0 on success */
+static int close_sequence(struct writer_sequence *seq, char * errmsg)
+{
+	int status = 0, failed = 0;
+
+	if(seq->df) failed = fits_direct_close(seq->df, errmsg) != 0;
+	if(seq->ff) {
+		if(seq->fmt.compression == COMPRESS_HCOMPRESS) pi_mutex_lock(&hcompress_lock);
+		fits_close_file(seq->ff, &status);
+		if(seq->fmt.compression == COMPRESS_HCOMPRESS) pi_mutex_unlock(&hcompress_lock);
+		if(status) {
+			sprintf_s(errmsg, STR_BUF_SIZE, "Could not write FITS file %s\n", seq->path);
+			fits_report_error(stderr, status);
+			failed = 1;
+		}
+	}
+	seq->df = NULL;
+	seq->ff = NULL;
+	return failed ? -1 : 0;
+}
+
+/* Appends the frame of job to seq, creating the file with the first.
+Each ROI is an extension named after the frame */
+static int append_sequence(struct writer_sequence *seq, struct writer_job *job, char * errmsg)
+{
+	struct fits_key keys[MAX_ROIS][MAX_KEYS];
+	struct fits_image images[MAX_ROIS];
+	struct hdu hdus[MAX_ROIS];
+	struct metadata *md = &job->md;
+	int k, nhdus, retcode;
+	double start = pi_now(), header = 0;
+
+	if(!seq->path[0] && create_sequence(seq, errmsg)) return -1;
+
+	nhdus = frame_hdus(job->frame->pixels, md, hdus);
+	for(k = 0; k < nhdus; k++) {
+		hdus[k].frame = (int) job->index + 1;
+		if(nhdus > 1)
+			sprintf_s(hdus[k].extname, sizeof(hdus[k].extname), "F%d.ROI%d", hdus[k].frame, k + 1);
+		else
+			sprintf_s(hdus[k].extname, sizeof(hdus[k].extname), "FRAME%d", hdus[k].frame);
+	}
+
+	if(seq->df) {
+		for(k = 0; k < nhdus; k++) {
+			images[k].pixels = hdus[k].pixels;
+			images[k].naxis1 = hdus[k].md.width;
+			images[k].naxis2 = hdus[k].md.height;
+			images[k].keys = keys[k];
+			images[k].nkeys = metadata_keys(&hdus[k], 1, keys[k]);
+			images[k].checksum = seq->fmt.checksum;
+		}
+		header = pi_now() - start;
+		retcode = fits_direct_append(seq->df, images, nhdus, errmsg);
+	} else {
+		header = pi_now() - start;
+		if(seq->fmt.compression == COMPRESS_HCOMPRESS) pi_mutex_lock(&hcompress_lock);
+		retcode = append_cfitsio(seq->ff, hdus, nhdus, seq->fmt.compression, &seq->fmt,
+			&header, errmsg);
+		if(seq->fmt.compression == COMPRESS_HCOMPRESS) pi_mutex_unlock(&hcompress_lock);
+	}
+	if(retcode) return -1;
+	latency_record(md->latency, LAT_HEADER, header);
+	latency_record(md->latency, LAT_DATA, pi_now() - start - header);
+	return 0;
+}
+
+/* Drops a reference to seq. With the last the file is closed, synced
+and reported, and seq freed */
+static void sequence_unref(struct writer_sequence *seq)
+{
+	char errmsg[STR_BUF_SIZE];
+	int refs, failed;
+
+	pi_mutex_lock(&seq->lock);
+	refs = --seq->refs;
+	pi_mutex_unlock(&seq->lock);
+	if(refs) return;
+
+	if(seq->path[0]) {
+		errmsg[0] = '\0';
+		failed = close_sequence(seq, errmsg) != 0;
+		if(!failed && !seq->failed)
+			failed = sync_output(seq->path, &seq->fmt, seq->latency, errmsg) != 0;
+		if(failed) {
+			pi_mutex_lock(&pool.lock);
+			pool.failed++;
+			sprintf_s(pool.last_error, STR_BUF_SIZE, "%s", errmsg);
+			pi_mutex_unlock(&pool.lock);
+		} else {
+			printf("Wrote '%s' (%ld frames).\n", seq->path, seq->written);
+		}
+	}
+	pi_cond_destroy(&seq->turn);
+	pi_mutex_destroy(&seq->lock);
+	free(seq);
+}
+
+/* Writes a job of a sequence once the frames before it are in the file.
+After a failure the file is closed and the rest of the frames fail */
+static int run_sequence_job(struct writer_job *job, char * outfile, char * errmsg)
+{
+	struct writer_sequence *seq = job->seq;
+	char unused[STR_BUF_SIZE];
+	int failed;
+
+	pi_mutex_lock(&seq->lock);
+	while(seq->next != job->index)
+		pi_cond_wait(&seq->turn, &seq->lock);
+	failed = seq->failed;
+	pi_mutex_unlock(&seq->lock);
+
+	/* Only the frame whose turn it is touches the file */
+	if(failed) {
+		sprintf_s(errmsg, STR_BUF_SIZE, "Frame %ld not written, sequence %s failed\n",
+			job->index + 1, seq->path[0] ? seq->path : seq->prepend);
+	} else if(append_sequence(seq, job, errmsg)) {
+		close_sequence(seq, unused);
+		failed = 1;
+	}
+	sprintf_s(outfile, STR_BUF_SIZE, "%s", seq->path);
+
+	pi_mutex_lock(&seq->lock);
+	if(failed) seq->failed = 1;
+	else seq->written++;
+	seq->latency = job->md.latency;
+	seq->next++;
+	pi_cond_broadcast(&seq->turn);
+	pi_mutex_unlock(&seq->lock);
+	return failed;
+}
+
+/* Writes a job and reports it, handing the file on for a preview;
+frees the job */
+static void run_job(struct writer_job *job)
+{
+	char outfile[STR_BUF_SIZE], errmsg[STR_BUF_SIZE];
+	int failed;
+	double span = trace_begin();
+
+	errmsg[0] = '\0';
+	if(job->seq)
+		failed = run_sequence_job(job, outfile, errmsg);
+	else
+		failed = write_data_to_file(job->frame->pixels, &job->md, job->prepend, &job->fmt,
+			outfile, errmsg) != 0;
+	trace_end("write", span, -1);
+	if(!failed) preview_submit(job->frame, &job->md, outfile);
+
+	pi_mutex_lock(&pool.lock);
+	if(failed) {
+		pool.failed++;
+		sprintf_s(pool.last_error, STR_BUF_SIZE, "%s", errmsg);
+	} else {
+		pool.written++;
+	}
+	pi_mutex_unlock(&pool.lock);
+
+	if(job->done) job->done(job->ctx, failed, errmsg);
+	frame_release(job->frame);
+	if(job->seq) sequence_unref(job->seq);
+	free(job);
+}
+
+static void writer_thread(void *arg)
+{
+	struct writer_job *job;
+	size_t bytes;
+	char name[32];
+
+	sprintf_s(name, sizeof(name), "writer %i", (int) (size_t) arg + 1);
+	trace_thread_name(name);
+	for(;;) {
+		pi_mutex_lock(&pool.lock);
+		while(!pool.head && !pool.stopping)
+			pi_cond_wait(&pool.work, &pool.lock);
+		if(!pool.head) {
+			pi_mutex_unlock(&pool.lock);
+			return;
+		}
+		job = pool.head;
+		pool.head = job->next;
+		if(!pool.head) pool.tail = NULL;
+		pool.in_flight++;
+		pi_mutex_unlock(&pool.lock);
+
+		/* The job's memory counts against the cap until it is written */
+		bytes = job->bytes;
+		run_job(job);
+
+		pi_mutex_lock(&pool.lock);
+		pool.in_flight--;
+		pool.queued--;
+		pool.queued_bytes -= bytes;
+		pi_cond_broadcast(&pool.space);
+		pi_cond_broadcast(&pool.idle);
+		pi_mutex_unlock(&pool.lock);
+	}
+}
+
+/* Call with pool.lock held */
+static int start_pool(void)
+{
+	int i;
+
+	pool.stopping = 0;
+	for(i = 0; i < pool.threads; i++) {
+		if(pi_thread_start(&pool.thread[i], writer_thread, (void *) (size_t) i) != 0) {
+			pool.threads = i;
+			break;
+		}
+	}
+	pool.started = 1;
+	return pool.threads;
+}
+
+void writer_start(void)
+{
+	static int initialized = 0;
+
+	if(!initialized) {
+		pi_mutex_init(&pool.lock);
+		pi_cond_init(&pool.work);
+		pi_cond_init(&pool.space);
+		pi_cond_init(&pool.idle);
+		pi_mutex_init(&hcompress_lock);
+		outpath_start();
+		initialized = 1;
+	}
+	pi_mutex_lock(&pool.lock);
+	if(!pool.started) start_pool();
+	pi_mutex_unlock(&pool.lock);
+}
+
+int writer_submit(const pi16u * pixels, size_t bytes, const struct metadata * md,
+	const char * prepend, writer_done_fn done, void * ctx)
+{
+	struct frame *frame;
+	int error;
+
+	frame = frame_copy(pixels, bytes);
+	if(!frame) return -1;
+	error = writer_submit_frame(frame, md, prepend, done, ctx);
+	frame_release(frame);
+	return error;
+}
+
+/* Gives seq its next frame index with pool.lock held, so that frames
+are queued in the order of their indices */
+static void sequence_enqueue(struct writer_job *job)
+{
+	struct writer_sequence *seq = job->seq;
+
+	if(!seq) return;
+	pi_mutex_lock(&seq->lock);
+	job->index = seq->submitted++;
+	seq->refs++;
+	pi_mutex_unlock(&seq->lock);
+}
+
+static int submit_job(struct frame * frame, const struct metadata * md, const char * prepend,
+	struct writer_sequence * seq, writer_done_fn done, void * ctx)
+{
+	struct writer_job *job;
+	size_t bytes = frame->bytes;
+
+	writer_start();
+
+	job = calloc(1, sizeof(*job));
+	if(!job) return -1;
+	frame_retain(frame);
+	job->frame = frame;
+	job->bytes = bytes;
+	job->md = *md;
+	job->id = *md->id;
+	job->md.id = &job->id;
+	sprintf_s(job->prepend, STR_BUF_SIZE, "%s", prepend);
+	job->done = done;
+	job->ctx = ctx;
+	job->seq = seq;
+
+	pi_mutex_lock(&pool.lock);
+	job->fmt = pool.fmt;
+	if(pool.threads == 0) {
+		sequence_enqueue(job);
+		pool.queued++;
+		pool.in_flight++;
+		pi_mutex_unlock(&pool.lock);
+		run_job(job);
+		pi_mutex_lock(&pool.lock);
+		pool.queued--;
+		pool.in_flight--;
+		pi_cond_broadcast(&pool.idle);
+		pi_mutex_unlock(&pool.lock);
+		return 0;
+	}
+
+	/* Back-pressure: an empty queue always takes one frame */
+	while(pool.queued && pool.queued_bytes + bytes > pool.memory_cap)
+		pi_cond_wait(&pool.space, &pool.lock);
+
+	sequence_enqueue(job);
+	if(pool.tail) pool.tail->next = job;
+	else pool.head = job;
+	pool.tail = job;
+	pool.queued++;
+	pool.queued_bytes += bytes;
+	pi_cond_signal(&pool.work);
+	pi_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+int writer_submit_frame(struct frame * frame, const struct metadata * md,
+	const char * prepend, writer_done_fn done, void * ctx)
+{
+	return submit_job(frame, md, prepend, NULL, done, ctx);
+}
+
+struct writer_sequence *writer_sequence_open(const char * prepend)
+{
+	struct writer_sequence *seq = calloc(1, sizeof(*seq));
+
+	if(!seq) return NULL;
+	writer_start();
+	pi_mutex_init(&seq->lock);
+	pi_cond_init(&seq->turn);
+	seq->refs = 1;
+	sprintf_s(seq->prepend, STR_BUF_SIZE, "%s", prepend);
+	pi_mutex_lock(&pool.lock);
+	seq->fmt = pool.fmt;
+	pi_mutex_unlock(&pool.lock);
+	return seq;
+}
+
+int writer_submit_sequence(struct writer_sequence * seq, struct frame * frame,
+	const struct metadata * md, writer_done_fn done, void * ctx)
+{
+	return submit_job(frame, md, seq->prepend, seq, done, ctx);
+}
+
+void writer_sequence_close(struct writer_sequence * seq)
+{
+	sequence_unref(seq);
+}
+
+int writer_flush(double timeout)
+{
+	double deadline = pi_now() + timeout;
+	int drained;
+
+	writer_start();
+	pi_mutex_lock(&pool.lock);
+	while(pool.queued || pool.in_flight) {
+		if(timeout < 0) {
+			pi_cond_wait(&pool.idle, &pool.lock);
+		} else if(pi_now() >= deadline) {
+			break;
+		} else {
+			pi_cond_timedwait(&pool.idle, &pool.lock, deadline - pi_now());
+		}
+	}
+	drained = !pool.queued && !pool.in_flight;
+	pi_mutex_unlock(&pool.lock);
+	return drained;
+}
+
+static void stop_pool(void)
+{
+	int i;
+
+	writer_flush(-1);
+	pi_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	pi_cond_broadcast(&pool.work);
+	pi_mutex_unlock(&pool.lock);
+
+	for(i = 0; i < pool.threads; i++)
+		pi_thread_join(pool.thread[i]);
+
+	pi_mutex_lock(&pool.lock);
+	pool.started = 0;
+	pi_mutex_unlock(&pool.lock);
+}
+
+int writer_threads_valid(int threads)
+{
+	return threads >= 0 && threads <= MAX_WRITER_THREADS;
+}
+
+int writer_configure(int threads, size_t memory_cap)
+{
+	if(!writer_threads_valid(threads)) return -1;
+
+	writer_start();
+	stop_pool();
+
+	pi_mutex_lock(&pool.lock);
+	pool.threads = threads;
+	if(memory_cap) pool.memory_cap = memory_cap;
+	start_pool();
+	pi_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+int writer_format_valid(const struct output_format * fmt)
+{
+	if(fmt->compression < 0 || fmt->compression >= NUM_COMPRESSION) return 0;
+	if(fmt->direct < FITS_CFITSIO || fmt->direct > FITS_VERIFY) return 0;
+	if(fmt->raw < RAW_OFF || fmt->raw >= NUM_RAW_CODECS || !raw_codec_available(fmt->raw)) return 0;
+	if(fmt->tile[0] < 1 || fmt->tile[1] < 1) return 0;
+
+	/* cfitsio wants HCOMPRESS tiles at least 4 pixels on a side */
+	if(fmt->compression == COMPRESS_HCOMPRESS && (fmt->tile[0] < 4 || fmt->tile[1] < 4))
+		return 0;
+	return 1;
+}
+
+int writer_set_format(const struct output_format * fmt)
+{
+	if(!writer_format_valid(fmt)) return -1;
+
+	writer_start();
+	pi_mutex_lock(&pool.lock);
+	pool.fmt = *fmt;
+	pi_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+void writer_get_status(struct writer_status * st, int reset)
+{
+	writer_start();
+	pi_mutex_lock(&pool.lock);
+	st->threads = pool.threads;
+	st->fmt = pool.fmt;
+	st->queued = pool.queued;
+	st->queued_bytes = pool.queued_bytes;
+	st->memory_cap = pool.memory_cap;
+	st->written = pool.written;
+	st->failed = pool.failed;
+	sprintf_s(st->last_error, STR_BUF_SIZE, "%s", pool.last_error);
+	if(reset) {
+		pool.failed = 0;
+		pool.last_error[0] = '\0';
+	}
+	pi_mutex_unlock(&pool.lock);
+}
+
+void writer_shutdown(void)
+{
+	writer_start();
+	stop_pool();
+	outpath_shutdown();
+}
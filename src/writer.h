@@ -0,0 +1,178 @@
+#ifndef writer_h
+#define writer_h
+
+#include <stddef.h>
+#include "sdk.h"
+#include "framestats.h"
+#include "frame.h"
+#include "latency.h"
+
+#define STR_BUF_SIZE 2048
+
+/* Longest master name recorded in a header, a FITS string value */
+#define CAL_NAME_LEN 68
+
+/* Regions read out in one frame */
+#define MAX_ROIS 8
+
+/* A region of the sensor as it lands in the frame: x, y are the
+sensor pixel (from 0) of its first binned pixel, width and height are
+in binned pixels */
+struct frame_roi {
+	piint x, y, width, height;
+	piint xbin, ybin;
+};
+
+struct metadata {
+	piint width, height;	/* NAXIS1, NAXIS2, of the first ROI */
+
+	/* The frame holds the ROIs one after the other, each written as
+	an image HDU of its own. 0 if the frame's place on the sensor is
+	not known, it is then one width x height image */
+	piint nrois;
+	struct frame_roi rois[MAX_ROIS];
+
+	piflt exptime, adcspeed, temp;
+	piint bitdepth, gain, adc;
+	PicamCameraID *id;
+	char date_obs[24];	/* UTC at readout, ISO 8601, "" if not known */
+	struct frame_stats stats;	/* written as keywords if valid */
+
+	/* Frames combined into this one and how, see stack.h; 0 and
+	NULL for a readout */
+	piint ncombine;
+	const char *combine;
+
+	/* Masters subtracted and divided out, see calib.h; calibrated
+	is 0 for a raw frame */
+	int calibrated;
+	char calbias[CAL_NAME_LEN], caldark[CAL_NAME_LEN], calflat[CAL_NAME_LEN];
+	float pedestal;
+
+	/* The camera's histograms the time taken writing the frame goes
+	to, NULL if it is not timed */
+	struct latency *latency;
+};
+
+/* Pixels in a frame described by md, every ROI */
+size_t metadata_pixels(const struct metadata * md);
+
+/* Called once a submitted frame is on disk (failed = 0) or not */
+typedef void (*writer_done_fn)(void *ctx, int failed, const char *errmsg);
+
+/* How uncompressed frames are written, see fitsdirect.h */
+enum fits_path {
+	FITS_CFITSIO,
+	FITS_DIRECT,
+	FITS_VERIFY	/* direct, then compared against cfitsio's file */
+};
+
+/* Output file layout. compression and tile (in pixels along NAXIS1,
+NAXIS2, clipped to the frame) select tile-compressed output, see
+compress.h; direct applies to uncompressed frames. With fsync each
+file is flushed to the disk before it counts as written. With sequence
+the frames of a burst go to one file, see writer_sequence_open. raw
+(a raw_codec) writes raw containers instead of FITS, see rawfile.h,
+and always a file per frame. With checksum every HDU carries CHECKSUM
+and DATASUM, which the direct path sums as it writes (fitsdirect.h)
+and tables of tiles as they are compressed. HCOMPRESS frames, which
+cfitsio compresses, go without; the cfitsio image path (direct off)
+reads each HDU back to sum it */
+struct output_format {
+	int compression;
+	long tile[2];
+	int direct;
+	int fsync;
+	int sequence;
+	int raw;
+	int checksum;
+};
+
+struct writer_status {
+	int threads;
+	struct output_format fmt;
+	size_t queued, queued_bytes, memory_cap;
+	long long written, failed;
+	char last_error[STR_BUF_SIZE];
+};
+
+/*
+	Writes one frame to a new FITS file under the dated directory,
+	tile-compressed unless fmt is NULL or COMPRESS_NONE, or to a raw
+	container if fmt->raw is set, its path going to outfile
+	(STR_BUF_SIZE). Returns 0 on success, otherwise non-zero
+	with a message in errmsg.
+*/
+int write_data_to_file(pi16u * buf, struct metadata * md, const char * prepend,
+	const struct output_format * fmt, char * outfile, char * errmsg);
+
+/*
+	write_data_to_file's FITS file for the frame at outfile, which is
+	not named here, and not synced. Used to convert raw containers
+	(rawfile.h).
+*/
+int write_fits_file(pi16u * buf, struct metadata * md, const struct output_format * fmt,
+	const char * outfile, char * errmsg);
+
+/*
+	Background FITS writer. Frames are copied into a queue and written
+	by a pool of threads. The queue holds at most memory_cap bytes of
+	frames; writer_submit blocks while it is full. With threads == 0
+	frames are written on the calling thread.
+*/
+
+/* Starts the pool if it is not running. Must first be called from the
+Lua thread before frames are submitted from any other thread */
+void writer_start(void);
+
+/* Whether writer_configure would accept threads, changing nothing */
+int writer_threads_valid(int threads);
+
+/* Waits for the queue to drain and restarts the pool, returns 0 on success */
+int writer_configure(int threads, size_t memory_cap);
+
+/* Whether writer_set_format would accept fmt, changing nothing */
+int writer_format_valid(const struct output_format * fmt);
+
+/* Compression for frames submitted from now on, returns 0 on success */
+int writer_set_format(const struct output_format * fmt);
+
+/* Queues a copy of the frame, done (may be NULL) runs on the writer thread */
+int writer_submit(const pi16u * pixels, size_t bytes, const struct metadata * md,
+	const char * prepend, writer_done_fn done, void * ctx);
+
+/* The same without copying, the queue holds a reference to frame */
+int writer_submit_frame(struct frame * frame, const struct metadata * md,
+	const char * prepend, writer_done_fn done, void * ctx);
+
+/*
+	A sequence appends frames to one multi-extension file instead of a
+	file each: an empty primary HDU, then for every frame an IMAGE
+	extension (or a tile-compressed table) per ROI, carrying that
+	frame's keywords and FRAMENUM. The file is named and created with
+	the first frame, in the format current at writer_sequence_open, and
+	frames are appended in the order they were submitted whichever
+	writer thread gets them. After a failure the file is closed and the
+	remaining frames fail. NULL if out of memory.
+*/
+struct writer_sequence;
+struct writer_sequence *writer_sequence_open(const char * prepend);
+
+/* writer_submit_frame for the next frame of seq */
+int writer_submit_sequence(struct writer_sequence * seq, struct frame * frame,
+	const struct metadata * md, writer_done_fn done, void * ctx);
+
+/* No more frames: the file is closed once the queued ones are written */
+void writer_sequence_close(struct writer_sequence * seq);
+
+/* Waits until everything queued is written, timeout < 0 waits forever.
+Returns 1 when drained, 0 on timeout */
+int writer_flush(double timeout);
+
+/* Snapshot of the queue; reset clears the failure count and last error */
+void writer_get_status(struct writer_status * st, int reset);
+
+/* Flushes and stops the pool */
+void writer_shutdown(void);
+
+#endif